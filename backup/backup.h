@@ -103,6 +103,9 @@ enum {
 #define BACKUP_VERIFY_MESSAGES (BACKUP_VERIFY_MESSAGE_LINKS | BACKUP_VERIFY_MESSAGE_GUIDS)
 #define BACKUP_VERIFY_FULL  ((unsigned) -1)
 int backup_verify(struct backup *backup, unsigned level, int verbose, FILE *out);
+int backup_verify_incremental(struct backup *backup, unsigned level,
+                              int last_chunk_id, const char *last_data_sha1,
+                              int verbose, FILE *out);
 
 
 /* accessing backup properties */
@@ -139,6 +142,7 @@ void backup_chunk_list_free(struct backup_chunk_list **chunk_listp);
 struct backup_chunk_list *backup_get_chunks(struct backup *backup);
 struct backup_chunk_list *backup_get_live_chunks(struct backup *backup,
                                                  time_t since);
+time_t backup_get_next_expiry(struct backup *backup, time_t since);
 
 struct backup_chunk *backup_get_chunk(struct backup *backup, int chunk_id);
 struct backup_chunk *backup_get_latest_chunk(struct backup *backup);
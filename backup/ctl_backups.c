@@ -45,6 +45,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 
 #include <assert.h>
@@ -55,6 +56,8 @@
 
 #include "lib/cyrusdb.h"
 #include "lib/exitcodes.h"
+#include "lib/xsha1.h"
+#include "lib/xstrlcpy.h"
 
 #include "imap/global.h"
 #include "imap/imap_err.h"
@@ -89,9 +92,12 @@ static void usage(void)
 
     fprintf(stderr, "%s\n",
             "Options:\n"
+            "    -B bytes            # limit I/O to bytes per second (k, m, g suffixes ok)\n"
             "    -C alt_config       # alternate config file\n"
             "    -F                  # force (run command even if not needed)\n"
+            "    -R progress_file    # record progress, and skip unchanged backups\n"
             "    -S                  # stop on error\n"
+            "    -j jobs             # process up to jobs backups in parallel\n"
             "    -v                  # verbose (repeat for more verbosity)\n"
             "    -w                  # wait for locks (don't skip locked backups)\n"
     );
@@ -119,6 +125,8 @@ static void usage(void)
             "    -u                  # specified backups interpreted as userids (default)\n"
             "\n"
             "    Modes -A, -D, -P not available for all commands\n" /* FIXME which */
+            "\n"
+            "    Options -B, -R, -j only available for compact, reindex and verify\n"
     );
 
     exit(EC_USAGE);
@@ -141,7 +149,20 @@ enum ctlbu_lock_mode {
     CTLBU_LOCK_MODE_EXEC,
 };
 
+enum ctlbu_cmd {
+    CTLBU_CMD_UNSPECIFIED = 0,
+    CTLBU_CMD_COMPACT,
+    CTLBU_CMD_DELETE,
+    CTLBU_CMD_LIST,
+    CTLBU_CMD_LOCK,
+    CTLBU_CMD_MOVE,
+    CTLBU_CMD_RECONSTRUCT,
+    CTLBU_CMD_REINDEX,
+    CTLBU_CMD_VERIFY,
+};
+
 struct ctlbu_cmd_options {
+    enum ctlbu_cmd cmd;
     enum ctlbu_mode mode;
     enum ctlbu_lock_mode lock_mode;
     enum backup_open_nonblock wait;
@@ -152,21 +173,13 @@ struct ctlbu_cmd_options {
     int force;
     const char *lock_exec_cmd;
     const char *domain;
-};
-
-enum ctlbu_cmd {
-    CTLBU_CMD_UNSPECIFIED = 0,
-    CTLBU_CMD_COMPACT,
-    CTLBU_CMD_DELETE,
-    CTLBU_CMD_LIST,
-    CTLBU_CMD_LOCK,
-    CTLBU_CMD_MOVE,
-    CTLBU_CMD_RECONSTRUCT,
-    CTLBU_CMD_REINDEX,
-    CTLBU_CMD_VERIFY,
+    int jobs;
+    uint64_t io_budget;
+    const char *progress_fname;
 };
 
 static int ctlbu_skips_fails = 0;
+static int ctlbu_jobs_running = 0;
 
 /* same signature as foreach_cb */
 static int cmd_compact_one(void *rock,
@@ -214,6 +227,11 @@ static int lock_run_exec(const char *userid, const char *fname,
                          enum backup_open_nonblock nonblock,
                          enum backup_open_create create);
 
+static int cmd_dispatch_one(void *rock,
+                            const char *key, size_t key_len,
+                            const char *data, size_t data_len);
+static int wait_jobs(struct ctlbu_cmd_options *options, int max_running);
+
 static enum ctlbu_cmd parse_cmd_string(const char *cmd)
 {
     assert(cmd != NULL);
@@ -253,6 +271,9 @@ static void print_status(const char *cmd,
         case 1:
             puts("skipped");
             break;
+        case 2:
+            puts("unchanged");
+            break;
         case 0:
             puts("ok");
             break;
@@ -303,6 +324,27 @@ static void save_argv0(const char *s)
         argv0 = s;
 }
 
+static uint64_t parse_bytes(const char *s)
+{
+    char *end = NULL;
+    uint64_t n;
+
+    errno = 0;
+    n = strtoull(s, &end, 10);
+    if (errno || end == s) usage();
+
+    switch (*end) {
+    case 'g': case 'G': n *= 1024; /* fall through */
+    case 'm': case 'M': n *= 1024; /* fall through */
+    case 'k': case 'K': n *= 1024; end++; break;
+    default: break;
+    }
+
+    if (*end) usage();
+
+    return n;
+}
+
 int main (int argc, char **argv)
 {
     save_argv0(argv[0]);
@@ -312,13 +354,17 @@ int main (int argc, char **argv)
     enum ctlbu_cmd cmd = CTLBU_CMD_UNSPECIFIED;
     struct ctlbu_cmd_options options = {0};
     options.wait = BACKUP_OPEN_NONBLOCK;
+    options.jobs = 1;
 
-    while ((opt = getopt(argc, argv, ":AC:DFPScfmpst:x:uvw")) != EOF) {
+    while ((opt = getopt(argc, argv, ":AB:C:DFPR:Scfj:mpst:x:uvw")) != EOF) {
         switch (opt) {
         case 'A':
             if (options.mode != CTLBU_MODE_UNSPECIFIED) usage();
             options.mode = CTLBU_MODE_ALL;
             break;
+        case 'B':
+            options.io_budget = parse_bytes(optarg);
+            break;
         case 'C':
             alt_config = optarg;
             break;
@@ -333,6 +379,9 @@ int main (int argc, char **argv)
             if (options.mode != CTLBU_MODE_UNSPECIFIED) usage();
             options.mode = CTLBU_MODE_PREFIX;
             break;
+        case 'R':
+            options.progress_fname = optarg;
+            break;
         case 'S':
             options.stop_on_error = 1;
             break;
@@ -343,6 +392,10 @@ int main (int argc, char **argv)
             if (options.mode != CTLBU_MODE_UNSPECIFIED) usage();
             options.mode = CTLBU_MODE_FILENAME;
             break;
+        case 'j':
+            options.jobs = atoi(optarg);
+            if (options.jobs < 1) usage();
+            break;
         case 'm':
             if (options.mode != CTLBU_MODE_UNSPECIFIED) usage();
             options.mode = CTLBU_MODE_MBOXNAME;
@@ -388,11 +441,20 @@ int main (int argc, char **argv)
     if (optind == argc) usage();
     cmd = parse_cmd_string(argv[optind++]);
     if (cmd == CTLBU_CMD_UNSPECIFIED) usage();
+    options.cmd = cmd;
 
     if (options.lock_mode != CTLBU_LOCK_MODE_UNSPECIFIED
         && cmd != CTLBU_CMD_LOCK)
         usage();
 
+    /* workers, throttling and progress only make sense for batch commands */
+    if (options.jobs > 1 || options.io_budget || options.progress_fname) {
+        if (cmd != CTLBU_CMD_COMPACT
+            && cmd != CTLBU_CMD_REINDEX
+            && cmd != CTLBU_CMD_VERIFY)
+            usage();
+    }
+
     switch (cmd) {
     /* list defaults to all */
     case CTLBU_CMD_LIST:
@@ -442,7 +504,7 @@ int main (int argc, char **argv)
 
         if (!r)
             r = cyrusdb_foreach(backups_db, NULL, 0, NULL,
-                                cmd_func[cmd], &options,
+                                cmd_dispatch_one, &options,
                                 &tid);
 
         if (backups_db) {
@@ -463,7 +525,7 @@ int main (int argc, char **argv)
 
             r = cyrusdb_foreach(backups_db, NULL, 0,
                                 domain_filter,
-                                cmd_func[cmd], &options,
+                                cmd_dispatch_one, &options,
                                 &tid);
         }
 
@@ -485,7 +547,7 @@ int main (int argc, char **argv)
             r = cyrusdb_foreach(backups_db,
                                 argv[i], strlen(argv[i]),
                                 NULL,
-                                cmd_func[cmd], &options,
+                                cmd_dispatch_one, &options,
                                 &tid);
         }
 
@@ -520,11 +582,11 @@ int main (int argc, char **argv)
                 buf_setcstr(&fname, argv[i]);
 
             if (cmd_func[cmd])
-                r = cmd_func[cmd](&options,
-                                  buf_cstring(&userid),
-                                  buf_len(&userid),
-                                  buf_cstring(&fname),
-                                  buf_len(&fname));
+                r = cmd_dispatch_one(&options,
+                                     buf_cstring(&userid),
+                                     buf_len(&userid),
+                                     buf_cstring(&fname),
+                                     buf_len(&fname));
 
             if (mbname) mbname_free(&mbname);
 
@@ -535,11 +597,280 @@ int main (int argc, char **argv)
         buf_free(&fname);
     }
 
+    /* wait for any workers still running */
+    if (wait_jobs(&options, 0) && !r)
+        r = EC_TEMPFAIL;
+
     backup_cleanup_staging_path();
     cyrus_done();
     exit(r || ctlbu_skips_fails ? EC_TEMPFAIL : EC_OK);
 }
 
+/* child exit statuses, so the parent can account for its workers */
+enum {
+    CTLBU_JOB_OK            = 0,
+    CTLBU_JOB_SKIPPED       = 1, /* skipped or failed, keep going */
+    CTLBU_JOB_STOP          = 2, /* failed, and stop_on_error is set */
+};
+
+/* reap workers until no more than max_running are left.
+ * returns non-zero if any of them wants us to stop */
+static int wait_jobs(struct ctlbu_cmd_options *options, int max_running)
+{
+    int r = 0;
+
+    while (ctlbu_jobs_running > max_running) {
+        int status;
+        pid_t pid = wait(&status);
+
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            perror("wait");
+            ctlbu_jobs_running = 0;
+            break;
+        }
+
+        ctlbu_jobs_running--;
+
+        if (!WIFEXITED(status)) {
+            ++ctlbu_skips_fails;
+            if (options->stop_on_error) r = -1;
+        }
+        else if (WEXITSTATUS(status) == CTLBU_JOB_SKIPPED) {
+            ++ctlbu_skips_fails;
+        }
+        else if (WEXITSTATUS(status) != CTLBU_JOB_OK) {
+            ++ctlbu_skips_fails;
+            r = -1;
+        }
+    }
+
+    return r;
+}
+
+/* sleep as needed to keep the rate at which we start on backups within
+ * the configured I/O budget, counting each backup's data file size */
+static void io_throttle(struct ctlbu_cmd_options *options, const char *fname)
+{
+    static struct timeval start = { 0, 0 };
+    static uint64_t dispatched = 0;
+    struct timeval now;
+    struct stat sbuf;
+    double elapsed, due;
+
+    if (!options->io_budget || !fname) return;
+
+    gettimeofday(&now, NULL);
+    if (!start.tv_sec) start = now;
+
+    elapsed = (now.tv_sec - start.tv_sec)
+              + (now.tv_usec - start.tv_usec) / 1000000.0;
+    due = (double) dispatched / options->io_budget;
+
+    if (due > elapsed) {
+        uint64_t delay = (due - elapsed) * 1000000;
+        if (options->verbose > 1)
+            fprintf(stderr, "throttling for %llu usec\n",
+                            (unsigned long long) delay);
+        while (delay) {
+            unsigned n = delay > 1000000 ? 1000000 : delay;
+            usleep(n);
+            delay -= n;
+        }
+    }
+
+    if (!stat(fname, &sbuf))
+        dispatched += sbuf.st_size;
+}
+
+static int cmd_dispatch_one(void *rock,
+                            const char *key, size_t key_len,
+                            const char *data, size_t data_len)
+{
+    struct ctlbu_cmd_options *options = (struct ctlbu_cmd_options *) rock;
+    foreach_cb *func = cmd_func[options->cmd];
+    char *fname = NULL;
+    pid_t pid;
+    int r;
+
+    if (options->io_budget && data_len) {
+        fname = xstrndup(data, data_len);
+        io_throttle(options, fname);
+        free(fname);
+    }
+
+    if (options->jobs <= 1)
+        return func(rock, key, key_len, data, data_len);
+
+    /* wait for a free worker */
+    r = wait_jobs(options, options->jobs - 1);
+    if (r) return r;
+
+    /* don't let the children inherit our buffered output */
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    switch (pid) {
+    case -1:
+        /* couldn't fork, so do it ourselves */
+        perror("fork");
+        return func(rock, key, key_len, data, data_len);
+
+    case 0:
+        /* child: each backup is locked when opened, so workers can't
+         * trip over each other even if a backup is listed twice */
+        ctlbu_jobs_running = 0;
+        ctlbu_skips_fails = 0;
+
+        r = func(rock, key, key_len, data, data_len);
+
+        fflush(stdout);
+        fflush(stderr);
+        backup_cleanup_staging_path();
+        _exit(r ? CTLBU_JOB_STOP
+                : ctlbu_skips_fails ? CTLBU_JOB_SKIPPED
+                : CTLBU_JOB_OK);
+
+    default:
+        /* parent */
+        ctlbu_jobs_running++;
+        return 0;
+    }
+}
+
+/* progress file, so that interrupted runs can be resumed, and backups
+ * that haven't changed since they were last processed can be skipped.
+ * each worker opens it for itself, so nothing is shared across forks */
+struct ctlbu_progress {
+    off_t size;
+    time_t mtime;
+    int chunk_id;
+    char data_sha1[2 * SHA1_DIGEST_LENGTH + 1];
+    time_t expiry;      /* 0 if nothing will expire, -1 if not known */
+};
+
+static int progress_get(const struct ctlbu_cmd_options *options,
+                        const char *cmd, const char *fname,
+                        struct ctlbu_progress *progress)
+{
+    struct db *db = NULL;
+    struct buf key = BUF_INITIALIZER;
+    const char *data = NULL;
+    size_t data_len = 0;
+    int r;
+
+    memset(progress, 0, sizeof(*progress));
+
+    if (!options->progress_fname || !fname) return CYRUSDB_NOTFOUND;
+
+    r = cyrusdb_open("twoskip", options->progress_fname, CYRUSDB_CREATE, &db);
+    if (r) goto done;
+
+    buf_printf(&key, "%s:%s", cmd, fname);
+    r = cyrusdb_fetch(db, buf_base(&key), buf_len(&key),
+                      &data, &data_len, NULL);
+    if (!r) {
+        char *val = xstrndup(data, data_len);
+        long long size, mtime, expiry = -1;
+
+        if (sscanf(val, "%lld %lld %d %40s %lld", &size, &mtime,
+                   &progress->chunk_id, progress->data_sha1, &expiry) < 2) {
+            r = CYRUSDB_NOTFOUND;
+        }
+        else {
+            progress->size = size;
+            progress->mtime = mtime;
+            progress->expiry = expiry;
+        }
+
+        free(val);
+    }
+
+done:
+    if (db) cyrusdb_close(db);
+    buf_free(&key);
+    return r;
+}
+
+static void progress_put(const struct ctlbu_cmd_options *options,
+                         const char *cmd, const char *fname,
+                         const struct ctlbu_progress *progress)
+{
+    struct db *db = NULL;
+    struct buf key = BUF_INITIALIZER;
+    struct buf val = BUF_INITIALIZER;
+    int r;
+
+    if (!options->progress_fname || !fname) return;
+
+    r = cyrusdb_open("twoskip", options->progress_fname, CYRUSDB_CREATE, &db);
+    if (r) {
+        fprintf(stderr, "unable to open progress file %s: %s\n",
+                options->progress_fname, cyrusdb_strerror(r));
+        return;
+    }
+
+    buf_printf(&key, "%s:%s", cmd, fname);
+    buf_printf(&val, "%lld %lld %d %s %lld",
+               (long long) progress->size, (long long) progress->mtime,
+               progress->chunk_id,
+               progress->data_sha1[0] ? progress->data_sha1 : "-",
+               (long long) progress->expiry);
+
+    r = cyrusdb_store(db, buf_base(&key), buf_len(&key),
+                      buf_base(&val), buf_len(&val), NULL);
+    if (r) {
+        fprintf(stderr, "unable to update progress file %s: %s\n",
+                options->progress_fname, cyrusdb_strerror(r));
+    }
+
+    cyrusdb_close(db);
+    buf_free(&key);
+    buf_free(&val);
+}
+
+static int progress_unchanged(const struct ctlbu_progress *progress,
+                              const struct stat *sbuf)
+{
+    return progress->size == sbuf->st_size
+           && progress->mtime == sbuf->st_mtime;
+}
+
+/* compaction also drops chunks whose contents have aged out of the
+ * retention period, so an unchanged backup still needs compacting once
+ * the first deletion or expunge after the last compaction does */
+static int progress_unexpired(const struct ctlbu_progress *progress,
+                              time_t now)
+{
+    if (config_getint(IMAPOPT_BACKUP_RETENTION_DAYS) <= 0) return 1;
+    if (progress->expiry < 0) return 0;
+
+    return !progress->expiry || now < progress->expiry;
+}
+
+static time_t compact_next_expiry(const struct ctlbu_cmd_options *options,
+                                  const char *fname, time_t started)
+{
+    const int retention_days = config_getint(IMAPOPT_BACKUP_RETENTION_DAYS);
+    const time_t retention = retention_days * 24 * 60 * 60;
+    struct backup *backup = NULL;
+    time_t expiry;
+    int r;
+
+    if (retention_days <= 0) return 0;
+
+    r = backup_open_paths(&backup, fname, NULL,
+                          options->wait, BACKUP_OPEN_NOCREATE);
+    if (r) return -1;
+
+    /* compaction's own idea of "now" can't be earlier than this */
+    expiry = backup_get_next_expiry(backup, started - retention);
+    backup_close(&backup);
+
+    return expiry > 0 ? expiry + retention : expiry;
+}
+
 static int cmd_compact_one(void *rock,
                            const char *key, size_t key_len,
                            const char *data, size_t data_len)
@@ -547,6 +878,7 @@ static int cmd_compact_one(void *rock,
     struct ctlbu_cmd_options *options = (struct ctlbu_cmd_options *) rock;
     char *userid = NULL;
     char *fname = NULL;
+    time_t started = time(NULL);
     int r = 0;
 
     /* input args might not be 0-terminated, so make a safe copy */
@@ -555,11 +887,37 @@ static int cmd_compact_one(void *rock,
     if (data_len)
         fname = xstrndup(data, data_len);
 
+    if (options->progress_fname && fname && !options->force) {
+        struct ctlbu_progress progress;
+        struct stat sbuf;
+
+        if (!progress_get(options, "compact", fname, &progress)
+            && !stat(fname, &sbuf)
+            && progress_unchanged(&progress, &sbuf)
+            && progress_unexpired(&progress, started)) {
+            print_status("compact", userid, fname, 2);
+            goto done;
+        }
+    }
+
     r = backup_compact(fname, options->wait, options->force,
                        options->verbose, stdout);
 
     print_status("compact", userid, fname, r);
 
+    if ((r == 0 || r == 1) && options->progress_fname && fname) {
+        struct ctlbu_progress progress = {0};
+        struct stat sbuf;
+
+        if (!stat(fname, &sbuf)) {
+            progress.size = sbuf.st_size;
+            progress.mtime = sbuf.st_mtime;
+            progress.expiry = compact_next_expiry(options, fname, started);
+            progress_put(options, "compact", fname, &progress);
+        }
+    }
+
+done:
     if (userid) free(userid);
     if (fname) free(fname);
 
@@ -682,7 +1040,7 @@ static int cmd_reindex_one(void *rock,
     struct ctlbu_cmd_options *options = (struct ctlbu_cmd_options *) rock;
     char *userid = NULL;
     char *fname = NULL;
-    int r;
+    int r = 0;
 
     /* input args might not be 0-terminated, so make a safe copy */
     if (key_len)
@@ -690,10 +1048,36 @@ static int cmd_reindex_one(void *rock,
     if (data_len)
         fname = xstrndup(data, data_len);
 
+    /* the index is rebuilt from the data file alone, so if that hasn't
+     * changed since the last reindex there's nothing to do */
+    if (options->progress_fname && fname && !options->force) {
+        struct ctlbu_progress progress;
+        struct stat sbuf;
+
+        if (!progress_get(options, "reindex", fname, &progress)
+            && !stat(fname, &sbuf)
+            && progress_unchanged(&progress, &sbuf)) {
+            print_status("reindex", userid, fname, 2);
+            goto done;
+        }
+    }
+
     r = backup_reindex(fname, options->wait, options->verbose, stdout);
 
     print_status("reindex", userid, fname, r);
 
+    if (!r && options->progress_fname && fname) {
+        struct ctlbu_progress progress = {0};
+        struct stat sbuf;
+
+        if (!stat(fname, &sbuf)) {
+            progress.size = sbuf.st_size;
+            progress.mtime = sbuf.st_mtime;
+            progress_put(options, "reindex", fname, &progress);
+        }
+    }
+
+done:
     if (userid) free(userid);
     if (fname) free(fname);
 
@@ -720,11 +1104,51 @@ static int cmd_verify_one(void *rock,
 
     r = backup_open_paths(&backup, fname, NULL,
                           options->wait, BACKUP_OPEN_NOCREATE);
+    if (r) goto done;
 
-    if (!r) r = backup_verify(backup, BACKUP_VERIFY_FULL, options->verbose, stdout);
+    if (options->progress_fname && !options->force) {
+        struct ctlbu_progress progress;
+        struct stat data_stat;
+
+        if (!progress_get(options, "verify", fname, &progress)
+            && !backup_stat(backup, &data_stat, NULL)) {
+            if (progress_unchanged(&progress, &data_stat)) {
+                print_status("verify", userid, fname, 2);
+                goto cleanup;
+            }
 
+            r = backup_verify_incremental(backup, BACKUP_VERIFY_FULL,
+                                          progress.chunk_id,
+                                          progress.data_sha1,
+                                          options->verbose, stdout);
+            goto done;
+        }
+    }
+
+    r = backup_verify(backup, BACKUP_VERIFY_FULL, options->verbose, stdout);
+
+done:
     print_status("verify", userid, fname, r);
 
+    if (!r && options->progress_fname) {
+        struct ctlbu_progress progress = {0};
+        struct backup_chunk *chunk = backup_get_latest_chunk(backup);
+        struct stat data_stat;
+
+        if (chunk && !backup_stat(backup, &data_stat, NULL)) {
+            progress.size = data_stat.st_size;
+            progress.mtime = data_stat.st_mtime;
+            progress.chunk_id = chunk->id;
+            if (chunk->data_sha1)
+                strlcpy(progress.data_sha1, chunk->data_sha1,
+                        sizeof(progress.data_sha1));
+            progress_put(options, "verify", fname, &progress);
+        }
+
+        if (chunk) backup_chunk_free(&chunk);
+    }
+
+cleanup:
     if (backup) backup_close(&backup);
     if (userid) free(userid);
     if (fname) free(fname);
@@ -131,6 +131,7 @@ HIDDEN int backup_real_open(struct backup **backupp,
 
     backup->data_fname = xstrdup(data_fname);
     backup->index_fname = xstrdup(index_fname);
+    backup->refs_dname = strconcat(data_fname, ".refs", (char *) NULL);
 
     int open_flags = O_RDWR | O_APPEND;
 
@@ -471,6 +472,7 @@ EXPORTED int backup_close(struct backup **backupp)
     if (backup->index_fname) free(backup->index_fname);
     if (backup->data_fname) free(backup->data_fname);
     if (backup->oldindex_fname) free(backup->oldindex_fname);
+    if (backup->refs_dname) free(backup->refs_dname);
 
     free(backup);
     return r1 ? r1 : r2;
@@ -175,14 +175,11 @@ EXPORTED int backup_append_start(struct backup *backup,
     return backup_real_append_start(backup, ts, offset, file_sha1, 0, flush);
 }
 
-EXPORTED int backup_append(struct backup *backup,
-                           struct dlist *dlist,
-                           const time_t *tsp,
-                           enum backup_append_flush flush)
+static int append_dlist(struct backup *backup,
+                        struct dlist *dlist,
+                        const time_t *tsp,
+                        enum backup_append_flush flush)
 {
-    if (!backup->append_state || backup->append_state->mode == BACKUP_APPEND_INACTIVE)
-        fatal("backup append not started", EC_SOFTWARE);
-
     off_t start = backup->append_state->wrote;
     size_t len = 0;
     time_t ts = tsp ? *tsp : time(NULL);
@@ -245,6 +242,32 @@ error:
     return IMAP_INTERNAL;
 }
 
+EXPORTED int backup_append(struct backup *backup,
+                           struct dlist *dlist,
+                           const time_t *tsp,
+                           enum backup_append_flush flush)
+{
+    struct dlist *refs = NULL;
+    int r;
+
+    if (!backup->append_state || backup->append_state->mode == BACKUP_APPEND_INACTIVE)
+        fatal("backup append not started", EC_SOFTWARE);
+
+    /* with a message store, the messages go there, and the backup only
+     * refers to them */
+    if (!(backup->append_state->mode & BACKUP_APPEND_INDEXONLY)
+        && strcmp(dlist->name, "MESSAGE") == 0)
+        refs = backup_msgstore_refs(backup, dlist);
+
+    if (refs) {
+        r = append_dlist(backup, refs, tsp, flush);
+        dlist_free(&refs);
+        return r;
+    }
+
+    return append_dlist(backup, dlist, tsp, flush);
+}
+
 HIDDEN int backup_real_append_end(struct backup *backup, time_t ts)
 {
     int r;
@@ -120,6 +120,11 @@ static int compact_open(const char *name,
         goto done;
     }
 
+    /* the compacted backup replaces the original, so it has the same
+     * references into the message store */
+    free(compact->refs_dname);
+    compact->refs_dname = xstrdup(original->refs_dname);
+
     *originalp = original;
     *compactp = compact;
 
@@ -278,7 +283,8 @@ static int compact_required(struct backup_chunk_list *all_chunks,
 static int want_append(struct dlist *dlist,
                        struct sync_msgid_list *keep_message_guids)
 {
-    if (strcmp(dlist->name, "MESSAGE") == 0) {
+    if (strcmp(dlist->name, "MESSAGE") == 0
+        || strcmp(dlist->name, "MSGREF") == 0) {
         struct dlist *di, *next;
 
         for (di = dlist->head; di; di = next) {
@@ -287,7 +293,7 @@ static int want_append(struct dlist *dlist,
             /* save next pointer now in case we need to unstitch */
             next = di->next;
 
-            if (!dlist_tofile(di, NULL, &guid, NULL, NULL))
+            if (!backup_msgstore_entry(di, NULL, &guid, NULL))
                 continue;
 
             if (!sync_msgid_lookup(keep_message_guids, guid)) {
@@ -350,6 +356,7 @@ EXPORTED int backup_compact(const char *name,
     struct sync_msgid_list *keep_message_guids = NULL;
     struct gzuncat *gzuc = NULL;
     struct protstream *in = NULL;
+    char *refs_dname = NULL;
     time_t since, chunk_start_time, ts;
     int r;
 
@@ -490,13 +497,26 @@ EXPORTED int backup_compact(const char *name,
 
     backup_chunk_list_free(&keep_chunks);
 
+    /* every message the compacted backup still has */
+    keep_message_guids = sync_msgid_list_create(0);
+    r = backup_message_foreach(compact, 0, NULL,
+                               _keep_message_guids_cb, keep_message_guids);
+    if (r) goto error;
+    refs_dname = xstrdup(original->refs_dname);
+
     /* if we get here okay, then the compact succeeded */
     r = compact_closerename(&original, &compact, now);
     if (r) goto error;
 
+    /* so anything else it had in the message store can go */
+    backup_msgstore_sweep(refs_dname, keep_message_guids);
+    sync_msgid_list_free(&keep_message_guids);
+    free(refs_dname);
+
     return 0;
 
 error:
+    free(refs_dname);
     if (in) prot_free(in);
     if (gzuc) gzuc_free(&gzuc);
     if (keep_message_guids) sync_msgid_list_free(&keep_message_guids);
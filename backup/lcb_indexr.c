@@ -976,6 +976,37 @@ EXPORTED struct backup_chunk_list *backup_get_live_chunks(struct backup *backup,
     return chunk_list;
 }
 
+static int _get_next_expiry_cb(sqlite3_stmt *stmt, void *rock)
+{
+    time_t *expiryp = (time_t *) rock;
+
+    *expiryp = _column_int64(stmt, 0);
+
+    return 0;
+}
+
+/* the first deletion or expunge after 'since': once that passes out of
+ * the retention period, compaction may find another chunk to drop.
+ * returns 0 if there is none, or -1 on error */
+EXPORTED time_t backup_get_next_expiry(struct backup *backup, time_t since)
+{
+    struct sqldb_bindval bval[] = {
+        { ":since", SQLITE_INTEGER, { .i = since } },
+        { NULL,     SQLITE_NULL,    { .s = NULL  } },
+    };
+
+    time_t expiry = 0;
+
+    int r = sqldb_exec(backup->db, backup_index_chunk_select_next_expiry_sql,
+                       bval, _get_next_expiry_cb, &expiry);
+    if (r) {
+        syslog(LOG_ERR, "%s: something went wrong: %i\n", __func__, r);
+        return -1;
+    }
+
+    return expiry;
+}
+
 EXPORTED struct backup_chunk *backup_get_chunk(struct backup *backup,
                                                int chunk_id)
 {
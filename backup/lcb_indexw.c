@@ -76,7 +76,8 @@ HIDDEN int backup_index(struct backup *backup, struct dlist *dlist,
         r = _index_mailbox(backup, dlist, ts, start);
     else if (strcmp(dlist->name, "UNMAILBOX") == 0)
         r = _index_unmailbox(backup, dlist, ts, start);
-    else if (strcmp(dlist->name, "MESSAGE") == 0)
+    else if (strcmp(dlist->name, "MESSAGE") == 0
+             || strcmp(dlist->name, "MSGREF") == 0)
         r = _index_message(backup, dlist, ts, start, len);
     else if (strcmp(dlist->name, "RENAME") == 0)
         r = _index_rename(backup, dlist, ts, start);
@@ -432,13 +433,14 @@ static int _index_message(struct backup *backup, struct dlist *dl,
     struct dlist *di;
     int r = 0;
 
-    /* n.b. APPLY MESSAGE contains a list of messages, not just one */
+    /* n.b. APPLY MESSAGE contains a list of messages, not just one,
+     * as does APPLY MSGREF for messages in the message store */
     for (di = dl->head; di && !r; di = di->next) {
         struct message_guid *guid = NULL;
         const char *partition = NULL;
         unsigned long size = 0;
 
-        if (!dlist_tofile(di, &partition, &guid, &size, NULL))
+        if (!backup_msgstore_entry(di, &partition, &guid, &size))
             continue;
 
         struct sqldb_bindval bval[] = {
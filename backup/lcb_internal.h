@@ -70,6 +70,7 @@ struct backup {
     char *data_fname;
     char *index_fname;
     char *oldindex_fname;
+    char *refs_dname;       /* links to the messages it has in the store */
     sqldb_t *db;
     struct backup_append_state *append_state;
 };
@@ -115,6 +116,22 @@ struct backup_mailbox_message *backup_mailbox_message_list_remove(
     struct backup_mailbox_message_list *list,
     struct backup_mailbox_message *mailbox_message);
 
+/* shared message store */
+const char *backup_msgstore_path(void);
+int backup_msgstore_entry(struct dlist *di, const char **partp,
+                          struct message_guid **guidp, unsigned long *sizep);
+struct dlist *backup_msgstore_refs(struct backup *backup, struct dlist *dl);
+int backup_msgstore_get(struct backup *backup,
+                        const struct message_guid *guid, struct buf *buf);
+int backup_msgstore_has(struct backup *backup,
+                        const struct message_guid *guid);
+int backup_msgstore_stage(struct backup *backup,
+                          const struct message_guid *guid,
+                          const char *partition,
+                          struct dlist *upload);
+int backup_msgstore_sweep(const char *refs_dname,
+                          const struct sync_msgid_list *keep);
+
 const char *partlist_backup_select(void);
 int partlist_backup_foreach(partlist_foreach_cb proc, void *rock);
 void partlist_backup_done(void);
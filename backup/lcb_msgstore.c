@@ -0,0 +1,499 @@
+/* lcb_msgstore.c -- replication-based backup api - shared message store
+ *
+ * Copyright (c) 1994-2016 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <syslog.h>
+#include <zlib.h>
+
+#include "lib/libconfig.h"
+#include "lib/map.h"
+#include "lib/util.h"
+#include "lib/xmalloc.h"
+#include "lib/xstrlcpy.h"
+
+#include "imap/dlist.h"
+#include "imap/imap_err.h"
+#include "imap/message_guid.h"
+#include "imap/sync_support.h"
+
+#include "backup/backup.h"
+
+#define LIBCYRUS_BACKUP_SOURCE /* this file is part of libcyrus_backup */
+#include "backup/lcb_internal.h"
+
+/*
+ * The message store is a content-addressed directory of message files,
+ * shared by every backup that is configured to use it.  Each message is
+ * stored exactly once, keyed on its GUID, as a single self-contained gzip
+ * member.  Backups then record an APPLY MSGREF line in place of the
+ * APPLY MESSAGE line they would otherwise have written, so identical
+ * messages delivered to many users only occupy one file, and a single
+ * message can be read back without decompressing the chunk around it.
+ *
+ * Each backup holds a hard link to every stored message it refers to,
+ * in its own refs directory (data_fname.refs), so the link count of a
+ * stored file is the number of backups still using it (plus one for the
+ * store itself).  Compaction removes the links for messages the backup
+ * no longer needs, and the stored file along with the last of them.
+ * This means the store must be on the same filesystem as the backups:
+ * if a message can't be linked, the backup keeps it inline as before.
+ */
+
+#define MSGSTORE_BUFSIZE (64 * 1024)
+
+HIDDEN const char *backup_msgstore_path(void)
+{
+    return config_getstring(IMAPOPT_BACKUP_MSGSTORE_PATH);
+}
+
+static const char *msgstore_fname(const char *hex, struct buf *fname)
+{
+    const char *path = backup_msgstore_path();
+
+    if (!path) return NULL;
+
+    buf_reset(fname);
+    buf_printf(fname, "%s/%c%c/%c%c/%s.gz",
+                      path, hex[0], hex[1], hex[2], hex[3], hex);
+
+    return buf_cstring(fname);
+}
+
+static const char *msgstore_ref_fname(const char *refs_dname, const char *hex,
+                                      struct buf *fname)
+{
+    buf_reset(fname);
+    buf_printf(fname, "%s/%c%c/%s.gz", refs_dname, hex[0], hex[1], hex);
+
+    return buf_cstring(fname);
+}
+
+/* the guid, partition and size of one message in an APPLY MESSAGE line
+ * (a file) or an APPLY MSGREF line (a reference to the store).
+ * returns 0 if 'di' is neither */
+HIDDEN int backup_msgstore_entry(struct dlist *di, const char **partp,
+                                 struct message_guid **guidp,
+                                 unsigned long *sizep)
+{
+    const char *partition = NULL;
+    struct message_guid *guid = NULL;
+    bit64 size = 0;
+
+    if (dlist_tofile(di, partp, guidp, sizep, NULL))
+        return 1;
+
+    if (!dlist_iskvlist(di)
+        || !dlist_getguid(di, "GUID", &guid)
+        || !dlist_getatom(di, "PARTITION", &partition)
+        || !dlist_getnum64(di, "SIZE", &size))
+        return 0;
+
+    if (partp) *partp = partition;
+    if (guidp) *guidp = guid;
+    if (sizep) *sizep = size;
+
+    return 1;
+}
+
+/* compress a message into the store, under a temporary name and then
+ * renamed into place, so that concurrent writers and readers never see
+ * a partial file */
+static int msgstore_write(const char *fname, const char *src_fname)
+{
+    struct buf tmp_fname = BUF_INITIALIZER;
+    struct buf data = BUF_INITIALIZER;
+    gzFile gzfile = NULL;
+    int fd = -1;
+    int r = 0;
+
+    fd = open(src_fname, O_RDONLY);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: %s open %s: %m", __func__, src_fname);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+    buf_init_mmap(&data, /*onceonly*/ 1, fd, src_fname, MAP_UNKNOWN_LEN, NULL);
+    close(fd);
+
+    buf_printf(&tmp_fname, "%s.%lu", fname, (unsigned long) getpid());
+
+    if (cyrus_mkdir(buf_cstring(&tmp_fname), 0755)) {
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    fd = open(buf_cstring(&tmp_fname), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) gzfile = gzdopen(dup(fd), "wb");
+    if (!gzfile) {
+        syslog(LOG_ERR, "IOERROR: %s gzdopen %s: %m",
+                        __func__, buf_cstring(&tmp_fname));
+        unlink(buf_cstring(&tmp_fname));
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    const char *p = buf_base(&data);
+    size_t left = buf_len(&data);
+    while (left) {
+        int n = MIN(left, MSGSTORE_BUFSIZE);
+        int wrote = gzwrite(gzfile, p, n);
+        if (wrote <= 0) {
+            int zr;
+            syslog(LOG_ERR, "IOERROR: %s gzwrite %s: %s", __func__,
+                            buf_cstring(&tmp_fname), gzerror(gzfile, &zr));
+            r = IMAP_IOERROR;
+            break;
+        }
+        left -= wrote;
+        p += wrote;
+    }
+
+    if (gzclose(gzfile) != Z_OK && !r) {
+        syslog(LOG_ERR, "IOERROR: %s gzclose %s failed",
+                        __func__, buf_cstring(&tmp_fname));
+        r = IMAP_IOERROR;
+    }
+    gzfile = NULL;
+
+    /* this is the only copy of the message, so make sure it's there */
+    if (!r && fsync(fd)) {
+        syslog(LOG_ERR, "IOERROR: %s fsync %s: %m",
+                        __func__, buf_cstring(&tmp_fname));
+        r = IMAP_IOERROR;
+    }
+
+    if (!r && rename(buf_cstring(&tmp_fname), fname)) {
+        syslog(LOG_ERR, "IOERROR: %s rename %s: %m", __func__, fname);
+        r = IMAP_IOERROR;
+    }
+
+    if (r) unlink(buf_cstring(&tmp_fname));
+
+done:
+    if (fd >= 0) close(fd);
+    buf_free(&data);
+    buf_free(&tmp_fname);
+    return r;
+}
+
+/* make sure the store has the message, and that the backup refers to it */
+static int msgstore_put(struct backup *backup,
+                        const struct message_guid *guid,
+                        const char *src_fname)
+{
+    struct buf fname = BUF_INITIALIZER;
+    struct buf ref_fname = BUF_INITIALIZER;
+    const char *hex = message_guid_encode(guid);
+    int tries, r = 0;
+
+    msgstore_fname(hex, &fname);
+    msgstore_ref_fname(backup->refs_dname, hex, &ref_fname);
+
+    if (cyrus_mkdir(buf_cstring(&ref_fname), 0755)) {
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    /* the stored file can go away under us, if the last other backup
+     * that used it is being compacted, so try again if it does */
+    for (tries = 0; tries < 3; tries++) {
+        if (!link(buf_cstring(&fname), buf_cstring(&ref_fname))
+            || errno == EEXIST)
+            goto done;
+
+        if (errno != ENOENT) {
+            syslog(LOG_ERR, "IOERROR: %s link %s: %m",
+                            __func__, buf_cstring(&ref_fname));
+            r = IMAP_IOERROR;
+            goto done;
+        }
+
+        r = msgstore_write(buf_cstring(&fname), src_fname);
+        if (r) goto done;
+    }
+
+    r = IMAP_AGAIN;
+
+done:
+    buf_free(&ref_fname);
+    buf_free(&fname);
+    return r;
+}
+
+/* put every message of an APPLY MESSAGE dlist in the store, and return
+ * the APPLY MSGREF dlist to write in its place.  returns NULL if there's
+ * no store, or if any message couldn't go there, in which case the
+ * backup keeps all of them inline */
+HIDDEN struct dlist *backup_msgstore_refs(struct backup *backup,
+                                          struct dlist *dl)
+{
+    struct dlist *refs;
+    struct dlist *di;
+    int r = 0;
+
+    if (!backup_msgstore_path()) return NULL;
+
+    refs = dlist_newlist(NULL, "MSGREF");
+
+    for (di = dl->head; di && !r; di = di->next) {
+        struct message_guid *guid = NULL;
+        const char *partition = NULL;
+        const char *fname = NULL;
+        unsigned long size = 0;
+        struct dlist *ref;
+
+        if (!dlist_tofile(di, &partition, &guid, &size, &fname))
+            continue;
+
+        r = msgstore_put(backup, guid, fname);
+        if (r) break;
+
+        ref = dlist_newkvlist(refs, NULL);
+        dlist_setguid(ref, "GUID", guid);
+        dlist_setatom(ref, "PARTITION", partition);
+        dlist_setnum64(ref, "SIZE", size);
+    }
+
+    if (r) {
+        syslog(LOG_WARNING, "%s: couldn't add messages from %s to message store: %s",
+                            __func__, backup->data_fname, error_message(r));
+        dlist_free(&refs);
+    }
+    else if (!refs->head) {
+        dlist_free(&refs);
+    }
+
+    return refs;
+}
+
+/* read a message the backup refers to into buf, checking that its
+ * content still matches its guid.  returns IMAP_NOTFOUND if the backup
+ * doesn't have a (usable) reference to the message */
+HIDDEN int backup_msgstore_get(struct backup *backup,
+                               const struct message_guid *guid,
+                               struct buf *buf)
+{
+    struct buf fname = BUF_INITIALIZER;
+    struct message_guid check;
+    gzFile gzfile = NULL;
+    int r = 0;
+
+    buf_reset(buf);
+
+    msgstore_ref_fname(backup->refs_dname, message_guid_encode(guid), &fname);
+
+    gzfile = gzopen(buf_cstring(&fname), "rb");
+    if (!gzfile) {
+        if (errno != ENOENT)
+            syslog(LOG_ERR, "IOERROR: %s gzopen %s: %m",
+                            __func__, buf_cstring(&fname));
+        r = IMAP_NOTFOUND;
+        goto done;
+    }
+    gzbuffer(gzfile, MSGSTORE_BUFSIZE);
+
+    for (;;) {
+        int n;
+
+        buf_ensure(buf, MSGSTORE_BUFSIZE);
+        n = gzread(gzfile, buf->s + buf->len, MSGSTORE_BUFSIZE);
+        if (n < 0) {
+            int zr;
+            syslog(LOG_ERR, "IOERROR: %s gzread %s: %s", __func__,
+                            buf_cstring(&fname), gzerror(gzfile, &zr));
+            r = IMAP_NOTFOUND;
+            break;
+        }
+        if (n == 0) break;
+        buf_truncate(buf, buf_len(buf) + n);
+    }
+
+    gzclose(gzfile);
+
+    if (!r) {
+        message_guid_generate(&check, buf_base(buf), buf_len(buf));
+        if (!message_guid_equal(guid, &check)) {
+            syslog(LOG_ERR, "IOERROR: %s %s: guid mismatch",
+                            __func__, buf_cstring(&fname));
+            r = IMAP_NOTFOUND;
+        }
+    }
+
+done:
+    if (r) buf_reset(buf);
+    buf_free(&fname);
+    return r;
+}
+
+/* does the backup refer to the message at all? */
+HIDDEN int backup_msgstore_has(struct backup *backup,
+                               const struct message_guid *guid)
+{
+    struct buf fname = BUF_INITIALIZER;
+    struct stat sbuf;
+    int r;
+
+    msgstore_ref_fname(backup->refs_dname, message_guid_encode(guid), &fname);
+    r = stat(buf_cstring(&fname), &sbuf);
+    buf_free(&fname);
+
+    return !r;
+}
+
+/* copy a message from the store into a staging file and add it to
+ * an upload dlist, as if it had been parsed out of the backup data */
+HIDDEN int backup_msgstore_stage(struct backup *backup,
+                                 const struct message_guid *guid,
+                                 const char *partition,
+                                 struct dlist *upload)
+{
+    struct buf data = BUF_INITIALIZER;
+    const char *fname;
+    FILE *f;
+    int r;
+
+    r = backup_msgstore_get(backup, guid, &data);
+    if (r) goto done;
+
+    fname = dlist_reserve_path(backup_get_staging_path(), 0, guid);
+    f = fopen(fname, "w");
+    if (!f) {
+        syslog(LOG_ERR, "IOERROR: %s fopen %s: %m", __func__, fname);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    if (fwrite(buf_base(&data), 1, buf_len(&data), f) != buf_len(&data)) {
+        syslog(LOG_ERR, "IOERROR: %s fwrite %s: %m", __func__, fname);
+        r = IMAP_IOERROR;
+    }
+    if (fclose(f) && !r) {
+        syslog(LOG_ERR, "IOERROR: %s fclose %s: %m", __func__, fname);
+        r = IMAP_IOERROR;
+    }
+
+    if (r)
+        unlink(fname);
+    else
+        dlist_setfile(upload, "MESSAGE", partition, guid, buf_len(&data), fname);
+
+done:
+    buf_free(&data);
+    return r;
+}
+
+/* drop a backup's reference to a stored message, and the stored file
+ * itself if nothing else refers to it any more.  checking the inode
+ * means a file stored again since can't be removed by mistake */
+static void msgstore_unref(const char *ref_fname, const char *hex)
+{
+    struct buf fname = BUF_INITIALIZER;
+    struct stat ref_sbuf, sbuf;
+
+    if (stat(ref_fname, &ref_sbuf)) return;
+
+    if (unlink(ref_fname)) {
+        syslog(LOG_ERR, "IOERROR: %s unlink %s: %m", __func__, ref_fname);
+        return;
+    }
+
+    if (msgstore_fname(hex, &fname)
+        && !stat(buf_cstring(&fname), &sbuf)
+        && sbuf.st_dev == ref_sbuf.st_dev && sbuf.st_ino == ref_sbuf.st_ino
+        && sbuf.st_nlink == 1) {
+        syslog(LOG_DEBUG, "%s: removing %s", __func__, buf_cstring(&fname));
+        unlink(buf_cstring(&fname));
+    }
+
+    buf_free(&fname);
+}
+
+/* drop every reference in 'refs_dname' to a message not in 'keep' */
+HIDDEN int backup_msgstore_sweep(const char *refs_dname,
+                                 const struct sync_msgid_list *keep)
+{
+    struct buf dname = BUF_INITIALIZER;
+    struct buf fname = BUF_INITIALIZER;
+    DIR *dirp, *subdirp;
+    struct dirent *dirent, *subdirent;
+
+    dirp = opendir(refs_dname);
+    if (!dirp) return errno == ENOENT ? 0 : IMAP_IOERROR;
+
+    while ((dirent = readdir(dirp))) {
+        if (dirent->d_name[0] == '.') continue;
+
+        buf_reset(&dname);
+        buf_printf(&dname, "%s/%s", refs_dname, dirent->d_name);
+
+        subdirp = opendir(buf_cstring(&dname));
+        if (!subdirp) continue;
+
+        while ((subdirent = readdir(subdirp))) {
+            struct message_guid guid;
+            char hex[2 * MESSAGE_GUID_SIZE + 1];
+
+            if (strlen(subdirent->d_name) != 2 * MESSAGE_GUID_SIZE + 3
+                || strcmp(subdirent->d_name + 2 * MESSAGE_GUID_SIZE, ".gz"))
+                continue;
+
+            strlcpy(hex, subdirent->d_name, sizeof(hex));
+            if (!message_guid_decode(&guid, hex)) continue;
+            if (sync_msgid_lookup(keep, &guid)) continue;
+
+            buf_reset(&fname);
+            buf_printf(&fname, "%s/%s", buf_cstring(&dname), subdirent->d_name);
+            msgstore_unref(buf_cstring(&fname), hex);
+        }
+
+        closedir(subdirp);
+    }
+
+    closedir(dirp);
+    buf_free(&fname);
+    buf_free(&dname);
+
+    return 0;
+}
@@ -101,8 +101,16 @@ EXPORTED int backup_read_message_data(struct backup *backup,
     struct gzuncat *gzuc = NULL;
     struct dlist *dl = NULL;
     struct dlist *di;
+    struct buf buf = BUF_INITIALIZER;
     int r;
 
+    /* if it's in the message store, we don't need to touch the chunk */
+    r = backup_msgstore_get(backup, message->guid, &buf);
+    if (!r) r = proc(&buf, rock);
+    buf_free(&buf);
+
+    if (r != IMAP_NOTFOUND) return r;
+
     chunk = backup_get_chunk(backup, message->chunk_id);
     if (!chunk) return -1;
 
@@ -185,6 +193,13 @@ EXPORTED int backup_prepare_message_upload(struct backup *backup,
         /* already uploaded */
         if (!msgid->need_upload) continue;
 
+        /* try the message store first, it's much cheaper */
+        if (!backup_msgstore_stage(backup, &msgid->guid, partition, upload)) {
+            msgid->need_upload = 0;
+            msgid_list->toupload--;
+            continue;
+        }
+
         message = backup_get_message(backup, &msgid->guid);
         if (!message) {
             syslog(LOG_ERR, "%s: couldn't find message %s in backup %s",
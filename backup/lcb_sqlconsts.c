@@ -162,6 +162,19 @@ const char backup_index_chunk_select_live_sql[] =
     ";"
 ;
 
+const char backup_index_chunk_select_next_expiry_sql[] =
+    "SELECT MIN(t) FROM ("
+    "  SELECT deleted AS t"
+    "   FROM mailbox"
+    "   WHERE deleted > :since"
+    "  UNION ALL"
+    "  SELECT expunged AS t"
+    "   FROM mailbox_message"
+    "   WHERE expunged > :since"
+    " )"
+    ";"
+;
+
 const char backup_index_chunk_select_latest_sql[] =
     "SELECT " CHUNK_SELECT_FIELDS
     " FROM chunk"
@@ -57,6 +57,7 @@ extern const char backup_index_end_sql[];
 
 extern const char backup_index_chunk_select_all_sql[];
 extern const char backup_index_chunk_select_live_sql[];
+extern const char backup_index_chunk_select_next_expiry_sql[];
 extern const char backup_index_chunk_select_latest_sql[];
 extern const char backup_index_chunk_select_id_sql[];
 
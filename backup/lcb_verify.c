@@ -65,9 +65,9 @@ static int verify_chunk_mailbox_links(struct backup *backup, struct backup_chunk
                                       struct gzuncat *gzuc, int verbose,
                                       FILE *out);
 
-EXPORTED int backup_verify(struct backup *backup, unsigned level, int verbose, FILE *out)
+static int verify_chunks(struct backup *backup, struct backup_chunk *first,
+                         unsigned level, int verbose, FILE *out)
 {
-    struct backup_chunk_list *chunk_list = NULL;
     struct gzuncat *gzuc = NULL;
     int r = 0;
 
@@ -79,20 +79,17 @@ EXPORTED int backup_verify(struct backup *backup, unsigned level, int verbose, F
     if ((level & BACKUP_VERIFY_MESSAGE_GUIDS))
         level &= ~BACKUP_VERIFY_MESSAGE_LINKS;
 
-    chunk_list = backup_get_chunks(backup);
-    if (!chunk_list || !chunk_list->count) goto done;
-
     gzuc = gzuc_new(backup->fd);
-    if (!gzuc) {
-        r = -1;
-        goto done;
-    }
+    if (!gzuc) return -1;
 
-    if (!r && (level & BACKUP_VERIFY_LAST_CHECKSUM))
-        r = verify_chunk_checksums(backup, chunk_list->tail, gzuc, verbose, out);
+    if (!r && (level & BACKUP_VERIFY_LAST_CHECKSUM)) {
+        struct backup_chunk *last = first;
+        while (last->next) last = last->next;
+        r = verify_chunk_checksums(backup, last, gzuc, verbose, out);
+    }
 
     if (!r && level > BACKUP_VERIFY_LAST_CHECKSUM) {
-        struct backup_chunk *chunk = chunk_list->head;
+        struct backup_chunk *chunk = first;
         while (!r && chunk) {
             if (!r && (level & BACKUP_VERIFY_ALL_CHECKSUMS))
                 r = verify_chunk_checksums(backup, chunk, gzuc, verbose, out);
@@ -107,8 +104,85 @@ EXPORTED int backup_verify(struct backup *backup, unsigned level, int verbose, F
         }
     }
 
+    gzuc_free(&gzuc);
+    return r;
+}
+
+EXPORTED int backup_verify(struct backup *backup, unsigned level, int verbose, FILE *out)
+{
+    struct backup_chunk_list *chunk_list = NULL;
+    int r = 0;
+
+    chunk_list = backup_get_chunks(backup);
+    if (!chunk_list || !chunk_list->count) goto done;
+
+    r = verify_chunks(backup, chunk_list->head, level, verbose, out);
+
+done:
+    if (chunk_list) backup_chunk_list_free(&chunk_list);
+    return r;
+}
+
+/* verify only the chunks appended since a previous successful verify.
+ *
+ * the file checksum recorded for the first new chunk covers every byte
+ * of the data file before it, so if that still matches, the previously
+ * verified chunks can't have changed and don't need to be decompressed
+ * again.  if the previously verified chunk can't be found (e.g. because
+ * the backup has since been compacted), falls back to a full verify.
+ */
+EXPORTED int backup_verify_incremental(struct backup *backup, unsigned level,
+                                       int last_chunk_id,
+                                       const char *last_data_sha1,
+                                       int verbose, FILE *out)
+{
+    struct backup_chunk_list *chunk_list = NULL;
+    struct backup_chunk *chunk = NULL;
+    char file_sha1[2 * SHA1_DIGEST_LENGTH + 1];
+    int r = 0;
+
+    chunk_list = backup_get_chunks(backup);
+    if (!chunk_list || !chunk_list->count) goto done;
+
+    for (chunk = chunk_list->head; chunk; chunk = chunk->next) {
+        if (chunk->id == last_chunk_id)
+            break;
+    }
+
+    if (!chunk || !chunk->data_sha1 || !last_data_sha1
+        || strcmp(chunk->data_sha1, last_data_sha1) != 0) {
+        if (out && verbose)
+            fprintf(out, "previously verified chunk %d not found, "
+                         "verifying all chunks\n", last_chunk_id);
+        r = verify_chunks(backup, chunk_list->head, level, verbose, out);
+        goto done;
+    }
+
+    if (!chunk->next) {
+        /* no new chunks, but the caller thinks something changed, so
+         * re-verify the last one (whose file checksum covers the rest) */
+        r = verify_chunks(backup, chunk, level, verbose, out);
+        goto done;
+    }
+
+    chunk = chunk->next;
+
+    if (out && verbose)
+        fprintf(out, "checking data before chunk %d is unchanged...\n",
+                chunk->id);
+
+    sha1_file(backup->fd, backup->data_fname, chunk->offset, file_sha1);
+    if (strncmp(chunk->file_sha1, file_sha1, sizeof(file_sha1)) != 0) {
+        if (out)
+            fprintf(out, "file checksum mismatch for chunk %d: %s on disk, %s in index\n",
+                    chunk->id, file_sha1, chunk->file_sha1);
+        r = -1;
+        goto done;
+    }
+
+    r = verify_chunks(backup, chunk, level, verbose, out);
+
 done:
-    if (gzuc) gzuc_free(&gzuc);
     if (chunk_list) backup_chunk_list_free(&chunk_list);
     return r;
 }
@@ -199,6 +273,7 @@ static ssize_t _prot_fill_cb(unsigned char *buf, size_t len, void *rock)
 }
 
 struct verify_message_rock {
+    struct backup *backup;
     struct gzuncat *gzuc;
     int verify_guid;
     struct dlist *cached_dlist;
@@ -207,6 +282,46 @@ struct verify_message_rock {
     FILE *out;
 };
 
+/* a message in the message store: the backup's reference to it must be
+ * there, and if asked for, still match its guid */
+static int _verify_msgref(struct verify_message_rock *vmrock,
+                          struct dlist *dl,
+                          const struct backup_message *message)
+{
+    struct dlist *di;
+    FILE *out = vmrock->out;
+    int r = -1;
+
+    for (di = dl->head; di; di = di->next) {
+        struct message_guid *guid = NULL;
+
+        if (!backup_msgstore_entry(di, NULL, &guid, NULL))
+            continue;
+
+        r = message_guid_cmp(guid, message->guid);
+        if (!r) {
+            if (vmrock->verify_guid) {
+                struct buf buf = BUF_INITIALIZER;
+
+                r = backup_msgstore_get(vmrock->backup, message->guid, &buf);
+                if (r && out)
+                    fprintf(out, "message %i missing or damaged in message store\n",
+                                 message->id);
+                buf_free(&buf);
+            }
+            else if (!backup_msgstore_has(vmrock->backup, message->guid)) {
+                if (out)
+                    fprintf(out, "message %i missing from message store\n",
+                                 message->id);
+                r = -1;
+            }
+            break;
+        }
+    }
+
+    return r;
+}
+
 static int _verify_message_cb(const struct backup_message *message, void *rock)
 {
     struct verify_message_rock *vmrock = (struct verify_message_rock *) rock;
@@ -252,6 +367,9 @@ static int _verify_message_cb(const struct backup_message *message, void *rock)
         dl = vmrock->cached_dlist;
     }
 
+    if (strcmp(dl->name, "MSGREF") == 0)
+        return _verify_msgref(vmrock, dl, message);
+
     r = strcmp(dl->name, "MESSAGE");
     if (r) return r;
 
@@ -305,6 +423,7 @@ static int verify_chunk_messages(struct backup *backup, struct backup_chunk *chu
     int r;
 
     struct verify_message_rock vmrock = {
+        backup,
         gzuc,
         (level & BACKUP_VERIFY_MESSAGE_GUIDS),
         NULL,
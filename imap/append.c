@@ -1267,7 +1267,8 @@ EXPORTED int append_copy(struct mailbox *mailbox, struct appendstate *as,
                          int nolink, int is_same_user)
 {
     int msg;
-    struct index_record record;
+    struct index_record *record;
+    struct index_record *newrecords = NULL;
     char *srcfname = NULL;
     char *destfname = NULL;
     int object_storage_enabled = 0 ;
@@ -1290,7 +1291,9 @@ EXPORTED int append_copy(struct mailbox *mailbox, struct appendstate *as,
         mboxevent = mboxevent_enqueue(as->event_type, &as->mboxevents);
     }
 
-    /* Copy/link all files and cache info */
+    newrecords = xmalloc(nummsg * sizeof(struct index_record));
+
+    /* Copy/link all files first */
     for (msg = 0; msg < nummsg; msg++) {
         /* read in existing cache record BEFORE we copy data, so that the
          * mmap will be up to date even if it's the same mailbox for source
@@ -1298,18 +1301,19 @@ EXPORTED int append_copy(struct mailbox *mailbox, struct appendstate *as,
         r = mailbox_cacherecord(mailbox, &records[msg]);
         if (r) goto out;
 
-        record = records[msg]; /* copy data */
+        record = &newrecords[msg];
+        *record = records[msg]; /* copy data */
 
         /* wipe out the bits that aren't magically copied */
-        record.system_flags &= ~FLAG_SEEN;
+        record->system_flags &= ~FLAG_SEEN;
         for (i = 0; i < MAX_USER_FLAGS/32; i++)
-            record.user_flags[i] = 0;
+            record->user_flags[i] = 0;
         if (!is_same_user)
-            record.cid = NULLCONVERSATION;
-        record.cache_offset = 0;
+            record->cid = NULLCONVERSATION;
+        record->cache_offset = 0;
 
         /* renumber the message into the new mailbox */
-        record.uid = as->mailbox->i.last_uid + 1;
+        record->uid = as->mailbox->i.last_uid + 1 + msg;
         as->nummsg++;
 
         /* user flags are special - different numbers, so look them up */
@@ -1324,23 +1328,23 @@ EXPORTED int append_copy(struct mailbox *mailbox, struct appendstate *as,
                                mailbox->flagname[userflag], mailbox->name, as->mailbox->name,
                                records[msg].uid, error_message(r));
                     else
-                        record.user_flags[num/32] |= 1<<(num&31);
+                        record->user_flags[num/32] |= 1<<(num&31);
                 }
             }
         }
         else {
             /* only flag allow to be kept without ACL_WRITE is DELETED */
-            record.system_flags &= FLAG_DELETED;
+            record->system_flags &= FLAG_DELETED;
         }
 
         /* deleted flag has its own ACL */
         if (!(as->myrights & ACL_DELETEMSG)) {
-            record.system_flags &= ~FLAG_DELETED;
+            record->system_flags &= ~FLAG_DELETED;
         }
 
         /* should this message be marked \Seen? */
         if (records[msg].system_flags & FLAG_SEEN) {
-            append_setseen(as, &record);
+            append_setseen(as, record);
         }
 
         /* we're not modifying the ARCHIVED flag here, just keeping it */
@@ -1349,7 +1353,7 @@ EXPORTED int append_copy(struct mailbox *mailbox, struct appendstate *as,
         free(srcfname);
         free(destfname);
         srcfname = xstrdup(mailbox_record_fname(mailbox, &records[msg]));
-        destfname = xstrdup(mailbox_record_fname(as->mailbox, &record));
+        destfname = xstrdup(mailbox_record_fname(as->mailbox, record));
 
         if (!(object_storage_enabled && records[msg].system_flags & FLAG_ARCHIVED))   // if object storage do not move file
            r = mailbox_copyfile(srcfname, destfname, nolink);
@@ -1358,38 +1362,46 @@ EXPORTED int append_copy(struct mailbox *mailbox, struct appendstate *as,
 
 #if defined ENABLE_OBJECTSTORE
         if (object_storage_enabled && records[msg].system_flags & FLAG_ARCHIVED)
-            r = objectstore_put(as->mailbox, &record, destfname);   // put should just add the refcount.
+            r = objectstore_put(as->mailbox, record, destfname);   // put should just add the refcount.
 #endif
 
         if (as->isoutbox) {
             char num[10];
-            snprintf(num, 10, "%u", record.uid);
-            r = notify_at(record.internaldate, "sendemail", "append", "", "", as->mailbox->name, 0, NULL, num);
+            snprintf(num, 10, "%u", record->uid);
+            r = notify_at(record->internaldate, "sendemail", "append", "", "", as->mailbox->name, 0, NULL, num);
             if (r) goto out;
         }
 
-        /* Write out index file entry */
-        r = mailbox_append_index_record(as->mailbox, &record);
-        if (r) goto out;
+        if (as->copy_progress && !((msg + 1) % APPEND_COPY_PROGRESS))
+            as->copy_progress(msg + 1, nummsg, as->copy_progress_rock);
+    }
+
+    /* Write out all the cache and index file entries together */
+    r = mailbox_append_index_records(as->mailbox, newrecords, nummsg);
+    if (r) goto out;
+
+    for (msg = 0; msg < nummsg; msg++) {
+        record = &newrecords[msg];
 
         /* ensure we have an astate connected to the destination
          * mailbox, so that the annotation txn will be committed
          * when we close the mailbox */
-        r = mailbox_get_annotate_state(as->mailbox, record.uid, &astate);
+        r = mailbox_get_annotate_state(as->mailbox, record->uid, &astate);
         if (r) goto out;
 
         r = annotate_msg_copy(mailbox, records[msg].uid,
-                              as->mailbox, record.uid,
+                              as->mailbox, record->uid,
                               as->userid);
         if (r) goto out;
 
-        mboxevent_extract_record(mboxevent, as->mailbox, &record);
+        mboxevent_extract_record(mboxevent, as->mailbox, record);
         mboxevent_extract_copied_record(mboxevent, mailbox, &records[msg]);
     }
 
 out:
     free(srcfname);
     free(destfname);
+    free(newrecords);
     if (r) {
         append_abort(as);
         return r;
@@ -52,6 +52,9 @@
 #include "annotate.h"
 #include "conversations.h"
 
+/* how often append_copy() reports its progress, in messages */
+#define APPEND_COPY_PROGRESS 1000
+
 /* it's ridiculous i have to expose this structure if i want to allow
    clients to stack-allocate it */
 struct appendstate {
@@ -82,6 +85,11 @@ struct appendstate {
     /* one event notification to send per appended message */
     enum event_type event_type;
     struct mboxevent *mboxevents;
+
+    /* told how far a long append_copy() has got.  Called with both
+     * mailboxes locked, so it mustn't block */
+    void (*copy_progress)(int done, int total, void *rock);
+    void *copy_progress_rock;
 };
 
 /* add helper function to determine uid range appended? */
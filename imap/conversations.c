@@ -97,6 +97,18 @@
 
 #define CONVERSATIONS_VERSION 0
 
+/*
+ * B and F records also come in version 1, which holds the same fields
+ * in the same order as the dlist text, but as varints and with the
+ * strings in a record interned.  Both are read and version 1 is
+ * written, so records convert as they are next saved.  Dumps are
+ * always text.
+ */
+#define CONVERSATIONS_BINARY_VERSION 1
+
+/* strings a record can refer back to, rather than repeat */
+#define CONV_STRTAB_MAX 64
+
 static conv_status_t NULLSTATUS = { 0, 0, 0};
 
 static char *convdir = NULL;
@@ -693,68 +705,125 @@ static int folder_number_rename(struct conversations_state *state,
     return write_folders(state);
 }
 
-EXPORTED int conversation_storestatus(struct conversations_state *state,
-                                      const char *key, size_t keylen,
-                                      const conv_status_t *status)
+/*
+ * Record encoding
+ */
+
+struct conv_strtab {
+    const char *base[CONV_STRTAB_MAX];
+    size_t len[CONV_STRTAB_MAX];
+    int count;
+};
+
+static void _strtab_add(struct conv_strtab *tab, const char *base, size_t len)
 {
-    if (!status || !status->modseq) {
-        return cyrusdb_delete(state->db,
-                              key, keylen,
-                              &state->txn, /*force*/1);
-    }
+    if (tab->count >= CONV_STRTAB_MAX) return;
+    tab->base[tab->count] = base;
+    tab->len[tab->count] = len;
+    tab->count++;
+}
 
-    struct dlist *dl = dlist_newlist(NULL, NULL);
-    dlist_setnum64(dl, "MODSEQ", status->modseq);
-    dlist_setnum32(dl, "EXISTS", status->exists);
-    dlist_setnum32(dl, "UNSEEN", status->unseen);
+/* NULL is 0; a string already in this record is its index * 2 + 1;
+ * anything else is (length + 1) * 2, followed by the bytes */
+static void _putstring(struct buf *buf, struct conv_strtab *tab,
+                       const char *str)
+{
+    size_t len;
+    int i;
 
-    struct buf buf = BUF_INITIALIZER;
-    buf_printf(&buf, "%d ", CONVERSATIONS_VERSION);
-    dlist_printbuf(dl, 0, &buf);
-    dlist_free(&dl);
+    if (!str) {
+        buf_appendvarint(buf, 0);
+        return;
+    }
 
-    int r = cyrusdb_store(state->db,
-                          key, keylen,
-                          buf.s, buf.len,
-                          &state->txn);
+    len = strlen(str);
+    for (i = 0; i < tab->count; i++) {
+        if (tab->len[i] == len && !memcmp(tab->base[i], str, len)) {
+            buf_appendvarint(buf, ((bit64)i << 1) | 1);
+            return;
+        }
+    }
 
-    buf_free(&buf);
+    buf_appendvarint(buf, (bit64)(len + 1) << 1);
+    buf_appendmap(buf, str, len);
+    _strtab_add(tab, str, len);
+}
 
-    return r;
+struct conv_reader {
+    const char *p;
+    const char *end;
+    struct conv_strtab strtab;
+};
+
+static int _getnum(struct conv_reader *rd, bit64 *valp)
+{
+    return parsevarint(rd->p, &rd->p, rd->end - rd->p, valp);
 }
 
-EXPORTED int conversation_setstatus(struct conversations_state *state,
-                                    const char *mboxname,
-                                    const conv_status_t *status)
+/* *strp is NULL, or a NUL terminated copy which lives in buf */
+static int _getstring(struct conv_reader *rd, struct buf *buf,
+                      const char **strp)
 {
-    char *key = strconcat("F", mboxname, (char *)NULL);
-    conv_status_t *cachestatus = NULL;
+    const char *base;
+    size_t len;
+    bit64 v;
 
-    cachestatus = hash_lookup(key, &state->folderstatus);
-    if (!cachestatus) {
-        cachestatus = xzmalloc(sizeof(conv_status_t));
-        hash_insert(key, cachestatus, &state->folderstatus);
+    if (_getnum(rd, &v)) return -1;
+
+    if (!v) {
+        *strp = NULL;
+        return 0;
     }
 
-    /* either way it's in the hash, update the value */
-    *cachestatus = status ? *status : NULLSTATUS;
+    if (v & 1) {
+        v >>= 1;
+        if (v >= (bit64)rd->strtab.count) return -1;
+        base = rd->strtab.base[v];
+        len = rd->strtab.len[v];
+    }
+    else {
+        v = (v >> 1) - 1;
+        if (v > (bit64)(rd->end - rd->p)) return -1;
+        base = rd->p;
+        len = v;
+        rd->p += len;
+        _strtab_add(&rd->strtab, base, len);
+    }
 
-    free(key);
+    buf_setmap(buf, base, len);
+    *strp = buf_cstring(buf);
 
     return 0;
 }
 
-EXPORTED int conversation_store(struct conversations_state *state,
-                       const char *key, int keylen,
-                       conversation_t *conv)
+static void _conversation_encodestatus(const conv_status_t *status,
+                                       int version, struct buf *buf)
+{
+    buf_printf(buf, "%d ", version);
+
+    if (version == CONVERSATIONS_VERSION) {
+        struct dlist *dl = dlist_newlist(NULL, NULL);
+        dlist_setnum64(dl, "MODSEQ", status->modseq);
+        dlist_setnum32(dl, "EXISTS", status->exists);
+        dlist_setnum32(dl, "UNSEEN", status->unseen);
+        dlist_printbuf(dl, 0, buf);
+        dlist_free(&dl);
+        return;
+    }
+
+    buf_appendvarint(buf, status->modseq);
+    buf_appendvarint(buf, status->exists);
+    buf_appendvarint(buf, status->unseen);
+}
+
+static void _conversation_encode_text(struct conversations_state *state,
+                                      const conversation_t *conv,
+                                      struct buf *buf)
 {
     struct dlist *dl, *n, *nn;
-    struct buf buf = BUF_INITIALIZER;
     const conv_folder_t *folder;
     const conv_sender_t *sender;
-    int version = CONVERSATIONS_VERSION;
     int i;
-    int r;
 
     dl = dlist_newlist(NULL, NULL);
     dlist_setnum64(dl, "MODSEQ", conv->modseq);
@@ -802,13 +871,139 @@ EXPORTED int conversation_store(struct conversations_state *state,
 
     dlist_setnum32(dl, "SIZE", conv->size);
 
-    buf_printf(&buf, "%d ", version);
-    dlist_printbuf(dl, 0, &buf);
+    dlist_printbuf(dl, 0, buf);
     dlist_free(&dl);
+}
+
+static void _conversation_encode(struct conversations_state *state,
+                                 const conversation_t *conv,
+                                 int version, struct buf *buf)
+{
+    struct conv_strtab strtab;
+    const conv_folder_t *folder;
+    const conv_sender_t *sender;
+    int ncounts = state->counted_flags ? state->counted_flags->count : 0;
+    int nfolders = 0;
+    int nsenders = 0;
+    int i;
+
+    buf_printf(buf, "%d ", version);
+
+    if (version == CONVERSATIONS_VERSION) {
+        _conversation_encode_text(state, conv, buf);
+        return;
+    }
+
+    strtab.count = 0;
+
+    buf_appendvarint(buf, conv->modseq);
+    buf_appendvarint(buf, conv->num_records);
+    buf_appendvarint(buf, conv->exists);
+    buf_appendvarint(buf, conv->unseen);
+
+    buf_appendvarint(buf, ncounts);
+    for (i = 0; i < ncounts; i++)
+        buf_appendvarint(buf, conv->counts[i]);
+
+    for (folder = conv->folders ; folder ; folder = folder->next) {
+        if (folder->num_records) nfolders++;
+    }
+    buf_appendvarint(buf, nfolders);
+    for (folder = conv->folders ; folder ; folder = folder->next) {
+        if (!folder->num_records)
+            continue;
+        buf_appendvarint(buf, folder->number);
+        buf_appendvarint(buf, folder->modseq);
+        buf_appendvarint(buf, folder->num_records);
+        buf_appendvarint(buf, folder->exists);
+        buf_appendvarint(buf, folder->unseen);
+    }
+
+    /* the same senders as the text version keeps */
+    i = 0;
+    for (sender = conv->senders ; sender ; sender = sender->next) {
+        if (!sender->exists)
+            continue;
+        if (++i >= 100) break;
+        nsenders++;
+    }
+    buf_appendvarint(buf, nsenders);
+    for (sender = conv->senders ; nsenders ; sender = sender->next) {
+        if (!sender->exists)
+            continue;
+        _putstring(buf, &strtab, sender->name);
+        _putstring(buf, &strtab, sender->route);
+        _putstring(buf, &strtab, sender->mailbox);
+        _putstring(buf, &strtab, sender->domain);
+        buf_appendvarint(buf, sender->lastseen);
+        buf_appendvarint(buf, sender->exists);
+        nsenders--;
+    }
+
+    _putstring(buf, &strtab, conv->subject);
+
+    buf_appendvarint(buf, conv->size);
+}
+
+EXPORTED int conversation_storestatus(struct conversations_state *state,
+                                      const char *key, size_t keylen,
+                                      const conv_status_t *status)
+{
+    if (!status || !status->modseq) {
+        return cyrusdb_delete(state->db,
+                              key, keylen,
+                              &state->txn, /*force*/1);
+    }
+
+    struct buf buf = BUF_INITIALIZER;
+    _conversation_encodestatus(status, CONVERSATIONS_BINARY_VERSION, &buf);
+
+    int r = cyrusdb_store(state->db,
+                          key, keylen,
+                          buf.s, buf.len,
+                          &state->txn);
+
+    buf_free(&buf);
+
+    return r;
+}
+
+EXPORTED int conversation_setstatus(struct conversations_state *state,
+                                    const char *mboxname,
+                                    const conv_status_t *status)
+{
+    char *key = strconcat("F", mboxname, (char *)NULL);
+    conv_status_t *cachestatus = NULL;
+
+    cachestatus = hash_lookup(key, &state->folderstatus);
+    if (!cachestatus) {
+        cachestatus = xzmalloc(sizeof(conv_status_t));
+        hash_insert(key, cachestatus, &state->folderstatus);
+    }
+
+    /* either way it's in the hash, update the value */
+    *cachestatus = status ? *status : NULLSTATUS;
+
+    free(key);
+
+    return 0;
+}
+
+EXPORTED int conversation_store(struct conversations_state *state,
+                       const char *key, int keylen,
+                       conversation_t *conv)
+{
+    struct buf buf = BUF_INITIALIZER;
+    int r;
+
+    _conversation_encode(state, conv, CONVERSATIONS_BINARY_VERSION, &buf);
 
     if (_sanity_check_counts(conv)) {
+        struct buf text = BUF_INITIALIZER;
+        _conversation_encode(state, conv, CONVERSATIONS_VERSION, &text);
         syslog(LOG_ERR, "IOERROR: conversations_audit on store: %s %.*s %.*s",
-               state->path, keylen, key, (int)buf.len, buf.s);
+               state->path, keylen, key, (int)text.len, text.s);
+        buf_free(&text);
     }
 
     r = cyrusdb_store(state->db, key, keylen, buf.s, buf.len, &state->txn);
@@ -930,6 +1125,20 @@ EXPORTED int conversation_parsestatus(const char *data, size_t datalen,
     rest++; /* skip space */
     restlen = datalen - (rest - data);
 
+    if (version == CONVERSATIONS_BINARY_VERSION) {
+        struct conv_reader rd = { rest, rest + restlen, { { 0 }, { 0 }, 0 } };
+        bit64 modseq, exists, unseen;
+
+        if (_getnum(&rd, &modseq) || _getnum(&rd, &exists) ||
+            _getnum(&rd, &unseen) || rd.p != rd.end)
+            return IMAP_MAILBOX_BADFORMAT;
+
+        status->modseq = modseq;
+        status->exists = exists;
+        status->unseen = unseen;
+        return 0;
+    }
+
     if (version != CONVERSATIONS_VERSION) {
         /* XXX - an error code for "incorrect version"? */
         return IMAP_MAILBOX_BADFORMAT;
@@ -1032,36 +1241,19 @@ EXPORTED conv_folder_t *conversation_get_folder(conversation_t *conv,
     return folder;
 }
 
-EXPORTED int conversation_parse(struct conversations_state *state,
-                       const char *data, size_t datalen,
-                       conversation_t **convp)
+static int _conversation_parse_text(struct conversations_state *state,
+                                    const char *data, size_t datalen,
+                                    conversation_t *conv)
 {
-    const char *rest;
-    int i;
-    int restlen;
-    bit64 version;
     struct dlist *dl = NULL;
     struct dlist *n, *nn;
-    conversation_t *conv;
     conv_folder_t *folder;
+    int i;
     int r;
 
-    *convp = NULL;
-
-    r = parsenum(data, &rest, datalen, &version);
-    if (r) return IMAP_MAILBOX_BADFORMAT;
-
-    if (rest[0] != ' ') return IMAP_MAILBOX_BADFORMAT;
-    rest++; /* skip space */
-    restlen = datalen - (rest - data);
-
-    if (version != CONVERSATIONS_VERSION) return IMAP_MAILBOX_BADFORMAT;
-
-    r = dlist_parsemap(&dl, 0, rest, restlen);
+    r = dlist_parsemap(&dl, 0, data, datalen);
     if (r) return r;
 
-    conv = conversation_new(state);
-
     n = dlist_getchildn(dl, 0);
     if (n)
         conv->modseq = dlist_num(n);
@@ -1138,9 +1330,124 @@ EXPORTED int conversation_parse(struct conversations_state *state,
     n = dlist_getchildn(dl, 8);
     if (n) conv->size = dlist_num(n);
 
+    dlist_free(&dl);
+    return 0;
+}
+
+static int _conversation_parse_binary(struct conversations_state *state,
+                                      const char *data, size_t datalen,
+                                      conversation_t *conv)
+{
+    struct conv_reader rd = { data, data + datalen, { { 0 }, { 0 }, 0 } };
+    struct buf name = BUF_INITIALIZER;
+    struct buf route = BUF_INITIALIZER;
+    struct buf mailbox = BUF_INITIALIZER;
+    struct buf domain = BUF_INITIALIZER;
+    int ncounts = state->counted_flags ? state->counted_flags->count : 0;
+    bit64 count, i, v[5];
+    int r = IMAP_MAILBOX_BADFORMAT;
+
+    if (_getnum(&rd, &v[0]) || _getnum(&rd, &v[1]) ||
+        _getnum(&rd, &v[2]) || _getnum(&rd, &v[3]))
+        goto done;
+    conv->modseq = v[0];
+    conv->num_records = v[1];
+    conv->exists = v[2];
+    conv->unseen = v[3];
+
+    /* counted_flags may have changed since this was written */
+    if (_getnum(&rd, &count)) goto done;
+    for (i = 0; i < count; i++) {
+        if (_getnum(&rd, &v[0])) goto done;
+        if (i < (bit64)ncounts) conv->counts[i] = v[0];
+    }
+
+    if (_getnum(&rd, &count)) goto done;
+    for (i = 0; i < count; i++) {
+        conv_folder_t *folder;
+        int j;
+
+        for (j = 0; j < 5; j++)
+            if (_getnum(&rd, &v[j])) goto done;
+        if (v[0] > INT_MAX) goto done;
+
+        folder = conversation_get_folder(conv, v[0], 1);
+        folder->modseq = v[1];
+        folder->num_records = v[2];
+        folder->exists = v[3];
+        folder->unseen = v[4];
+        folder->prev_exists = folder->exists;
+    }
+
+    if (_getnum(&rd, &count)) goto done;
+    for (i = 0; i < count; i++) {
+        const char *n, *rt, *m, *d;
+
+        if (_getstring(&rd, &name, &n) || _getstring(&rd, &route, &rt) ||
+            _getstring(&rd, &mailbox, &m) || _getstring(&rd, &domain, &d) ||
+            _getnum(&rd, &v[0]) || _getnum(&rd, &v[1]))
+            goto done;
+        if (!m || !d) goto done;
+
+        conversation_update_sender(conv, n, rt, m, d, v[0], v[1]);
+    }
+
+    {
+        const char *subject;
+        if (_getstring(&rd, &name, &subject)) goto done;
+        conv->subject = xstrdupnull(subject);
+    }
+
+    if (_getnum(&rd, &v[0])) goto done;
+    conv->size = v[0];
+
+    if (rd.p == rd.end) r = 0;
+
+done:
+    buf_free(&name);
+    buf_free(&route);
+    buf_free(&mailbox);
+    buf_free(&domain);
+    return r;
+}
+
+EXPORTED int conversation_parse(struct conversations_state *state,
+                       const char *data, size_t datalen,
+                       conversation_t **convp)
+{
+    const char *rest;
+    size_t restlen;
+    bit64 version;
+    conversation_t *conv;
+    int r;
+
+    *convp = NULL;
+
+    r = parsenum(data, &rest, datalen, &version);
+    if (r) return IMAP_MAILBOX_BADFORMAT;
+
+    if (rest[0] != ' ') return IMAP_MAILBOX_BADFORMAT;
+    rest++; /* skip space */
+    restlen = datalen - (rest - data);
+
+    if (version != CONVERSATIONS_BINARY_VERSION &&
+        version != CONVERSATIONS_VERSION)
+        return IMAP_MAILBOX_BADFORMAT;
+
+    conv = conversation_new(state);
+
+    if (version == CONVERSATIONS_BINARY_VERSION)
+        r = _conversation_parse_binary(state, rest, restlen, conv);
+    else
+        r = _conversation_parse_text(state, rest, restlen, conv);
+
+    if (r) {
+        conversation_free(conv);
+        return r;
+    }
+
     conv->prev_unseen = conv->unseen;
 
-    dlist_free(&dl);
     conv->dirty = 0;
     *convp = conv;
     return 0;
@@ -1177,8 +1484,12 @@ EXPORTED int conversation_load(struct conversations_state *state,
     }
 
     if (_sanity_check_counts(*convp)) {
+        struct buf text = BUF_INITIALIZER;
+        conversations_record_text(state, bkey, strlen(bkey),
+                                  data, datalen, &text);
         syslog(LOG_ERR, "IOERROR: conversations_audit on load: %s %s %.*s",
-               state->path, bkey, (int)datalen, data);
+               state->path, bkey, (int)text.len, text.s);
+        buf_free(&text);
     }
 
     return 0;
@@ -1186,8 +1497,8 @@ EXPORTED int conversation_load(struct conversations_state *state,
 
 /* Parse just enough of the B record to retrieve the modseq.
  * Fortunately the modseq is the first field after the record version
- * number, given the way that _conversation_save() and dlist works.  See
- * _conversation_load() for the full shebang. */
+ * number in both formats, given the way that _conversation_encode()
+ * and dlist works.  See conversation_parse() for the full shebang. */
 static int _conversation_load_modseq(const char *data, int datalen,
                                      modseq_t *modseqp)
 {
@@ -1197,7 +1508,16 @@ static int _conversation_load_modseq(const char *data, int datalen,
     int r;
 
     r = parsenum(p, &p, (end-p), &version);
-    if (r || version != CONVERSATIONS_VERSION)
+    if (r || (end - p) < 2 || p[0] != ' ')
+        return IMAP_MAILBOX_BADFORMAT;
+
+    if (version == CONVERSATIONS_BINARY_VERSION) {
+        if (parsevarint(p + 1, &p, end - (p + 1), modseqp))
+            return IMAP_MAILBOX_BADFORMAT;
+        return 0;
+    }
+
+    if (version != CONVERSATIONS_VERSION)
         return IMAP_MAILBOX_BADFORMAT;
 
     if ((end - p) < 4 || p[0] != ' ' || p[1] != '(')
@@ -1788,9 +2108,64 @@ EXPORTED int conversations_cleanup_zero(struct conversations_state *state)
                            state, &state->txn);
 }
 
+/* Render a record as text: B and F records come back in the text
+ * format whichever version they were stored in, anything else as is */
+EXPORTED void conversations_record_text(struct conversations_state *state,
+                                        const char *key, size_t keylen,
+                                        const char *data, size_t datalen,
+                                        struct buf *out)
+{
+    buf_reset(out);
+
+    if (keylen && key[0] == 'B') {
+        conversation_t *conv = NULL;
+
+        if (!conversation_parse(state, data, datalen, &conv)) {
+            _conversation_encode(state, conv, CONVERSATIONS_VERSION, out);
+            conversation_free(conv);
+            return;
+        }
+    }
+    else if (keylen && key[0] == 'F') {
+        conv_status_t status = CONV_STATUS_INIT;
+
+        if (!conversation_parsestatus(data, datalen, &status)) {
+            _conversation_encodestatus(&status, CONVERSATIONS_VERSION, out);
+            return;
+        }
+    }
+
+    buf_setmap(out, data, datalen);
+}
+
+struct dump_rock {
+    struct conversations_state *state;
+    FILE *fp;
+    struct buf text;
+};
+
+static int dump_cb(void *rock,
+                   const char *key, size_t keylen,
+                   const char *data, size_t datalen)
+{
+    struct dump_rock *drock = (struct dump_rock *) rock;
+
+    conversations_record_text(drock->state, key, keylen, data, datalen,
+                              &drock->text);
+    fprintf(drock->fp, "%.*s\t%.*s\n", (int)keylen, key,
+            (int)drock->text.len, drock->text.s);
+
+    return 0;
+}
+
+/* the dump is text, for people and for undump, which reads it back in
+ * as text records to be converted when they are next written */
 EXPORTED void conversations_dump(struct conversations_state *state, FILE *fp)
 {
-    cyrusdb_dumpfile(state->db, "", 0, fp, &state->txn);
+    struct dump_rock drock = { state, fp, BUF_INITIALIZER };
+
+    cyrusdb_foreach(state->db, "", 0, NULL, dump_cb, &drock, &state->txn);
+    buf_free(&drock.text);
 }
 
 EXPORTED int conversations_truncate(struct conversations_state *state)
@@ -216,6 +216,10 @@ extern int conversations_prune(struct conversations_state *state,
                                time_t thresh, unsigned int *,
                                unsigned int *);
 extern void conversations_dump(struct conversations_state *, FILE *);
+extern void conversations_record_text(struct conversations_state *state,
+                                      const char *key, size_t keylen,
+                                      const char *data, size_t datalen,
+                                      struct buf *out);
 extern int conversations_undump(struct conversations_state *, FILE *);
 
 extern int conversations_truncate(struct conversations_state *);
@@ -373,6 +373,8 @@ static unsigned int diff_records(struct conversations_state *a,
     struct cursor ca, cb;
     int keydelta;
     int delta;
+    struct buf texta = BUF_INITIALIZER;
+    struct buf textb = BUF_INITIALIZER;
 
     cursor_init(&ca, a->db, &a->txn);
     ra = cursor_next(&ca);
@@ -385,37 +387,51 @@ static unsigned int diff_records(struct conversations_state *a,
         if (rb || keydelta < 0) {
             if (ra) break;
             ndiffs++;
-            if (verbose)
+            if (verbose) {
+                conversations_record_text(a, ca.key, ca.keylen,
+                                          ca.data, ca.datalen, &texta);
                 printf("REALONLY: \"%.*s\" data \"%.*s\"\n",
-                       (int)ca.keylen, ca.key, (int)ca.datalen, ca.data);
+                       (int)ca.keylen, ca.key, (int)texta.len, texta.s);
+            }
             ra = next_diffable_record(&ca);
             continue;
         }
         if (ra || keydelta > 0) {
             if (rb) break;
             ndiffs++;
-            if (verbose)
+            if (verbose) {
+                conversations_record_text(b, cb.key, cb.keylen,
+                                          cb.data, cb.datalen, &textb);
                 printf("TEMPONLY: \"%.*s\" data \"%.*s\"\n",
-                       (int)cb.keylen, cb.key, (int)cb.datalen, cb.data);
+                       (int)cb.keylen, cb.key, (int)textb.len, textb.s);
+            }
             rb = next_diffable_record(&cb);
             continue;
         }
 
-        /* both exist an are the same key */
-        delta = blob_compare(ca.data, ca.datalen, cb.data, cb.datalen);
+        /* both exist an are the same key, but either may not have
+         * been converted to the current record format yet */
+        conversations_record_text(a, ca.key, ca.keylen,
+                                  ca.data, ca.datalen, &texta);
+        conversations_record_text(b, cb.key, cb.keylen,
+                                  cb.data, cb.datalen, &textb);
+        delta = blob_compare(texta.s, texta.len, textb.s, textb.len);
         if (delta) {
             ndiffs++;
             if (verbose)
                 printf("REAL: \"%.*s\" data \"%.*s\"\n"
                        "TEMP: \"%.*s\" data \"%.*s\"\n",
-                       (int)ca.keylen, ca.key, (int)ca.datalen, ca.data,
-                       (int)cb.keylen, cb.key, (int)cb.datalen, cb.data);
+                       (int)ca.keylen, ca.key, (int)texta.len, texta.s,
+                       (int)cb.keylen, cb.key, (int)textb.len, textb.s);
         }
 
         ra = next_diffable_record(&ca);
         rb = next_diffable_record(&cb);
     }
 
+    buf_free(&texta);
+    buf_free(&textb);
+
     return ndiffs;
 }
 
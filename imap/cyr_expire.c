@@ -52,18 +52,25 @@
 #include <sys/stat.h>
 #include <syslog.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
 #include <sasl/sasl.h>
 
 #include "annotate.h"
+#include "assert.h"
 #include "duplicate.h"
 #include "exitcodes.h"
+#include "expirequeue.h"
 #include "global.h"
 #include "hash.h"
 #include "libcyr_cfg.h"
 #include "mboxevent.h"
 #include "mboxlist.h"
 #include "conversations.h"
+#include "quota.h"
+#include "retry.h"
+#include "strhash.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "strarray.h"
@@ -76,13 +83,22 @@ static volatile sig_atomic_t sigquit = 0;
 static int verbose = 0;
 static int keep_flagged = 1;
 
+/* parallel workers, and which one this is */
+static int nworkers = 1;
+static int worker = 0;
+
+/* most mailboxes each worker opens per second, 0 for no limit */
+static double io_budget = 0;
+static struct timeval budget_start;
+static unsigned long budget_count = 0;
+
 /* current namespace */
 static struct namespace expire_namespace;
 
 static void usage(void)
 {
     fprintf(stderr,
-            "cyr_expire [-C <altconfig>] [-E <expire-duration>] [-D <delete-duration] [-X <expunge-duration>] [-p prefix] [-a] [-v] [-x]\n");
+            "cyr_expire [-C <altconfig>] [-E <expire-duration>] [-D <delete-duration] [-X <expunge-duration>] [-p prefix] [-j workers] [-B mailboxes-per-second] [-a] [-v] [-x]\n");
     exit(-1);
 }
 
@@ -91,10 +107,13 @@ struct expire_rock {
     time_t expire_mark;
     time_t expunge_mark;
     unsigned long mailboxes_seen;
+    unsigned long mailboxes_skipped;
     unsigned long messages_seen;
     unsigned long messages_expired;
     unsigned long messages_expunged;
     int skip_annotate;
+    int use_queue;
+    int update_queue;
     bit32 userflags[MAX_USER_FLAGS/32];
     int do_userflags;
     unsigned long userflags_expunged;
@@ -160,6 +179,142 @@ static int parse_duration(const char *s, int *secondsp)
     return 1;
 }
 
+/*
+ * Stay within the I/O budget: called before each mailbox is opened,
+ * it sleeps for as long as this worker is ahead of io_budget mailboxes
+ * a second.
+ */
+static void throttle(void)
+{
+    struct timeval now;
+    double ahead;
+
+    if (!io_budget) return;
+
+    gettimeofday(&now, NULL);
+    if (!budget_count++) {
+        budget_start = now;
+        return;
+    }
+
+    ahead = budget_count / io_budget - timesub(&budget_start, &now);
+    if (ahead > 0)
+        usleep(ahead * 1000000);
+}
+
+struct worker_rock {
+    mboxlist_cb *proc;
+    void *rock;
+};
+
+static int worker_cb(const mbentry_t *mbentry, void *rock)
+{
+    struct worker_rock *wrock = (struct worker_rock *) rock;
+    char *userid;
+    unsigned hash;
+
+    /* all of a user's mailboxes go to the same worker, so workers
+     * don't fight over the user's conversations db */
+    userid = mboxname_to_userid(mbentry->name);
+    hash = strhash(userid ? userid : mbentry->name);
+    free(userid);
+
+    if (hash % nworkers != (unsigned) worker)
+        return 0;
+
+    return wrock->proc(mbentry, wrock->rock);
+}
+
+/*
+ * Run 'proc' over the mailboxes we were asked about.  With more than
+ * one worker, fork them to share the users out between them and add
+ * up the NULL terminated list of 'counters' each of them returns.
+ */
+static void foreach_mailbox(const char *find_prefix, const char *do_user,
+                            mboxlist_cb *proc, void *rock,
+                            unsigned long *counters[])
+{
+    struct worker_rock wrock = { proc, rock };
+    int fds[2];
+    int i, n;
+
+    if (nworkers <= 1) {
+        if (do_user)
+            mboxlist_usermboxtree(do_user, proc, rock, MBOXTREE_DELETED);
+        else
+            mboxlist_allmbox(find_prefix, proc, rock, 0);
+        return;
+    }
+
+    for (n = 0; counters && counters[n]; n++);
+
+    if (pipe(fds) == -1)
+        fatal("unable to create pipe for workers", EC_TEMPFAIL);
+
+    for (i = 0; i < nworkers; i++) {
+        pid_t pid = fork();
+
+        if (pid == -1) {
+            syslog(LOG_ERR, "cyr_expire: unable to fork worker: %m");
+            fatal("unable to fork worker", EC_TEMPFAIL);
+        }
+
+        if (!pid) {
+            unsigned long *values = xzmalloc((n + 1) * sizeof(unsigned long));
+            int j;
+
+            worker = i;
+            close(fds[0]);
+
+            /* don't share database handles with the other workers */
+            mboxlist_close();
+            mboxlist_open(NULL);
+            annotatemore_close();
+            annotatemore_open();
+            quotadb_close();
+            quotadb_open(NULL);
+            expirequeue_close();
+            if (expirequeue_enabled()) expirequeue_open();
+
+            if (do_user)
+                mboxlist_usermboxtree(do_user, worker_cb, &wrock,
+                                      MBOXTREE_DELETED);
+            else
+                mboxlist_allmbox(find_prefix, worker_cb, &wrock, 0);
+
+            for (j = 0; j < n; j++)
+                values[j] = *counters[j];
+            if (retry_write(fds[1], values, n * sizeof(unsigned long)) < 0)
+                syslog(LOG_ERR, "cyr_expire: worker %d: write: %m", i);
+
+            expirequeue_close();
+            quotadb_close();
+            annotatemore_close();
+            mboxlist_close();
+            _exit(0);
+        }
+    }
+
+    close(fds[1]);
+
+    for (i = 0; i < nworkers; i++) {
+        unsigned long values[16];
+        int j;
+
+        assert(n <= 16);
+        if (n && retry_read(fds[0], values, n * sizeof(unsigned long)) !=
+            (ssize_t) (n * sizeof(unsigned long)))
+            continue;
+
+        for (j = 0; j < n; j++)
+            *counters[j] += values[j];
+    }
+
+    close(fds[0]);
+
+    while (wait(NULL) > 0 || errno == EINTR);
+}
+
 static int expunge_userflags(struct mailbox *mailbox, struct expire_rock *erock)
 {
     unsigned int i;
@@ -234,13 +389,17 @@ static int archive(const mbentry_t *mbentry, void *rock)
     if (mbentry->mbtype & MBTYPE_REMOTE)
         goto done;
 
-    if (mailbox_open_iwl(mbentry->name, &mailbox))
+    throttle();
+
+    /* a read lock is enough to decide, mailbox_archive_staged takes
+     * the write lock itself once the copying is done */
+    if (mailbox_open_irl(mbentry->name, &mailbox))
         goto done;
 
     if (verbose)
         fprintf(stderr, "archiving mailbox %s\n", mbentry->name);
 
-    mailbox_archive(mailbox, NULL, rock, ITER_SKIP_EXPUNGED);
+    mailbox_archive_staged(mailbox, NULL, rock, ITER_SKIP_EXPUNGED);
 
 done:
     mailbox_close(&mailbox);
@@ -249,6 +408,29 @@ done:
     return 0;
 }
 
+/*
+ * Look up the expire annotation which applies to a mailbox.  Since
+ * mailboxes inherit /vendor/cmu/cyrus-imapd/expire, we need to iterate
+ * all the way up to "" (server entry)
+ */
+static void expire_annotation(const char *name, struct buf *attrib)
+{
+    char *buf = xstrdup(name);
+    int r;
+
+    do {
+        buf_free(attrib);
+        r = annotatemore_lookup(buf, IMAP_ANNOT_NS "expire", "", attrib);
+
+        if (r ||                            /* error */
+            attrib->s)                      /* found an entry */
+            break;
+
+    } while (mboxname_make_parent(buf));
+
+    free(buf);
+}
+
 /*
  * callback function to:
  * - expire messages from mailboxes,
@@ -258,7 +440,6 @@ done:
 static int expire(const mbentry_t *mbentry, void *rock)
 {
     struct expire_rock *erock = (struct expire_rock *) rock;
-    char *buf;
     struct buf attrib = BUF_INITIALIZER;
     int r;
     struct mailbox *mailbox = NULL;
@@ -286,28 +467,26 @@ static int expire(const mbentry_t *mbentry, void *rock)
         goto done;
     }
 
-    buf = xstrdup(mbentry->name);
-
-    /* see if we need to expire messages.
-     * since mailboxes inherit /vendor/cmu/cyrus-imapd/expire,
-     * we need to iterate all the way up to "" (server entry)
-     */
-    if (!erock->skip_annotate) {
-        do {
-            buf_free(&attrib);
-            r = annotatemore_lookup(buf, IMAP_ANNOT_NS "expire", "",
-                                    &attrib);
+    /* see if we need to expire messages */
+    if (!erock->skip_annotate)
+        expire_annotation(mbentry->name, &attrib);
 
-            if (r ||                            /* error */
-                attrib.s)                       /* found an entry */
-                break;
+    /* if there's nothing to do but clean up expunged messages,
+     * don't open the mailbox unless some are due */
+    if (erock->use_queue && !attrib.s && !erock->do_userflags) {
+        time_t first_expunged;
 
-        } while (mboxname_make_parent(buf));
+        if (!expirequeue_lookup(mbentry->name, &first_expunged) &&
+            (!first_expunged || first_expunged > erock->expunge_mark)) {
+            erock->mailboxes_skipped++;
+            goto done;
+        }
     }
-    free(buf);
 
     memset(erock->userflags, 0, sizeof(erock->userflags));
 
+    throttle();
+
     r = mailbox_open_iwl(mbentry->name, &mailbox);
     if (r) {
         /* mailbox corrupt/nonexistent -- skip it */
@@ -365,13 +544,47 @@ static int expire(const mbentry_t *mbentry, void *rock)
         syslog(LOG_WARNING, "failure expiring %s: %s", mbentry->name, error_message(r));
         annotate_state_abort(&mailbox->annot_state);
     }
+    else if (erock->update_queue) {
+        expirequeue_update(mbentry->name, mailbox->i.first_expunged);
+    }
 
 done:
+    buf_free(&attrib);
     mailbox_close(&mailbox);
     /* Even if we had a problem with one mailbox, continue with the others */
     return 0;
 }
 
+/*
+ * callback function to build the hash table of mailboxes with an expire
+ * annotation for duplicate_prune(), when workers did the expiring
+ */
+static int expire_table(const mbentry_t *mbentry, void *rock)
+{
+    struct expire_rock *erock = (struct expire_rock *) rock;
+    struct buf attrib = BUF_INITIALIZER;
+    int expire_seconds = 0;
+
+    if (sigquit)
+        return 1;
+
+    if (mbentry->mbtype & (MBTYPE_REMOTE|MBTYPE_DELETED))
+        return 0;
+
+    expire_annotation(mbentry->name, &attrib);
+
+    if (attrib.s && parse_duration(attrib.s, &expire_seconds)) {
+        time_t expire_mark = expire_seconds ?
+                             time(0) - expire_seconds : 0 /* never */ ;
+        hash_insert(mbentry->name,
+                    xmemdup(&expire_mark, sizeof(expire_mark)),
+                    &erock->table);
+    }
+
+    buf_free(&attrib);
+    return 0;
+}
+
 static int delete(const mbentry_t *mbentry, void *rock)
 {
     struct delete_rock *drock = (struct delete_rock *) rock;
@@ -483,7 +696,7 @@ int main(int argc, char *argv[])
     memset(&crock, 0, sizeof(crock));
     construct_hash_table(&crock.seen, 100, 1);
 
-    while ((opt = getopt(argc, argv, "C:D:E:X:A:p:u:vaxtcFS:")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:D:E:X:A:p:u:vaxtcFS:j:B:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -543,6 +756,16 @@ int main(int argc, char *argv[])
             do_cid_expire = 0;
             break;
 
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) usage();
+            break;
+
+        case 'B':
+            io_budget = atof(optarg);
+            if (io_budget <= 0) usage();
+            break;
+
         default:
             usage();
             break;
@@ -599,13 +822,20 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (expirequeue_enabled()) {
+        expirequeue_open();
+        erock.update_queue = 1;
+        /* every so often, don't trust it */
+        erock.use_queue = !expirequeue_fullscan_due(time(0));
+    }
+
+    /* the budget is for the whole run */
+    io_budget /= nworkers;
+
     if (archive_seconds >= 0) {
         time_t archive_mark = time(0) - archive_seconds;
         /* XXX - add syslog? */
-        if (do_user)
-            mboxlist_usermboxtree(do_user, archive, &archive_mark, MBOXTREE_DELETED);
-        else
-            mboxlist_allmbox(find_prefix, archive, &archive_mark, 0);
+        foreach_mailbox(find_prefix, do_user, archive, &archive_mark, NULL);
     }
 
     if (do_expunge && (expunge_seconds >= 0 || expire_seconds || erock.do_userflags)) {
@@ -627,10 +857,32 @@ int main(int argc, char *argv[])
             }
         }
 
-        if (do_user)
-            mboxlist_usermboxtree(do_user, expire, &erock, MBOXTREE_DELETED);
-        else
-            mboxlist_allmbox(find_prefix, expire, &erock, 0);
+        unsigned long *counters[] = {
+            &erock.mailboxes_seen,
+            &erock.mailboxes_skipped,
+            &erock.messages_seen,
+            &erock.messages_expired,
+            &erock.messages_expunged,
+            &erock.userflags_expunged,
+            NULL
+        };
+
+        time_t scan_start = time(0);
+
+        foreach_mailbox(find_prefix, do_user, expire, &erock, counters);
+
+        /* only a complete pass over every mailbox counts */
+        if (erock.update_queue && !erock.use_queue && !do_user &&
+            !find_prefix && !sigquit)
+            expirequeue_fullscan_done(scan_start);
+
+        /* the workers' tables of expire annotations went with them */
+        if (nworkers > 1 && expire_seconds > 0) {
+            if (do_user)
+                mboxlist_usermboxtree(do_user, expire_table, &erock, MBOXTREE_DELETED);
+            else
+                mboxlist_allmbox(find_prefix, expire_table, &erock, 0);
+        }
 
         syslog(LOG_NOTICE, "Expired %lu and expunged %lu out of %lu "
                             "messages from %lu mailboxes",
@@ -641,6 +893,9 @@ int main(int argc, char *argv[])
         if (erock.do_userflags)
             syslog(LOG_NOTICE, "Expunged %lu user flags",
                            erock.userflags_expunged);
+        if (erock.use_queue)
+            syslog(LOG_NOTICE, "Skipped %lu mailboxes with nothing due",
+                           erock.mailboxes_skipped);
         if (verbose) {
             fprintf(stderr, "\nExpired %lu and expunged %lu out of %lu "
                             "messages from %lu mailboxes\n",
@@ -651,6 +906,9 @@ int main(int argc, char *argv[])
             if (erock.do_userflags)
                 fprintf(stderr, "Expunged %lu user flags\n",
                                erock.userflags_expunged);
+            if (erock.use_queue)
+                fprintf(stderr, "Skipped %lu mailboxes with nothing due\n",
+                               erock.mailboxes_skipped);
         }
     }
     if (sigquit) {
@@ -737,6 +995,7 @@ int main(int argc, char *argv[])
         r = duplicate_prune(expire_seconds, &erock.table);
 
 finish:
+    expirequeue_close();
     free_hash_table(&erock.table, free);
     free_hash_table(&crock.seen, NULL);
     strarray_fini(&drock.to_delete);
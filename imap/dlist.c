@@ -62,6 +62,8 @@
 #include "mailbox.h"
 #include "quota.h"
 #include "xmalloc.h"
+#include "hashmap.h"
+#include "mpool.h"
 #include "seen.h"
 #include "mboxname.h"
 #include "map.h"
@@ -239,6 +241,55 @@ error:
 
 /* DLIST STUFF */
 
+/* the root of an arena tree, which frees the pool with itself */
+#define DLIST_OWNPOOL   (1<<0)
+
+/* kvlists with at least this many children get a name index the
+ * first time dlist_getchild() has to look that far */
+#define DLIST_INDEX_MIN 32
+
+/* arenas start small and double, a one line sync response shouldn't
+ * cost more than a page */
+#define DLIST_POOL_SIZE 1024
+
+static void *_dlist_alloc(struct mpool *pool, size_t size)
+{
+    void *p;
+
+    if (!pool) return xzmalloc(size);
+
+    p = mpool_malloc(pool, size);
+    memset(p, 0, size);
+    return p;
+}
+
+static char *_dlist_strdup(struct mpool *pool, const char *str)
+{
+    return pool ? mpool_strdup(pool, str) : xstrdup(str);
+}
+
+static void _dlist_release(struct mpool *pool, void *p)
+{
+    /* arena memory goes back all at once, with the root */
+    if (!pool) free(p);
+}
+
+static void _dlist_index_add(struct dlist *parent, struct dlist *child)
+{
+    /* dlist_getchild() finds the first match, keep it that way */
+    if (child->name && !hashmap_lookup(child->name, parent->index))
+        hashmap_insert(child->name, child, parent->index);
+}
+
+static void _dlist_index_drop(struct dlist *dl)
+{
+    if (!dl->index) return;
+
+    free_hashmap(dl->index, NULL);
+    free(dl->index);
+    dl->index = NULL;
+}
+
 EXPORTED void dlist_stitch(struct dlist *parent, struct dlist *child)
 {
     assert(!child->next);
@@ -250,6 +301,8 @@ EXPORTED void dlist_stitch(struct dlist *parent, struct dlist *child)
     else {
         parent->head = parent->tail = child;
     }
+
+    if (parent->index) _dlist_index_add(parent, child);
 }
 
 EXPORTED void dlist_unstitch(struct dlist *parent, struct dlist *child)
@@ -265,6 +318,8 @@ EXPORTED void dlist_unstitch(struct dlist *parent, struct dlist *child)
 
     assert(replace);
 
+    _dlist_index_drop(parent);
+
     if (prev) prev->next = child->next;
     else parent->head = child->next;
 
@@ -273,16 +328,44 @@ EXPORTED void dlist_unstitch(struct dlist *parent, struct dlist *child)
     child->next = NULL;
 }
 
-static struct dlist *dlist_child(struct dlist *dl, const char *name)
+static struct dlist *_dlist_new(struct mpool *pool, const char *name)
 {
-    struct dlist *i = xzmalloc(sizeof(struct dlist));
-    if (name) i->name = xstrdup(name);
+    struct dlist *i = _dlist_alloc(pool, sizeof(struct dlist));
+    if (name) i->name = _dlist_strdup(pool, name);
     i->type = DL_NIL;
+    i->pool = pool;
+    return i;
+}
+
+static struct dlist *dlist_child(struct dlist *dl, const char *name)
+{
+    struct dlist *i = _dlist_new(dl ? dl->pool : NULL, name);
     if (dl)
         dlist_stitch(dl, i);
     return i;
 }
 
+static struct dlist *_dlist_newroot(const char *name, int type)
+{
+    struct mpool *pool = new_mpool(DLIST_POOL_SIZE);
+    struct dlist *dl = _dlist_new(pool, name);
+
+    dl->type = type;
+    dl->flags |= DLIST_OWNPOOL;
+
+    return dl;
+}
+
+EXPORTED struct dlist *dlist_newlist_arena(const char *name)
+{
+    return _dlist_newroot(name, DL_ATOMLIST);
+}
+
+EXPORTED struct dlist *dlist_newkvlist_arena(const char *name)
+{
+    return _dlist_newroot(name, DL_KVLIST);
+}
+
 static void _dlist_free_children(struct dlist *dl)
 {
     struct dlist *next;
@@ -298,6 +381,7 @@ static void _dlist_free_children(struct dlist *dl)
     }
 
     dl->head = dl->tail = NULL;
+    _dlist_index_drop(dl);
 }
 
 static void _dlist_clean(struct dlist *dl)
@@ -308,11 +392,11 @@ static void _dlist_clean(struct dlist *dl)
     _dlist_free_children(dl);
 
     /* clean out values */
-    free(dl->part);
+    _dlist_release(dl->pool, dl->part);
     dl->part = NULL;
-    free(dl->sval);
+    _dlist_release(dl->pool, dl->sval);
     dl->sval = NULL;
-    free(dl->gval);
+    _dlist_release(dl->pool, dl->gval);
     dl->gval = NULL;
     dl->nval = 0;
 }
@@ -324,7 +408,7 @@ void dlist_makeatom(struct dlist *dl, const char *val)
     _dlist_clean(dl);
     if (val) {
         dl->type = DL_ATOM;
-        dl->sval = xstrdup(val);
+        dl->sval = _dlist_strdup(dl->pool, val);
         dl->nval = strlen(val);
     }
     else
@@ -337,7 +421,7 @@ void dlist_makeflag(struct dlist *dl, const char *val)
     _dlist_clean(dl);
     if (val) {
         dl->type = DL_FLAG;
-        dl->sval = xstrdup(val);
+        dl->sval = _dlist_strdup(dl->pool, val);
         dl->nval = strlen(val);
     }
     else
@@ -382,7 +466,7 @@ void dlist_makeguid(struct dlist *dl, const struct message_guid *guid)
     _dlist_clean(dl);
     if (guid) {
         dl->type = DL_GUID,
-        dl->gval = xzmalloc(sizeof(struct message_guid));
+        dl->gval = _dlist_alloc(dl->pool, sizeof(struct message_guid));
         message_guid_copy(dl->gval, guid);
     }
     else
@@ -397,11 +481,11 @@ void dlist_makefile(struct dlist *dl,
     _dlist_clean(dl);
     if (part && guid && fname) {
         dl->type = DL_FILE;
-        dl->gval = xzmalloc(sizeof(struct message_guid));
+        dl->gval = _dlist_alloc(dl->pool, sizeof(struct message_guid));
         message_guid_copy(dl->gval, guid);
-        dl->sval = xstrdup(fname);
+        dl->sval = _dlist_strdup(dl->pool, fname);
         dl->nval = size;
-        dl->part = xstrdup(part);
+        dl->part = _dlist_strdup(dl->pool, part);
     }
     else
         dl->type = DL_NIL;
@@ -417,7 +501,7 @@ EXPORTED void dlist_makemap(struct dlist *dl, const char *val, size_t len)
          * data may be binary, and xstrndup does not copy
          * binary data correctly - but we still want to NULL
          * terminate for non-binary data */
-        dl->sval = xmalloc(len+1);
+        dl->sval = _dlist_alloc(dl->pool, len+1);
         memcpy(dl->sval, val, len);
         dl->sval[len] = '\0'; /* make it string safe too */
         dl->nval = len;
@@ -684,11 +768,23 @@ EXPORTED void dlist_unlink_files(struct dlist *dl)
 
 EXPORTED void dlist_free(struct dlist **dlp)
 {
-    if (!*dlp) return;
-    _dlist_clean(*dlp);
-    free((*dlp)->name);
-    free(*dlp);
+    struct dlist *dl = *dlp;
+
+    if (!dl) return;
     *dlp = NULL;
+
+    /* still walk an arena tree, in case anything from outside the
+     * arena was stitched into it */
+    _dlist_clean(dl);
+
+    if (dl->flags & DLIST_OWNPOOL) {
+        /* the root itself lives in the pool */
+        free_mpool(dl->pool);
+        return;
+    }
+
+    _dlist_release(dl->pool, dl->name);
+    _dlist_release(dl->pool, dl);
 }
 
 struct dlist_stack_node {
@@ -1008,8 +1104,9 @@ static char next_nonspace(struct protstream *in, char c)
     return c;
 }
 
-EXPORTED int dlist_parse(struct dlist **dlp, int parsekey,
-                          struct protstream *in, const char *alt_reserve_base)
+static int _dlist_parse(struct dlist **dlp, int parsekey,
+                        struct protstream *in, const char *alt_reserve_base,
+                        struct mpool *pool)
 {
     struct dlist *dl = NULL;
     static struct buf kbuf;
@@ -1031,12 +1128,13 @@ EXPORTED int dlist_parse(struct dlist **dlp, int parsekey,
 
     /* check what sort of value we have */
     if (c == '(') {
-        dl = dlist_newlist(NULL, kbuf.s);
+        dl = _dlist_new(pool, kbuf.s);
+        dl->type = DL_ATOMLIST;
         c = next_nonspace(in, ' ');
         while (c != ')') {
             struct dlist *di = NULL;
             prot_ungetc(c, in);
-            c = dlist_parse(&di, 0, in, alt_reserve_base);
+            c = _dlist_parse(&di, 0, in, alt_reserve_base, pool);
             if (di) dlist_stitch(dl, di);
             c = next_nonspace(in, c);
             if (c == EOF) goto fail;
@@ -1047,12 +1145,13 @@ EXPORTED int dlist_parse(struct dlist **dlp, int parsekey,
         /* no whitespace allowed here */
         c = prot_getc(in);
         if (c == '(') {
-            dl = dlist_newkvlist(NULL, kbuf.s);
+            dl = _dlist_new(pool, kbuf.s);
+            dl->type = DL_KVLIST;
             c = next_nonspace(in, ' ');
             while (c != ')') {
                 struct dlist *di = NULL;
                 prot_ungetc(c, in);
-                c = dlist_parse(&di, 1, in, alt_reserve_base);
+                c = _dlist_parse(&di, 1, in, alt_reserve_base, pool);
                 if (di) dlist_stitch(dl, di);
                 c = next_nonspace(in, c);
                 if (c == EOF) goto fail;
@@ -1076,7 +1175,8 @@ EXPORTED int dlist_parse(struct dlist **dlp, int parsekey,
             if (!message_guid_decode(&tmp_guid, gbuf.s)) goto fail;
             part = alt_reserve_base ? alt_reserve_base : pbuf.s;
             if (reservefile(in, part, &tmp_guid, size, &fname)) goto fail;
-            dl = dlist_setfile(NULL, kbuf.s, pbuf.s, &tmp_guid, size, fname);
+            dl = _dlist_new(pool, kbuf.s);
+            dlist_makefile(dl, pbuf.s, &tmp_guid, size, fname);
             /* file literal */
         }
         else {
@@ -1089,17 +1189,20 @@ EXPORTED int dlist_parse(struct dlist **dlp, int parsekey,
         prot_ungetc(c, in);
         /* could be binary in a literal */
         c = getbastring(in, NULL, &vbuf);
-        dl = dlist_setmap(NULL, kbuf.s, vbuf.s, vbuf.len);
+        dl = _dlist_new(pool, kbuf.s);
+        dlist_makemap(dl, vbuf.s, vbuf.len);
     }
     else if (c == '\\') { /* special case for flags */
         prot_ungetc(c, in);
         c = getastring(in, NULL, &vbuf);
-        dl = dlist_setflag(NULL, kbuf.s, vbuf.s);
+        dl = _dlist_new(pool, kbuf.s);
+        dlist_makeflag(dl, vbuf.s);
     }
     else {
         prot_ungetc(c, in);
         c = getnastring(in, NULL, &vbuf);
-        dl = dlist_setatom(NULL, kbuf.s, vbuf.s);
+        dl = _dlist_new(pool, kbuf.s);
+        dlist_makeatom(dl, vbuf.s);
     }
 
     /* success */
@@ -1111,6 +1214,31 @@ fail:
     return EOF;
 }
 
+EXPORTED int dlist_parse(struct dlist **dlp, int parsekey,
+                          struct protstream *in, const char *alt_reserve_base)
+{
+    return _dlist_parse(dlp, parsekey, in, alt_reserve_base, NULL);
+}
+
+EXPORTED int dlist_parse_arena(struct dlist **dlp, int parsekey,
+                               struct protstream *in,
+                               const char *alt_reserve_base)
+{
+    struct mpool *pool = new_mpool(DLIST_POOL_SIZE);
+    struct dlist *dl = NULL;
+    int c;
+
+    c = _dlist_parse(&dl, parsekey, in, alt_reserve_base, pool);
+
+    if (dl) {
+        dl->flags |= DLIST_OWNPOOL;
+        *dlp = dl;
+    }
+    else free_mpool(pool);
+
+    return c;
+}
+
 EXPORTED int dlist_parse_asatomlist(struct dlist **dlp, int parsekey,
                             struct protstream *in)
 {
@@ -1151,15 +1279,33 @@ EXPORTED int dlist_parsemap(struct dlist **dlp, int parsekey,
 EXPORTED struct dlist *dlist_getchild(struct dlist *dl, const char *name)
 {
     struct dlist *i;
+    int n = 0;
 
     if (!dl) return NULL;
 
-    for (i = dl->head; i; i = i->next) {
+    if (dl->index) {
+        i = hashmap_lookup(name, dl->index);
+        if (!i) lastkey = name;
+        return i;
+    }
+
+    for (i = dl->head; i; i = i->next, n++) {
         if (i->name && !strcmp(name, i->name))
-            return i;
+            break;
     }
-    lastkey = name;
-    return NULL;
+
+    /* that was a long walk - index the names so that it's the last */
+    if (n >= DLIST_INDEX_MIN && dl->type == DL_KVLIST) {
+        struct dlist *j;
+
+        dl->index = xzmalloc(sizeof(struct hashmap));
+        construct_hashmap(dl->index, n, 0);
+        for (j = dl->head; j; j = j->next)
+            _dlist_index_add(dl, j);
+    }
+
+    if (!i) lastkey = name;
+    return i;
 }
 
 EXPORTED struct dlist *dlist_getchildn(struct dlist *dl, int num)
@@ -1184,6 +1330,8 @@ EXPORTED struct dlist *dlist_splice(struct dlist *dl, int num)
     ret->type = dl->type;
     ret->nval = dl->nval;
 
+    _dlist_index_drop(dl);
+
     if (num > 0) {
         struct dlist *end = dlist_getchildn(dl, num - 1);
 
@@ -1219,6 +1367,8 @@ EXPORTED void dlist_splat(struct dlist *parent, struct dlist *child)
 
     assert(replace);
 
+    _dlist_index_drop(parent);
+
     if (child->head) {
         /* stitch in children */
         if (prev) prev->next = child->head;
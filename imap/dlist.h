@@ -90,10 +90,13 @@ struct dlist {
     struct dlist *tail;
     struct dlist *next;
     int type;
+    int flags;
     char *sval;
     bit64 nval;
     struct message_guid *gval; /* guid if any */
     char *part; /* so what if we're big! */
+    struct mpool *pool; /* arena trees: the pool this node came from */
+    struct hashmap *index; /* big kvlists: children by name */
 };
 
 const char *dlist_reserve_path(const char *part, int isarchive, const struct message_guid *guid);
@@ -145,6 +148,14 @@ struct dlist *dlist_newlist(struct dlist *parent, const char *name);
 struct dlist *dlist_newpklist(struct dlist *parent, const char *name);
 struct dlist *dlist_newkvlist(struct dlist *parent, const char *name);
 
+/* Arena trees.  Every node added under an arena root, and every value
+ * set on one, is allocated from a memory pool which belongs to the
+ * root, and dlist_free() on the root releases the lot at once.  Nodes
+ * from an arena tree must not outlive its root, even if unstitched;
+ * nodes from elsewhere may be stitched in and are freed as usual. */
+struct dlist *dlist_newlist_arena(const char *name);
+struct dlist *dlist_newkvlist_arena(const char *name);
+
 struct dlist *dlist_setatom(struct dlist *parent, const char *name,
                             const char *val);
 struct dlist *dlist_setflag(struct dlist *parent, const char *name,
@@ -222,6 +233,8 @@ int dlist_parse(struct dlist **dlp, int parsekeys,
                  struct protstream *in, const char *alt_reserve_base);
 int dlist_parse_asatomlist(struct dlist **dlp, int parsekey,
                             struct protstream *in);
+int dlist_parse_arena(struct dlist **dlp, int parsekeys,
+                      struct protstream *in, const char *alt_reserve_base);
 int dlist_parsemap(struct dlist **dlp, int parsekeys,
                    const char *base, unsigned len);
 
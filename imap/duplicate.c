@@ -46,9 +46,11 @@
 #include <string.h>
 #include <syslog.h>
 #include <ctype.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <errno.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -73,6 +75,9 @@
 #include "exitcodes.h"
 #include "util.h"
 #include "cyrusdb.h"
+#include "cyr_lock.h"
+#include "hashmap.h"
+#include "ptrarray.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -83,35 +88,614 @@
 
 #define DB (config_duplicate_db)
 
-static struct db *dupdb = NULL;
+/*
+ * With duplicate_partition_days set, records live in one database per
+ * period of their mark, named after the unpartitioned database plus
+ * ".t<start of period>", so that pruning can drop whole periods.  An
+ * unpartitioned database left over from before is still read, and is
+ * moved into partitions by the next prune.
+ *
+ * With duplicate_bloom_size set as well, a Bloom filter over every key
+ * is kept in a file mapped shared by all processes, so that checking
+ * for a message we haven't seen, the usual case, doesn't touch any
+ * database.  The filter has a slot per partition, found from its start
+ * time modulo DUPBLOOM_NSLOTS and labelled with it, which is simply
+ * cleared when that partition is dropped.  Keys of a partition which
+ * can't have its own slot, because another partition has it, go into
+ * a spill slot instead, which is rebuilt from those partitions after
+ * one of them has been dropped.  A partition which already exists
+ * never takes over a slot, so its keys are never split between slots.
+ *
+ * Everything which changes the filter does it with the filter file
+ * locked, and keeps it locked while storing the record; checks don't
+ * lock at all.
+ */
+
+#define PARTITION_SUFFIX        ".t"
+
+#define DUPBLOOM_SUFFIX         ".bloom"
+#define DUPBLOOM_MAGIC          "CYRDUPBL"
+#define DUPBLOOM_HEADER_SIZE    512
+#define DUPBLOOM_NSLOTS         32
+#define DUPBLOOM_SPILL          DUPBLOOM_NSLOTS
+#define DUPBLOOM_NHASH          7
+#define DUPBLOOM_EMPTY          ((int64_t) -1)
+
+struct dupbloom_header {
+    char magic[8];
+    uint32_t valid;
+    uint32_t slotbytes;
+    int64_t period;
+    int64_t labels[DUPBLOOM_NSLOTS];    /* partition start, or EMPTY */
+};
+
+struct partition {
+    time_t start;
+    struct db *db;
+    int seen;
+};
+
+static struct db *dupdb = NULL;     /* unpartitioned, or left over */
 static int duplicate_dbopen = 0;
+static char *dupfname = NULL;
+static time_t partition_period = 0;
+static ptrarray_t partitions = PTRARRAY_INITIALIZER;   /* newest first */
+static time_t partitions_mtime = -1;    /* of the directory, when read */
+static time_t partitions_scanned = 0;   /* and when that was */
+
+static char *bloom_fname = NULL;
+static int bloom_fd = -1;
+static char *bloom_base = NULL;
+static size_t bloom_len = 0;
+
+/* -------------------------------- partitions -------------------------- */
+
+static time_t partition_start(time_t mark)
+{
+    if (mark < 0) mark = 0;
+    return mark - mark % partition_period;
+}
+
+static char *partition_fname(time_t start)
+{
+    struct buf buf = BUF_INITIALIZER;
+
+    buf_printf(&buf, "%s" PARTITION_SUFFIX "%ld", dupfname, (long) start);
+    return buf_release(&buf);
+}
+
+static struct partition *partition_nth(int i)
+{
+    return (struct partition *) ptrarray_nth(&partitions, i);
+}
+
+static int partition_cmp(const void *a, const void *b)
+{
+    const struct partition *pa = *(struct partition **) a;
+    const struct partition *pb = *(struct partition **) b;
+
+    if (pa->start == pb->start) return 0;
+    return pa->start > pb->start ? -1 : 1;
+}
+
+static struct partition *partition_open(time_t start, int create)
+{
+    struct partition *part;
+    char *fname = partition_fname(start);
+    struct db *db = NULL;
+    int r;
+
+    r = cyrusdb_open(DB, fname, create ? CYRUSDB_CREATE : 0, &db);
+    if (r) {
+        if (r != CYRUSDB_NOTFOUND)
+            syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+                   cyrusdb_strerror(r));
+        free(fname);
+        return NULL;
+    }
+    free(fname);
+
+    part = xzmalloc(sizeof(struct partition));
+    part->start = start;
+    part->db = db;
+    part->seen = 1;
+
+    ptrarray_append(&partitions, part);
+    qsort(partitions.data, partitions.count, sizeof(void *), partition_cmp);
+
+    return part;
+}
+
+static void partition_close(int i)
+{
+    struct partition *part = ptrarray_remove(&partitions, i);
+
+    cyrusdb_close(part->db);
+    free(part);
+}
+
+/* the partition for records marked 'mark' */
+static struct partition *partition_find(time_t mark, int create)
+{
+    time_t start = partition_start(mark);
+    int i;
+
+    for (i = 0; i < partitions.count; i++) {
+        if (partition_nth(i)->start == start)
+            return partition_nth(i);
+    }
+
+    return partition_open(start, create);
+}
+
+static int partition_exists(time_t start)
+{
+    char *fname = partition_fname(start);
+    int r = !access(fname, F_OK);
+
+    free(fname);
+    return r;
+}
+
+/* bring the open partitions into line with what's on disk: other
+ * processes create them, and cyr_expire removes them.  Either changes
+ * the directory's mtime, so there's nothing to do while that's the same
+ * as when we last read it -- unless it was the very second we read it,
+ * in which case something may have changed since without moving it */
+static void partitions_refresh(void)
+{
+    char *dir = xstrdup(dupfname);
+    char *base = strrchr(dir, '/');
+    size_t baselen;
+    struct stat sbuf;
+    DIR *dirp;
+    struct dirent *dirent;
+    int i;
+
+    if (!base) {
+        free(dir);
+        return;
+    }
+    *base++ = '\0';
+    baselen = strlen(base);
+
+    if (stat(dir, &sbuf) == 0) {
+        if (sbuf.st_mtime == partitions_mtime &&
+            partitions_mtime < partitions_scanned) {
+            free(dir);
+            return;
+        }
+        partitions_mtime = sbuf.st_mtime;
+        partitions_scanned = time(NULL);
+    }
+    else {
+        partitions_mtime = -1;
+    }
+
+    dirp = opendir(dir);
+    if (!dirp) {
+        syslog(LOG_ERR, "IOERROR: reading %s: %m", dir);
+        free(dir);
+        return;
+    }
+
+    for (i = 0; i < partitions.count; i++)
+        partition_nth(i)->seen = 0;
+
+    while ((dirent = readdir(dirp))) {
+        const char *p = dirent->d_name;
+        const char *q;
+        time_t start;
+
+        if (strncmp(p, base, baselen)) continue;
+        p += baselen;
+        if (strncmp(p, PARTITION_SUFFIX, strlen(PARTITION_SUFFIX))) continue;
+        p += strlen(PARTITION_SUFFIX);
+
+        /* nothing but the start time: not shards, not temporary files */
+        for (q = p; Uisdigit(*q); q++);
+        if (q == p || *q) continue;
+
+        start = atol(p);
+        for (i = 0; i < partitions.count; i++) {
+            if (partition_nth(i)->start == start) {
+                partition_nth(i)->seen = 1;
+                break;
+            }
+        }
+        if (i == partitions.count)
+            partition_open(start, 0);
+    }
+    closedir(dirp);
+
+    for (i = partitions.count - 1; i >= 0; i--) {
+        if (!partition_nth(i)->seen)
+            partition_close(i);
+    }
+
+    free(dir);
+}
+
+/* -------------------------------- bloom filter ------------------------ */
+
+static struct dupbloom_header *bloom_header(void)
+{
+    return (struct dupbloom_header *) bloom_base;
+}
+
+static unsigned char *bloom_slot(int n)
+{
+    return (unsigned char *) bloom_base + DUPBLOOM_HEADER_SIZE +
+           (size_t) n * bloom_header()->slotbytes;
+}
+
+static int bloom_slotfor(time_t start)
+{
+    return (start / partition_period) % DUPBLOOM_NSLOTS;
+}
+
+/* the bits of 'key' in a slot */
+static void bloom_bits(const char *key, size_t keylen,
+                       uint32_t bits[DUPBLOOM_NHASH])
+{
+    uint64_t h = 14695981039346656037ULL;    /* FNV-1a, then mixed */
+    uint32_t nbits = bloom_header()->slotbytes * 8;
+    uint32_t h1, h2;
+    size_t i;
+
+    for (i = 0; i < keylen; i++) {
+        h ^= (unsigned char) key[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    h1 = h;
+    h2 = (h >> 32) | 1;
+    for (i = 0; i < DUPBLOOM_NHASH; i++)
+        bits[i] = (h1 + i * h2) % nbits;
+}
+
+static void bloom_set(int slot, const uint32_t bits[DUPBLOOM_NHASH])
+{
+    unsigned char *map = bloom_slot(slot);
+    int i;
+
+    for (i = 0; i < DUPBLOOM_NHASH; i++)
+        map[bits[i] >> 3] |= 1 << (bits[i] & 7);
+}
+
+static int bloom_test(int slot, const uint32_t bits[DUPBLOOM_NHASH])
+{
+    const volatile unsigned char *map = bloom_slot(slot);
+    int i;
+
+    for (i = 0; i < DUPBLOOM_NHASH; i++) {
+        if (!(map[bits[i] >> 3] & (1 << (bits[i] & 7))))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* might we have a record for 'key'? */
+static int bloom_maybe(const struct buf *key)
+{
+    struct dupbloom_header *hdr = bloom_header();
+    uint32_t bits[DUPBLOOM_NHASH];
+    int i;
+
+    if (!hdr->valid) return 1;
+
+    bloom_bits(key->s, key->len, bits);
+
+    for (i = 0; i < DUPBLOOM_NSLOTS; i++) {
+        if (hdr->labels[i] != DUPBLOOM_EMPTY && bloom_test(i, bits))
+            return 1;
+    }
+
+    return bloom_test(DUPBLOOM_SPILL, bits);
+}
+
+static void bloom_insert(const char *key, size_t keylen, time_t mark)
+{
+    struct dupbloom_header *hdr = bloom_header();
+    time_t start = partition_start(mark);
+    int slot = bloom_slotfor(start);
+    uint32_t bits[DUPBLOOM_NHASH];
+
+    /* a new partition can have a free slot */
+    if (hdr->labels[slot] == DUPBLOOM_EMPTY && !partition_exists(start))
+        hdr->labels[slot] = start;
+
+    if (hdr->labels[slot] != start) slot = DUPBLOOM_SPILL;
+
+    bloom_bits(key, keylen, bits);
+    bloom_set(slot, bits);
+}
+
+/* add 'key', marked 'mark', to the filter.  The filter must be locked */
+static void bloom_add(const char *key, size_t keylen, time_t mark)
+{
+    /* whoever builds it will find the record */
+    if (!bloom_header()->valid) return;
+
+    bloom_insert(key, keylen, mark);
+}
+
+static int bloom_lock(void)
+{
+    if (!bloom_base) return 0;
+
+    if (lock_blocking(bloom_fd, bloom_fname)) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", bloom_fname);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void bloom_unlock(void)
+{
+    lock_unlock(bloom_fd, bloom_fname);
+}
+
+static int bloom_add_cb(void *rock __attribute__((unused)),
+                        const char *key, size_t keylen,
+                        const char *data,
+                        size_t datalen __attribute__((unused)))
+{
+    time_t mark;
+
+    memcpy(&mark, data, sizeof(time_t));
+    bloom_insert(key, keylen, mark);
+
+    return 0;
+}
+
+static int bloom_spill_cb(void *rock,
+                          const char *key, size_t keylen,
+                          const char *data __attribute__((unused)),
+                          size_t datalen __attribute__((unused)))
+{
+    unsigned char *map = (unsigned char *) rock;
+    uint32_t bits[DUPBLOOM_NHASH];
+    int i;
+
+    bloom_bits(key, keylen, bits);
+    for (i = 0; i < DUPBLOOM_NHASH; i++)
+        map[bits[i] >> 3] |= 1 << (bits[i] & 7);
+
+    return 0;
+}
+
+/* the time between a and b, for putting the partitions nearest
+ * to now first */
+static int partition_nearest_cmp(const void *a, const void *b)
+{
+    time_t now = time(NULL);
+    const struct partition *pa = *(struct partition **) a;
+    const struct partition *pb = *(struct partition **) b;
+    time_t da = pa->start > now ? pa->start - now : now - pa->start;
+    time_t db = pb->start > now ? pb->start - now : now - pb->start;
+
+    if (da == db) return 0;
+    return da < db ? -1 : 1;
+}
+
+/* fill an empty filter from every record.  The filter must be locked */
+static void bloom_build(void)
+{
+    struct dupbloom_header *hdr = bloom_header();
+    ptrarray_t nearest = PTRARRAY_INITIALIZER;
+    int i, slot;
+
+    hdr->valid = 0;
+    __sync_synchronize();
+
+    memset(bloom_base + DUPBLOOM_HEADER_SIZE, 0,
+           bloom_len - DUPBLOOM_HEADER_SIZE);
+    for (i = 0; i < DUPBLOOM_NSLOTS; i++)
+        hdr->labels[i] = DUPBLOOM_EMPTY;
+
+    /* the partitions most likely to be written to get slots first */
+    partitions_refresh();
+    for (i = 0; i < partitions.count; i++)
+        ptrarray_append(&nearest, partition_nth(i));
+    qsort(nearest.data, nearest.count, sizeof(void *), partition_nearest_cmp);
+
+    for (i = 0; i < nearest.count; i++) {
+        struct partition *part = ptrarray_nth(&nearest, i);
+        slot = bloom_slotfor(part->start);
+        if (hdr->labels[slot] == DUPBLOOM_EMPTY)
+            hdr->labels[slot] = part->start;
+    }
+    ptrarray_fini(&nearest);
+
+    for (i = 0; i < partitions.count; i++)
+        cyrusdb_foreach(partition_nth(i)->db, "", 0, NULL,
+                        bloom_add_cb, NULL, NULL);
+    if (dupdb)
+        cyrusdb_foreach(dupdb, "", 0, NULL, bloom_add_cb, NULL, NULL);
+
+    __sync_synchronize();
+    hdr->valid = 1;
+
+    syslog(LOG_NOTICE, "duplicate: built bloom filter %s from %d partitions%s",
+           bloom_fname, partitions.count, dupdb ? " and the old database" : "");
+}
+
+/* forget the keys of a partition which has been dropped.  Returns 1 if
+ * they were in the spill slot, which then needs rebuilding.  The
+ * filter must be locked */
+static int bloom_drop(time_t start)
+{
+    struct dupbloom_header *hdr = bloom_header();
+    int slot = bloom_slotfor(start);
+
+    if (hdr->labels[slot] != start) return 1;
+
+    memset(bloom_slot(slot), 0, hdr->slotbytes);
+    __sync_synchronize();
+    hdr->labels[slot] = DUPBLOOM_EMPTY;
+
+    return 0;
+}
+
+/* refill the spill slot from the partitions which use it.  The filter
+ * must be locked */
+static void bloom_rebuild_spill(void)
+{
+    struct dupbloom_header *hdr = bloom_header();
+    unsigned char *map = xzmalloc(hdr->slotbytes);
+    int i;
+
+    for (i = 0; i < partitions.count; i++) {
+        struct partition *part = partition_nth(i);
+        if (hdr->labels[bloom_slotfor(part->start)] == part->start) continue;
+        cyrusdb_foreach(part->db, "", 0, NULL, bloom_spill_cb, map, NULL);
+    }
+    if (dupdb)
+        cyrusdb_foreach(dupdb, "", 0, NULL, bloom_spill_cb, map, NULL);
+
+    /* every byte is either the old one or the new one, and both have
+     * all the bits of the keys which are still there */
+    memcpy(bloom_slot(DUPBLOOM_SPILL), map, hdr->slotbytes);
+    free(map);
+}
+
+/* map the filter, building it if it's new */
+static void bloom_map(void)
+{
+    int kbytes = config_getint(IMAPOPT_DUPLICATE_BLOOM_SIZE);
+    struct dupbloom_header *hdr;
+    uint32_t slotbytes;
+    struct stat sbuf;
+    size_t len;
+    void *base;
+
+    if (kbytes <= 0) return;
+
+    slotbytes = ((size_t) kbytes * 1024 / (DUPBLOOM_NSLOTS + 1)) & ~7;
+    if (slotbytes < 64) slotbytes = 64;
+    len = DUPBLOOM_HEADER_SIZE + (size_t) (DUPBLOOM_NSLOTS + 1) * slotbytes;
+
+    bloom_fname = strconcat(dupfname, DUPBLOOM_SUFFIX, (char *)NULL);
+    bloom_fd = open(bloom_fname, O_RDWR|O_CREAT, 0644);
+    if (bloom_fd == -1) {
+        syslog(LOG_ERR, "IOERROR: opening %s: %m", bloom_fname);
+        goto fail;
+    }
+
+    if (fstat(bloom_fd, &sbuf) == -1) {
+        syslog(LOG_ERR, "IOERROR: fstat %s: %m", bloom_fname);
+        goto fail;
+    }
+
+    /* a new (zero-filled) filter isn't valid until it's built.  One
+     * of the wrong size is from an old config: remove the file to
+     * resize it */
+    if (!sbuf.st_size && ftruncate(bloom_fd, len) == -1) {
+        syslog(LOG_ERR, "IOERROR: sizing %s: %m", bloom_fname);
+        goto fail;
+    }
+    else if (sbuf.st_size && (size_t) sbuf.st_size != len) {
+        syslog(LOG_ERR, "duplicate: %s is not %d kbytes, not using it",
+               bloom_fname, kbytes);
+        goto fail;
+    }
+
+    base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, bloom_fd, 0);
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mapping %s: %m", bloom_fname);
+        goto fail;
+    }
+
+    bloom_base = base;
+    bloom_len = len;
+    hdr = bloom_header();
+
+    if (!hdr->valid || hdr->period != partition_period) {
+        if (!bloom_lock()) goto fail;
+
+        if (!hdr->valid || hdr->period != partition_period) {
+            memcpy(hdr->magic, DUPBLOOM_MAGIC, 8);
+            hdr->slotbytes = slotbytes;
+            hdr->period = partition_period;
+            bloom_build();
+        }
+
+        bloom_unlock();
+    }
+
+    return;
+
+fail:
+    if (bloom_base) munmap(bloom_base, bloom_len);
+    bloom_base = NULL;
+    if (bloom_fd != -1) close(bloom_fd);
+    bloom_fd = -1;
+    free(bloom_fname);
+    bloom_fname = NULL;
+}
+
+static void bloom_unmap(void)
+{
+    if (!bloom_base) return;
+
+    munmap(bloom_base, bloom_len);
+    bloom_base = NULL;
+    close(bloom_fd);
+    bloom_fd = -1;
+    free(bloom_fname);
+    bloom_fname = NULL;
+}
+
+/* -------------------------------- the API ----------------------------- */
 
 /* must be called after cyrus_init */
 EXPORTED int duplicate_init(const char *fname)
 {
+    int days = config_getint(IMAPOPT_DUPLICATE_PARTITION_DAYS);
+    int usebloom = !fname;
     int r = 0;
-    char *tofree = NULL;
 
     if (!fname)
         fname = config_getstring(IMAPOPT_DUPLICATE_DB_PATH);
 
     /* create db file name */
-    if (!fname) {
-        tofree = strconcat(config_dir, FNAME_DELIVERDB, (char *)NULL);
-        fname = tofree;
+    if (!fname)
+        dupfname = strconcat(config_dir, FNAME_DELIVERDB, (char *)NULL);
+    else
+        dupfname = xstrdup(fname);
+
+    partition_period = days > 0 ? (time_t) days * 86400 : 0;
+
+    r = cyrusdb_open(DB, dupfname, partition_period ? 0 : CYRUSDB_CREATE,
+                     &dupdb);
+    if (r == CYRUSDB_NOTFOUND && partition_period) {
+        /* nothing left over */
+        r = 0;
+        dupdb = NULL;
     }
-
-    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &dupdb);
-    if (r != 0) {
-        syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+    else if (r != 0) {
+        syslog(LOG_ERR, "DBERROR: opening %s: %s", dupfname,
                cyrusdb_strerror(r));
+        free(dupfname);
+        dupfname = NULL;
         goto out;
     }
     duplicate_dbopen = 1;
 
-out:
-    free(tofree);
+    if (partition_period) {
+        cyrus_mkdir(dupfname, 0755);
+        partitions_refresh();
+        /* only the daemons' own database gets a filter */
+        if (usebloom) bloom_map();
+    }
 
+out:
     return r;
 }
 
@@ -160,21 +744,16 @@ static int split_key(const char *key, int keylen, duplicate_key_t *dkey)
 #undef MAXFIELDS
 }
 
-EXPORTED time_t duplicate_check(const duplicate_key_t *dkey)
+/* look 'key' up in one database.  Returns 1 and sets *markp if found */
+static int lookup(struct db *db, const struct buf *key,
+                  const duplicate_key_t *dkey, time_t *markp)
 {
-    struct buf key = BUF_INITIALIZER;
-    int r;
     const char *data = NULL;
     size_t len = 0;
-    time_t mark = 0;
-
-    if (!duplicate_dbopen) return 0;
-
-    r = make_key(&key, dkey);
-    if (r) return 0;
+    int r;
 
     do {
-        r = cyrusdb_fetch(dupdb, key.s, key.len,
+        r = cyrusdb_fetch(db, key->s, key->len,
                       &data, &len, NULL);
     } while (r == CYRUSDB_AGAIN);
 
@@ -183,16 +762,50 @@ EXPORTED time_t duplicate_check(const duplicate_key_t *dkey)
                (len == sizeof(time_t) + sizeof(unsigned long)));
 
         /* found the record */
-        memcpy(&mark, data, sizeof(time_t));
+        memcpy(markp, data, sizeof(time_t));
+        return 1;
     } else if (r != CYRUSDB_OK) {
         if (r != CYRUSDB_NOTFOUND) {
             syslog(LOG_ERR, "duplicate_check: error looking up %s/%s/%s: %s",
                    dkey->id, dkey->to, dkey->date,
                    cyrusdb_strerror(r));
         }
-        mark = 0;
     }
 
+    return 0;
+}
+
+EXPORTED time_t duplicate_check(const duplicate_key_t *dkey)
+{
+    struct buf key = BUF_INITIALIZER;
+    int r;
+    time_t mark = 0;
+
+    if (!duplicate_dbopen) return 0;
+
+    r = make_key(&key, dkey);
+    if (r) return 0;
+
+    /* never marked, and most messages aren't duplicates */
+    if (bloom_base && !bloom_maybe(&key))
+        goto done;
+
+    if (partition_period) {
+        int i, found = 0;
+
+        /* a record marked again is in a later partition */
+        partitions_refresh();
+        for (i = 0; !found && i < partitions.count; i++)
+            found = lookup(partition_nth(i)->db, &key, dkey, &mark);
+
+        if (!found && dupdb)
+            lookup(dupdb, &key, dkey, &mark);
+    }
+    else {
+        lookup(dupdb, &key, dkey, &mark);
+    }
+
+done:
 #if DEBUG
     syslog(LOG_DEBUG, "duplicate_check: %-40s %-20s %-40s %ld",
            dkey->id, dkey->to, dkey->date, mark);
@@ -226,10 +839,29 @@ EXPORTED void duplicate_mark(const duplicate_key_t *dkey, time_t mark, unsigned
     memcpy(data, &mark, sizeof(mark));
     memcpy(data + sizeof(mark), &uid, sizeof(uid));
 
-    do {
-        r = cyrusdb_store(dupdb, key.s, key.len,
-                      data, sizeof(mark)+sizeof(uid), NULL);
-    } while (r == CYRUSDB_AGAIN);
+    if (partition_period) {
+        struct partition *part;
+        int locked = bloom_lock();
+
+        /* into the filter first, so nobody misses the record */
+        if (locked) bloom_add(key.s, key.len, mark);
+
+        part = partition_find(mark, /*create*/1);
+        if (part) {
+            do {
+                r = cyrusdb_store(part->db, key.s, key.len,
+                              data, sizeof(mark)+sizeof(uid), NULL);
+            } while (r == CYRUSDB_AGAIN);
+        }
+
+        if (locked) bloom_unlock();
+    }
+    else {
+        do {
+            r = cyrusdb_store(dupdb, key.s, key.len,
+                          data, sizeof(mark)+sizeof(uid), NULL);
+        } while (r == CYRUSDB_AGAIN);
+    }
 
 #if DEBUG
     syslog(LOG_DEBUG, "duplicate_mark: %-40s %-20s %-40s %ld %lu",
@@ -241,8 +873,28 @@ EXPORTED void duplicate_mark(const duplicate_key_t *dkey, time_t mark, unsigned
 struct findrock {
     duplicate_find_proc_t proc;
     void *rock;
+    hashmap_t *seen;    /* keys already found in a later partition */
 };
 
+/* have we already found this key in a later partition? */
+static int find_seen(hashmap_t *seen, const char *key, size_t keylen)
+{
+    struct buf buf = BUF_INITIALIZER;
+    size_t i;
+    int r;
+
+    /* keys are nul separated, which won't do as a hash key */
+    buf_setmap(&buf, key, keylen);
+    for (i = 0; i < buf.len; i++)
+        if (!buf.s[i]) buf.s[i] = '\x1f';
+
+    r = hashmap_lookup(buf_cstring(&buf), seen) != NULL;
+    if (!r) hashmap_insert(buf_cstring(&buf), (void *) 1, seen);
+
+    buf_free(&buf);
+    return r;
+}
+
 static int find_cb(void *rock, const char *key, size_t keylen,
                    const char *data, size_t datalen)
 {
@@ -258,6 +910,8 @@ static int find_cb(void *rock, const char *key, size_t keylen,
     /* make sure its a mailbox */
     if (dkey.to[0] == '.') return 0;
 
+    if (frock->seen && find_seen(frock->seen, key, keylen)) return 0;
+
     /* grab the mark and uid */
     memcpy(&mark, data, sizeof(time_t));
     if (datalen > (int) sizeof(mark))
@@ -278,6 +932,27 @@ EXPORTED int duplicate_find(const char *msgid,
 
     frock.proc = proc;
     frock.rock = rock;
+    frock.seen = NULL;
+
+    if (partition_period) {
+        hashmap_t seen;
+        int i;
+
+        /* newest first, so a record marked again is found as it is now */
+        construct_hashmap(&seen, 1024, 1);
+        frock.seen = &seen;
+
+        partitions_refresh();
+        for (i = 0; i < partitions.count; i++)
+            cyrusdb_foreach(partition_nth(i)->db, msgid, strlen(msgid),
+                            NULL, find_cb, &frock, NULL);
+        if (dupdb)
+            cyrusdb_foreach(dupdb, msgid, strlen(msgid),
+                            NULL, find_cb, &frock, NULL);
+
+        free_hashmap(&seen, NULL);
+        return 0;
+    }
 
     /* check each entry in our database */
     cyrusdb_foreach(dupdb, msgid, strlen(msgid), NULL, find_cb, &frock, NULL);
@@ -336,6 +1011,124 @@ static int prune_cb(void *rock, const char *id, size_t idlen,
     return 0;
 }
 
+/* move a record from the old unpartitioned database into its partition */
+static int migrate_cb(void *rock,
+                      const char *key, size_t keylen,
+                      const char *data, size_t datalen)
+{
+    int *lockedp = (int *) rock;
+    struct partition *part;
+    time_t mark;
+    int r = 0;
+
+    memcpy(&mark, data, sizeof(time_t));
+
+    part = partition_find(mark, /*create*/1);
+    if (!part) return CYRUSDB_IOERROR;
+
+    if (*lockedp) bloom_add(key, keylen, mark);
+
+    do {
+        r = cyrusdb_store(part->db, key, keylen, data, datalen, NULL);
+    } while (r == CYRUSDB_AGAIN);
+
+    return r;
+}
+
+static void cutoff_cb(const char *key __attribute__((unused)),
+                      void *data, void *rock)
+{
+    time_t *cutoffs = (time_t *) rock;
+    time_t expmark = *(time_t *) data;
+
+    if (expmark < cutoffs[0]) cutoffs[0] = expmark;
+    if (expmark > cutoffs[1]) cutoffs[1] = expmark;
+}
+
+static int prune_partitions(struct prunerock *prock)
+{
+    time_t now = time(NULL);
+    time_t cutoffs[2];
+    time_t *dropped;
+    int ndropped = 0;
+    int i, r = 0;
+
+    /* move everything out of the old database first, so that it's
+     * pruned along with the rest */
+    if (dupdb) {
+        int locked = bloom_lock();
+
+        r = cyrusdb_foreach(dupdb, "", 0, NULL, migrate_cb, &locked, NULL);
+        if (!r) {
+            cyrusdb_close(dupdb);
+            dupdb = NULL;
+            cyrusdb_unlink(DB, dupfname);
+            syslog(LOG_NOTICE, "duplicate_prune: moved %s into partitions",
+                   dupfname);
+        }
+        else {
+            syslog(LOG_ERR, "DBERROR: moving %s into partitions: %s",
+                   dupfname, cyrusdb_strerror(r));
+        }
+
+        if (locked) bloom_unlock();
+    }
+
+    /* a partition can go as a whole once everything in it has expired
+     * for every mailbox, and is left alone if nothing in it has */
+    cutoffs[0] = cutoffs[1] = prock->expmark;
+    if (prock->expire_table)
+        hash_enumerate(prock->expire_table, cutoff_cb, cutoffs);
+
+    partitions_refresh();
+    dropped = xmalloc((partitions.count + 1) * sizeof(time_t));
+    for (i = partitions.count - 1; i >= 0; i--) {
+        struct partition *part = partition_nth(i);
+        time_t start = part->start;
+        time_t end = start + partition_period;
+        char *fname;
+
+        if (start >= cutoffs[1]) continue;
+
+        if (end > cutoffs[0]) {
+            int count = prock->count, deletions = prock->deletions;
+
+            prock->db = part->db;
+            cyrusdb_foreach(part->db, "", 0, &prune_p, &prune_cb, prock, NULL);
+
+            /* keep it if someone might still mark something into it */
+            if (prock->count - count != prock->deletions - deletions ||
+                end > now)
+                continue;
+        }
+
+        fname = partition_fname(start);
+        partition_close(i);
+        if (cyrusdb_unlink(DB, fname))
+            syslog(LOG_ERR, "IOERROR: removing %s: %m", fname);
+        else
+            dropped[ndropped++] = start;
+        free(fname);
+    }
+
+    /* and then forget their keys */
+    if (ndropped && bloom_lock()) {
+        int respill = 0;
+
+        for (i = 0; i < ndropped; i++) {
+            if (bloom_drop(dropped[i])) respill = 1;
+        }
+        if (respill) bloom_rebuild_spill();
+
+        bloom_unlock();
+    }
+
+    syslog(LOG_NOTICE, "duplicate_prune: dropped %d partitions", ndropped);
+    free(dropped);
+
+    return r;
+}
+
 EXPORTED int duplicate_prune(int seconds, struct hash_table *expire_table)
 {
     struct prunerock prock;
@@ -348,9 +1141,14 @@ EXPORTED int duplicate_prune(int seconds, struct hash_table *expire_table)
     syslog(LOG_NOTICE, "duplicate_prune: pruning back %0.2f days",
            ((double)seconds/86400));
 
-    /* check each entry in our database */
-    prock.db = dupdb;
-    cyrusdb_foreach(dupdb, "", 0, &prune_p, &prune_cb, &prock, NULL);
+    if (partition_period) {
+        prune_partitions(&prock);
+    }
+    else {
+        /* check each entry in our database */
+        prock.db = dupdb;
+        cyrusdb_foreach(dupdb, "", 0, &prune_p, &prune_cb, &prock, NULL);
+    }
 
     syslog(LOG_NOTICE, "duplicate_prune: purged %d out of %d entries",
            prock.deletions, prock.count);
@@ -415,8 +1213,18 @@ EXPORTED int duplicate_dump(FILE *f)
     drock.f = f;
     drock.count = 0;
 
+    if (partition_period) {
+        int i;
+
+        partitions_refresh();
+        for (i = 0; i < partitions.count; i++)
+            cyrusdb_foreach(partition_nth(i)->db, "", 0, NULL,
+                            &dump_cb, &drock, NULL);
+    }
+
     /* check each entry in our database */
-    cyrusdb_foreach(dupdb, "", 0, NULL, &dump_cb, &drock, NULL);
+    if (dupdb)
+        cyrusdb_foreach(dupdb, "", 0, NULL, &dump_cb, &drock, NULL);
 
     return drock.count;
 }
@@ -426,11 +1234,21 @@ EXPORTED int duplicate_done(void)
     int r = 0;
 
     if (duplicate_dbopen) {
-        r = cyrusdb_close(dupdb);
+        bloom_unmap();
+
+        while (partitions.count)
+            partition_close(partitions.count - 1);
+        ptrarray_fini(&partitions);
+        partitions_mtime = -1;
+
+        if (dupdb) r = cyrusdb_close(dupdb);
         if (r) {
             syslog(LOG_ERR, "DBERROR: error closing deliverdb: %s",
                    cyrusdb_strerror(r));
         }
+        dupdb = NULL;
+        free(dupfname);
+        dupfname = NULL;
         duplicate_dbopen = 0;
     }
 
@@ -0,0 +1,324 @@
+/* expirequeue.c -- when each mailbox next needs cyr_expire
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * cyr_expire used to open and lock every mailbox on the server to look
+ * for expunged messages due for cleanup, and most have none.  This
+ * database holds, for each mailbox, a time no later than its
+ * first_expunged, so cyr_expire only needs to open the mailboxes which
+ * may be due.  A mailbox with no entry is always opened.
+ *
+ * Only cyr_expire writes the exact value, after it has cleaned up a
+ * mailbox.  Everyone else just notes a new first_expunged after
+ * releasing the mailbox lock, and a note can only move the entry
+ * earlier, so notes applied late or out of order are still safe: the
+ * worst they do is have cyr_expire open a mailbox with nothing due.
+ * An entry which can't be updated is removed rather than trusted,
+ * and cyr_expire ignores the queue altogether every
+ * expirequeue_fullscan days, in case entries went stale while the
+ * queue was disabled.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "cyrusdb.h"
+#include "global.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/* generated headers are not necessarily in current directory */
+#include "imap/imap_err.h"
+
+#include "expirequeue.h"
+
+/* when cyr_expire last opened every mailbox */
+#define FULLSCAN_KEY "$FULLSCAN"
+
+static struct db *expirequeuedb = NULL;
+static int expirequeue_keepopen = 0;
+
+EXPORTED int expirequeue_enabled(void)
+{
+    return config_getswitch(IMAPOPT_EXPIREQUEUE);
+}
+
+static struct db *expirequeue_db(void)
+{
+    const char *fname;
+    char *tofree = NULL;
+    int r;
+
+    if (expirequeuedb) return expirequeuedb;
+
+    fname = config_getstring(IMAPOPT_EXPIREQUEUE_DB_PATH);
+    if (!fname)
+        fname = tofree = strconcat(config_dir, FNAME_EXPIREQUEUEDB,
+                                   (char *)NULL);
+
+    r = cyrusdb_open(config_getstring(IMAPOPT_EXPIREQUEUE_DB), fname,
+                     CYRUSDB_CREATE, &expirequeuedb);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+               cyrusdb_strerror(r));
+        expirequeuedb = NULL;
+    }
+
+    free(tofree);
+    return expirequeuedb;
+}
+
+static void expirequeue_done(void)
+{
+    int r;
+
+    if (expirequeue_keepopen || !expirequeuedb) return;
+
+    r = cyrusdb_close(expirequeuedb);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: error closing expirequeue: %s",
+               cyrusdb_strerror(r));
+    }
+    expirequeuedb = NULL;
+}
+
+EXPORTED void expirequeue_open(void)
+{
+    expirequeue_keepopen = 1;
+    expirequeue_db();
+}
+
+EXPORTED void expirequeue_close(void)
+{
+    expirequeue_keepopen = 0;
+    expirequeue_done();
+}
+
+static int expirequeue_parse(const char *data, size_t datalen, time_t *val)
+{
+    char buf[32];
+
+    if (!datalen || datalen >= sizeof(buf)) return IMAP_IOERROR;
+
+    memcpy(buf, data, datalen);
+    buf[datalen] = '\0';
+    *val = strtoul(buf, NULL, 10);
+
+    return 0;
+}
+
+static int expirequeue_store(struct db *db, const char *key, time_t val,
+                             struct txn **tid)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long) val);
+    return cyrusdb_store(db, key, strlen(key), buf, strlen(buf), tid);
+}
+
+EXPORTED int expirequeue_lookup(const char *mboxname, time_t *first_expunged)
+{
+    struct db *db = expirequeue_db();
+    const char *data = NULL;
+    size_t datalen = 0;
+    int r;
+
+    if (!db) return IMAP_IOERROR;
+
+    r = cyrusdb_fetch(db, mboxname, strlen(mboxname), &data, &datalen, NULL);
+    if (!r) r = expirequeue_parse(data, datalen, first_expunged);
+
+    expirequeue_done();
+    return r;
+}
+
+EXPORTED int expirequeue_update(const char *mboxname, time_t first_expunged)
+{
+    struct db *db = expirequeue_db();
+    int r;
+
+    if (!db) return IMAP_IOERROR;
+
+    r = expirequeue_store(db, mboxname, first_expunged, NULL);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: updating expirequeue for %s: %s",
+               mboxname, cyrusdb_strerror(r));
+        expirequeue_delete(mboxname);
+    }
+
+    expirequeue_done();
+    return r;
+}
+
+EXPORTED int expirequeue_note(const char *mboxname, time_t first_expunged)
+{
+    struct db *db;
+    struct txn *tid = NULL;
+    const char *data = NULL;
+    size_t datalen = 0;
+    time_t old = 0;
+    int r;
+
+    /* nothing newly due: the entry is at worst early */
+    if (!first_expunged) return 0;
+
+    db = expirequeue_db();
+    if (!db) return IMAP_IOERROR;
+
+    r = cyrusdb_fetchlock(db, mboxname, strlen(mboxname),
+                          &data, &datalen, &tid);
+    if (r == CYRUSDB_NOTFOUND) {
+        /* no entry, cyr_expire will open it anyway */
+        r = 0;
+        goto done;
+    }
+    if (!r) r = expirequeue_parse(data, datalen, &old);
+    if (!r && (!old || old > first_expunged))
+        r = expirequeue_store(db, mboxname, first_expunged, &tid);
+
+ done:
+    if (tid) {
+        if (r) cyrusdb_abort(db, tid);
+        else r = cyrusdb_commit(db, tid);
+    }
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: updating expirequeue for %s: %s",
+               mboxname, cyrusdb_strerror(r));
+        expirequeue_delete(mboxname);
+    }
+
+    expirequeue_done();
+    return r;
+}
+
+EXPORTED int expirequeue_rename(const char *oldname, const char *newname)
+{
+    struct db *db = expirequeue_db();
+    struct txn *tid = NULL;
+    const char *data = NULL;
+    size_t datalen = 0;
+    int r;
+
+    if (!db) return IMAP_IOERROR;
+
+    /* the new mailbox starts with no entry, so it will be opened;
+     * carry the old one across if there is one */
+    r = cyrusdb_fetchlock(db, oldname, strlen(oldname),
+                          &data, &datalen, &tid);
+    if (!r) r = cyrusdb_store(db, newname, strlen(newname),
+                              data, datalen, &tid);
+    if (!r) r = cyrusdb_delete(db, oldname, strlen(oldname), &tid, 1);
+    if (r == CYRUSDB_NOTFOUND) r = 0;
+
+    if (tid) {
+        if (r) cyrusdb_abort(db, tid);
+        else r = cyrusdb_commit(db, tid);
+    }
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: renaming expirequeue entry %s to %s: %s",
+               oldname, newname, cyrusdb_strerror(r));
+        expirequeue_delete(newname);
+    }
+
+    expirequeue_done();
+    return r;
+}
+
+EXPORTED int expirequeue_delete(const char *mboxname)
+{
+    struct db *db = expirequeue_db();
+    int r;
+
+    if (!db) return IMAP_IOERROR;
+
+    r = cyrusdb_delete(db, mboxname, strlen(mboxname), NULL, 1);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: removing expirequeue entry for %s: %s",
+               mboxname, cyrusdb_strerror(r));
+    }
+
+    expirequeue_done();
+    return r;
+}
+
+EXPORTED int expirequeue_fullscan_due(time_t now)
+{
+    struct db *db = expirequeue_db();
+    const char *data = NULL;
+    size_t datalen = 0;
+    time_t last = 0;
+    int days = config_getint(IMAPOPT_EXPIREQUEUE_FULLSCAN);
+    int r;
+
+    if (!db) return 1;
+
+    r = cyrusdb_fetch(db, FULLSCAN_KEY, strlen(FULLSCAN_KEY),
+                      &data, &datalen, NULL);
+    if (!r) r = expirequeue_parse(data, datalen, &last);
+
+    expirequeue_done();
+
+    if (r) return 1;
+    if (days <= 0) return 0;
+    return (now - last >= days * 86400);
+}
+
+EXPORTED int expirequeue_fullscan_done(time_t now)
+{
+    struct db *db = expirequeue_db();
+    int r;
+
+    if (!db) return IMAP_IOERROR;
+
+    r = expirequeue_store(db, FULLSCAN_KEY, now, NULL);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: updating expirequeue: %s",
+               cyrusdb_strerror(r));
+    }
+
+    expirequeue_done();
+    return r;
+}
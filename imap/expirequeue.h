@@ -0,0 +1,80 @@
+/* expirequeue.h -- when each mailbox next needs cyr_expire
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef EXPIREQUEUE_H
+#define EXPIREQUEUE_H
+
+#include <time.h>
+
+#define FNAME_EXPIREQUEUEDB "/expirequeue.db"
+
+/* is the queue in use? */
+extern int expirequeue_enabled(void);
+
+/* keep the database open between calls, as cyr_expire does */
+extern void expirequeue_open(void);
+extern void expirequeue_close(void);
+
+/* when might the oldest message still waiting to be cleaned up in
+ * 'mboxname' have been expunged?  Zero if none are.  Returns nonzero
+ * if the mailbox has no entry, in which case nothing is known about
+ * it. */
+extern int expirequeue_lookup(const char *mboxname, time_t *first_expunged);
+
+/* record the mailbox's first_expunged exactly, as cyr_expire does
+ * after cleaning it up */
+extern int expirequeue_update(const char *mboxname, time_t first_expunged);
+
+/* note a new first_expunged for the mailbox, moving its entry earlier
+ * if need be.  Safe to call without the mailbox locked */
+extern int expirequeue_note(const char *mboxname, time_t first_expunged);
+
+/* move or remove a mailbox's entry */
+extern int expirequeue_rename(const char *oldname, const char *newname);
+extern int expirequeue_delete(const char *mboxname);
+
+/* is it time for cyr_expire to ignore the queue and open every
+ * mailbox, and record that it has */
+extern int expirequeue_fullscan_due(time_t now);
+extern int expirequeue_fullscan_done(time_t now);
+
+#endif /* EXPIREQUEUE_H */
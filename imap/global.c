@@ -117,6 +117,23 @@ static int session_id_count = 0;
 
 static strarray_t *suppressed_capabilities = NULL;
 
+/* names of the sharded backends built below, kept for the process */
+static strarray_t sharded_backends = STRARRAY_INITIALIZER;
+
+/* wrap backend in "sharded:N:" if opt asks for more than one shard */
+static const char *sharded_db(const char *backend, enum imapopt opt)
+{
+    int nshards = config_getint(opt);
+    struct buf buf = BUF_INITIALIZER;
+
+    if (nshards <= 1) return backend;
+
+    buf_printf(&buf, "sharded:%d:%s", nshards, backend);
+    strarray_appendm(&sharded_backends, buf_release(&buf));
+
+    return strarray_nth(&sharded_backends, -1);
+}
+
 static int get_facility(const char *name)
 {
     if (!strcasecmp(name, "DAEMON"))
@@ -261,16 +278,20 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
 
     if (!cyrus_init_nodb) {
         /* lookup the database backends */
-        config_mboxlist_db = config_getstring(IMAPOPT_MBOXLIST_DB);
+        config_mboxlist_db = sharded_db(config_getstring(IMAPOPT_MBOXLIST_DB),
+                                        IMAPOPT_MBOXLIST_DB_SHARDS);
         config_quota_db = config_getstring(IMAPOPT_QUOTA_DB);
         config_subscription_db = config_getstring(IMAPOPT_SUBSCRIPTION_DB);
-        config_annotation_db = config_getstring(IMAPOPT_ANNOTATION_DB);
+        config_annotation_db = sharded_db(config_getstring(IMAPOPT_ANNOTATION_DB),
+                                          IMAPOPT_ANNOTATION_DB_SHARDS);
         config_seenstate_db = config_getstring(IMAPOPT_SEENSTATE_DB);
         config_mboxkey_db = config_getstring(IMAPOPT_MBOXKEY_DB);
-        config_duplicate_db = config_getstring(IMAPOPT_DUPLICATE_DB);
+        config_duplicate_db = sharded_db(config_getstring(IMAPOPT_DUPLICATE_DB),
+                                         IMAPOPT_DUPLICATE_DB_SHARDS);
         config_tls_sessions_db = config_getstring(IMAPOPT_TLS_SESSIONS_DB);
         config_ptscache_db = config_getstring(IMAPOPT_PTSCACHE_DB);
-        config_statuscache_db = config_getstring(IMAPOPT_STATUSCACHE_DB);
+        config_statuscache_db = sharded_db(config_getstring(IMAPOPT_STATUSCACHE_DB),
+                                           IMAPOPT_STATUSCACHE_DB_SHARDS);
         config_userdeny_db = config_getstring(IMAPOPT_USERDENY_DB);
         config_zoneinfo_db = config_getstring(IMAPOPT_ZONEINFO_DB);
         config_conversations_db = config_getstring(IMAPOPT_CONVERSATIONS_DB);
@@ -316,6 +337,8 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
                                   config_getswitch(IMAPOPT_SQL_USESSL));
         libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
                                   config_getswitch(IMAPOPT_SKIPLIST_ALWAYS_CHECKPOINT));
+        libcyrus_config_setint(CYRUSOPT_SHARDED_DB_DEPTH,
+                               config_getint(IMAPOPT_SHARDED_DB_DEPTH));
 
         /* Not until all configuration parameters are set! */
         libcyrus_init();
@@ -59,7 +59,7 @@
 #include "global.h"
 #include "mboxlist.h"
 #include "xmalloc.h"
-#include "hash.h"
+#include "hashmap.h"
 #include "exitcodes.h"
 
 extern int optind;
@@ -74,7 +74,7 @@ struct ientry {
     time_t itime;
     struct ientry *next;
 };
-static struct hash_table itable;
+static hashmap_t itable = HASHMAP_INITIALIZER;
 
 EXPORTED void fatal(const char *msg, int err)
 {
@@ -87,21 +87,13 @@ EXPORTED void fatal(const char *msg, int err)
     exit(err);
 }
 
-static int mbox_count_cb(const mbentry_t *mbentry __attribute__((unused)), void *rockp)
-{
-    int *ip = (int *) rockp;
-    (*ip)++;
-
-    return 0;
-}
-
 /* remove an ientry from list of those idling on mboxname */
 static void remove_ientry(const char *mboxname,
                           const struct sockaddr_un *remote)
 {
     struct ientry *t, *p = NULL;
 
-    t = (struct ientry *) hash_lookup(mboxname, &itable);
+    t = (struct ientry *) hashmap_lookup(mboxname, &itable);
     while (t && memcmp(&t->remote, remote, sizeof(*remote))) {
         p = t;
         t = t->next;
@@ -114,7 +106,8 @@ static void remove_ientry(const char *mboxname,
 
             /* we just removed the data that the hash entry
                was pointing to, so insert the new data */
-            hash_insert(mboxname, p, &itable);
+            if (p) hashmap_insert(mboxname, p, &itable);
+            else hashmap_del(mboxname, &itable);
         }
         else {
             /* not the first ientry in the linked list */
@@ -139,12 +132,12 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
                    idle_id_from_addr(remote), msg->mboxname);
 
         /* add an ientry to list of those idling on mboxname */
-        t = (struct ientry *) hash_lookup(msg->mboxname, &itable);
+        t = (struct ientry *) hashmap_lookup(msg->mboxname, &itable);
         n = (struct ientry *) xzmalloc(sizeof(struct ientry));
         n->remote = *remote;
         n->itime = time(NULL);
         n->next = t;
-        hash_insert(msg->mboxname, n, &itable);
+        hashmap_insert(msg->mboxname, n, &itable);
         break;
 
     case IDLE_MSG_NOTIFY:
@@ -152,7 +145,7 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
             syslog(LOG_DEBUG, "IDLE_MSG_NOTIFY '%s'\n", msg->mboxname);
 
         /* send a message to all clients idling on mboxname */
-        t = (struct ientry *) hash_lookup(msg->mboxname, &itable);
+        t = (struct ientry *) hashmap_lookup(msg->mboxname, &itable);
         for ( ; t ; t = n) {
             n = t->next;
             if ((t->itime + idle_timeout) < time(NULL)) {
@@ -250,7 +243,17 @@ static void send_alert(const char *key,
 static void shut_down(int ec) __attribute__((noreturn));
 static void shut_down(int ec)
 {
-    hash_enumerate(&itable, send_alert, NULL);
+    /* send_alert() forgets idlers which have gone away, and the table
+     * can't be changed while it is being enumerated */
+    strarray_t *keys = hashmap_keys(&itable);
+    int i;
+
+    for (i = 0; i < keys->count; i++) {
+        const char *key = strarray_nth(keys, i);
+        send_alert(key, hashmap_lookup(key, &itable), NULL);
+    }
+    strarray_free(keys);
+
     idle_done_sock();
     cyrus_done();
     exit(ec);
@@ -260,7 +263,6 @@ int main(int argc, char **argv)
 {
     char *p = NULL;
     int opt;
-    int nmbox = 0;
     int s;
     struct sockaddr_un local;
     fd_set read_set, rset;
@@ -294,18 +296,12 @@ int main(int argc, char **argv)
     if (idle_timeout < 30) idle_timeout = 30;
     idle_timeout *= 60;
 
-    /* count the number of mailboxes */
-    mboxlist_init(0);
-    mboxlist_open(NULL);
-    mboxlist_allmbox("", &mbox_count_cb, &nmbox, /*incdel*/0);
-    mboxlist_close();
-    mboxlist_done();
-
     signals_set_shutdown(shut_down);
     signals_add_handlers(0);
 
-    /* create idle table -- +1 to avoid a zero value */
-    construct_hash_table(&itable, nmbox + 1, 1);
+    /* the idle table grows with the number of mailboxes being idled
+     * on, so there's no need to size it from mailboxes.db */
+    construct_hashmap(&itable, 0, 0);
 
     if (!idle_make_server_address(&local) ||
         !idle_init_sock(&local)) {
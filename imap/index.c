@@ -74,6 +74,7 @@
 #include "search_engines.h"
 #include "search_query.h"
 #include "seen.h"
+#include "sortcache.h"
 #include "statuscache.h"
 #include "strhash.h"
 #include "user.h"
@@ -108,11 +109,11 @@ struct index_modified_flags {
 
 static int index_writeseen(struct index_state *state);
 static void index_fetchmsg(struct index_state *state,
-                    const struct buf *msg,
+                    const struct buf *msg, const char *fname,
                     unsigned offset, unsigned size,
                     unsigned start_octet, unsigned octet_count);
 static int index_fetchsection(struct index_state *state, const char *resp,
-                              const struct buf *msg,
+                              const struct buf *msg, const char *fname,
                               char *section,
                               const char *cachestr, unsigned size,
                               unsigned start_octet, unsigned octet_count);
@@ -133,6 +134,10 @@ static void index_fetchcacheheader(struct index_state *state, struct index_recor
                                    unsigned octet_count);
 static void index_listflags(struct index_state *state);
 static void index_fetchflags(struct index_state *state, uint32_t msgno);
+static int index_fetch_isstatic(const struct fetchargs *fetchargs);
+static void index_fetchreply_static(struct index_state *state, uint32_t msgno,
+                                    const struct fetchargs *fetchargs,
+                                    struct buf *resp);
 
 static int index_copysetup(struct index_state *state, uint32_t msgno,
                            struct copyargs *copyargs);
@@ -150,12 +155,18 @@ static char *get_localpart_addr(const char *header);
 static char *get_displayname(const char *header);
 static char *index_extract_subject(const char *subj, size_t len, int *is_refwd);
 static char *_index_extract_subject(char *s, int *is_refwd);
+static void get_ids(char **msgidp, strarray_t *refs,
+                    char *envtokens[], const char *headers, unsigned size);
+static void index_fill_msgid(MsgData *msgdata);
 static void index_get_ids(MsgData *msgdata,
                           char *envtokens[], const char *headers, unsigned size);
 
 static int index_sort_compare(MsgData *md1, MsgData *md2,
                               const struct sortcrit *call_data);
 static int index_sort_compare_qsort(const void *v1, const void *v2);
+static int is_mutable_ordering(struct sortcrit *sortcrit,
+                               struct searchargs *searchargs);
+static void index_lastsort_free(struct index_lastsort **lsp);
 
 static void *index_thread_getnext(Thread *thread);
 static void index_thread_setnext(Thread *thread, Thread *next);
@@ -274,6 +285,7 @@ EXPORTED void index_close(struct index_state **stateptr)
 
     index_release(state);
 
+    index_lastsort_free(&state->lastsort);
     free(state->map);
     free(state->mboxname);
     free(state->userid);
@@ -1078,6 +1090,21 @@ EXPORTED void index_fetchresponses(struct index_state *state,
     if (start < 1) start = 1;
     if (end > state->exists) end = state->exists;
 
+    if (index_fetch_isstatic(fetchargs)) {
+        struct buf resp = BUF_INITIALIZER;
+
+        for (msgno = start; msgno <= end; msgno++) {
+            im = &state->map[msgno-1];
+            if (seq && !seqset_ismember(seq, usinguid ? im->uid : msgno))
+                continue;
+            index_fetchreply_static(state, msgno, fetchargs, &resp);
+            fetched = 1;
+        }
+
+        buf_free(&resp);
+        goto done;
+    }
+
     for (msgno = start; msgno <= end; msgno++) {
         im = &state->map[msgno-1];
         if (seq && !seqset_ismember(seq, usinguid ? im->uid : msgno))
@@ -1087,6 +1114,7 @@ EXPORTED void index_fetchresponses(struct index_state *state,
         fetched = 1;
     }
 
+done:
     if (fetchedsomething) *fetchedsomething = fetched;
     annotate_putdb(&annot_db);
 }
@@ -1862,6 +1890,168 @@ out:
     return nmsg;
 }
 
+/*
+ * The result of the last SORT on this index, if its ordering can't be
+ * changed by anything but messages arriving or being expunged.
+ * Repeating the same SORT only has to load and insert the new
+ * messages and drop the expunged ones.
+ *
+ * The MsgData for every message it has loaded stays in memory until
+ * another SORT replaces it or the mailbox is closed, so it is only
+ * kept while that's at most sort_incremental_limit messages.
+ */
+struct index_lastsort {
+    char *sortcrit;         /* sortcrit_as_string() */
+    char *search;           /* search_expr_serialise() of the criteria */
+    uint32_t uidvalidity;
+    uint32_t last_uid;      /* all UIDs up to here have been considered */
+    ptrarray_t msgdata;     /* MsgData *, in sorted order */
+    ptrarray_t saved;       /* struct search_saved_msgdata *, to free */
+    unsigned nloaded;       /* number of MsgData in 'saved' */
+};
+
+static void index_lastsort_free(struct index_lastsort **lsp)
+{
+    struct index_lastsort *ls = *lsp;
+    int i;
+
+    if (!ls) return;
+
+    for (i = 0 ; i < ls->saved.count ; i++) {
+        struct search_saved_msgdata *saved = ptrarray_nth(&ls->saved, i);
+        index_msgdata_free(saved->msgdata, saved->n);
+        free(saved);
+    }
+    ptrarray_fini(&ls->saved);
+    ptrarray_fini(&ls->msgdata);
+    free(ls->sortcrit);
+    free(ls->search);
+    free(ls);
+    *lsp = NULL;
+}
+
+static uint32_t index_lastuid_seen(struct index_state *state)
+{
+    return state->exists ? state->map[state->exists-1].uid : 0;
+}
+
+/* keep the result of a SORT which has just run, taking over its MsgData */
+static void index_lastsort_save(struct index_state *state,
+                                search_query_t *query,
+                                char *sortcrit, char *search)
+{
+    struct index_lastsort *ls;
+    int i;
+
+    index_lastsort_free(&state->lastsort);
+
+    ls = xzmalloc(sizeof(struct index_lastsort));
+    ls->sortcrit = sortcrit;
+    ls->search = search;
+    ls->uidvalidity = state->mailbox->i.uidvalidity;
+    ls->last_uid = index_lastuid_seen(state);
+
+    for (i = 0 ; i < query->merged_msgdata.count ; i++) {
+        MsgData *md = ptrarray_nth(&query->merged_msgdata, i);
+        md->folder = NULL;  /* goes away with the query */
+        ptrarray_append(&ls->msgdata, md);
+    }
+
+    ls->saved = query->saved_msgdata;
+    ptrarray_init(&query->saved_msgdata);
+    for (i = 0 ; i < ls->saved.count ; i++) {
+        struct search_saved_msgdata *saved = ptrarray_nth(&ls->saved, i);
+        ls->nloaded += saved->n;
+    }
+
+    state->lastsort = ls;
+}
+
+/*
+ * Bring the last SORT up to date, if it was the same SORT as this one.
+ * Returns 1 if state->lastsort->msgdata is now the answer.
+ */
+static int index_lastsort_update(struct index_state *state,
+                                 const struct sortcrit *sortcrit,
+                                 struct searchargs *searchargs,
+                                 const char *critstr, const char *search)
+{
+    struct index_lastsort *ls = state->lastsort;
+    struct search_saved_msgdata *saved;
+    unsigned *msgno_list = NULL;
+    unsigned nmsg = 0;
+    uint32_t msgno;
+    MsgData **msgdata;
+    int i, k;
+
+    if (!ls) return 0;
+
+    if (strcmp(ls->sortcrit, critstr) || strcmp(ls->search, search) ||
+        ls->uidvalidity != state->mailbox->i.uidvalidity ||
+        ls->nloaded > 2 * (unsigned) ls->msgdata.count + 1024 ||
+        (int) ls->nloaded > config_getint(IMAPOPT_SORT_INCREMENTAL_LIMIT)) {
+        index_lastsort_free(&state->lastsort);
+        return 0;
+    }
+
+    /* drop the messages which have gone, and renumber the rest */
+    for (i = 0, k = 0 ; i < ls->msgdata.count ; i++) {
+        MsgData *md = ptrarray_nth(&ls->msgdata, i);
+        msgno = index_finduid(state, md->uid);
+        if (!msgno || state->map[msgno-1].uid != md->uid ||
+            (state->map[msgno-1].system_flags & FLAG_EXPUNGED))
+            continue;
+        md->msgno = msgno;
+        ls->msgdata.data[k++] = md;
+    }
+    ls->msgdata.count = k;
+
+    /* find the new messages which match */
+    msgno = index_finduid(state, ls->last_uid) + 1;
+    if (msgno <= state->exists) {
+        msgno_list = xmalloc((state->exists - msgno + 1) * sizeof(unsigned));
+        search_expr_internalise(state, searchargs->root);
+        for ( ; msgno <= state->exists ; msgno++) {
+            if (state->map[msgno-1].system_flags & FLAG_EXPUNGED)
+                continue;
+            if (!index_search_evaluate(state, searchargs->root, msgno))
+                continue;
+            msgno_list[nmsg++] = msgno;
+        }
+    }
+
+    if (nmsg) {
+        msgdata = index_msgdata_load(state, msgno_list, nmsg, sortcrit, 0, NULL);
+
+        /* binary insertion: the comparison is a total order (it ends
+         * with the message number), so we land exactly where a full
+         * sort would have put each one */
+        for (i = 0 ; i < (int) nmsg ; i++) {
+            int low = 0, high = ls->msgdata.count;
+            while (low < high) {
+                int mid = low + (high - low) / 2;
+                if (index_sort_compare(ptrarray_nth(&ls->msgdata, mid),
+                                       msgdata[i], sortcrit) < 0)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+            ptrarray_insert(&ls->msgdata, low, msgdata[i]);
+        }
+
+        saved = xzmalloc(sizeof(*saved));
+        saved->msgdata = msgdata;
+        saved->n = nmsg;
+        ptrarray_append(&ls->saved, saved);
+        ls->nloaded += nmsg;
+    }
+    free(msgno_list);
+
+    ls->last_uid = index_lastuid_seen(state);
+
+    return 1;
+}
+
 /*
  * Performs a SORT command
  */
@@ -1874,6 +2064,10 @@ EXPORTED int index_sort(struct index_state *state,
     modseq_t highestmodseq = 0;
     search_query_t *query = NULL;
     search_folder_t *folder = NULL;
+    ptrarray_t *sorted;
+    char *critstr = NULL;
+    char *search = NULL;
+    int limit = config_getint(IMAPOPT_SORT_INCREMENTAL_LIMIT);
     int r;
 
     /* update the index */
@@ -1882,6 +2076,20 @@ EXPORTED int index_sort(struct index_state *state,
 
     highestmodseq = needs_modseq(searchargs, NULL);
 
+    /* an ordering which only arrivals and expunges can change can be
+     * brought up to date rather than worked out again */
+    if (!highestmodseq &&
+        !is_mutable_ordering((struct sortcrit *)sortcrit, searchargs)) {
+        critstr = sortcrit_as_string(sortcrit);
+        search = search_expr_serialise(searchargs->root);
+        if (index_lastsort_update(state, sortcrit, searchargs,
+                                  critstr, search)) {
+            sorted = &state->lastsort->msgdata;
+            nmsg = sorted->count;
+            goto output;
+        }
+    }
+
     /* Search for messages based on the given criteria */
     query = search_query_new(state, searchargs);
     query->sortcrit = sortcrit;
@@ -1894,13 +2102,15 @@ EXPORTED int index_sort(struct index_state *state,
             highestmodseq = search_folder_get_highest_modseq(folder);
         nmsg = search_folder_get_count(folder);
     }
+    sorted = &query->merged_msgdata;
 
+output:
     prot_printf(state->out, "* SORT");
 
     if (nmsg) {
         /* Output the sorted messages */
-        for (i = 0 ; i < query->merged_msgdata.count ; i++) {
-            MsgData *md = ptrarray_nth(&query->merged_msgdata, i);
+        for (i = 0 ; i < sorted->count ; i++) {
+            MsgData *md = ptrarray_nth(sorted, i);
             prot_printf(state->out, " %u",
                         (usinguid ? md->uid : md->msgno));
         }
@@ -1911,8 +2121,16 @@ EXPORTED int index_sort(struct index_state *state,
 
     prot_printf(state->out, "\r\n");
 
+    if (query && critstr && !query->multiple && !query->folder_count &&
+        limit > 0 && sorted->count <= limit) {
+        index_lastsort_save(state, query, critstr, search);
+        critstr = search = NULL;
+    }
+
 out:
     search_query_free(query);
+    free(critstr);
+    free(search);
     return nmsg;
 }
 
@@ -2779,6 +2997,21 @@ out:
     return nmsg;
 }
 
+/* keep a client waiting on a long COPY or MOVE informed.  We're called
+ * with both mailboxes locked, so never wait on the client here: what it
+ * isn't ready to read yet is spooled by the protstream, and goes out
+ * with the tagged response once the locks are released */
+static void index_copy_progress(int done, int total, void *rock)
+{
+    struct index_state *state = (struct index_state *) rock;
+    int blocking = prot_IS_BLOCKING(state->out);
+
+    prot_NONBLOCK(state->out);
+    prot_printf(state->out, "* OK Copying %d of %d messages\r\n", done, total);
+    prot_flush_internal(state->out, 0);
+    if (blocking) prot_BLOCK(state->out);
+}
+
 /*
  * Performs a COPY command
  */
@@ -2861,6 +3094,11 @@ index_copy(struct index_state *state,
 
     docopyuid = (appendstate.myrights & ACL_READ);
 
+    if (state->out) {
+        appendstate.copy_progress = index_copy_progress;
+        appendstate.copy_progress_rock = state;
+    }
+
     r = append_copy(srcmailbox, &appendstate, copyargs.nummsg,
                     copyargs.records, nolink, is_same_user);
     if (r) {
@@ -2980,7 +3218,7 @@ static int index_appendremote(struct index_state *state, uint32_t msgno,
     prot_printf(pout, ") \"%s\" ", datebuf);
 
     /* message literal */
-    index_fetchmsg(state, &buf, 0, record.size, 0, 0);
+    index_fetchmsg(state, &buf, NULL, 0, record.size, 0, 0);
 
     /* close the message file */
     buf_free(&buf);
@@ -3065,9 +3303,11 @@ static int data_domain(const char *p, size_t n)
  * of size 'msg_size', starting at 'offset' and containing 'size'
  * octets.  If 'octet_count' is nonzero, the data is
  * further constrained by 'start_octet' and 'octet_count' as per the
- * IMAP command PARTIAL.
+ * IMAP command PARTIAL.  If 'msg' is a mapping of the file 'fname',
+ * a large literal is sent straight from the file.
  */
 void index_fetchmsg(struct index_state *state, const struct buf *msg,
+                    const char *fname,
                     unsigned offset,
                     unsigned size,     /* this is the correct size for a news message after
                                           having LF translated to CRLF */
@@ -3125,7 +3365,17 @@ void index_fetchmsg(struct index_state *state, const struct buf *msg,
     /* Non-text literal -- tell the protstream about it */
     if (domain != DOMAIN_7BIT) prot_data_boundary(state->out);
 
-    prot_write(state->out, msg->s + offset, n);
+    if (fname && prot_cansendfile(state->out, n)) {
+        int fd = open(fname, O_RDONLY, 0);
+        if (fd == -1) fname = NULL;
+        else {
+            prot_sendfile(state->out, fd, offset, n);
+            close(fd);
+        }
+    }
+    else fname = NULL;
+    if (!fname) prot_write(state->out, msg->s + offset, n);
+
     while (n++ < size) {
         /* File too short, resynch client.
          *
@@ -3143,7 +3393,7 @@ void index_fetchmsg(struct index_state *state, const struct buf *msg,
  * Helper function to fetch a body section
  */
 static int index_fetchsection(struct index_state *state, const char *resp,
-                              const struct buf *inmsg,
+                              const struct buf *inmsg, const char *fname,
                               char *section, const char *cachestr, unsigned size,
                               unsigned start_octet, unsigned octet_count)
 {
@@ -3164,7 +3414,7 @@ static int index_fetchsection(struct index_state *state, const char *resp,
             prot_printf(state->out, "%s%u", resp, size);
         } else {
             prot_printf(state->out, "%s", resp);
-            index_fetchmsg(state, &msg, 0, size,
+            index_fetchmsg(state, &msg, fname, 0, size,
                            start_octet, octet_count);
         }
         return 0;
@@ -3245,6 +3495,9 @@ static int index_fetchsection(struct index_state *state, const char *resp,
         msg.s = (char *)charset_decode_mimebody(msg.s + offset, size, encoding,
                                                 &decbuf, &newsize);
 
+        /* the decoded data isn't in the file */
+        fname = NULL;
+
         if (!msg.s) {
             /* failed to decode */
             if (decbuf) free(decbuf);
@@ -3266,7 +3519,7 @@ static int index_fetchsection(struct index_state *state, const char *resp,
 
     /* Output body part */
     prot_printf(state->out, "%s", resp);
-    index_fetchmsg(state, &msg, offset, size,
+    index_fetchmsg(state, &msg, fname, offset, size,
                    start_octet, octet_count);
 
     if (decbuf) free(decbuf);
@@ -3724,38 +3977,38 @@ static int index_fetchannotations(struct index_state *state,
  * Does not send the terminating close paren or CRLF.
  * Also sends preceeding * FLAGS if necessary.
  */
-static void index_fetchflags(struct index_state *state,
-                             uint32_t msgno)
+static void index_fetchflags_buf(struct index_state *state,
+                                 uint32_t msgno, struct buf *buf)
 {
     int sepchar = '(';
     unsigned flag;
     bit32 flagmask = 0;
     struct index_map *im = &state->map[msgno-1];
 
-    prot_printf(state->out, "* %u FETCH (FLAGS ", msgno);
+    buf_printf(buf, "* %u FETCH (FLAGS ", msgno);
 
     if (im->isrecent) {
-        prot_printf(state->out, "%c\\Recent", sepchar);
+        buf_printf(buf, "%c\\Recent", sepchar);
         sepchar = ' ';
     }
     if (im->system_flags & FLAG_ANSWERED) {
-        prot_printf(state->out, "%c\\Answered", sepchar);
+        buf_printf(buf, "%c\\Answered", sepchar);
         sepchar = ' ';
     }
     if (im->system_flags & FLAG_FLAGGED) {
-        prot_printf(state->out, "%c\\Flagged", sepchar);
+        buf_printf(buf, "%c\\Flagged", sepchar);
         sepchar = ' ';
     }
     if (im->system_flags & FLAG_DRAFT) {
-        prot_printf(state->out, "%c\\Draft", sepchar);
+        buf_printf(buf, "%c\\Draft", sepchar);
         sepchar = ' ';
     }
     if (im->system_flags & FLAG_DELETED) {
-        prot_printf(state->out, "%c\\Deleted", sepchar);
+        buf_printf(buf, "%c\\Deleted", sepchar);
         sepchar = ' ';
     }
     if (im->isseen) {
-        prot_printf(state->out, "%c\\Seen", sepchar);
+        buf_printf(buf, "%c\\Seen", sepchar);
         sepchar = ' ';
     }
     for (flag = 0; flag < VECTOR_SIZE(state->flagname); flag++) {
@@ -3763,15 +4016,25 @@ static void index_fetchflags(struct index_state *state,
             flagmask = im->user_flags[flag/32];
         }
         if (state->flagname[flag] && (flagmask & (1<<(flag & 31)))) {
-            prot_printf(state->out, "%c%s", sepchar, state->flagname[flag]);
+            buf_printf(buf, "%c%s", sepchar, state->flagname[flag]);
             sepchar = ' ';
         }
     }
-    if (sepchar == '(') (void)prot_putc('(', state->out);
-    (void)prot_putc(')', state->out);
+    if (sepchar == '(') buf_putc(buf, '(');
+    buf_putc(buf, ')');
     im->told_modseq = im->modseq;
 }
 
+static void index_fetchflags(struct index_state *state,
+                             uint32_t msgno)
+{
+    struct buf buf = BUF_INITIALIZER;
+
+    index_fetchflags_buf(state, msgno, &buf);
+    prot_putbuf(state->out, &buf);
+    buf_free(&buf);
+}
+
 static void index_printflags(struct index_state *state,
                              uint32_t msgno, int usinguid,
                              int printmodseq)
@@ -3789,6 +4052,124 @@ static void index_printflags(struct index_state *state,
     prot_printf(state->out, ")\r\n");
 }
 
+/* FETCH items which come straight from the index record and the cache */
+#define FETCH_STATIC_ITEMS (FETCH_UID|FETCH_INTERNALDATE|FETCH_SIZE| \
+                            FETCH_FLAGS|FETCH_ENVELOPE|FETCH_BODYSTRUCTURE| \
+                            FETCH_BODY|FETCH_MODSEQ|FETCH_GUID)
+
+static int index_fetch_isstatic(const struct fetchargs *fetchargs)
+{
+    if (!(fetchargs->fetchitems & FETCH_STATIC_ITEMS)) return 0;
+    if (fetchargs->fetchitems & ~FETCH_STATIC_ITEMS) return 0;
+
+    return !fetchargs->fsections && !fetchargs->bodysections &&
+           !fetchargs->binsections && !fetchargs->sizesections &&
+           !fetchargs->headers.count && !fetchargs->headers_not.count &&
+           !fetchargs->cidhash && !fetchargs->cache_atleast;
+}
+
+/*
+ * index_fetchreply() for a FETCH of only FETCH_STATIC_ITEMS, which is
+ * what clients ask for when they first sync a mailbox.  The small items
+ * are formatted into 'resp' and the cached ENVELOPE, BODYSTRUCTURE and
+ * BODY, which are already in wire format, go to the output straight
+ * from the cache file mapping, so each message is a handful of writes
+ * into the protstream.  The bytes sent must be exactly those
+ * index_fetchreply() would send.
+ */
+static void index_fetchreply_static(struct index_state *state, uint32_t msgno,
+                                    const struct fetchargs *fetchargs,
+                                    struct buf *resp)
+{
+    struct mailbox *mailbox = state->mailbox;
+    int fetchitems = fetchargs->fetchitems;
+    struct index_map *im = &state->map[msgno-1];
+    struct index_record record;
+    int sepchar = '(';
+    int ischanged;
+
+    /* Check the modseq against changedsince */
+    if (fetchargs->changedsince && im->modseq <= fetchargs->changedsince)
+        return;
+
+    /* skip missing records entirely */
+    if (!im->recno)
+        return;
+
+    if (index_reload_record(state, msgno, &record)) {
+        prot_printf(state->out, "* OK ");
+        prot_printf(state->out, error_message(IMAP_NO_MSGGONE), msgno);
+        prot_printf(state->out, "\r\n");
+        return;
+    }
+
+    ischanged = im->told_modseq < record.modseq;
+    buf_reset(resp);
+
+    if (fetchitems & FETCH_FLAGS || ischanged) {
+        index_fetchflags_buf(state, msgno, resp);
+        sepchar = ' ';
+    }
+    else {
+        buf_printf(resp, "* %u FETCH ", msgno);
+    }
+    if (fetchitems & FETCH_UID || (ischanged && (client_capa & CAPA_QRESYNC))) {
+        buf_printf(resp, "%cUID %u", sepchar, record.uid);
+        sepchar = ' ';
+    }
+    if (fetchitems & FETCH_GUID) {
+        buf_printf(resp, "%cDIGEST.SHA1 %s", sepchar,
+                   message_guid_encode(&record.guid));
+        sepchar = ' ';
+    }
+    if (fetchitems & FETCH_INTERNALDATE) {
+        char datebuf[RFC3501_DATETIME_MAX+1];
+
+        time_to_rfc3501(record.internaldate, datebuf, sizeof(datebuf));
+        buf_printf(resp, "%cINTERNALDATE \"%s\"", sepchar, datebuf);
+        sepchar = ' ';
+    }
+    if (fetchitems & FETCH_MODSEQ || (ischanged && (client_capa & CAPA_CONDSTORE))) {
+        buf_printf(resp, "%cMODSEQ (" MODSEQ_FMT ")", sepchar, record.modseq);
+        sepchar = ' ';
+    }
+    if (fetchitems & FETCH_SIZE) {
+        buf_printf(resp, "%cRFC822.SIZE %u", sepchar, record.size);
+        sepchar = ' ';
+    }
+
+    if ((fetchitems & (FETCH_ENVELOPE|FETCH_BODYSTRUCTURE|FETCH_BODY)) &&
+        !mailbox_cacherecord(mailbox, &record)) {
+        static const struct {
+            int item;
+            const char *name;
+            int field;
+        } cached[] = {
+            { FETCH_ENVELOPE,      "ENVELOPE",      CACHE_ENVELOPE },
+            { FETCH_BODYSTRUCTURE, "BODYSTRUCTURE", CACHE_BODYSTRUCTURE },
+            { FETCH_BODY,          "BODY",          CACHE_BODY },
+            { 0, NULL, 0 }
+        };
+        int i;
+
+        for (i = 0; cached[i].item; i++) {
+            if (!(fetchitems & cached[i].item)) continue;
+            buf_printf(resp, "%c%s ", sepchar, cached[i].name);
+            sepchar = ' ';
+            prot_putbuf(state->out, resp);
+            buf_reset(resp);
+            prot_write(state->out, cacheitem_base(&record, cached[i].field),
+                       cacheitem_size(&record, cached[i].field));
+        }
+    }
+
+    if (sepchar != '(') {
+        /* finsh the response if we have one */
+        buf_appendcstr(resp, ")\r\n");
+    }
+    prot_putbuf(state->out, resp);
+}
+
 /*
  * Helper function to send requested * FETCH data for a message
  */
@@ -3804,6 +4185,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     struct section *section;
     struct fieldlist *fsection;
     char respbuf[100];
+    char *msgfname = NULL;
     int r = 0;
     struct index_map *im = &state->map[msgno-1];
     struct index_record record;
@@ -3842,6 +4224,10 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
             prot_printf(state->out, "\r\n");
             return 0;
         }
+
+        /* large literals can be sent straight from the file */
+        if (prot_cansendfile(state->out, PROT_SENDFILE_MIN))
+            msgfname = xstrdup(mailbox_record_fname(mailbox, &record));
     }
     int ischanged = im->told_modseq < record.modseq;
 
@@ -3963,7 +4349,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     if (fetchitems & FETCH_HEADER) {
         prot_printf(state->out, "%cRFC822.HEADER ", sepchar);
         sepchar = ' ';
-        index_fetchmsg(state, &buf, 0,
+        index_fetchmsg(state, &buf, msgfname, 0,
                        record.header_size,
                        (fetchitems & FETCH_IS_PARTIAL) ?
                          fetchargs->start_octet : 0,
@@ -3985,7 +4371,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     if (fetchitems & FETCH_TEXT) {
         prot_printf(state->out, "%cRFC822.TEXT ", sepchar);
         sepchar = ' ';
-        index_fetchmsg(state, &buf,
+        index_fetchmsg(state, &buf, msgfname,
                        record.header_size, record.size - record.header_size,
                        (fetchitems & FETCH_IS_PARTIAL) ?
                          fetchargs->start_octet : 0,
@@ -3995,7 +4381,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     if (fetchitems & FETCH_RFC822) {
         prot_printf(state->out, "%cRFC822 ", sepchar);
         sepchar = ' ';
-        index_fetchmsg(state, &buf, 0, record.size,
+        index_fetchmsg(state, &buf, msgfname, 0, record.size,
                        (fetchitems & FETCH_IS_PARTIAL) ?
                          fetchargs->start_octet : 0,
                        (fetchitems & FETCH_IS_PARTIAL) ?
@@ -4050,7 +4436,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
         oi = &section->octetinfo;
 
         if (!mailbox_cacherecord(mailbox, &record)) {
-            r = index_fetchsection(state, respbuf, &buf,
+            r = index_fetchsection(state, respbuf, &buf, msgfname,
                                    section->name, cacheitem_base(&record, CACHE_SECTION),
                                    record.size,
                                    (fetchitems & FETCH_IS_PARTIAL) ?
@@ -4071,7 +4457,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 
         if (!mailbox_cacherecord(mailbox, &record)) {
             oi = &section->octetinfo;
-            r = index_fetchsection(state, respbuf, &buf,
+            r = index_fetchsection(state, respbuf, &buf, msgfname,
                                    section->name, cacheitem_base(&record, CACHE_SECTION),
                                    record.size,
                                    (fetchitems & FETCH_IS_PARTIAL) ?
@@ -4091,7 +4477,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
                  "%cBINARY.SIZE[%s ", sepchar, section->name);
 
         if (!mailbox_cacherecord(mailbox, &record)) {
-            r = index_fetchsection(state, respbuf, &buf,
+            r = index_fetchsection(state, respbuf, &buf, msgfname,
                                    section->name, cacheitem_base(&record, CACHE_SECTION),
                                    record.size,
                                    fetchargs->start_octet, fetchargs->octet_count);
@@ -4103,6 +4489,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
         prot_printf(state->out, ")\r\n");
     }
     buf_free(&buf);
+    free(msgfname);
 
     return r;
 }
@@ -4742,6 +5129,87 @@ static int index_copysetup(struct index_state *state, uint32_t msgno,
     return 0;
 }
 
+/* keys which come from parsing cached headers, see sortcache.h */
+static int is_sortcache_key(int label)
+{
+    switch (label) {
+    case SORT_CC:
+    case SORT_FROM:
+    case SORT_SUBJECT:
+    case SORT_TO:
+    case SORT_DISPLAYFROM:
+    case SORT_DISPLAYTO:
+    case LOAD_IDS:
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Fill in all the header-derived sort keys of 'cur' from the sort key
+ * cache, working them out from the cache record and saving them first
+ * if this message hasn't been seen before.
+ */
+static int index_sortcache_load(struct sortcache *sortcache,
+                                struct mailbox *mailbox,
+                                struct index_record *record,
+                                MsgData *cur)
+{
+    struct sortcache_keys keys;
+    int r;
+
+    r = sortcache_fetch(sortcache, record->uid, &keys);
+    if (r == CYRUSDB_NOTFOUND) {
+        if (mailbox_cacherecord(mailbox, record))
+            return IMAP_IOERROR;
+
+        keys.is_refwd = 0;
+        keys.xsubj = index_extract_subject(cacheitem_base(record, CACHE_SUBJECT),
+                                           cacheitem_size(record, CACHE_SUBJECT),
+                                           &keys.is_refwd);
+        keys.from = get_localpart_addr(cacheitem_base(record, CACHE_FROM));
+        keys.to = get_localpart_addr(cacheitem_base(record, CACHE_TO));
+        keys.cc = get_localpart_addr(cacheitem_base(record, CACHE_CC));
+        keys.displayfrom = get_displayname(cacheitem_base(record, CACHE_FROM));
+        keys.displayto = get_displayname(cacheitem_base(record, CACHE_TO));
+
+        strarray_init(&keys.ref);
+        keys.msgid = NULL;
+        if (cacheitem_size(record, CACHE_ENVELOPE) > 2) {
+            char *envtokens[NUMENVTOKENS];
+            /* strip the outer ()'s, as index_msgdata_load() does */
+            char *tmpenv = xstrndup(cacheitem_base(record, CACHE_ENVELOPE) + 1,
+                                    cacheitem_size(record, CACHE_ENVELOPE) - 2);
+            parse_cached_envelope(tmpenv, envtokens, VECTOR_SIZE(envtokens));
+            get_ids(&keys.msgid, &keys.ref, envtokens,
+                    cacheitem_base(record, CACHE_HEADERS),
+                    cacheitem_size(record, CACHE_HEADERS));
+            free(tmpenv);
+        }
+
+        /* not fatal, we'll just work them out again next time */
+        sortcache_store(sortcache, record->uid, &keys);
+    }
+    else if (r) {
+        return r;
+    }
+
+    /* hand the strings over */
+    cur->is_refwd = keys.is_refwd;
+    cur->xsubj = keys.xsubj;
+    cur->xsubj_hash = strhash(cur->xsubj);
+    cur->from = keys.from;
+    cur->to = keys.to;
+    cur->cc = keys.cc;
+    cur->displayfrom = keys.displayfrom;
+    cur->displayto = keys.displayto;
+    cur->msgid = keys.msgid;
+    cur->ref = keys.ref;
+    index_fill_msgid(cur);
+
+    return 0;
+}
+
 /*
  * Creates a list, and optionally also an array of pointers to, of msgdata.
  *
@@ -4757,15 +5225,23 @@ MsgData **index_msgdata_load(struct index_state *state,
     int i, j;
     char *tmpenv;
     char *envtokens[NUMENVTOKENS];
-    int did_cache, did_env, did_conv;
+    int did_cache, did_env, did_conv, did_keys;
     int label;
     struct mailbox *mailbox = state->mailbox;
     struct index_record record;
     struct conversations_state *cstate = NULL;
     conversation_t *conv = NULL;
+    struct sortcache *sortcache = NULL;
 
     if (!n) return NULL;
 
+    for (j = 0; sortcrit[j].key; j++) {
+        if (is_sortcache_key(sortcrit[j].key)) {
+            sortcache = sortcache_open(mailbox);
+            break;
+        }
+    }
+
     /* create an array of MsgData */
     ptrs = (MsgData **) xzmalloc(n * sizeof(MsgData *) + n * sizeof(MsgData));
     md = (MsgData *)(ptrs + n);
@@ -4796,9 +5272,15 @@ MsgData **index_msgdata_load(struct index_state *state,
         tmpenv = NULL;
         conv = NULL; /* XXX: use a hash to avoid re-reading? */
 
+        did_keys = sortcache &&
+            !index_sortcache_load(sortcache, mailbox, &record, cur);
+
         for (j = 0; sortcrit[j].key; j++) {
             label = sortcrit[j].key;
 
+            if (did_keys && is_sortcache_key(label))
+                continue;
+
             if ((label == SORT_CC || label == SORT_DATE ||
                  label == SORT_FROM || label == SORT_SUBJECT ||
                  label == SORT_TO || label == LOAD_IDS ||
@@ -4934,6 +5416,8 @@ MsgData **index_msgdata_load(struct index_state *state,
         conversation_free(conv);
     }
 
+    sortcache_close(&sortcache);
+
     return ptrs;
 }
 
@@ -5166,10 +5650,21 @@ static char *_index_extract_subject(char *s, int *is_refwd)
     return base;
 }
 
-/* Get message-id, and references/in-reply-to */
+/* Give a message without a Message-ID one, unique to this mailbox */
+static void index_fill_msgid(MsgData *msgdata)
+{
+    struct buf buf = BUF_INITIALIZER;
 
-void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers,
-                   unsigned size)
+    if (msgdata->msgid) return;
+
+    buf_printf(&buf, "<Empty-ID: %u>", msgdata->msgno);
+    msgdata->msgid = buf_release(&buf);
+}
+
+/* Get message-id (NULL if there isn't one), and references/in-reply-to */
+
+static void get_ids(char **msgidp, strarray_t *refs,
+                    char *envtokens[], const char *headers, unsigned size)
 {
     static struct buf buf;
     strarray_t refhdr = STRARRAY_INITIALIZER;
@@ -5178,13 +5673,7 @@ void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers,
     buf_reset(&buf);
 
     /* get msgid */
-    msgdata->msgid = find_msgid(envtokens[ENV_MSGID], NULL);
-     /* if we don't have one, create one */
-    if (!msgdata->msgid) {
-        buf_printf(&buf, "<Empty-ID: %u>", msgdata->msgno);
-        msgdata->msgid = xstrdup(buf.s);
-        buf_reset(&buf);
-    }
+    *msgidp = find_msgid(envtokens[ENV_MSGID], NULL);
 
     /* Copy headers to the buffer */
     buf_appendmap(&buf, headers, size);
@@ -5201,19 +5690,28 @@ void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers,
         refstr = buf.s;
         massage_header(refstr);
         while ((ref = find_msgid(refstr, &refstr)) != NULL)
-            strarray_appendm(&msgdata->ref, ref);
+            strarray_appendm(refs, ref);
     }
 
     /* if we have no references, try in-reply-to */
-    if (!msgdata->ref.count) {
+    if (!refs->count) {
         /* get in-reply-to id */
         in_reply_to = find_msgid(envtokens[ENV_INREPLYTO], NULL);
         /* if we have an in-reply-to id, make it the ref */
         if (in_reply_to)
-            strarray_appendm(&msgdata->ref, in_reply_to);
+            strarray_appendm(refs, in_reply_to);
     }
 }
 
+void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers,
+                   unsigned size)
+{
+    get_ids(&msgdata->msgid, &msgdata->ref, envtokens, headers, size);
+
+    /* if we don't have one, create one */
+    index_fill_msgid(msgdata);
+}
+
 /*
  * Function for comparing two integers.
  */
@@ -5594,15 +6092,11 @@ EXPORTED int find_thread_algorithm(char *arg)
  */
 static int thread_is_descendent(Thread *parent, Thread *child)
 {
-    Thread *kid;
-
-    /* self */
-    if (parent == child)
-        return 1;
-
-    /* search each child's decendents */
-    for (kid = parent->child; kid; kid = kid->next) {
-        if (thread_is_descendent(kid, child))
+    /* walk up from the child rather than searching the whole of the
+     * parent's subtree: the depth of a thread is usually far smaller
+     * than its size, and this is called for every reference */
+    for ( ; child; child = child->parent) {
+        if (child == parent)
             return 1;
     }
     return 0;
@@ -132,6 +132,7 @@ struct index_state {
     int want_dav;
     int want_expunged;
     unsigned num_expunged;
+    struct index_lastsort *lastsort;    /* to repeat the last SORT */
 };
 
 struct copyargs {
@@ -55,6 +55,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/wait.h>
 #include <utime.h>
 
 #ifdef HAVE_DIRENT_H
@@ -100,9 +101,11 @@
 #include "proc.h"
 #include "retry.h"
 #include "seen.h"
+#include "sortcache.h"
 #include "util.h"
 #include "sequence.h"
 #include "statuscache.h"
+#include "expirequeue.h"
 #include "strarray.h"
 #include "sync_log.h"
 #include "xmalloc.h"
@@ -132,6 +135,8 @@ static struct mailboxlist *open_mailboxes = NULL;
                          (m).index_fd = -1; \
                          (m).header_fd = -1; }
 
+struct modseqlog_entry;
+
 /* for repack */
 struct mailbox_repack {
     struct mailbox *mailbox;
@@ -141,6 +146,11 @@ struct mailbox_repack {
     int old_version;
     int newindex_fd;
     ptrarray_t caches;
+    struct modseqlog_entry *modseqlog;
+    uint32_t modseqlog_alloc;
+    uint32_t *uids;         /* live UIDs, to prune the sort key cache */
+    uint32_t num_uids;
+    uint32_t uids_alloc;
 };
 
 static int mailbox_index_unlink(struct mailbox *mailbox);
@@ -678,6 +688,78 @@ static int mailbox_append_cache(struct mailbox *mailbox,
     return 0;
 }
 
+/*
+ * Write the cache records for many appends to the end of their cache
+ * files, with one write per cache file.  Records whose cache has to be
+ * rebuilt from the message are left for mailbox_append_cache().
+ */
+static int mailbox_append_caches(struct mailbox *mailbox,
+                                 struct index_record *records, int n)
+{
+    struct iovec *iov = xmalloc(n * sizeof(struct iovec));
+    char *done = xzmalloc(n);
+    int i, j;
+    int r = 0;
+
+    assert(mailbox_index_islocked(mailbox, 1));
+
+    for (i = 0; i < n; i++) {
+        struct mappedfile *cachefile;
+        size_t offset, base;
+        int nio = 0;
+
+        if (done[i]) continue;
+        if (records[i].cache_offset || !records[i].crec.len ||
+            (records[i].system_flags & FLAG_UNLINKED))
+            continue;
+
+        cachefile = mailbox_cachefile(mailbox, &records[i]);
+        if (!cachefile) {
+            syslog(LOG_ERR, "Failed to open cache to %s for %u",
+                    mailbox->name, records[i].uid);
+            r = IMAP_IOERROR; /* unable to append */
+            break;
+        }
+
+        /* gather every record which goes to the same file */
+        base = offset = mappedfile_size(cachefile);
+        for (j = i; j < n; j++) {
+            if (done[j]) continue;
+            if (records[j].cache_offset || !records[j].crec.len ||
+                (records[j].system_flags & FLAG_UNLINKED))
+                continue;
+            if ((records[j].system_flags & FLAG_ARCHIVED) !=
+                (records[i].system_flags & FLAG_ARCHIVED))
+                continue;
+
+            iov[nio].iov_base = (char *) cache_base(&records[j]);
+            iov[nio].iov_len = cache_len(&records[j]);
+            records[j].cache_offset = offset;
+            offset += iov[nio].iov_len;
+            done[j] = 1;
+            nio++;
+        }
+
+        if (mappedfile_pwritev(cachefile, iov, nio, base) < 0) {
+            syslog(LOG_ERR, "failed to append " SIZE_T_FMT
+                   " bytes to cache for %s", offset - base, mailbox->name);
+            r = IMAP_IOERROR;
+            break;
+        }
+    }
+
+    if (r) {
+        /* none of them made it */
+        for (i = 0; i < n; i++)
+            if (done[i]) records[i].cache_offset = 0;
+    }
+
+    free(done);
+    free(iov);
+
+    return r;
+}
+
 EXPORTED int mailbox_cacherecord(struct mailbox *mailbox,
                                  const struct index_record *record)
 {
@@ -1760,15 +1842,29 @@ static void _store_change(struct mailbox *mailbox, struct index_record *record,
     change->flags = flags;
 }
 
-static int _commit_one(struct mailbox *mailbox, struct index_change *change)
+/* most index records written by one commit */
+#define COMMIT_RUN_MAX 1024
+
+/*
+ * Write out 'n' changes to consecutive records with a single write,
+ * which is what a large append looks like.
+ */
+static int _commit_run(struct mailbox *mailbox, struct index_change *changes,
+                       uint32_t n)
 {
-    indexbuffer_t ibuf;
-    unsigned char *buf = ibuf.buf;
+    struct buf buf = BUF_INITIALIZER;
     size_t offset;
-    struct index_record *record = &change->record;
-    uint32_t recno = record->recno;
+    uint32_t recno = changes[0].record.recno;
+    uint32_t i;
+    int r = 0;
 
-    mailbox_index_record_to_buf(&change->record, mailbox->i.minor_version, buf);
+    buf_ensure(&buf, n * INDEX_RECORD_SIZE);
+    for (i = 0; i < n; i++) {
+        mailbox_index_record_to_buf(&changes[i].record,
+                                    mailbox->i.minor_version,
+                                    (unsigned char *) buf.s +
+                                    i * INDEX_RECORD_SIZE);
+    }
 
     offset = mailbox->i.start_offset + ((recno-1) * mailbox->i.record_size);
 
@@ -1776,15 +1872,23 @@ static int _commit_one(struct mailbox *mailbox, struct index_change *change)
     if (lseek(mailbox->index_fd, offset, SEEK_SET) == -1) {
         syslog(LOG_ERR, "IOERROR: seeking index record %u for %s: %m",
                recno, mailbox->name);
-        return IMAP_IOERROR;
+        r = IMAP_IOERROR;
     }
-
-    if (retry_write(mailbox->index_fd, buf, INDEX_RECORD_SIZE) != INDEX_RECORD_SIZE) {
-        syslog(LOG_ERR, "IOERROR: writing index record %u for %s: %m",
-               recno, mailbox->name);
-        return IMAP_IOERROR;
+    else if (retry_write(mailbox->index_fd, buf.s, n * INDEX_RECORD_SIZE) !=
+             (ssize_t) (n * INDEX_RECORD_SIZE)) {
+        syslog(LOG_ERR, "IOERROR: writing index records %u-%u for %s: %m",
+               recno, recno + n - 1, mailbox->name);
+        r = IMAP_IOERROR;
     }
 
+    buf_free(&buf);
+    return r;
+}
+
+static void _commit_audit(struct mailbox *mailbox, struct index_change *change)
+{
+    struct index_record *record = &change->record;
+
     /* audit logging */
     if (config_auditlog) {
         if (change->flags & CHANGE_ISAPPEND)
@@ -1804,8 +1908,6 @@ static int _commit_one(struct mailbox *mailbox, struct index_change *change)
                    session_id(), mailbox->name, mailbox->uniqueid,
                    record->uid);
     }
-
-    return 0;
 }
 
 static void _cleanup_changes(struct mailbox *mailbox)
@@ -1832,7 +1934,7 @@ static int change_compar(const void *a, const void *b)
 
 static int _commit_changes(struct mailbox *mailbox)
 {
-    uint32_t i;
+    uint32_t i, j, n;
     int r;
 
     if (!mailbox->index_change_count) return 0;
@@ -1844,9 +1946,22 @@ static int _commit_changes(struct mailbox *mailbox)
     qsort(mailbox->index_changes, mailbox->index_change_count,
           sizeof(struct index_change), change_compar);
 
-    for (i = 1; i <= mailbox->index_change_count; i++) {
-        r = _commit_one(mailbox, &mailbox->index_changes[i-1]);
+    for (i = 0; i < mailbox->index_change_count; i += n) {
+        struct index_change *run = &mailbox->index_changes[i];
+
+        /* records are only contiguous on disk at the current size */
+        n = 1;
+        if (mailbox->i.record_size == INDEX_RECORD_SIZE) {
+            while (i + n < mailbox->index_change_count && n < COMMIT_RUN_MAX &&
+                   run[n].record.recno == run[n-1].record.recno + 1)
+                n++;
+        }
+
+        r = _commit_run(mailbox, run, n);
         if (r) return r; /* DAMN, we're screwed */
+
+        for (j = 0; j < n; j++)
+            _commit_audit(mailbox, &run[j]);
     }
 
     _cleanup_changes(mailbox);
@@ -2190,6 +2305,12 @@ EXPORTED void mailbox_unlock_index(struct mailbox *mailbox, struct statusdata *s
         mailbox->index_locktype = 0;
     }
 
+    if (mailbox->expirequeue_dirty) {
+        if (expirequeue_enabled())
+            expirequeue_note(mailbox->name, mailbox->i.first_expunged);
+        mailbox->expirequeue_dirty = 0;
+    }
+
     gettimeofday(&endtime, 0);
     timediff = timesub(&mailbox->starttime, &endtime);
     if (timediff > 1.0) {
@@ -2454,6 +2575,387 @@ EXPORTED int mailbox_abort(struct mailbox *mailbox)
     return 0;
 }
 
+/*
+ * The modseq log
+ *
+ * cyrus.modseqlog lists the modseq and recno of every index record
+ * written since the index was last repacked, in modseq order, so that
+ * finding the records changed since a given modseq (for CONDSTORE,
+ * QRESYNC and replication) only has to read the records which
+ * actually changed.  Entries are appended at commit time, before the
+ * records themselves are written, and the whole log is rewritten from
+ * the index on repack, or when it grows much larger than the index.
+ *
+ * The header records the index generation, uidvalidity and
+ * highestmodseq it describes.  If any of those don't match the index
+ * (an index written by something which doesn't maintain the log, or
+ * a crash between the two commits) the log is ignored and the caller
+ * falls back to reading every record.
+ *
+ * A record's modseq may go backwards (e.g. from a replica), so the
+ * modseq logged is clamped to be at least the previous entry's: the
+ * log stays sorted, and a logged modseq is never lower than the
+ * record's, which is always reread anyway.
+ */
+
+#define MODSEQLOG_MAGIC                 "CYRMSLOG"
+#define MODSEQLOG_OFFSET_GENERATION_NO  8
+#define MODSEQLOG_OFFSET_UIDVALIDITY    12
+#define MODSEQLOG_OFFSET_HIGHESTMODSEQ  16
+#define MODSEQLOG_HEADER_SIZE           32
+#define MODSEQLOG_RECORD_SIZE           16
+
+struct modseqlog_entry {
+    modseq_t modseq;
+    uint32_t recno;
+};
+
+static int modseqlog_entry_compar(const void *a, const void *b)
+{
+    const struct modseqlog_entry *ea = (const struct modseqlog_entry *)a;
+    const struct modseqlog_entry *eb = (const struct modseqlog_entry *)b;
+
+    if (ea->modseq != eb->modseq)
+        return ea->modseq < eb->modseq ? -1 : 1;
+    if (ea->recno != eb->recno)
+        return ea->recno < eb->recno ? -1 : 1;
+    return 0;
+}
+
+static int modseqlog_recno_compar(const void *a, const void *b)
+{
+    uint32_t ra = *(const uint32_t *)a;
+    uint32_t rb = *(const uint32_t *)b;
+
+    if (ra != rb)
+        return ra < rb ? -1 : 1;
+    return 0;
+}
+
+static void modseqlog_entry_to_buf(const struct modseqlog_entry *entry,
+                                   unsigned char *buf)
+{
+    memset(buf, 0, MODSEQLOG_RECORD_SIZE);
+    align_htonll(buf, entry->modseq);
+    *((bit32 *)(buf+8)) = htonl(entry->recno);
+}
+
+static modseq_t modseqlog_buf_modseq(const unsigned char *buf)
+{
+    return align_ntohll(buf);
+}
+
+static uint32_t modseqlog_buf_recno(const unsigned char *buf)
+{
+    return ntohl(*((bit32 *)(buf+8)));
+}
+
+/* open the modseq log and check that it describes the index described
+ * by 'i'.  Returns the fd and number of entries, or -1 if there's no
+ * usable log */
+static int modseqlog_open(struct mailbox *mailbox,
+                          const struct index_header *i,
+                          int flags, int checkmodseq,
+                          uint32_t *num_entriesp)
+{
+    const char *fname = mailbox_meta_fname(mailbox, META_MODSEQLOG);
+    unsigned char buf[MODSEQLOG_HEADER_SIZE];
+    struct stat sbuf;
+    int fd;
+
+    if (!fname) return -1;
+
+    fd = open(fname, flags, 0);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+        return -1;
+    }
+
+    if (fstat(fd, &sbuf) == -1 ||
+        sbuf.st_size < MODSEQLOG_HEADER_SIZE ||
+        pread(fd, buf, MODSEQLOG_HEADER_SIZE, 0) != MODSEQLOG_HEADER_SIZE)
+        goto bad;
+
+    if (memcmp(buf, MODSEQLOG_MAGIC, 8))
+        goto bad;
+    if (ntohl(*((bit32 *)(buf+MODSEQLOG_OFFSET_GENERATION_NO))) != i->generation_no)
+        goto bad;
+    if (ntohl(*((bit32 *)(buf+MODSEQLOG_OFFSET_UIDVALIDITY))) != i->uidvalidity)
+        goto bad;
+    if (checkmodseq &&
+        align_ntohll(buf+MODSEQLOG_OFFSET_HIGHESTMODSEQ) != i->highestmodseq)
+        goto bad;
+
+    /* ignore any partially written entry at the end */
+    *num_entriesp = (sbuf.st_size - MODSEQLOG_HEADER_SIZE) / MODSEQLOG_RECORD_SIZE;
+
+    return fd;
+
+bad:
+    close(fd);
+    return -1;
+}
+
+/* write a complete new log for the index described by 'i' to the
+ * ".NEW" file */
+static int modseqlog_write_new(struct mailbox *mailbox,
+                               const struct index_header *i,
+                               struct modseqlog_entry *entries,
+                               uint32_t num_entries)
+{
+    const char *fname = mailbox_meta_newfname(mailbox, META_MODSEQLOG);
+    unsigned char hbuf[MODSEQLOG_HEADER_SIZE];
+    unsigned char rbuf[MODSEQLOG_RECORD_SIZE];
+    struct buf buf = BUF_INITIALIZER;
+    uint32_t n;
+    int fd;
+    int r = 0;
+
+    if (!fname) return IMAP_MAILBOX_BADNAME;
+
+    qsort(entries, num_entries, sizeof(struct modseqlog_entry),
+          modseqlog_entry_compar);
+
+    memset(hbuf, 0, MODSEQLOG_HEADER_SIZE);
+    memcpy(hbuf, MODSEQLOG_MAGIC, 8);
+    *((bit32 *)(hbuf+MODSEQLOG_OFFSET_GENERATION_NO)) = htonl(i->generation_no);
+    *((bit32 *)(hbuf+MODSEQLOG_OFFSET_UIDVALIDITY)) = htonl(i->uidvalidity);
+    align_htonll(hbuf+MODSEQLOG_OFFSET_HIGHESTMODSEQ, i->highestmodseq);
+    buf_appendmap(&buf, (const char *)hbuf, MODSEQLOG_HEADER_SIZE);
+
+    for (n = 0; n < num_entries; n++) {
+        modseqlog_entry_to_buf(&entries[n], rbuf);
+        buf_appendmap(&buf, (const char *)rbuf, MODSEQLOG_RECORD_SIZE);
+    }
+
+    fd = open(fname, O_RDWR|O_TRUNC|O_CREAT, 0666);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", fname);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    if (retry_write(fd, buf_base(&buf), buf_len(&buf)) < 0 || fsync(fd)) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+        r = IMAP_IOERROR;
+    }
+    close(fd);
+
+    if (r) unlink(fname);
+
+done:
+    buf_free(&buf);
+    return r;
+}
+
+/* rewrite the log from the committed index */
+static int modseqlog_rebuild(struct mailbox *mailbox)
+{
+    struct modseqlog_entry *entries = NULL;
+    struct index_record record;
+    uint32_t num_entries = 0;
+    uint32_t recno;
+    int r;
+
+    if (mailbox->i.num_records)
+        entries = xmalloc(mailbox->i.num_records * sizeof(struct modseqlog_entry));
+
+    for (recno = 1; recno <= mailbox->i.num_records; recno++) {
+        if (mailbox_read_index_record(mailbox, recno, &record)) continue;
+        if (!record.uid) continue;
+        entries[num_entries].modseq = record.modseq;
+        entries[num_entries].recno = recno;
+        num_entries++;
+    }
+
+    r = modseqlog_write_new(mailbox, &mailbox->i, entries, num_entries);
+    if (!r) r = mailbox_meta_rename(mailbox, META_MODSEQLOG);
+
+    free(entries);
+    return r;
+}
+
+/* append the pending index changes to the log, before they are
+ * written to the index.  The entries must be on disk before the index
+ * is, or a crash could leave the log claiming changes it doesn't list.
+ * The log is left open in *fdp for modseqlog_commit() */
+static int modseqlog_append(struct mailbox *mailbox, int *fdp)
+{
+    unsigned char rbuf[MODSEQLOG_RECORD_SIZE];
+    struct modseqlog_entry *entries;
+    struct buf buf = BUF_INITIALIZER;
+    modseq_t last = 0;
+    uint32_t num_entries;
+    uint32_t n;
+    off_t offset;
+    int fd;
+    int r = 0;
+
+    /* the header modseq won't match until the commit is done */
+    *fdp = fd = modseqlog_open(mailbox, &mailbox->i, O_RDWR,
+                               /*checkmodseq*/0, &num_entries);
+    if (fd == -1) return 0; /* no log to maintain */
+
+    if (!mailbox->index_change_count) return 0;
+
+    offset = MODSEQLOG_HEADER_SIZE + (off_t) num_entries * MODSEQLOG_RECORD_SIZE;
+    if (num_entries) {
+        if (pread(fd, rbuf, MODSEQLOG_RECORD_SIZE,
+                  offset - MODSEQLOG_RECORD_SIZE) != MODSEQLOG_RECORD_SIZE) {
+            r = IMAP_IOERROR;
+            goto done;
+        }
+        last = modseqlog_buf_modseq(rbuf);
+    }
+
+    entries = xmalloc(mailbox->index_change_count * sizeof(struct modseqlog_entry));
+    for (n = 0; n < mailbox->index_change_count; n++) {
+        entries[n].modseq = mailbox->index_changes[n].record.modseq;
+        entries[n].recno = mailbox->index_changes[n].record.recno;
+    }
+    qsort(entries, mailbox->index_change_count, sizeof(struct modseqlog_entry),
+          modseqlog_entry_compar);
+
+    for (n = 0; n < mailbox->index_change_count; n++) {
+        if (entries[n].modseq < last)
+            entries[n].modseq = last;
+        last = entries[n].modseq;
+        modseqlog_entry_to_buf(&entries[n], rbuf);
+        buf_appendmap(&buf, (const char *)rbuf, MODSEQLOG_RECORD_SIZE);
+    }
+    free(entries);
+
+    /* this also makes the header written by the last commit durable */
+    if (pwrite(fd, buf_base(&buf), buf_len(&buf), offset) !=
+            (ssize_t) buf_len(&buf) || fdatasync(fd)) {
+        r = IMAP_IOERROR;
+    }
+
+done:
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: appending to modseq log for %s: %m",
+               mailbox->name);
+        close(fd);
+        *fdp = -1;
+    }
+    buf_free(&buf);
+    return r;
+}
+
+/* mark the log open on 'fd' as up to date with the just-committed index
+ * header, rebuilding it if it has grown too large, and close it.
+ *
+ * The header isn't synced here: until the next append syncs it, a crash
+ * can only leave it behind the index, and a log that doesn't match the
+ * index's highestmodseq is never read */
+static void modseqlog_commit(struct mailbox *mailbox, int fd)
+{
+    unsigned char buf[8];
+    struct stat sbuf;
+
+    if (fd == -1) return;
+
+    if (fstat(fd, &sbuf) == -1) {
+        syslog(LOG_ERR, "IOERROR: fstat modseq log for %s: %m",
+               mailbox->name);
+        close(fd);
+        return;
+    }
+
+    if ((sbuf.st_size - MODSEQLOG_HEADER_SIZE) / MODSEQLOG_RECORD_SIZE >
+        2 * mailbox->i.num_records + 1024) {
+        close(fd);
+        if (modseqlog_rebuild(mailbox))
+            syslog(LOG_ERR, "IOERROR: rebuilding modseq log for %s",
+                   mailbox->name);
+        return;
+    }
+
+    align_htonll(buf, mailbox->i.highestmodseq);
+    if (pwrite(fd, buf, 8, MODSEQLOG_OFFSET_HIGHESTMODSEQ) != 8)
+        syslog(LOG_ERR, "IOERROR: updating modseq log for %s: %m",
+               mailbox->name);
+    close(fd);
+}
+
+/* find the records changed since 'changedsince', in recno order.
+ * Returns non-zero if the log can't be used to do that */
+static int modseqlog_find(struct mailbox *mailbox, modseq_t changedsince,
+                          uint32_t **recnosp, uint32_t *num_recnosp)
+{
+    unsigned char rbuf[MODSEQLOG_RECORD_SIZE];
+    unsigned char *data = NULL;
+    uint32_t *recnos = NULL;
+    uint32_t num_entries, lo, hi, n, count;
+    size_t len;
+    int fd;
+    int r = IMAP_NOTFOUND;
+
+    /* uncommitted changes aren't in the log yet */
+    if (mailbox->index_change_count) return r;
+
+    fd = modseqlog_open(mailbox, &mailbox->i, O_RDONLY, /*checkmodseq*/1,
+                        &num_entries);
+    if (fd == -1) return r;
+
+    /* find the first entry with modseq > changedsince */
+    lo = 0;
+    hi = num_entries;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        off_t offset = MODSEQLOG_HEADER_SIZE + (off_t) mid * MODSEQLOG_RECORD_SIZE;
+        if (pread(fd, rbuf, MODSEQLOG_RECORD_SIZE, offset) != MODSEQLOG_RECORD_SIZE)
+            goto done;
+        if (modseqlog_buf_modseq(rbuf) <= changedsince)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    /* it's cheaper to just read the index */
+    count = num_entries - lo;
+    if (count > mailbox->i.num_records)
+        goto done;
+
+    /* never NULL, even if nothing has changed */
+    recnos = xmalloc((count ? count : 1) * sizeof(uint32_t));
+
+    len = (size_t) count * MODSEQLOG_RECORD_SIZE;
+    if (count) {
+        data = xmalloc(len);
+        if (pread(fd, data, len, MODSEQLOG_HEADER_SIZE +
+                  (off_t) lo * MODSEQLOG_RECORD_SIZE) != (ssize_t) len)
+            goto done;
+    }
+
+    for (n = 0, *num_recnosp = 0; n < count; n++) {
+        uint32_t recno = modseqlog_buf_recno(data + n * MODSEQLOG_RECORD_SIZE);
+        if (!recno || recno > mailbox->i.num_records) continue;
+        recnos[(*num_recnosp)++] = recno;
+    }
+
+    /* each record once, in index order */
+    if (*num_recnosp) {
+        qsort(recnos, *num_recnosp, sizeof(uint32_t), modseqlog_recno_compar);
+        for (n = 1, count = 1; n < *num_recnosp; n++) {
+            if (recnos[n] != recnos[count-1])
+                recnos[count++] = recnos[n];
+        }
+        *num_recnosp = count;
+    }
+
+    *recnosp = recnos;
+    recnos = NULL;
+    r = 0;
+
+done:
+    free(recnos);
+    free(data);
+    close(fd);
+    return r;
+}
+
 /*
  * Write the index header for 'mailbox'
  */
@@ -2461,6 +2963,8 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
 {
     /* XXX - ibuf for alignment? */
     static unsigned char buf[INDEX_HEADER_SIZE];
+    time_t old_first_expunged = 0;
+    int logfd = -1;
     int n, r;
 
     /* try to commit sub parts first */
@@ -2486,9 +2990,20 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
 
     assert(mailbox_index_islocked(mailbox, 1));
 
-    r = _commit_changes(mailbox);
+    r = modseqlog_append(mailbox, &logfd);
     if (r) return r;
 
+    r = _commit_changes(mailbox);
+    if (r) {
+        if (logfd != -1) close(logfd);
+        return r;
+    }
+
+    /* what cyr_expire was last told, if anything */
+    if (mailbox->index_size >= OFFSET_FIRST_EXPUNGED + 4)
+        old_first_expunged =
+            ntohl(*((bit32 *)(mailbox->index_base+OFFSET_FIRST_EXPUNGED)));
+
     mailbox_index_header_to_buf(&mailbox->i, buf);
 
     lseek(mailbox->index_fd, 0, SEEK_SET);
@@ -2496,9 +3011,17 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
     if (n < 0 || fsync(mailbox->index_fd)) {
         syslog(LOG_ERR, "IOERROR: writing index header for %s: %m",
                mailbox->name);
+        if (logfd != -1) close(logfd);
         return IMAP_IOERROR;
     }
 
+    modseqlog_commit(mailbox, logfd);
+    statuscache_shm_update(mailbox);
+
+    /* tell the expire queue once we've let go of the lock */
+    if (mailbox->i.first_expunged != old_first_expunged)
+        mailbox->expirequeue_dirty = 1;
+
     if (config_auditlog && mailbox->modseq_dirty)
         syslog(LOG_NOTICE, "auditlog: modseq sessionid=<%s> "
                "mailbox=<%s> uniqueid=<%s> highestmodseq=<" MODSEQ_FMT ">",
@@ -3734,6 +4257,29 @@ EXPORTED int mailbox_append_index_record(struct mailbox *mailbox,
     return 0;
 }
 
+/*
+ * Append 'n' records in uid order, as a bulk COPY/MOVE does.  The cache
+ * records go out in one write per cache file; the index records are
+ * written together when the mailbox is committed.
+ */
+EXPORTED int mailbox_append_index_records(struct mailbox *mailbox,
+                                          struct index_record *records,
+                                          int n)
+{
+    int i;
+    int r;
+
+    r = mailbox_append_caches(mailbox, records, n);
+    if (r) return r;
+
+    for (i = 0; i < n; i++) {
+        r = mailbox_append_index_record(mailbox, &records[i]);
+        if (r) return r;
+    }
+
+    return 0;
+}
+
 static void mailbox_record_cleanup(struct mailbox *mailbox,
                                    struct index_record *record)
 {
@@ -4000,6 +4546,24 @@ static int mailbox_repack_add(struct mailbox_repack *repack,
 
     repack->i.num_records++;
 
+    /* and note it for the new modseq log */
+    if (repack->i.num_records > repack->modseqlog_alloc) {
+        repack->modseqlog_alloc += 1024;
+        repack->modseqlog = xrealloc(repack->modseqlog,
+            repack->modseqlog_alloc * sizeof(struct modseqlog_entry));
+    }
+    repack->modseqlog[repack->i.num_records-1].modseq = record->modseq;
+    repack->modseqlog[repack->i.num_records-1].recno = repack->i.num_records;
+
+    if (!(record->system_flags & FLAG_EXPUNGED)) {
+        if (repack->num_uids >= repack->uids_alloc) {
+            repack->uids_alloc += 1024;
+            repack->uids = xrealloc(repack->uids,
+                repack->uids_alloc * sizeof(uint32_t));
+        }
+        repack->uids[repack->num_uids++] = record->uid;
+    }
+
     return 0;
 }
 
@@ -4028,6 +4592,9 @@ static void mailbox_repack_abort(struct mailbox_repack **repackptr)
     }
     ptrarray_fini(&repack->caches);
 
+    unlink(mailbox_meta_newfname(repack->mailbox, META_MODSEQLOG));
+    free(repack->modseqlog);
+    free(repack->uids);
     free(repack->userid);
     free(repack);
     *repackptr = NULL;
@@ -4084,6 +4651,13 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
 
     xclose(repack->newindex_fd);
 
+    /* the new index gets a complete modseq log.  A failure here just
+     * means searching by modseq reads the whole index until the next
+     * repack */
+    if (modseqlog_write_new(repack->mailbox, &repack->i, repack->modseqlog,
+                            repack->i.num_records))
+        unlink(mailbox_meta_newfname(repack->mailbox, META_MODSEQLOG));
+
     /* NOTE: cache files need commiting before index is renamed */
     for (i = 0; i < repack->caches.count; i++) {
         struct mappedfile *cachefile = ptrarray_nth(&repack->caches, i);
@@ -4096,6 +4670,10 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
     r = mailbox_meta_rename(repack->mailbox, META_INDEX);
     if (r) goto fail;
 
+    /* an old log won't match the new index generation, so it's safe
+     * to leave it if there's no new one */
+    mailbox_meta_rename(repack->mailbox, META_MODSEQLOG);
+
     /* which cache files might currently exist? */
     strarray_add(&cachefiles, mailbox_meta_fname(repack->mailbox, META_CACHE));
     strarray_add(&cachefiles, mailbox_meta_fname(repack->mailbox, META_ARCHIVECACHE));
@@ -4122,7 +4700,12 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
 
     strarray_fini(&cachefiles);
 
+    /* expunged messages won't be sorted again */
+    sortcache_prune(repack->mailbox, repack->uids, repack->num_uids);
+
     seqset_free(repack->seqset);
+    free(repack->modseqlog);
+    free(repack->uids);
     free(repack->userid);
     free(repack);
     *repackptr = NULL;
@@ -4287,144 +4870,454 @@ EXPORTED unsigned mailbox_should_archive(struct mailbox *mailbox,
 }
 
 /*
- * Move messages between spool and archive partition
- * function pointed to by 'decideproc' is called (with 'deciderock') to
- * determine which messages to move.  If deciderock return 0, the message
- * should be in the spool - if 1, the message should be in the archive.
+ * Move messages between spool and archive partition.
+ *
+ * Copying with the index write lock held would stall every client of
+ * a large mailbox for as long as the copy takes.  Instead we decide
+ * what to move under the lock the caller already holds, drop it, copy
+ * the message files (or upload them to object storage) in batches,
+ * and only take the write lock again to flip FLAG_ARCHIVED and write
+ * the new cache records.  The caller's name lock stays held
+ * throughout, so cleanup can't unlink any of the source files from
+ * under us.
  */
-EXPORTED void mailbox_archive(struct mailbox *mailbox,
-                              mailbox_decideproc_t *decideproc, void *deciderock, unsigned flags)
 
+struct archive_item {
+    uint32_t uid;
+    struct message_guid guid;
+    int archive;        /* 1 = to archive, 0 = back to spool */
+    int staged;         /* copy made and synced */
+    int flipped;        /* index record rewritten */
+};
+
+static const char *archive_item_src(struct mailbox *mailbox,
+                                    struct archive_item *item)
 {
-    int r;
-    int dirtycache = 0;
-    const struct index_record *record;
-    struct index_record copyrecord;
-    const char *srcname;
-    const char *destname;
-    char *spoolcache = xstrdup(mailbox_meta_fname(mailbox, META_CACHE));
-    char *archivecache = xstrdup(mailbox_meta_fname(mailbox, META_ARCHIVECACHE));
-    int differentcache = strcmp(spoolcache, archivecache);
-    int object_storage_enabled = 0;
-#if defined ENABLE_OBJECTSTORE
-    object_storage_enabled = config_getswitch(IMAPOPT_OBJECT_STORAGE_ENABLED) ;
-#endif
-    free(spoolcache);
-    free(archivecache);
+    return item->archive ? mailbox_spool_fname(mailbox, item->uid)
+                         : mailbox_archive_fname(mailbox, item->uid);
+}
 
-    assert(mailbox_index_islocked(mailbox, 1));
-    if (!decideproc) decideproc = &mailbox_should_archive;
+static const char *archive_item_dest(struct mailbox *mailbox,
+                                     struct archive_item *item)
+{
+    return item->archive ? mailbox_archive_fname(mailbox, item->uid)
+                         : mailbox_spool_fname(mailbox, item->uid);
+}
 
-    struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, flags);
+static int archive_sync_fname(const char *fname)
+{
+    int fd = open(fname, O_RDONLY, 0);
+    int r = 0;
 
-    while ((record = mailbox_iter_step(iter))) {
-        const char *action = NULL;
-        if (decideproc(mailbox, record, deciderock)) {
-            if (record->system_flags & FLAG_ARCHIVED)
-                continue;
-            copyrecord = *record;
-            srcname = mailbox_spool_fname(mailbox, copyrecord.uid);
-            destname = mailbox_archive_fname(mailbox, copyrecord.uid);
+    if (fd == -1) return -1;
+    if (fsync(fd) < 0) r = -1;
+    close(fd);
 
-            /* load cache before changing the flags */
-            r = mailbox_cacherecord(mailbox, &copyrecord);
-            if (r) {
-                syslog(LOG_ERR, "IOERROR archive %s %u failed to read cache: %s",
-                       mailbox->name, copyrecord.uid, error_message(r));
-                continue;
-            }
-#if defined ENABLE_OBJECTSTORE
-            if (object_storage_enabled){
-                /* upload on the blob store */
-                r = objectstore_put(mailbox, &copyrecord, srcname);
-                if (r) {
-                    syslog(LOG_ERR, "IOERROR archive %s %u failed to objectstorage put file (%s): %s",
-                           mailbox->name, copyrecord.uid, srcname, error_message(r));
-                    // didn't manage to store it, so remove the ARCHIVED flag
-                    continue;
-                }
-                r = unlink (srcname);
-                if (r < 0)
-                    syslog(LOG_ERR, "unlink(%s) failed: %m", srcname);
+    return r;
+}
+
+#ifdef HAVE_SYNCFS
+/* sync each filesystem the batch's directories live on, once.  That's
+ * one or two calls (archive and/or spool partition) rather than one
+ * fsync per file and directory.  Returns -1 if any of them failed, in
+ * which case the caller syncs file by file to find out what's safe */
+static int archive_sync_dirs(const strarray_t *dirs)
+{
+    dev_t *devs = xmalloc(strarray_size(dirs) * sizeof(dev_t));
+    int ndevs = 0;
+    int i, j, r = 0;
+
+    for (i = 0; i < strarray_size(dirs) && !r; i++) {
+        struct stat sbuf;
+        int fd = open(strarray_nth(dirs, i), O_RDONLY, 0);
+
+        if (fd == -1 || fstat(fd, &sbuf) < 0) {
+            r = -1;
+        }
+        else {
+            for (j = 0; j < ndevs; j++)
+                if (devs[j] == sbuf.st_dev) break;
+
+            if (j == ndevs) {
+                devs[ndevs++] = sbuf.st_dev;
+                if (syncfs(fd) < 0) r = -1;
             }
+        }
+
+        if (fd != -1) close(fd);
+    }
+
+    free(devs);
+
+    return r;
+}
 #endif
-            copyrecord.system_flags |= FLAG_ARCHIVED | FLAG_NEEDS_CLEANUP;
-            action = "archive";
+
+/* copy one batch of files without syncing each one as we go, then
+ * sync the lot at once, so the disk sees one long sequential write */
+static void archive_copy_batch(struct mailbox *mailbox,
+                               struct archive_item *items, int n)
+{
+    strarray_t dirs = STRARRAY_INITIALIZER;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        char *srcname = xstrdup(archive_item_src(mailbox, &items[i]));
+        const char *destname = archive_item_dest(mailbox, &items[i]);
+        char *p;
+
+        if (!strcmp(srcname, destname)) {
+            items[i].staged = 1;
+            free(srcname);
+            continue;
         }
-        else
-        {
-            if (!(record->system_flags & FLAG_ARCHIVED))
-                continue;
-            copyrecord = *record;
-            destname = mailbox_spool_fname(mailbox, copyrecord.uid);
-            srcname = mailbox_archive_fname(mailbox, copyrecord.uid);
 
-            /* load cache before changing the flags */
-            r = mailbox_cacherecord(mailbox, &copyrecord);
-            if (r) {
-                syslog(LOG_ERR, "IOERROR archive %s %u failed to read cache: %s",
-                       mailbox->name, copyrecord.uid, error_message(r));
-                continue;
-            }
+        if (cyrus_copyfile(srcname, destname,
+                           COPYFILE_MKDIR|COPYFILE_NOSYNC)) {
+            syslog(LOG_ERR, "IOERROR archive %s %u failed to copyfile (%s => %s)",
+                   mailbox->name, items[i].uid, srcname, destname);
+            free(srcname);
+            continue;
+        }
+        free(srcname);
+
+        items[i].staged = 1;
+
+        p = xstrdup(destname);
+        *strrchr(p, '/') = '\0';
+        strarray_add(&dirs, p);
+        free(p);
+    }
+
+#ifdef HAVE_SYNCFS
+    if (!strarray_size(&dirs) || !archive_sync_dirs(&dirs)) {
+        strarray_fini(&dirs);
+        return;
+    }
+    syslog(LOG_WARNING, "archive %s: syncfs failed, syncing each file",
+           mailbox->name);
+#endif
+
+    for (i = 0; i < n; i++) {
+        const char *destname;
+
+        if (!items[i].staged) continue;
+
+        destname = archive_item_dest(mailbox, &items[i]);
+        if (!strcmp(archive_item_src(mailbox, &items[i]), destname))
+            continue;
+
+        if (archive_sync_fname(destname)) {
+            syslog(LOG_ERR, "IOERROR archive %s %u failed to fsync %s: %m",
+                   mailbox->name, items[i].uid, destname);
+            unlink(destname);
+            items[i].staged = 0;
+        }
+    }
+
+    /* and the new directory entries */
+    for (i = 0; i < strarray_size(&dirs); i++) {
+        if (archive_sync_fname(strarray_nth(&dirs, i)))
+            syslog(LOG_ERR, "IOERROR archive %s failed to fsync %s: %m",
+                   mailbox->name, strarray_nth(&dirs, i));
+    }
+
+    strarray_fini(&dirs);
+}
 
 #if defined ENABLE_OBJECTSTORE
-            if (object_storage_enabled){
-                /* recover from the blob store */
-                r = objectstore_get(mailbox, &copyrecord, destname);
-                if (r) {
-                    syslog(LOG_ERR, "IOERROR archive %s %u failed to objectstorage get file (%s): %s",
-                          mailbox->name, copyrecord.uid, destname, error_message(r));
+static int archive_object_one(struct mailbox *mailbox,
+                              struct archive_item *item)
+{
+    struct index_record record;
+
+    memset(&record, 0, sizeof(struct index_record));
+    record.uid = item->uid;
+    record.guid = item->guid;
+
+    if (item->archive)
+        return objectstore_put(mailbox, &record,
+                               mailbox_spool_fname(mailbox, item->uid));
+    else
+        return objectstore_get(mailbox, &record,
+                               mailbox_spool_fname(mailbox, item->uid));
+}
+
+/* object stores are slow per request but don't mind many requests at
+ * once, so spread the transfers over a few children.  Each child
+ * reports the index of every item it moved back through a pipe. */
+static void archive_object_batch(struct mailbox *mailbox,
+                                 struct archive_item *items, int n)
+{
+    int nworkers = config_getint(IMAPOPT_ARCHIVE_UPLOAD_WORKERS);
+    pid_t *pids;
+    int fds[2];
+    int w, i;
+    uint32_t idx;
+
+    if (nworkers > n) nworkers = n;
+
+    if (nworkers <= 1 || pipe(fds) < 0) {
+        for (i = 0; i < n; i++) {
+            if (!archive_object_one(mailbox, &items[i]))
+                items[i].staged = 1;
+            else
+                syslog(LOG_ERR, "IOERROR archive %s %u failed to objectstorage transfer",
+                       mailbox->name, items[i].uid);
+        }
+        return;
+    }
+
+    pids = xzmalloc(nworkers * sizeof(pid_t));
+
+    for (w = 0; w < nworkers; w++) {
+        pids[w] = fork();
+        if (pids[w] < 0) {
+            syslog(LOG_ERR, "archive %s: fork failed: %m", mailbox->name);
+            break;
+        }
+        if (!pids[w]) {
+            close(fds[0]);
+            for (i = w; i < n; i += nworkers) {
+                if (archive_object_one(mailbox, &items[i])) {
+                    syslog(LOG_ERR, "IOERROR archive %s %u failed to objectstorage transfer",
+                           mailbox->name, items[i].uid);
                     continue;
                 }
-                objectstore_delete(mailbox, &copyrecord); // this should only lower ref count.
+                idx = i;
+                retry_write(fds[1], &idx, sizeof(idx));
             }
+            close(fds[1]);
+            _exit(0);
+        }
+    }
+    close(fds[1]);
+
+    /* any slices we couldn't fork for are done here */
+    for (; w < nworkers; w++) {
+        for (i = w; i < n; i += nworkers) {
+            if (!archive_object_one(mailbox, &items[i]))
+                items[i].staged = 1;
+        }
+    }
+
+    while (retry_read(fds[0], &idx, sizeof(idx)) == sizeof(idx)) {
+        if (idx < (uint32_t) n)
+            items[idx].staged = 1;
+    }
+    close(fds[0]);
+
+    for (w = 0; w < nworkers; w++) {
+        if (pids[w] > 0)
+            waitpid(pids[w], NULL, 0);
+    }
+
+    free(pids);
+}
 #endif
 
-            copyrecord.system_flags &= ~FLAG_ARCHIVED;
-            copyrecord.system_flags |= FLAG_NEEDS_CLEANUP;
-            action = "unarchive";
+/* under the write lock: flip the flags on everything which was staged
+ * and hasn't changed underneath us */
+static void archive_flip(struct mailbox *mailbox,
+                         struct archive_item *items, int n,
+                         int differentcache)
+{
+    struct index_record *records = xmalloc(n * sizeof(struct index_record));
+    struct archive_item **which = xmalloc(n * sizeof(struct archive_item *));
+    int nrecords = 0;
+    int i, r;
+
+    for (i = 0; i < n; i++) {
+        struct index_record *record = &records[nrecords];
+
+        if (!items[i].staged) continue;
+
+        if (mailbox_find_index_record(mailbox, items[i].uid, record))
+            continue;
+        if (!message_guid_equal(&record->guid, &items[i].guid))
+            continue;
+        if (record->system_flags & (FLAG_EXPUNGED|FLAG_UNLINKED))
+            continue;
+        if (!!(record->system_flags & FLAG_ARCHIVED) == items[i].archive) {
+            /* somebody else got there first, and the file is theirs now */
+            items[i].staged = 0;
+            continue;
         }
 
-        if (!object_storage_enabled){
-            /* got a file to copy! */
-            if (strcmp(srcname, destname)) {
-                r = cyrus_copyfile(srcname, destname, COPYFILE_MKDIR);
-                if (r) {
-                    syslog(LOG_ERR, "IOERROR archive %s %u failed to copyfile (%s => %s): %s",
-                           mailbox->name, copyrecord.uid, srcname, destname, error_message(r));
-                    continue;
-                }
-            }
+        r = mailbox_cacherecord(mailbox, record);
+        if (r) {
+            syslog(LOG_ERR, "IOERROR archive %s %u failed to read cache: %s",
+                   mailbox->name, record->uid, error_message(r));
+            continue;
         }
 
-        /* got a new cache record to write */
-        if (differentcache)
-        {
-            dirtycache = 1;
-            copyrecord.cache_offset = 0;
-            if (mailbox_append_cache(mailbox, &copyrecord))
-                continue;
+        if (items[i].archive)
+            record->system_flags |= FLAG_ARCHIVED | FLAG_NEEDS_CLEANUP;
+        else {
+            record->system_flags &= ~FLAG_ARCHIVED;
+            record->system_flags |= FLAG_NEEDS_CLEANUP;
         }
 
-        /* rewrite the index record */
-        copyrecord.silent = 1;
-        if (mailbox_rewrite_index_record(mailbox, &copyrecord))
+        if (differentcache)
+            record->cache_offset = 0;
+
+        which[nrecords++] = &items[i];
+    }
+
+    if (differentcache && nrecords) {
+        /* one write per cache file for the whole batch */
+        mailbox_append_caches(mailbox, records, nrecords);
+        mailbox_index_dirty(mailbox);
+        mailbox->i.options |= OPT_MAILBOX_NEEDS_REPACK;
+    }
+
+    for (i = 0; i < nrecords; i++) {
+        struct index_record *record = &records[i];
+
+        if (differentcache && !record->cache_offset &&
+            mailbox_append_cache(mailbox, record))
+            continue;
+
+        record->silent = 1;
+        if (mailbox_rewrite_index_record(mailbox, record))
             continue;
         mailbox->i.options |= OPT_MAILBOX_NEEDS_UNLINK;
+        which[i]->flipped = 1;
 
         if (config_auditlog)
             syslog(LOG_NOTICE, "auditlog: %s sessionid=<%s> mailbox=<%s> uniqueid=<%s> uid=<%u> guid=<%s> cid=<%s> sysflags=<%u>",
-                    action, session_id(), mailbox->name, mailbox->uniqueid, copyrecord.uid,
-                    message_guid_encode(&copyrecord.guid), conversation_id_encode(copyrecord.cid),
-                    copyrecord.system_flags);
+                    which[i]->archive ? "archive" : "unarchive",
+                    session_id(), mailbox->name, mailbox->uniqueid, record->uid,
+                    message_guid_encode(&record->guid), conversation_id_encode(record->cid),
+                    record->system_flags);
+    }
+
+    free(which);
+    free(records);
+}
+
+/*
+ * Move messages between spool and archive partition, only holding the
+ * index write lock while flipping flags.  'decideproc' is called (with
+ * 'deciderock') to determine which messages to move: 0 means the
+ * message should be in the spool, 1 in the archive.  Defaults to
+ * mailbox_should_archive.  The mailbox must be locked (shared is enough) on
+ * entry, and is left write locked on success.  Returns an IMAP error
+ * if the lock couldn't be taken back, in which case the mailbox is
+ * unlocked and the caller should just close it.
+ */
+EXPORTED int mailbox_archive_staged(struct mailbox *mailbox,
+                                    mailbox_decideproc_t *decideproc,
+                                    void *deciderock, unsigned flags)
+{
+    const struct index_record *record;
+    struct archive_item *items = NULL;
+    int nitems = 0, alloc = 0;
+    char *spoolcache = xstrdup(mailbox_meta_fname(mailbox, META_CACHE));
+    char *archivecache = xstrdup(mailbox_meta_fname(mailbox, META_ARCHIVECACHE));
+    int differentcache = strcmp(spoolcache, archivecache);
+    int object_storage_enabled = 0;
+    int batchsize = config_getint(IMAPOPT_ARCHIVE_BATCHSIZE);
+    int i, r;
+#if defined ENABLE_OBJECTSTORE
+    object_storage_enabled = config_getswitch(IMAPOPT_OBJECT_STORAGE_ENABLED) ;
+#endif
+    free(spoolcache);
+    free(archivecache);
+
+    assert(mailbox_index_islocked(mailbox, 0));
+    if (!decideproc) decideproc = &mailbox_should_archive;
+    if (batchsize < 1) batchsize = 1;
+
+    /* 1: decide, under the caller's lock */
+    struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, flags);
+    while ((record = mailbox_iter_step(iter))) {
+        int archive = decideproc(mailbox, record, deciderock) ? 1 : 0;
+
+        if (!!(record->system_flags & FLAG_ARCHIVED) == archive)
+            continue;
+
+        if (nitems == alloc) {
+            alloc += 256;
+            items = xrealloc(items, alloc * sizeof(struct archive_item));
+        }
+        memset(&items[nitems], 0, sizeof(struct archive_item));
+        items[nitems].uid = record->uid;
+        items[nitems].guid = record->guid;
+        items[nitems].archive = archive;
+        nitems++;
     }
     mailbox_iter_done(&iter);
 
-    /* if we have stale cache records, we'll need a repack */
-    if (dirtycache) {
-        mailbox_index_dirty(mailbox);
-        mailbox->i.options |= OPT_MAILBOX_NEEDS_REPACK;
+    if (!nitems) {
+        if (!mailbox_index_islocked(mailbox, 1)) {
+            mailbox_unlock_index(mailbox, NULL);
+            return mailbox_lock_index(mailbox, LOCK_EXCLUSIVE);
+        }
+        return 0;
+    }
+
+    /* 2: move the data, unlocked.  Items are in uid order, which is
+     * also roughly the order the files were written in */
+    mailbox_unlock_index(mailbox, NULL);
+
+    for (i = 0; i < nitems; i += batchsize) {
+        int n = nitems - i < batchsize ? nitems - i : batchsize;
+
+#if defined ENABLE_OBJECTSTORE
+        if (object_storage_enabled) {
+            archive_object_batch(mailbox, items + i, n);
+            continue;
+        }
+#endif
+        archive_copy_batch(mailbox, items + i, n);
     }
+
+    /* 3: flip the flags, locked */
+    r = mailbox_lock_index(mailbox, LOCK_EXCLUSIVE);
+    if (!r) {
+        archive_flip(mailbox, items, nitems, differentcache);
+        r = mailbox_commit(mailbox);
+    }
+
+    /* 4: tidy up whatever didn't make it, and the spool copies of
+     * objects which are now only in the store */
+    for (i = 0; i < nitems; i++) {
+        struct archive_item *item = &items[i];
+
+        if (!item->staged) continue;
+
+        if (object_storage_enabled) {
+#if defined ENABLE_OBJECTSTORE
+            const char *spoolname = mailbox_spool_fname(mailbox, item->uid);
+            struct index_record stub;
+
+            if (!item->archive && item->flipped) {
+                /* this should only lower the ref count */
+                memset(&stub, 0, sizeof(struct index_record));
+                stub.uid = item->uid;
+                stub.guid = item->guid;
+                objectstore_delete(mailbox, &stub);
+            }
+            else if (item->archive && item->flipped && !r) {
+                if (unlink(spoolname) < 0)
+                    syslog(LOG_ERR, "unlink(%s) failed: %m", spoolname);
+            }
+            else if (!item->archive && !item->flipped) {
+                unlink(spoolname);
+            }
+#endif
+        }
+        else if (!item->flipped || r) {
+            const char *destname = archive_item_dest(mailbox, item);
+            if (strcmp(archive_item_src(mailbox, item), destname))
+                unlink(destname);
+        }
+    }
+
+    free(items);
+
+    return r;
 }
 
 EXPORTED void mailbox_remove_files_from_object_storage(struct mailbox *mailbox,
@@ -4769,6 +5662,10 @@ EXPORTED int mailbox_create(const char *name,
     r = mailbox_commit(mailbox);
     if (r) goto done;
 
+    /* start the modseq log for the new index */
+    if (modseqlog_rebuild(mailbox))
+        syslog(LOG_ERR, "IOERROR: creating modseq log for %s", mailbox->name);
+
     if (config_auditlog)
         syslog(LOG_NOTICE, "auditlog: create sessionid=<%s> "
                            "mailbox=<%s> uniqueid=<%s> uidvalidity=<%u>",
@@ -4957,6 +5854,11 @@ static int mailbox_delete_internal(struct mailbox **mailboxptr)
     /* remove any seen */
     seen_delete_mailbox(NULL, mailbox);
 
+    /* and the expire queue entry */
+    mailbox->expirequeue_dirty = 0;
+    if (expirequeue_enabled())
+        expirequeue_delete(mailbox->name);
+
     /* can't unlink any files yet, because our promise to other
      * users of the mailbox applies! Can only unlink with an
      * exclusive lock.  mailbox_close will try to get one of
@@ -5073,6 +5975,8 @@ static struct meta_file meta_files[] = {
     { META_SQUAT,        1, 0 },
     { META_ANNOTATIONS,  1, 1 },
     { META_ARCHIVECACHE, 1, 1 },
+    { META_MODSEQLOG,    1, 1 },
+    { META_SORTCACHE,    1, 1 },
     { 0, 0, 0 }
 };
 
@@ -5353,6 +6257,10 @@ HIDDEN int mailbox_rename_copy(struct mailbox *oldmailbox,
     r = mailbox_commit(newmailbox);
     if (r) goto fail;
 
+    /* the copy has the same first_expunged */
+    if (expirequeue_enabled())
+        expirequeue_rename(oldmailbox->name, newname);
+
     if (config_auditlog)
         syslog(LOG_NOTICE, "auditlog: rename sessionid=<%s> "
                            "oldmailbox=<%s> newmailbox=<%s> uniqueid=<%s>",
@@ -6616,6 +7524,12 @@ EXPORTED struct mailbox_iter *mailbox_iter_init(struct mailbox *mailbox,
     iter->changedsince = changedsince;
     iter->num_records = mailbox->i.num_records;
 
+    /* only read the records which changed, if the modseq log can
+     * tell us which they are */
+    if (changedsince &&
+        modseqlog_find(mailbox, changedsince, &iter->recnos, &iter->num_recnos))
+        iter->recnos = NULL;
+
     /* calculate which system_flags to skip over */
     if (flags & ITER_SKIP_UNLINKED)
         iter->skipflags |= FLAG_UNLINKED;
@@ -6633,15 +7547,30 @@ EXPORTED void mailbox_iter_startuid(struct mailbox_iter *iter, uint32_t uid)
     iter->recno = uid ? mailbox_finduid(mailbox, uid-1) : 0;
 }
 
+static int mailbox_iter_want(struct mailbox_iter *iter)
+{
+    int r = mailbox_read_index_record(iter->mailbox, iter->recno, &iter->record);
+    if (r) return 0;
+    if (!iter->record.uid) return 0; /* can happen on damaged mailboxes */
+    if ((iter->record.system_flags & iter->skipflags)) return 0;
+    if (iter->record.modseq <= iter->changedsince) return 0;
+    return 1;
+}
+
 EXPORTED const struct index_record *mailbox_iter_step(struct mailbox_iter *iter)
 {
+    if (iter->recnos) {
+        while (iter->pos < iter->num_recnos) {
+            uint32_t recno = iter->recnos[iter->pos++];
+            if (recno <= iter->recno) continue; /* before startuid */
+            iter->recno = recno;
+            if (mailbox_iter_want(iter)) return &iter->record;
+        }
+        return NULL;
+    }
+
     for (iter->recno++; iter->recno <= iter->num_records; iter->recno++) {
-        int r = mailbox_read_index_record(iter->mailbox, iter->recno, &iter->record);
-        if (r) continue;
-        if (!iter->record.uid) continue; /* can happen on damaged mailboxes */
-        if ((iter->record.system_flags & iter->skipflags)) continue;
-        if (iter->record.modseq <= iter->changedsince) continue;
-        return &iter->record;
+        if (mailbox_iter_want(iter)) return &iter->record;
     }
 
     /* guess we're done */
@@ -6652,6 +7581,7 @@ EXPORTED void mailbox_iter_done(struct mailbox_iter **iterp)
 {
     struct mailbox_iter *iter = *iterp;
     if (!iter) return;
+    free(iter->recnos);
     free(iter);
     *iterp = NULL;
 }
@@ -86,6 +86,8 @@
 #define FNAME_DAV "/cyrus.dav"
 #endif
 #define FNAME_ANNOTATIONS "/cyrus.annotations"
+#define FNAME_MODSEQLOG "/cyrus.modseqlog"
+#define FNAME_SORTCACHE "/cyrus.sortcache"
 
 enum meta_filename {
   META_HEADER = 1,
@@ -97,7 +99,9 @@ enum meta_filename {
 #ifdef WITH_DAV
   META_DAV,
 #endif
-  META_ARCHIVECACHE
+  META_ARCHIVECACHE,
+  META_MODSEQLOG,
+  META_SORTCACHE
 };
 
 #define MAILBOX_FNAME_LEN 256
@@ -266,6 +270,7 @@ struct mailbox {
     int modseq_dirty;
     int header_dirty;
     int quota_dirty;
+    int expirequeue_dirty;
     int has_changed;
     time_t last_updated; /* for appends*/
     quota_t quota_previously_used[QUOTA_NUMRESOURCES]; /* for quota change */
@@ -288,6 +293,10 @@ struct mailbox_iter {
     uint32_t recno;
     uint32_t num_records;
     unsigned skipflags;
+    uint32_t *recnos;   /* records changed since changedsince, from the
+                         * modseq log - or NULL to scan every record */
+    uint32_t num_recnos;
+    uint32_t pos;
 };
 
 /* Offsets of index/expunge header fields
@@ -530,6 +539,8 @@ extern int mailbox_rewrite_index_record(struct mailbox *mailbox,
                                         struct index_record *record);
 extern int mailbox_append_index_record(struct mailbox *mailbox,
                                        struct index_record *record);
+extern int mailbox_append_index_records(struct mailbox *mailbox,
+                                        struct index_record *records, int n);
 extern int mailbox_find_index_record(struct mailbox *mailbox, uint32_t uid,
                                      struct index_record *record);
 
@@ -564,8 +575,9 @@ extern int mailbox_expunge_cleanup(struct mailbox *mailbox, time_t expunge_mark,
 extern int mailbox_expunge(struct mailbox *mailbox,
                            mailbox_decideproc_t *decideproc, void *deciderock,
                            unsigned *nexpunged, int event_type);
-extern void mailbox_archive(struct mailbox *mailbox,
-                            mailbox_decideproc_t *decideproc, void *deciderock, unsigned flags);
+extern int mailbox_archive_staged(struct mailbox *mailbox,
+                                  mailbox_decideproc_t *decideproc,
+                                  void *deciderock, unsigned flags);
 extern void mailbox_remove_files_from_object_storage(struct mailbox *mailbox, unsigned flags);
 extern int mailbox_cleanup(struct mailbox *mailbox, int iscurrentdir,
                            mailbox_decideproc_t *decideproc, void *deciderock);
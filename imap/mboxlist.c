@@ -82,6 +82,8 @@
 #include "mboxlist.h"
 #include "quota.h"
 #include "sync_log.h"
+#include "xstats.h"
+#include "hashmap.h"
 
 #define DB config_mboxlist_db
 #define SUBDB config_subscription_db
@@ -89,6 +91,14 @@
 cyrus_acl_canonproc_t mboxlist_ensureOwnerRights;
 
 static struct db *mbdb;
+static int mbdb_racl;
+static char *mbdb_fname;
+
+struct mbdb_stamp {
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
 
 static int mboxlist_dbopen = 0;
 
@@ -488,6 +498,191 @@ done:
     return r;
 }
 
+/*
+ * mailboxes.db stamp
+ *
+ * For the append-only backends (twoskip, skiplist) every commit, by
+ * any process, changes the inode, size or mtime of the file, so those
+ * make a cheap generation number for anything we derive from it.
+ *
+ * A sharded mailboxes.db (mboxlist_db_shards) over one of those is
+ * stamped with the sum of its shards' inodes and sizes and the latest
+ * of their mtimes: a commit to any shard grows it, and a repacked
+ * shard is a new file.
+ */
+static int mbdb_getstamp(struct mbdb_stamp *stamp)
+{
+    const char *backend = DB;
+    struct buf fname = BUF_INITIALIZER;
+    struct stat sbuf;
+    char *end;
+    int nshards = 0;
+    int i;
+
+    if (!mboxlist_dbopen || !mbdb_fname) return -1;
+
+    if (!strncmp(backend, "sharded:", 8)) {
+        nshards = strtol(backend + 8, &end, 10);
+        if (nshards < 1 || *end != ':') return -1;
+        backend = end + 1;
+    }
+
+    /* only the append-only backends change the file on every commit */
+    if (strcmp(backend, "twoskip") && strcmp(backend, "skiplist")) return -1;
+
+    if (!nshards) {
+        if (stat(mbdb_fname, &sbuf)) return -1;
+
+        stamp->ino = sbuf.st_ino;
+        stamp->size = sbuf.st_size;
+        stamp->mtime = sbuf.st_mtime;
+
+        return 0;
+    }
+
+    memset(stamp, 0, sizeof(struct mbdb_stamp));
+    for (i = 0; i < nshards; i++) {
+        buf_reset(&fname);
+        buf_printf(&fname, "%s.%d", mbdb_fname, i);
+        if (stat(buf_cstring(&fname), &sbuf)) {
+            buf_free(&fname);
+            return -1;
+        }
+
+        stamp->ino += sbuf.st_ino;
+        stamp->size += sbuf.st_size;
+        if (sbuf.st_mtime > stamp->mtime)
+            stamp->mtime = sbuf.st_mtime;
+    }
+    buf_free(&fname);
+
+    return 0;
+}
+
+static int mbdb_samestamp(const struct mbdb_stamp *a,
+                          const struct mbdb_stamp *b)
+{
+    return (a->ino == b->ino && a->size == b->size && a->mtime == b->mtime);
+}
+
+/*
+ * Decoded mbentry cache
+ *
+ * The last mboxlist_cachesize names looked up outside a transaction,
+ * with their parsed entries (or the fact that there was no record),
+ * most recently used first.  The whole lot is dropped when the
+ * mailboxes.db stamp changes.
+ */
+
+struct mbcache_entry {
+    char *name;
+    mbentry_t *mbentry;         /* NULL if there was no record */
+    struct mbcache_entry *prev;
+    struct mbcache_entry *next;
+};
+
+static struct mbcache {
+    hashmap_t byname;
+    struct mbcache_entry *head; /* most recently used */
+    struct mbcache_entry *tail;
+    int count;
+    struct mbdb_stamp stamp;
+} mbcache = { HASHMAP_INITIALIZER, NULL, NULL, 0, { 0, 0, 0 } };
+
+static void mbcache_unlink(struct mbcache_entry *e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else mbcache.head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else mbcache.tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void mbcache_push(struct mbcache_entry *e)
+{
+    e->next = mbcache.head;
+    if (mbcache.head) mbcache.head->prev = e;
+    else mbcache.tail = e;
+    mbcache.head = e;
+}
+
+static void mbcache_entry_free(struct mbcache_entry *e)
+{
+    mboxlist_entry_free(&e->mbentry);
+    free(e->name);
+    free(e);
+}
+
+static void mbcache_flush(void)
+{
+    struct mbcache_entry *e, *next;
+
+    for (e = mbcache.head; e; e = next) {
+        next = e->next;
+        mbcache_entry_free(e);
+    }
+
+    free_hashmap(&mbcache.byname, NULL);
+    mbcache.head = mbcache.tail = NULL;
+    mbcache.count = 0;
+}
+
+/* Return non-zero if the cache can be used for a lookup right now,
+ * emptying it first if the database has changed. */
+static int mbcache_check(void)
+{
+    struct mbdb_stamp stamp;
+
+    if (config_getint(IMAPOPT_MBOXLIST_CACHESIZE) <= 0 ||
+        mbdb_getstamp(&stamp)) {
+        if (mbcache.count) mbcache_flush();
+        return 0;
+    }
+
+    if (!mbdb_samestamp(&mbcache.stamp, &stamp)) {
+        if (mbcache.count) {
+            mbcache_flush();
+            xstats_inc(MBOXLIST_CACHE_FLUSH);
+        }
+        mbcache.stamp = stamp;
+    }
+
+    return 1;
+}
+
+static struct mbcache_entry *mbcache_find(const char *name)
+{
+    struct mbcache_entry *e = hashmap_lookup(name, &mbcache.byname);
+
+    if (e && e != mbcache.head) {
+        mbcache_unlink(e);
+        mbcache_push(e);
+    }
+
+    return e;
+}
+
+/* takes ownership of mbentry */
+static void mbcache_store(const char *name, mbentry_t *mbentry)
+{
+    struct mbcache_entry *e;
+
+    while (mbcache.count >= config_getint(IMAPOPT_MBOXLIST_CACHESIZE)) {
+        e = mbcache.tail;
+        mbcache_unlink(e);
+        hashmap_del(e->name, &mbcache.byname);
+        mbcache_entry_free(e);
+        mbcache.count--;
+    }
+
+    e = xzmalloc(sizeof(struct mbcache_entry));
+    e->name = xstrdup(name);
+    e->mbentry = mbentry;
+    mbcache_push(e);
+    hashmap_insert(e->name, e, &mbcache.byname);
+    mbcache.count++;
+}
+
 /* read a record and parse into parts */
 static int mboxlist_mylookup(const char *name,
                              mbentry_t **mbentryptr,
@@ -496,11 +691,37 @@ static int mboxlist_mylookup(const char *name,
     int r;
     const char *data;
     size_t datalen;
+    mbentry_t *mbentry = NULL;
+    int usecache = (!tid && !wrlock && mbcache_check());
+
+    if (usecache) {
+        struct mbcache_entry *e = mbcache_find(name);
+
+        if (e) {
+            xstats_inc(MBOXLIST_CACHE_HIT);
+            if (!e->mbentry) return IMAP_MAILBOX_NONEXISTENT;
+            if (mbentryptr) *mbentryptr = mboxlist_entry_copy(e->mbentry);
+            return 0;
+        }
+
+        xstats_inc(MBOXLIST_CACHE_MISS);
+    }
 
     r = mboxlist_read(name, &data, &datalen, tid, wrlock);
+    if (r == IMAP_MAILBOX_NONEXISTENT && usecache)
+        mbcache_store(name, NULL);
     if (r) return r;
 
-    return mboxlist_parse_entry(mbentryptr, name, 0, data, datalen);
+    r = mboxlist_parse_entry(&mbentry, name, 0, data, datalen);
+    if (r) return r;
+
+    if (usecache)
+        mbcache_store(name, mboxlist_entry_copy(mbentry));
+
+    if (mbentryptr) *mbentryptr = mbentry;
+    else mboxlist_entry_free(&mbentry);
+
+    return 0;
 }
 
 /*
@@ -703,11 +924,23 @@ static int mboxlist_update_racl(const char *name, const mbentry_t *oldmbentry, c
     return r;
 }
 
+/* Is reverse ACL support on?  Under a sharded mailboxes.db the marker
+ * may live in a shard below the ones a transaction already holds, so
+ * only look it up before the transaction starts.  It is only changed
+ * by ctl_cyrusdb at startup. */
+static int mboxlist_have_racl(struct txn **txn)
+{
+    if (!txn || !*txn)
+        mbdb_racl = !cyrusdb_fetch(mbdb, "$RACL", 5, NULL, NULL, NULL);
+
+    return mbdb_racl;
+}
+
 static int mboxlist_update_entry(const char *name, const mbentry_t *mbentry, struct txn **txn)
 {
     int r = 0;
 
-    if (!cyrusdb_fetch(mbdb, "$RACL", 5, NULL, NULL, txn)) {
+    if (mboxlist_have_racl(txn)) {
         mbentry_t *old = NULL;
         mboxlist_mylookup(name, &old, txn, 0); // ignore errors, it will be NULL
         r = mboxlist_update_racl(name, old, mbentry, txn);
@@ -1198,7 +1431,12 @@ EXPORTED int mboxlist_insertremote(mbentry_t *mbentry,
     case CYRUSDB_OK:
         break;
     case CYRUSDB_AGAIN:
-        abort(); /* shouldn't happen ! */
+        /* a sharded mailboxes.db gave up the transaction to take its
+         * locks in order: callers updating many entries at once need
+         * mboxlist_lockall() first */
+        syslog(LOG_ERR, "DBERROR: transaction for %s given up, retry",
+               mbentry->name);
+        r = IMAP_AGAIN;
         break;
     default:
         syslog(LOG_ERR, "DBERROR: error updating database %s: %s",
@@ -2264,6 +2502,8 @@ static int find_p(void *rockp,
     /* skip any $RACL or future $ space keys */
     if (key[0] == '$') return 0;
 
+    xstats_inc(MBOXLIST_FIND_CANDIDATE);
+
     memcpy(intname, key, keylen);
     intname[keylen] = 0;
 
@@ -2511,7 +2751,10 @@ EXPORTED int mboxlist_set_racls(int enabled)
 {
     struct txn *tid = NULL;
     int r = 0;
-    int now = !cyrusdb_fetch(mbdb, "$RACL", 5, NULL, NULL, &tid);
+    int now;
+
+ retry:
+    now = !cyrusdb_fetch(mbdb, "$RACL", 5, NULL, NULL, &tid);
 
     if (now && !enabled) {
         syslog(LOG_NOTICE, "removing reverse acl support");
@@ -2531,11 +2774,19 @@ EXPORTED int mboxlist_set_racls(int enabled)
         if (!r) r = cyrusdb_store(mbdb, "$RACL", 5, "", 0, &tid);
     }
 
+    if (r == CYRUSDB_AGAIN) {
+        /* a sharded mailboxes.db gave up the locks to take them in order */
+        tid = NULL;
+        goto retry;
+    }
+
     if (r)
         cyrusdb_abort(mbdb, tid);
     else
         cyrusdb_commit(mbdb, tid);
 
+    if (!r) mbdb_racl = enabled;
+
     return r;
 }
 
@@ -2633,8 +2884,276 @@ EXPORTED int mboxlist_usermboxtree(const char *userid, mboxlist_cb *proc,
     return r;
 }
 
+/*
+ * Mailbox name trie
+ *
+ * An in-process tree of the names in mailboxes.db, one node per
+ * hierarchy component, used by mboxlist_find_category() to skip whole
+ * subtrees that the LIST/LSUB patterns can never reach.
+ *
+ * The tree is only used while the mailboxes.db stamp is unchanged since
+ * it was built.  Rebuilding it costs a read of the whole database, as
+ * much as a LIST without it, so on a database which keeps changing it
+ * is rebuilt at most once every mboxlist_trie_interval seconds, and in
+ * between LIST just reads the database as it would without the tree.
+ */
+
+struct mbtrie_node {
+    char *name;                 /* this component only */
+    int ismailbox;              /* a key exists for the full name */
+    ptrarray_t children;        /* struct mbtrie_node *, in insertion order */
+};
+
+struct mbtrie {
+    struct mbtrie_node root;
+    struct mbdb_stamp stamp;
+    time_t built;
+};
+
+static struct mbtrie *mbtrie_cache;
+
+static void mbtrie_node_fini(struct mbtrie_node *node)
+{
+    int i;
+
+    for (i = 0; i < node->children.count; i++) {
+        struct mbtrie_node *child = ptrarray_nth(&node->children, i);
+        mbtrie_node_fini(child);
+        free(child);
+    }
+    ptrarray_fini(&node->children);
+    free(node->name);
+}
+
+static void mbtrie_free(struct mbtrie **triep)
+{
+    struct mbtrie *trie = *triep;
+
+    if (!trie) return;
+
+    mbtrie_node_fini(&trie->root);
+    free(trie);
+    *triep = NULL;
+}
+
+static void mbtrie_insert(struct mbtrie_node *node, const char *name, size_t len)
+{
+    const char *p = name;
+    const char *end = name + len;
+    const char *bang = memchr(name, '!', len);
+
+    while (p < end) {
+        /* a domain prefix belongs to the first component */
+        const char *start = (p == name && bang) ? bang + 1 : p;
+        const char *dot = memchr(start, '.', end - start);
+        size_t clen = (dot ? dot : end) - p;
+        struct mbtrie_node *child = NULL;
+        int i;
+
+        /* keys arrive in database order, so a match is almost always
+         * the most recently added child */
+        for (i = node->children.count - 1; i >= 0; i--) {
+            struct mbtrie_node *c = ptrarray_nth(&node->children, i);
+            if (!strncmp(c->name, p, clen) && !c->name[clen]) {
+                child = c;
+                break;
+            }
+        }
+        if (!child) {
+            child = xzmalloc(sizeof(struct mbtrie_node));
+            child->name = xstrndup(p, clen);
+            ptrarray_append(&node->children, child);
+        }
+
+        node = child;
+        p += clen;
+        if (p < end) p++;   /* skip the separator */
+    }
+
+    node->ismailbox = 1;
+}
+
+static int mbtrie_build_cb(void *rock,
+                           const char *key, size_t keylen,
+                           const char *data __attribute__((unused)),
+                           size_t datalen __attribute__((unused)))
+{
+    struct mbtrie *trie = (struct mbtrie *) rock;
+
+    /* skip any $RACL or future $ space keys */
+    if (keylen && key[0] != '$')
+        mbtrie_insert(&trie->root, key, keylen);
+
+    return 0;
+}
+
+/* Return the trie for mailboxes.db, rebuilding it if the file has
+ * changed since we last looked, or NULL if it can't be used. */
+static struct mbtrie *mbtrie_get(void)
+{
+    struct mbdb_stamp stamp;
+    time_t now = time(NULL);
+    int r;
+
+    if (!config_getswitch(IMAPOPT_MBOXLIST_TRIE)) return NULL;
+
+    if (mbdb_getstamp(&stamp)) {
+        mbtrie_free(&mbtrie_cache);
+        return NULL;
+    }
+
+    if (mbtrie_cache) {
+        if (mbdb_samestamp(&mbtrie_cache->stamp, &stamp))
+            return mbtrie_cache;
+
+        /* out of date, and too soon to build another */
+        if (now >= mbtrie_cache->built &&
+            now < mbtrie_cache->built +
+                  config_getint(IMAPOPT_MBOXLIST_TRIE_INTERVAL)) {
+            xstats_inc(MBOXLIST_TRIE_STALE);
+            return NULL;
+        }
+    }
+
+    mbtrie_free(&mbtrie_cache);
+
+    mbtrie_cache = xzmalloc(sizeof(struct mbtrie));
+    mbtrie_cache->built = now;
+    r = cyrusdb_foreach(mbdb, "", 0, NULL, mbtrie_build_cb, mbtrie_cache, NULL);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: building mailbox trie: %s",
+               cyrusdb_strerror(r));
+        mbtrie_free(&mbtrie_cache);
+        return NULL;
+    }
+
+    /* stamp again: if someone wrote while we were reading, the next
+     * lookup rebuilds rather than trusting a half-new tree */
+    if (mbdb_getstamp(&mbtrie_cache->stamp)) {
+        mbtrie_free(&mbtrie_cache);
+        return NULL;
+    }
+
+    return mbtrie_cache;
+}
+
+/* return non-zero if nothing at or below 'intname' can match */
+static int find_prune(struct find_rock *rock, const char *intname)
+{
+    const char *deletedprefix = config_getstring(IMAPOPT_DELETEDPREFIX);
+    const char *local = strchr(intname, '!');
+    size_t dlen = strlen(deletedprefix);
+    const char *extname;
+    mbname_t *mbname;
+    int category;
+    int prune = 1;
+    int i;
+
+    local = local ? local + 1 : intname;
+
+    /* only prune once we're inside a namespace the patterns describe */
+    if (!*local || !strcmp(local, "user")) return 0;
+    if (!strncmp(local, deletedprefix, dlen) &&
+        (!local[dlen] || local[dlen] == '.'))
+        return 0;
+
+    mbname = mbname_from_intname(intname);
+
+    /* everything below another user's or a shared name shares its
+     * category, so a pass for some other category can skip it all */
+    category = mbname_category(mbname, rock->namespace, rock->userid);
+    if (category != MBNAME_OTHERUSER && category != MBNAME_SHARED) {
+        prune = 0;
+        goto done;
+    }
+    if (category != rock->mb_category)
+        goto done;
+
+    extname = mbname_extname(mbname, rock->namespace, rock->userid);
+    if (!extname) {
+        prune = 0;
+        goto done;
+    }
+
+    for (i = 0; i < rock->globs.count; i++) {
+        glob *g = ptrarray_nth(&rock->globs, i);
+        if (glob_test(g, extname) > 0 || glob_test_below(g, extname)) {
+            prune = 0;
+            break;
+        }
+    }
+
+done:
+    mbname_free(&mbname);
+    return prune;
+}
+
+struct mbtrie_walk {
+    struct find_rock *rock;
+    const char *prefix;
+    size_t prefixlen;
+    struct buf name;
+    strarray_t *matches;
+};
+
+static void mbtrie_walk(struct mbtrie_walk *walk, struct mbtrie_node *node)
+{
+    size_t len = walk->name.len;
+    size_t cmplen = len < walk->prefixlen ? len : walk->prefixlen;
+    int i;
+
+    /* off the prefix entirely */
+    if (memcmp(walk->name.s, walk->prefix, cmplen)) return;
+
+    if (len >= walk->prefixlen) {
+        if (len && find_prune(walk->rock, buf_cstring(&walk->name))) {
+            xstats_inc(MBOXLIST_FIND_PRUNED);
+            return;
+        }
+        if (node->ismailbox)
+            strarray_append(walk->matches, buf_cstring(&walk->name));
+    }
+
+    for (i = 0; i < node->children.count; i++) {
+        struct mbtrie_node *child = ptrarray_nth(&node->children, i);
+        if (len && walk->name.s[len-1] != '!')
+            buf_putc(&walk->name, '.');
+        buf_appendcstr(&walk->name, child->name);
+        mbtrie_walk(walk, child);
+        buf_truncate(&walk->name, len);
+    }
+}
+
+static struct db *mbtrie_sortdb;
+
+static int mbtrie_cmp(const void *a, const void *b)
+{
+    const char *sa = *(const char **) a;
+    const char *sb = *(const char **) b;
+
+    return cyrusdb_compar(mbtrie_sortdb, sa, strlen(sa), sb, strlen(sb));
+}
+
+/* Append to 'matches' every name in 'trie' starting with 'prefix' that
+ * survives pruning, in database key order. */
+static void mbtrie_candidates(struct mbtrie *trie, struct find_rock *rock,
+                              const char *prefix, size_t len,
+                              strarray_t *matches)
+{
+    struct mbtrie_walk walk = { rock, prefix, len, BUF_INITIALIZER, matches };
+
+    buf_cstring(&walk.name);
+    mbtrie_walk(&walk, &trie->root);
+    buf_free(&walk.name);
+
+    mbtrie_sortdb = rock->db;
+    qsort(matches->data, matches->count, sizeof(char *), mbtrie_cmp);
+    mbtrie_sortdb = NULL;
+}
+
 static int mboxlist_find_category(struct find_rock *rock, const char *prefix, size_t len)
 {
+    struct mbtrie *trie;
     int r = 0;
     if (!rock->issubs && !rock->isadmin && !cyrusdb_fetch(rock->db, "$RACL", 5, NULL, NULL, NULL)) {
         /* we're using reverse ACLs */
@@ -2648,6 +3167,21 @@ static int mboxlist_find_category(struct find_rock *rock, const char *prefix, si
          * we get correct names in matches */
         if (len) buf_appendmap(&buf, prefix, len);
         r = cyrusdb_foreach(rock->db, buf.s, buf.len, NULL, racl_cb, &raclrock, NULL);
+        buf_free(&buf);
+        if (!r && config_getswitch(IMAPOPT_MBOXLIST_TRIE)) {
+            /* the visible set is usually tiny, so a throwaway tree of it
+             * lets the patterns skip whole subtrees of it as well */
+            struct mbtrie visible;
+            int i;
+            memset(&visible, 0, sizeof(struct mbtrie));
+            for (i = 0; i < strarray_size(&matches); i++) {
+                const char *key = strarray_nth(&matches, i);
+                mbtrie_insert(&visible.root, key, strlen(key));
+            }
+            strarray_truncate(&matches, 0);
+            mbtrie_candidates(&visible, rock, prefix, len, &matches);
+            mbtrie_node_fini(&visible.root);
+        }
         /* XXX - later we need to sort the array when we've added groups */
         int i;
         for (i = 0; !r && i < strarray_size(&matches); i++) {
@@ -2656,6 +3190,16 @@ static int mboxlist_find_category(struct find_rock *rock, const char *prefix, si
         }
         strarray_fini(&matches);
     }
+    else if (!rock->issubs && rock->db == mbdb && (trie = mbtrie_get())) {
+        strarray_t matches = STRARRAY_INITIALIZER;
+        int i;
+        mbtrie_candidates(trie, rock, prefix, len, &matches);
+        for (i = 0; !r && i < strarray_size(&matches); i++) {
+            const char *key = strarray_nth(&matches, i);
+            r = cyrusdb_forone(rock->db, key, strlen(key), &find_p, &find_cb, rock, NULL);
+        }
+        strarray_fini(&matches);
+    }
     else {
         r = cyrusdb_foreach(rock->db, prefix, len, &find_p, &find_cb, rock, NULL);
     }
@@ -3284,8 +3828,12 @@ EXPORTED void mboxlist_open(const char *fname)
         fatal("can't read mailboxes file", EC_TEMPFAIL);
     }
 
+    free(mbdb_fname);
+    mbdb_fname = xstrdup(fname);
     free(tofree);
 
+    mbdb_racl = !cyrusdb_fetch(mbdb, "$RACL", 5, NULL, NULL, NULL);
+
     mboxlist_dbopen = 1;
 }
 
@@ -3301,6 +3849,11 @@ EXPORTED void mboxlist_close(void)
         }
         mboxlist_dbopen = 0;
     }
+
+    mbtrie_free(&mbtrie_cache);
+    mbcache_flush();
+    free(mbdb_fname);
+    mbdb_fname = NULL;
 }
 
 EXPORTED void mboxlist_done(void)
@@ -3584,6 +4137,29 @@ EXPORTED int mboxlist_changesub(const char *name, const char *userid,
 }
 
 /* Transaction Handlers */
+/* Write lock the whole of mailboxes.db, for a transaction which will
+ * touch many unrelated entries.  Otherwise a sharded mailboxes.db has
+ * to give up its locks with CYRUSDB_AGAIN to take them in order. */
+EXPORTED int mboxlist_lockall(struct txn **tid)
+{
+    int r = cyrusdb_lockall(mbdb, tid);
+
+    switch (r) {
+    case CYRUSDB_OK:
+        break;
+    case CYRUSDB_AGAIN:
+        r = IMAP_AGAIN;
+        break;
+    default:
+        syslog(LOG_ERR, "DBERROR: error locking mailboxes list: %s",
+               cyrusdb_strerror(r));
+        r = IMAP_IOERROR;
+        break;
+    }
+
+    return r;
+}
+
 EXPORTED int mboxlist_commit(struct txn *tid)
 {
     assert(tid);
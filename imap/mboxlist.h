@@ -300,6 +300,7 @@ void mboxlist_init(int flags);
 void mboxlist_done(void);
 
 /* for transactions */
+int mboxlist_lockall(struct txn **tid);
 int mboxlist_commit(struct txn *tid);
 int mboxlist_abort(struct txn *tid);
 
@@ -1854,6 +1854,18 @@ EXPORTED char *mboxname_metapath(const char *partition,
         filename = FNAME_DAV;
         break;
 #endif
+    case META_MODSEQLOG:
+        /* lives with the index it describes */
+        snprintf(confkey, 256, "metadir-index-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_INDEX;
+        filename = FNAME_MODSEQLOG;
+        break;
+    case META_SORTCACHE:
+        /* derived from the cache, so it lives with it */
+        snprintf(confkey, 256, "metadir-cache-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_CACHE;
+        filename = FNAME_SORTCACHE;
+        break;
     case META_ARCHIVECACHE:
         snprintf(confkey, 256, "metadir-archivecache-%s", partition);
         metaflag = IMAP_ENUM_METAPARTITION_FILES_ARCHIVECACHE;
@@ -2399,6 +2399,15 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
 
     mboxlist_allmbox("", sync_findall_cb, (void*)&rock, /*incdel*/0);
 
+    /* the changes below can be anywhere in the mailbox list */
+    ret = mboxlist_lockall(&tid);
+    if (ret) {
+        syslog(LOG_ERR, "can't lock mailbox list for synchronization: %s",
+               error_message(ret));
+        pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+        return ret;
+    }
+
     /* Traverse both lists, compare the names */
     /* If they match, ensure that location and acl are correct, if so,
        move on, if not, fix them */
@@ -52,6 +52,7 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <syslog.h>
 #include <netdb.h>
 #include <sys/socket.h>
@@ -2034,6 +2035,65 @@ int openinbox(void)
     return 1;
 }
 
+/* write a run of the message, from the file if it's worth it */
+static void blat_range(int fd, const char *base, size_t offset, size_t len)
+{
+    if (prot_cansendfile(popd_out, len))
+        prot_sendfile(popd_out, fd, offset, len);
+    else
+        prot_write(popd_out, base + offset, len);
+}
+
+/*
+ * Send a whole message, dot-stuffing the lines which start with '.'.
+ * The stretches in between go straight from the file to the client.
+ * Returns nonzero without writing anything if the file can't be read.
+ */
+static int blat_sendfile(const char *fname)
+{
+    struct buf msg = BUF_INITIALIZER;
+    struct stat sbuf;
+    size_t offset = 0;
+    int fd;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) return IMAP_IOERROR;
+
+    if (fstat(fd, &sbuf) == -1) {
+        syslog(LOG_ERR, "IOERROR: fstat on %s: %m", fname);
+        close(fd);
+        return IMAP_IOERROR;
+    }
+
+    buf_init_mmap(&msg, /*onceonly*/1, fd, fname, sbuf.st_size,
+                  popd_mailbox->name);
+
+    prot_printf(popd_out, "+OK Message follows\r\n");
+    if (msg.len && msg.s[0] == '.')
+        (void)prot_putc('.', popd_out);
+    while (offset < msg.len) {
+        const char *dot = memmem(msg.s + offset, msg.len - offset, "\n.", 2);
+        size_t end = dot ? (size_t)(dot - msg.s) + 1 : msg.len;
+
+        blat_range(fd, msg.s, offset, end - offset);
+        if (!dot) break;
+
+        /* the '.' itself goes out with the next run */
+        (void)prot_putc('.', popd_out);
+        offset = end;
+    }
+
+    /* Protect against messages not ending in CRLF */
+    if (!msg.len || msg.s[msg.len-1] != '\n') prot_printf(popd_out, "\r\n");
+
+    prot_printf(popd_out, ".\r\n");
+
+    buf_free(&msg);
+    close(fd);
+
+    return 0;
+}
+
 static int blat(int msgno, int lines)
 {
     FILE *msgfile;
@@ -2052,6 +2112,14 @@ static int blat(int msgno, int lines)
     }
 
     fname = mailbox_record_fname(popd_mailbox, &record);
+
+    /* big RETRs are sent without copying the message through us */
+    if (lines == -1 && prot_cansendfile(popd_out, record.size) &&
+        !blat_sendfile(fname)) {
+        prot_resettimeout(popd_in);
+        return 0;
+    }
+
     msgfile = fopen(fname, "r");
     if (!msgfile) {
         prot_printf(popd_out, "-ERR [SYS/PERM] Could not read message file\r\n");
@@ -123,6 +123,7 @@ int main(int argc,char **argv)
     int opt;
     int i;
     int fflag = 0;
+    int jflag = 0;
     int r, code = 0;
     int do_report = 1;
     char *alt_config = NULL, *domain = NULL;
@@ -131,7 +132,7 @@ int main(int argc,char **argv)
         fatal("must run as the Cyrus user", EC_USAGE);
     }
 
-    while ((opt = getopt(argc, argv, "C:d:fqZ")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:d:fJqZ")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -149,6 +150,10 @@ int main(int argc,char **argv)
             fflag = 1;
             break;
 
+        case 'J':
+            jflag = 1;
+            break;
+
         /* deliberately undocumented option for testing */
         case 'Z':
             test_sync_mode = 1;
@@ -186,6 +191,13 @@ int main(int argc,char **argv)
     quotadb_init(0);
     quotadb_open(NULL);
 
+    /* get any journaled usage into the db before we look at it */
+    r = quota_journal_fold(NULL);
+    if (jflag) {
+        code = convert_code(r);
+        goto done;
+    }
+
     quota_changelock();
 
     if (!r)
@@ -199,6 +211,7 @@ int main(int argc,char **argv)
     if (r) code = convert_code(r);
     else if (do_report) reportquota();
 
+done:
     quotadb_close();
     quotadb_done();
 
@@ -218,7 +231,8 @@ int main(int argc,char **argv)
 static void usage(void)
 {
     fprintf(stderr,
-            "usage: quota [-C <alt_config>] [-d <domain>] [-f] [-q] [prefix]...\n");
+            "usage: quota [-C <alt_config>] [-d <domain>] [-f] [-q] [prefix]...\n"
+            "       quota [-C <alt_config>] -J\n");
     exit(EC_USAGE);
 }
 
@@ -492,6 +506,11 @@ static int fixquota_dombox(const mbentry_t *mbentry, void *rock)
             if (r) goto done;
         }
 
+        /* the mailbox is locked, so once its journaled changes are
+         * in they all predate the scan, and any later ones follow it */
+        r = quota_journal_fold(root);
+        if (r) goto done;
+
         /* read the current data */
         quota_init(&localq, root);
         r = quota_read(&localq, &txn, 1);
@@ -560,6 +579,12 @@ int fixquota_finish(int thisquota)
         return r;
     }
 
+    r = quota_journal_fold(root);
+    if (r) {
+        errmsg("failed folding quota journal for '%s'", root, r);
+        return r;
+    }
+
     /* re-read the quota with the record locked */
     quota_init(&localq, root);
     r = quota_read(&localq, &tid, 1);
@@ -53,6 +53,7 @@
 #include <config.h>
 
 #define FNAME_QUOTADB "/quotas.db"
+#define FNAME_QUOTAJOURNAL "/quotajournal/"
 
 /* Define the proper quota type, which is 64 bit and signed */
 typedef long long int quota_t;
@@ -118,6 +119,7 @@ extern int quota_update_useds(const char *quotaroot,
                               const char *mboxname);
 extern int quota_check_useds(const char *quotaroot,
                              const quota_t diff[QUOTA_NUMRESOURCES]);
+extern int quota_journal_fold(const char *quotaroot);
 
 extern int quota_deleteroot(const char *quotaroot);
 
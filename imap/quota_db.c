@@ -45,11 +45,16 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/stat.h>
 
+#include "cyr_lock.h"
 #include "cyrusdb.h"
 #include "dlist.h"
 #include "exitcodes.h"
@@ -58,6 +63,8 @@
 #include "mboxname.h"
 #include "mboxevent.h"
 #include "quota.h"
+#include "retry.h"
+#include "strhash.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -453,11 +460,412 @@ EXPORTED int quota_write(struct quota *quota, struct txn **tid)
     return r;
 }
 
+/*
+ * Apply 'diff' to the usage of 'quotaroot' inside the transaction 'tid',
+ * queueing any QuotaWithin events on 'mboxevents'.  If a quota -f scan
+ * is in progress and has already passed 'mboxname', the scanned usage
+ * is adjusted too.
+ */
+static int quota_apply_useds(const char *quotaroot,
+                             const quota_t diff[QUOTA_NUMRESOURCES],
+                             const char *mboxname, struct txn **tid,
+                             struct mboxevent **mboxevents)
+{
+    struct quota q;
+    int res;
+    int cmp = 1;
+    int r;
+
+    quota_init(&q, quotaroot);
+
+    r = quota_read(&q, tid, 1);
+    if (r) goto done;
+
+    if (q.scanmbox && mboxname) {
+        cmp = cyrusdb_compar(qdb, mboxname, strlen(mboxname),
+                             q.scanmbox, strlen(q.scanmbox));
+    }
+    for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+        int was_over = quota_is_overquota(&q, res, NULL);
+        quota_use(&q, res, diff[res]);
+        if (cmp <= 0)
+            q.scanuseds[res] += diff[res];
+
+        if (was_over && !quota_is_overquota(&q, res, NULL)) {
+            struct mboxevent *mboxevent =
+                mboxevent_enqueue(EVENT_QUOTA_WITHIN, mboxevents);
+            mboxevent_extract_quota(mboxevent, &q, res);
+        }
+    }
+    r = quota_write(&q, tid);
+
+done:
+    quota_free(&q);
+    return r;
+}
+
+/*
+ * Quota delta journal.
+ *
+ * With quota_journal enabled, usage changes are not written to the
+ * quota db as they happen; instead each one is appended as a line
+ *
+ *     quotaroot TAB diff diff diff diff TAB mboxname LF
+ *
+ * to one of quota_journal_shards files in confdir/quotajournal/, chosen
+ * by hashing the quotaroot.  Appends only hold a lock on their shard,
+ * so they don't serialise on the quota db.  quota_journal_fold() later
+ * applies a shard's lines to the quota db in a single transaction and
+ * empties it.  Lines are applied in order with their mailbox name, so
+ * a concurrent quota -f sees them exactly as it would have done had
+ * they been written directly.
+ */
+#define QUOTA_JOURNAL_MAXSHARDS 256
+
+typedef int journalproc_t(const char *quotaroot,
+                          const quota_t diff[QUOTA_NUMRESOURCES],
+                          const char *mboxname, void *rock);
+
+static char *quota_journal_fname(const char *quotaroot)
+{
+    struct buf buf = BUF_INITIALIZER;
+    int nshards = config_getint(IMAPOPT_QUOTA_JOURNAL_SHARDS);
+
+    if (nshards < 1) nshards = 1;
+    if (nshards > QUOTA_JOURNAL_MAXSHARDS) nshards = QUOTA_JOURNAL_MAXSHARDS;
+
+    buf_printf(&buf, "%s%s%u", config_dir, FNAME_QUOTAJOURNAL,
+               strhash(quotaroot) % nshards);
+
+    return buf_release(&buf);
+}
+
+static int quota_journal_open(const char *fname, int flags)
+{
+    int fd = open(fname, flags, 0644);
+
+    if (fd == -1 && errno == ENOENT && (flags & O_CREAT)) {
+        if (cyrus_mkdir(fname, 0755) == 0)
+            fd = open(fname, flags, 0644);
+    }
+
+    return fd;
+}
+
+static int quota_journal_append(const char *quotaroot,
+                                const quota_t diff[QUOTA_NUMRESOURCES],
+                                const char *mboxname)
+{
+    struct buf buf = BUF_INITIALIZER;
+    char *fname = NULL;
+    int fd = -1;
+    int res;
+    int r;
+
+    buf_printf(&buf, "%s\t", quotaroot);
+    for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+        buf_printf(&buf, QUOTA_T_FMT "%c", diff[res],
+                   res < QUOTA_NUMRESOURCES-1 ? ' ' : '\t');
+    }
+    buf_printf(&buf, "%s\n", mboxname ? mboxname : "");
+
+    fname = quota_journal_fname(quotaroot);
+
+    fd = quota_journal_open(fname, O_WRONLY|O_APPEND|O_CREAT);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: opening quota journal %s: %m", fname);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    if (lock_blocking(fd, fname)) {
+        syslog(LOG_ERR, "IOERROR: locking quota journal %s: %m", fname);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    /* don't journal changes nobody will ever fold.  This is checked
+     * under the lock because quota_deleteroot() holds it too, so a
+     * line can't be written for a root after it has been deleted */
+    r = cyrusdb_fetch(qdb, quotaroot, strlen(quotaroot), NULL, NULL, NULL);
+    if (r == CYRUSDB_NOTFOUND) r = IMAP_QUOTAROOT_NONEXISTENT;
+    else if (r == CYRUSDB_AGAIN) r = IMAP_AGAIN;
+    else if (r) r = IMAP_IOERROR;
+
+    if (!r && retry_write(fd, buf.s, buf.len) != (ssize_t)buf.len) {
+        syslog(LOG_ERR, "IOERROR: writing quota journal %s: %m", fname);
+        r = IMAP_IOERROR;
+    }
+
+    lock_unlock(fd, fname);
+
+done:
+    if (fd != -1) close(fd);
+    free(fname);
+    buf_free(&buf);
+    return r;
+}
+
+/*
+ * Read the whole of the locked journal 'fd' and call 'proc' for each
+ * complete line in it.
+ */
+static int quota_journal_foreach(int fd, const char *fname,
+                                 journalproc_t *proc, void *rock)
+{
+    struct stat sbuf;
+    char *base = NULL;
+    char *line, *next, *end;
+    int r = 0;
+
+    if (fstat(fd, &sbuf) == -1) {
+        syslog(LOG_ERR, "IOERROR: stating quota journal %s: %m", fname);
+        return IMAP_IOERROR;
+    }
+    if (!sbuf.st_size) return 0;
+
+    base = xmalloc(sbuf.st_size);
+    if (lseek(fd, 0, SEEK_SET) == -1 ||
+        retry_read(fd, base, sbuf.st_size) != (ssize_t)sbuf.st_size) {
+        syslog(LOG_ERR, "IOERROR: reading quota journal %s: %m", fname);
+        free(base);
+        return IMAP_IOERROR;
+    }
+    end = base + sbuf.st_size;
+
+    for (line = base; !r && line < end; line = next) {
+        quota_t diff[QUOTA_NUMRESOURCES];
+        char *mboxname, *p;
+        int res;
+
+        next = memchr(line, '\n', end - line);
+        if (!next) {
+            syslog(LOG_ERR, "IOERROR: quota journal %s: "
+                            "discarding partial line at offset %ld",
+                   fname, (long)(line - base));
+            break;
+        }
+        *next++ = '\0';
+
+        p = strchr(line, '\t');
+        mboxname = strrchr(line, '\t');
+        if (!p || p == mboxname) goto bad;
+        *p++ = '\0';
+        *mboxname++ = '\0';
+
+        for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+            char *q;
+            errno = 0;
+            diff[res] = strtoll(p, &q, 10);
+            if (errno || q == p) goto bad;
+            p = q;
+        }
+        if (*p) goto bad;
+
+        r = proc(line, diff, *mboxname ? mboxname : NULL, rock);
+        continue;
+
+    bad:
+        syslog(LOG_ERR, "IOERROR: quota journal %s: "
+                        "invalid line at offset %ld",
+               fname, (long)(line - base));
+    }
+
+    free(base);
+    return r;
+}
+
+struct journal_fold_rock {
+    struct txn *tid;
+    struct mboxevent *mboxevents;
+};
+
+static int journal_fold_cb(const char *quotaroot,
+                           const quota_t diff[QUOTA_NUMRESOURCES],
+                           const char *mboxname, void *rock)
+{
+    struct journal_fold_rock *frock = (struct journal_fold_rock *)rock;
+    int r;
+
+    r = quota_apply_useds(quotaroot, diff, mboxname,
+                          &frock->tid, &frock->mboxevents);
+
+    /* the root was deleted since; its usage went with it */
+    if (r == IMAP_QUOTAROOT_NONEXISTENT) r = 0;
+
+    return r;
+}
+
+/*
+ * Apply the locked journal 'fd' to the quota db and empty it.
+ */
+static int quota_journal_foldfd(int fd, const char *fname)
+{
+    struct journal_fold_rock frock = { NULL, NULL };
+    int r;
+
+    r = quota_journal_foreach(fd, fname, journal_fold_cb, &frock);
+
+    if (r) {
+        quota_abort(&frock.tid);
+    }
+    else if (frock.tid) {
+        quota_commit(&frock.tid);
+        mboxevent_notify(frock.mboxevents);
+    }
+
+    /* the lines are in the quota db now: if we crash before this
+     * truncate they'll be applied twice, which quota -f will fix */
+    if (!r && ftruncate(fd, 0) == -1) {
+        syslog(LOG_ERR, "IOERROR: truncating quota journal %s: %m", fname);
+        r = IMAP_IOERROR;
+    }
+
+    mboxevent_freequeue(&frock.mboxevents);
+
+    if (r) {
+        syslog(LOG_ERR, "LOSTQUOTA: unable to fold quota journal %s: %s",
+               fname, error_message(r));
+    }
+
+    return r;
+}
+
+static int quota_journal_foldfile(const char *fname)
+{
+    int fd;
+    int r;
+
+    fd = open(fname, O_RDWR, 0);
+    if (fd == -1) {
+        if (errno == ENOENT) return 0;
+        syslog(LOG_ERR, "IOERROR: opening quota journal %s: %m", fname);
+        return IMAP_IOERROR;
+    }
+
+    if (lock_blocking(fd, fname)) {
+        syslog(LOG_ERR, "IOERROR: locking quota journal %s: %m", fname);
+        close(fd);
+        return IMAP_IOERROR;
+    }
+
+    r = quota_journal_foldfd(fd, fname);
+
+    lock_unlock(fd, fname);
+    close(fd);
+
+    return r;
+}
+
+/*
+ * Apply any journaled usage changes to the quota db.  If 'quotaroot' is
+ * given, only the shard holding that root is folded, otherwise all of
+ * them are.
+ */
+EXPORTED int quota_journal_fold(const char *quotaroot)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct dirent *dirent;
+    DIR *dirp;
+    int r = 0;
+
+    if (quotaroot) {
+        char *fname = quota_journal_fname(quotaroot);
+        r = quota_journal_foldfile(fname);
+        free(fname);
+        return r;
+    }
+
+    /* walk the directory rather than counting shards, in case
+     * quota_journal_shards has changed since the lines were written */
+    buf_printf(&buf, "%s%s", config_dir, FNAME_QUOTAJOURNAL);
+    dirp = opendir(buf_cstring(&buf));
+    if (!dirp) {
+        buf_free(&buf);
+        return 0;
+    }
+
+    while ((dirent = readdir(dirp))) {
+        int sr;
+
+        if (dirent->d_name[0] == '.') continue;
+
+        buf_reset(&buf);
+        buf_printf(&buf, "%s%s%s", config_dir, FNAME_QUOTAJOURNAL,
+                   dirent->d_name);
+        sr = quota_journal_foldfile(buf_cstring(&buf));
+        if (sr && !r) r = sr;
+    }
+
+    closedir(dirp);
+    buf_free(&buf);
+
+    return r;
+}
+
+static int journal_pending_cb(const char *quotaroot,
+                              const quota_t diff[QUOTA_NUMRESOURCES],
+                              const char *mboxname __attribute__((unused)),
+                              void *rock)
+{
+    struct quota *q = (struct quota *)rock;
+    int res;
+
+    if (strcmp(quotaroot, q->root)) return 0;
+
+    /* be conservative: an increase may already be on its way into the
+     * quota db, but a decrease mustn't be spent until it has arrived */
+    for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+        if (diff[res] > 0)
+            q->useds[res] += diff[res];
+    }
+
+    return 0;
+}
+
+/*
+ * Read 'q' from the quota db, plus the not yet folded increases to its
+ * usage.  The shard is share locked across both reads, so a fold can't
+ * move lines into the db between them and have them counted twice, or
+ * not at all.
+ */
+static int quota_read_pending(struct quota *q)
+{
+    char *fname = quota_journal_fname(q->root);
+    int fd;
+    int r = 0;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            syslog(LOG_ERR, "IOERROR: opening quota journal %s: %m", fname);
+            r = IMAP_IOERROR;
+        }
+        else r = quota_read(q, NULL, /*wrlock*/0);
+        goto done;
+    }
+
+    if (lock_shared(fd, fname)) {
+        syslog(LOG_ERR, "IOERROR: locking quota journal %s: %m", fname);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    r = quota_read(q, NULL, /*wrlock*/0);
+    if (!r) r = quota_journal_foreach(fd, fname, journal_pending_cb, q);
+
+    lock_unlock(fd, fname);
+
+done:
+    if (fd != -1) close(fd);
+    free(fname);
+    return r;
+}
+
 EXPORTED int quota_update_useds(const char *quotaroot,
                        const quota_t diff[QUOTA_NUMRESOURCES],
                        const char *mboxname)
 {
-    struct quota q;
     struct txn *tid = NULL;
     int r = 0;
     struct mboxevent *mboxevents = NULL;
@@ -465,32 +873,13 @@ EXPORTED int quota_update_useds(const char *quotaroot,
     if (!quotaroot || !*quotaroot)
         return IMAP_QUOTAROOT_NONEXISTENT;
 
-    quota_init(&q, quotaroot);
-
-    r = quota_read(&q, &tid, 1);
-
-    if (!r) {
-        int res;
-        int cmp = 1;
-        if (q.scanmbox) {
-            cmp = cyrusdb_compar(qdb, mboxname, strlen(mboxname),
-                                 q.scanmbox, strlen(q.scanmbox));
-        }
-        for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
-            int was_over = quota_is_overquota(&q, res, NULL);
-            quota_use(&q, res, diff[res]);
-            if (cmp <= 0)
-                q.scanuseds[res] += diff[res];
-
-            if (was_over && !quota_is_overquota(&q, res, NULL)) {
-                struct mboxevent *mboxevent =
-                    mboxevent_enqueue(EVENT_QUOTA_WITHIN, &mboxevents);
-                mboxevent_extract_quota(mboxevent, &q, res);
-            }
-        }
-        r = quota_write(&q, &tid);
+    if (config_getswitch(IMAPOPT_QUOTA_JOURNAL)) {
+        r = quota_journal_append(quotaroot, diff, mboxname);
+        goto out;
     }
 
+    r = quota_apply_useds(quotaroot, diff, mboxname, &tid, &mboxevents);
+
     if (r) {
         quota_abort(&tid);
         goto out;
@@ -500,7 +889,6 @@ EXPORTED int quota_update_useds(const char *quotaroot,
     mboxevent_notify(mboxevents);
 
 out:
-    quota_free(&q);
     if (r) {
         syslog(LOG_ERR, "LOSTQUOTA: unable to record change of "
                QUOTA_T_FMT " bytes and " QUOTA_T_FMT " messages in quota %s: %s",
@@ -533,7 +921,10 @@ EXPORTED int quota_check_useds(const char *quotaroot,
         return 0;           /* all negative */
 
     quota_init(&q, quotaroot);
-    r = quota_read(&q, NULL, /*wrlock*/0);
+    if (config_getswitch(IMAPOPT_QUOTA_JOURNAL))
+        r = quota_read_pending(&q);
+    else
+        r = quota_read(&q, NULL, /*wrlock*/0);
 
     if (r == IMAP_QUOTAROOT_NONEXISTENT) {
         r = 0;
@@ -556,26 +947,63 @@ done:
  */
 EXPORTED int quota_deleteroot(const char *quotaroot)
 {
+    char *fname = NULL;
+    int fd = -1;
     int r;
 
     if (!quotaroot || !*quotaroot)
         return IMAP_QUOTAROOT_NONEXISTENT;
 
+    /* journaled changes for the root mustn't outlive it, or they'd be
+     * charged to the next root of the same name: fold its shard, and
+     * hold the lock until the root is gone so no more can be added.
+     * Leftover lines from when journaling was on are folded too */
+    fname = quota_journal_fname(quotaroot);
+    fd = quota_journal_open(fname, O_RDWR |
+                    (config_getswitch(IMAPOPT_QUOTA_JOURNAL) ? O_CREAT : 0));
+    if (fd == -1 && errno != ENOENT) {
+        syslog(LOG_ERR, "IOERROR: opening quota journal %s: %m", fname);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+    if (fd != -1) {
+        if (lock_blocking(fd, fname)) {
+            syslog(LOG_ERR, "IOERROR: locking quota journal %s: %m", fname);
+            close(fd);
+            fd = -1;
+            r = IMAP_IOERROR;
+            goto done;
+        }
+        r = quota_journal_foldfd(fd, fname);
+        if (r) goto done;
+    }
+
     r = cyrusdb_delete(qdb, quotaroot, strlen(quotaroot), NULL, 0);
 
     switch (r) {
     case CYRUSDB_OK:
     case CYRUSDB_NOTFOUND:  /* shouldn't happen anyway */
-        return 0;
+        r = 0;
+        break;
 
     case CYRUSDB_AGAIN:
-        return IMAP_AGAIN;
+        r = IMAP_AGAIN;
+        break;
 
     default:
         syslog(LOG_ERR, "DBERROR: error deleting quotaroot %s: %s",
                quotaroot, cyrusdb_strerror(r));
-        return IMAP_IOERROR;
+        r = IMAP_IOERROR;
+        break;
+    }
+
+done:
+    if (fd != -1) {
+        lock_unlock(fd, fname);
+        close(fd);
     }
+    free(fname);
+    return r;
 }
 
 /*
@@ -43,6 +43,11 @@
 #include <config.h>
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <syslog.h>
 #include <string.h>
@@ -55,6 +60,8 @@
 #include "global.h"
 #include "search_engines.h"
 #include "ptrarray.h"
+#include "retry.h"
+#include "xmalloc.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -140,6 +147,13 @@ EXPORTED search_text_receiver_t *search_begin_update(int verbose)
     return (se->begin_update ? se->begin_update(verbose) : NULL);
 }
 
+static struct search_update_stats update_stats;
+
+EXPORTED void search_get_update_stats(struct search_update_stats *stats)
+{
+    *stats = update_stats;
+}
+
 static int search_batch_size(void)
 {
     const struct search_engine *se = engine();
@@ -147,6 +161,456 @@ static int search_batch_size(void)
             config_getint(IMAPOPT_SEARCH_BATCHSIZE) : INT_MAX);
 }
 
+/*
+ * Parallel text extraction.
+ *
+ * Extracting text from a message (MIME decoding, charset conversion,
+ * HTML stripping) is CPU bound, and writing it to the index can't
+ * start until it's done.  With extraction workers configured, a pool
+ * of children is forked the first time it's needed and kept for the
+ * life of the process.  The parent hands out messages round robin,
+ * by uid and file name, down each worker's command pipe.  A worker
+ * extracts text using a receiver that just serialises the receiver
+ * calls down its result pipe, and the parent buffers those results
+ * and replays them into the real receiver strictly in batch order, so
+ * the search engine only ever sees one writer and ascending uids.
+ * At most EXTRACT_WINDOW messages are outstanding per worker, which
+ * bounds both the pipes and the parent's buffers.
+ *
+ * Each task is a 4 byte uid and a 4 byte length, then the file name.
+ * Each result is framed as a 4 byte length, then a sequence of
+ * records, each a type byte and a 4 byte value (or length, for text).
+ * A zero length result means the worker failed to extract the message.
+ */
+
+#define EXTRACT_WINDOW 8
+
+struct extract_worker {
+    pid_t pid;
+    int cmdfd;
+    int resfd;
+    struct buf in;
+};
+
+static struct extract_worker *extract_pool = NULL;
+static int extract_pool_size = 0;
+
+static int extract_workers = 0;
+
+static void extract_pool_stop(void);
+
+EXPORTED void search_set_extract_workers(int n)
+{
+    if (n != extract_workers) extract_pool_stop();
+    extract_workers = n;
+}
+
+static int search_extract_workers(void)
+{
+    if (extract_workers) return extract_workers;
+    return config_getint(IMAPOPT_SEARCH_EXTRACT_WORKERS);
+}
+
+enum {
+    EXTRACT_BEGIN_MESSAGE   = 'M',
+    EXTRACT_BEGIN_PART      = 'P',
+    EXTRACT_TEXT            = 'T',
+    EXTRACT_END_PART        = 'E',
+};
+
+struct extract_receiver {
+    search_text_receiver_t super;
+    int fd;
+    uint32_t uid;
+    struct buf out;
+    int error;
+};
+
+static void extract_put_record(struct extract_receiver *er,
+                               char type, uint32_t val)
+{
+    uint32_t nval = htonl(val);
+
+    buf_putc(&er->out, type);
+    buf_appendmap(&er->out, (const char *) &nval, sizeof(nval));
+}
+
+static void extract_begin_message(search_text_receiver_t *rx,
+                                  uint32_t uid __attribute__((unused)))
+{
+    struct extract_receiver *er = (struct extract_receiver *) rx;
+
+    /* leave room for the frame length.  The worker only has the
+     * message file, so the uid comes from the task instead */
+    buf_reset(&er->out);
+    buf_appendmap(&er->out, "\0\0\0\0", 4);
+    extract_put_record(er, EXTRACT_BEGIN_MESSAGE, er->uid);
+}
+
+static void extract_begin_part(search_text_receiver_t *rx, int part)
+{
+    extract_put_record((struct extract_receiver *) rx,
+                       EXTRACT_BEGIN_PART, part);
+}
+
+static void extract_append_text(search_text_receiver_t *rx,
+                                const struct buf *text)
+{
+    struct extract_receiver *er = (struct extract_receiver *) rx;
+
+    extract_put_record(er, EXTRACT_TEXT, text->len);
+    buf_appendmap(&er->out, text->s, text->len);
+}
+
+static void extract_end_part(search_text_receiver_t *rx, int part)
+{
+    extract_put_record((struct extract_receiver *) rx,
+                       EXTRACT_END_PART, part);
+}
+
+static int extract_end_message(search_text_receiver_t *rx)
+{
+    struct extract_receiver *er = (struct extract_receiver *) rx;
+    uint32_t len = htonl(buf_len(&er->out) - 4);
+
+    memcpy(er->out.s, &len, sizeof(len));
+
+    if (retry_write(er->fd, buf_base(&er->out), buf_len(&er->out)) < 0) {
+        syslog(LOG_ERR, "IOERROR: search extract worker write: %m");
+        er->error = IMAP_IOERROR;
+    }
+    buf_reset(&er->out);
+
+    return er->error;
+}
+
+/* the worker: extract each message we're sent until the parent
+ * closes our command pipe */
+static void extract_worker_main(int cmdfd, int resfd)
+{
+    struct extract_receiver er;
+    struct buf fname = BUF_INITIALIZER;
+    uint32_t hdr[2];
+    ssize_t n;
+
+    memset(&er, 0, sizeof(er));
+    er.super.begin_message = extract_begin_message;
+    er.super.begin_part = extract_begin_part;
+    er.super.append_text = extract_append_text;
+    er.super.end_part = extract_end_part;
+    er.super.end_message = extract_end_message;
+    er.fd = resfd;
+
+    while (!er.error && (n = retry_read(cmdfd, hdr, sizeof(hdr))) > 0) {
+        message_t *msg;
+        uint32_t len = ntohl(hdr[1]);
+        int r;
+
+        if (n != sizeof(hdr) || len >= MAX_MAILBOX_PATH) {
+            er.error = IMAP_IOERROR;
+            break;
+        }
+
+        buf_reset(&fname);
+        buf_ensure(&fname, len);
+        if (retry_read(cmdfd, fname.s, len) != (ssize_t) len) {
+            er.error = IMAP_IOERROR;
+            break;
+        }
+        buf_truncate(&fname, len);
+
+        er.uid = ntohl(hdr[0]);
+        msg = message_new_from_filename(buf_cstring(&fname));
+        r = index_getsearchtext(msg, &er.super, 0);
+        message_unref(&msg);
+
+        if (r && !er.error) {
+            /* tell the parent, so it doesn't wait for this message */
+            static const char failed[4] = { 0, 0, 0, 0 };
+
+            syslog(LOG_ERR, "search extract worker: %s: %s",
+                   buf_cstring(&fname), error_message(r));
+            if (retry_write(resfd, failed, sizeof(failed)) < 0)
+                er.error = IMAP_IOERROR;
+        }
+    }
+
+    buf_free(&fname);
+    buf_free(&er.out);
+    close(cmdfd);
+    close(resfd);
+    _exit(er.error ? 1 : 0);
+}
+
+static void extract_pool_stop(void)
+{
+    int w;
+
+    if (!extract_pool) return;
+
+    /* closing the command pipes tells the workers to exit; closing the
+     * result pipes kills any still writing with SIGPIPE */
+    for (w = 0; w < extract_pool_size; w++) {
+        if (extract_pool[w].cmdfd >= 0) close(extract_pool[w].cmdfd);
+        if (extract_pool[w].resfd >= 0) close(extract_pool[w].resfd);
+        buf_free(&extract_pool[w].in);
+    }
+
+    for (w = 0; w < extract_pool_size; w++) {
+        int status;
+
+        if (extract_pool[w].pid <= 0) continue;
+        while (waitpid(extract_pool[w].pid, &status, 0) < 0 && errno == EINTR);
+    }
+
+    free(extract_pool);
+    extract_pool = NULL;
+    extract_pool_size = 0;
+}
+
+static int extract_pool_start(int nworkers)
+{
+    int nfds = getdtablesize();
+    int w;
+
+    extract_pool = xzmalloc(nworkers * sizeof(struct extract_worker));
+    extract_pool_size = nworkers;
+    for (w = 0; w < nworkers; w++) {
+        extract_pool[w].cmdfd = -1;
+        extract_pool[w].resfd = -1;
+    }
+
+    /* don't let the children inherit buffered output */
+    fflush(stdout);
+    fflush(stderr);
+
+    for (w = 0; w < nworkers; w++) {
+        int cmdpipe[2];
+        int respipe[2];
+
+        if (pipe(cmdpipe) < 0) {
+            syslog(LOG_ERR, "IOERROR: search extract pipe: %m");
+            goto err;
+        }
+        if (pipe(respipe) < 0) {
+            syslog(LOG_ERR, "IOERROR: search extract pipe: %m");
+            close(cmdpipe[0]);
+            close(cmdpipe[1]);
+            goto err;
+        }
+
+        extract_pool[w].pid = fork();
+        if (extract_pool[w].pid < 0) {
+            syslog(LOG_ERR, "IOERROR: search extract fork: %m");
+            close(cmdpipe[0]);
+            close(cmdpipe[1]);
+            close(respipe[0]);
+            close(respipe[1]);
+            goto err;
+        }
+
+        if (!extract_pool[w].pid) {
+            /* child: the worker outlives whatever databases and
+             * locks the parent has open now, so hold on to nothing
+             * but our own pipes */
+            int fd;
+
+            for (fd = 3; fd < nfds; fd++) {
+                if (fd != cmdpipe[0] && fd != respipe[1]) close(fd);
+            }
+            extract_worker_main(cmdpipe[0], respipe[1]);
+        }
+
+        /* parent */
+        close(cmdpipe[0]);
+        close(respipe[1]);
+        extract_pool[w].cmdfd = cmdpipe[1];
+        extract_pool[w].resfd = respipe[0];
+    }
+
+    return 0;
+
+ err:
+    extract_pool_stop();
+    return IMAP_IOERROR;
+}
+
+/* replay one framed message into the real receiver */
+static int extract_replay(search_text_receiver_t *rx,
+                          const char *base, size_t len)
+{
+    const char *p = base;
+    const char *end = base + len;
+    int in_message = 0;
+
+    while (p + 5 <= end) {
+        char type = *p;
+        uint32_t val;
+        struct buf text = BUF_INITIALIZER;
+
+        memcpy(&val, p + 1, sizeof(val));
+        val = ntohl(val);
+        p += 5;
+
+        switch (type) {
+        case EXTRACT_BEGIN_MESSAGE:
+            rx->begin_message(rx, val);
+            in_message = 1;
+            break;
+        case EXTRACT_BEGIN_PART:
+            rx->begin_part(rx, val);
+            break;
+        case EXTRACT_TEXT:
+            if (p + val > end) return IMAP_IOERROR;
+            buf_init_ro(&text, p, val);
+            rx->append_text(rx, &text);
+            p += val;
+            break;
+        case EXTRACT_END_PART:
+            rx->end_part(rx, val);
+            break;
+        default:
+            return IMAP_IOERROR;
+        }
+    }
+
+    if (!in_message || p != end) return IMAP_IOERROR;
+
+    return rx->end_message(rx);
+}
+
+static int extract_send_task(struct extract_worker *worker, message_t *msg)
+{
+    const char *fname = NULL;
+    uint32_t uid = 0;
+    uint32_t hdr[2];
+    struct iovec iov[2];
+    int r;
+
+    r = message_get_uid(msg, &uid);
+    if (!r) r = message_get_fname(msg, &fname);
+    if (r) return r;
+
+    hdr[0] = htonl(uid);
+    hdr[1] = htonl(strlen(fname));
+    iov[0].iov_base = (char *) hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (char *) fname;
+    iov[1].iov_len = strlen(fname);
+
+    if (retry_writev(worker->cmdfd, iov, 2) < 0) {
+        syslog(LOG_ERR, "IOERROR: search extract task write: %m");
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+static int extract_batch_parallel(search_text_receiver_t *rx,
+                                  ptrarray_t *batch, int nworkers)
+{
+    struct pollfd *fds;
+    int nsent = 0;
+    int nreplayed = 0;
+    int nactive;
+    int i, w;
+    int r = 0;
+
+    if (extract_pool_size != nworkers) {
+        extract_pool_stop();
+        r = extract_pool_start(nworkers);
+        if (r) return r;
+    }
+
+    /* a short batch only needs some of the pool */
+    nactive = nworkers < batch->count ? nworkers : batch->count;
+
+    fds = xmalloc(nactive * sizeof(struct pollfd));
+
+    while (!r && nreplayed < batch->count) {
+        struct extract_worker *next;
+        uint32_t len;
+
+        /* keep every worker busy, up to the window */
+        while (!r && nsent < batch->count &&
+               nsent < nreplayed + nactive * EXTRACT_WINDOW) {
+            r = extract_send_task(&extract_pool[nsent % nactive],
+                                  ptrarray_nth(batch, nsent));
+            nsent++;
+        }
+        if (r) break;
+
+        /* replay the next message in batch order, if it's complete */
+        next = &extract_pool[nreplayed % nactive];
+        if (buf_len(&next->in) >= 4) {
+            memcpy(&len, next->in.s, sizeof(len));
+            len = ntohl(len);
+            if (!len) {
+                r = IMAP_IOERROR;
+                break;
+            }
+            if (buf_len(&next->in) >= 4 + len) {
+                r = extract_replay(rx, next->in.s + 4, len);
+                buf_remove(&next->in, 0, 4 + len);
+                nreplayed++;
+                continue;
+            }
+        }
+
+        /* otherwise buffer whatever the workers have ready */
+        for (w = 0; w < nactive; w++) {
+            fds[w].fd = extract_pool[w].resfd;
+            fds[w].events = POLLIN;
+            fds[w].revents = 0;
+        }
+        if (poll(fds, nactive, -1) < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "IOERROR: search extract poll: %m");
+            r = IMAP_IOERROR;
+            break;
+        }
+
+        for (w = 0; w < nactive; w++) {
+            char tmp[65536];
+            ssize_t n;
+
+            if (fds[w].fd < 0 || !fds[w].revents) continue;
+
+            n = read(fds[w].fd, tmp, sizeof(tmp));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (n < 0)
+                    syslog(LOG_ERR, "IOERROR: search extract read: %m");
+                else
+                    syslog(LOG_ERR, "IOERROR: search extract worker exited");
+                r = IMAP_IOERROR;
+                break;
+            }
+
+            buf_appendmap(&extract_pool[w].in, tmp, n);
+        }
+    }
+
+    /* the workers are out of step with us now; start again next time */
+    if (r) extract_pool_stop();
+
+    for (i = 0; i < batch->count; i++) {
+        message_t *msg = ptrarray_nth(batch, i);
+        uint32_t size = 0;
+
+        if (!r && !message_get_size(msg, &size)) {
+            update_stats.messages++;
+            update_stats.bytes += size;
+        }
+        message_unref(&msg);
+    }
+    ptrarray_truncate(batch, 0);
+
+    free(fds);
+
+    return r;
+}
+
 /*
  * Flush a batch of messages to the search engine's indexer code.  We
  * drop the index lock during the presumably CPU and IO heavy parts of
@@ -159,6 +623,7 @@ static int flush_batch(search_text_receiver_t *rx,
                        ptrarray_t *batch)
 {
     int i;
+    int nworkers;
     int r = 0;
 
     /* give someone else a chance */
@@ -176,10 +641,23 @@ static int flush_batch(search_text_receiver_t *rx,
                             so we'll fail later anyway */
     }
 
+    nworkers = search_extract_workers();
+    if (nworkers > 1 && batch->count > 1) {
+        r = extract_batch_parallel(rx, batch, nworkers);
+        if (r) return r;
+    }
+
     for (i = 0 ; i < batch->count ; i++) {
         message_t *msg = ptrarray_nth(batch, i);
-        if (!r)
+        if (!r) {
+            uint32_t size = 0;
+
             r = index_getsearchtext(msg, rx, 0);
+            if (!r && !message_get_size(msg, &size)) {
+                update_stats.messages++;
+                update_stats.bytes += size;
+            }
+        }
         message_unref(&msg);
     }
     ptrarray_truncate(batch, 0);
@@ -209,6 +687,8 @@ EXPORTED int search_update_mailbox(search_text_receiver_t *rx,
     r = rx->begin_mailbox(rx, mailbox, flags);
     if (r) goto done;
 
+    update_stats.mailboxes++;
+
     struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, ITER_SKIP_EXPUNGED);
     mailbox_iter_startuid(iter, rx->first_unindexed_uid(rx));
 
@@ -132,6 +132,8 @@ struct search_engine {
                                          * expunged records */
 #define SEARCH_COMPACT_AUDIT    (1<<7)  /* check DB for missing records */
 #define SEARCH_COMPACT_REINDEX  (1<<8)  /* re-index all matching messages */
+#define SEARCH_COMPACT_AUTO     (1<<9)  /* only if search_autocompact_*
+                                         * says it's due */
     search_builder_t *(*begin_search)(struct mailbox *, int opts);
     void (*end_search)(search_builder_t *);
     search_text_receiver_t *(*begin_update)(int verbose);
@@ -164,10 +166,24 @@ extern void search_end_search(search_builder_t *);
 
 #define SEARCH_UPDATE_INCREMENTAL (1<<0)
 #define SEARCH_UPDATE_NONBLOCKING (1<<1)
+#define SEARCH_UPDATE_BATCH       (1<<2)  /* commit across mailboxes, if
+                                           * the engine can */
 search_text_receiver_t *search_begin_update(int verbose);
 int search_update_mailbox(search_text_receiver_t *rx,
                           struct mailbox *mailbox,
                           int flags);
+
+/* running totals of what search_update_mailbox has indexed */
+struct search_update_stats {
+    uint64_t mailboxes;
+    uint64_t messages;
+    uint64_t bytes;
+};
+void search_get_update_stats(struct search_update_stats *stats);
+
+/* number of processes to extract text with, overriding
+ * search_extract_workers */
+void search_set_extract_workers(int n);
 int search_end_update(search_text_receiver_t *rx);
 search_text_receiver_t *search_begin_snippets(void *internalised,
                                               int verbose,
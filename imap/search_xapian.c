@@ -57,6 +57,7 @@
 #include "assert.h"
 #include "bitvector.h"
 #include "global.h"
+#include "hash.h"
 #include "ptrarray.h"
 #include "user.h"
 #include "xmalloc.h"
@@ -608,47 +609,63 @@ static int store_indexed(struct db *db, struct txn **tid,
     return r;
 }
 
+struct write_indexed_rock {
+    struct db *db;
+    struct txn *txn;
+    const char *path;
+    int verbose;
+    int r;
+};
+
+static void write_indexed_cb(const char *key, void *data, void *rock)
+{
+    struct write_indexed_rock *wrock = (struct write_indexed_rock *)rock;
+    struct seqset *seq = (struct seqset *)data;
+
+    if (wrock->r) return;
+
+    if (wrock->verbose) {
+        char *str = seqset_cstring(seq);
+        syslog(LOG_INFO, "write_indexed db=%s key=%s uids=%s",
+               wrock->path, key, str);
+        free(str);
+    }
+
+    wrock->r = store_indexed(wrock->db, &wrock->txn, key, strlen(key), seq);
+}
+
 /* Given the directory of a xapian database which has just had
- * messages indexed into it, add the sequence of UIDs to the
- * record for the given mailbox and uidvalidity */
+ * messages indexed into it, add the sequences of UIDs to the
+ * records for each "mailbox.uidvalidity" key in the table,
+ * all in a single transaction */
 static int write_indexed(const char *dir,
-                         const char *mboxname,
-                         uint32_t uidvalidity,
-                         struct seqset *seq,
+                         hash_table *indexed,
                          int verbose)
 {
     struct buf path = BUF_INITIALIZER;
-    struct buf key = BUF_INITIALIZER;
-    struct db *db = NULL;
-    struct txn *txn = NULL;
+    struct write_indexed_rock wrock = { NULL, NULL, NULL, verbose, 0 };
     int r = 0;
 
-    buf_reset(&path);
-    buf_printf(&path, "%s%s", dir, INDEXEDDB_FNAME);
-
-    if (verbose) {
-        char *str = seqset_cstring(seq);
-        syslog(LOG_INFO, "write_indexed db=%s mailbox=%s uidvalidity=%u uids=%s",
-               buf_cstring(&path), mboxname, uidvalidity, str);
-        free(str);
-    }
+    if (!hash_numrecords(indexed)) return 0;
 
-    buf_printf(&key, "%s.%u", mboxname, uidvalidity);
+    buf_printf(&path, "%s%s", dir, INDEXEDDB_FNAME);
+    wrock.path = buf_cstring(&path);
 
     r = cyrusdb_open(config_getstring(IMAPOPT_SEARCH_INDEXED_DB),
-                     buf_cstring(&path), CYRUSDB_CREATE, &db);
+                     buf_cstring(&path), CYRUSDB_CREATE, &wrock.db);
     if (r) goto out;
 
-    r = store_indexed(db, &txn, key.s, key.len, seq);
+    hash_enumerate(indexed, write_indexed_cb, &wrock);
+    r = wrock.r;
+
     if (!r)
-        r = cyrusdb_commit(db, txn);
-    else
-        cyrusdb_abort(db, txn);
+        r = cyrusdb_commit(wrock.db, wrock.txn);
+    else if (wrock.txn)
+        cyrusdb_abort(wrock.db, wrock.txn);
 
 out:
-    if (db) cyrusdb_close(db);
+    if (wrock.db) cyrusdb_close(wrock.db);
     buf_free(&path);
-    buf_free(&key);
     return r;
 }
 
@@ -906,6 +923,8 @@ static int run(search_builder_t *bx, search_hit_cb_t proc, void *rock)
     bb->proc = proc;
     bb->rock = rock;
 
+    xstats_add(XAPIAN_POSTINGS, xapian_query_postings(bb->db, qq));
+
     r = xapian_query_run(bb->db, qq, xapian_run_cb, bb);
     if (r) goto out;
 
@@ -1019,6 +1038,13 @@ static search_builder_t *begin_search(struct mailbox *mailbox, int opts)
     r = xapian_db_open((const char **)dirs->data, &bb->db);
     if (r) goto out;
 
+    /* searches get slower with every database; count the ones which
+     * have more than the compaction policy allows for */
+    xstats_add(XAPIAN_DB_OPEN, dirs->count);
+    if (config_getint(IMAPOPT_SEARCH_AUTOCOMPACT_MAXDBS) > 0 &&
+        dirs->count > config_getint(IMAPOPT_SEARCH_AUTOCOMPACT_MAXDBS))
+        xstats_inc(XAPIAN_DB_FANOUT);
+
     /* read the list of all indexed messages to allow (optional) false positives
      * for unindexed messages */
     bb->indexed = seqset_init(0, SEQ_MERGE);
@@ -1080,11 +1106,16 @@ struct xapian_update_receiver
     xapian_receiver_t super;
     xapian_dbw_t *dbw;
     struct mappedfile *activefile;
+    char *activefname;
+    char *activeitem;           /* the activefile entry we're writing to */
     unsigned int uncommitted;
+    size_t uncommitted_bytes;
     unsigned int commits;
     struct seqset *oldindexed;
-    struct seqset *indexed;
+    struct seqset *indexed;     /* points into pending_indexed */
+    hash_table pending_indexed; /* "mboxname.uidvalidity" => seqset */
     strarray_t *activedirs;
+    int batch;
 };
 
 /* receiver used for extracting snippets after a search */
@@ -1206,9 +1237,15 @@ out:
     return r;
 }
 
-static int flush(search_text_receiver_t *rx)
+static void free_pending_indexed(void *data)
+{
+    seqset_free((struct seqset *)data);
+}
+
+/* commit whatever has been indexed so far, whichever mailboxes it
+ * came from, and then record all of it in cyrus.indexed.db at once */
+static int commit_pending(xapian_update_receiver_t *tr)
 {
-    xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
     int r = 0;
     struct timeval start, end;
 
@@ -1221,24 +1258,131 @@ static int flush(search_text_receiver_t *rx)
     if (r) goto out;
     gettimeofday(&end, NULL);
 
-    syslog(LOG_INFO, "Xapian committed %u updates in %.6f sec",
-                tr->uncommitted, timesub(&start, &end));
+    syslog(LOG_INFO, "Xapian committed %u updates (%llu bytes) in %.6f sec",
+                tr->uncommitted, (unsigned long long) tr->uncommitted_bytes,
+                timesub(&start, &end));
 
-    /* We write out the indexed list for the mailbox only after successfully
+    /* We write out the indexed list for the mailboxes only after successfully
      * updating the index, to avoid a future instance not realising that
      * there are unindexed messages should we fail to index */
     r = write_indexed(strarray_nth(tr->activedirs, 0),
-                      tr->super.mailbox->name, tr->super.mailbox->i.uidvalidity,
-                      tr->indexed, tr->super.verbose);
+                      &tr->pending_indexed, tr->super.verbose);
     if (r) goto out;
 
+    /* what's been written is now old news for the current mailbox */
+    if (tr->indexed) {
+        if (tr->oldindexed)
+            seqset_join(tr->oldindexed, tr->indexed);
+        tr->indexed = NULL;
+    }
+    free_hash_table(&tr->pending_indexed, free_pending_indexed);
+    construct_hash_table(&tr->pending_indexed, 1024, 0);
+
     tr->uncommitted = 0;
+    tr->uncommitted_bytes = 0;
     tr->commits++;
 
 out:
     return r;
 }
 
+/* throw away whatever has been indexed but not committed.  None of it
+ * is recorded in cyrus.indexed.db, so it's picked up again next time */
+static void discard_pending(xapian_update_receiver_t *tr)
+{
+    if (!tr->uncommitted) return;
+
+    syslog(LOG_NOTICE, "Xapian: discarding %u uncommitted updates for %s",
+                       tr->uncommitted, tr->activefname);
+
+    xapian_dbw_cancel_txn(tr->dbw);
+
+    tr->indexed = NULL;
+    free_hash_table(&tr->pending_indexed, free_pending_indexed);
+    construct_hash_table(&tr->pending_indexed, 1024, 0);
+
+    tr->uncommitted = 0;
+    tr->uncommitted_bytes = 0;
+}
+
+/* in batch mode the activefile lock is let go of between mailboxes, so
+ * take it again before writing.  If a compaction has moved indexing to
+ * a new database in the meantime, the old one mustn't be written to any
+ * more, so anything uncommitted is discarded and IMAP_AGAIN returned */
+static int relock_activefile(xapian_update_receiver_t *tr)
+{
+    strarray_t *active;
+    int r;
+
+    if (mappedfile_iswritelocked(tr->activefile))
+        return 0;
+
+    r = mappedfile_writelock(tr->activefile);
+    if (r) {
+        discard_pending(tr);
+        return IMAP_IOERROR;
+    }
+
+    active = activefile_read(tr->activefile);
+    if (!active->count || strcmp(strarray_nth(active, 0), tr->activeitem)) {
+        discard_pending(tr);
+        r = IMAP_AGAIN;
+    }
+    strarray_free(active);
+
+    return r;
+}
+
+static int flush(search_text_receiver_t *rx)
+{
+    xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
+
+    /* in batch mode, keep accumulating until we hit the memory budget */
+    if (tr->batch) {
+        size_t budget = config_getint(IMAPOPT_SEARCH_BATCH_MEMORY);
+        if (tr->uncommitted_bytes < budget * 1024 * 1024)
+            return 0;
+    }
+
+    return commit_pending(tr);
+}
+
+/* commit everything and release the database and activefile */
+static int close_dbw(xapian_update_receiver_t *tr)
+{
+    int r;
+
+    /* anything uncommitted from a batch can't go in if we lost the race */
+    if (tr->dbw) relock_activefile(tr);
+
+    r = commit_pending(tr);
+
+    if (tr->dbw) {
+        xapian_dbw_close(tr->dbw);
+        tr->dbw = NULL;
+    }
+
+    /* don't unlock until DB is committed */
+    if (tr->activefile) {
+        if (mappedfile_islocked(tr->activefile))
+            mappedfile_unlock(tr->activefile);
+        mappedfile_close(&tr->activefile);
+        tr->activefile = NULL;
+    }
+
+    if (tr->activedirs) {
+        strarray_free(tr->activedirs);
+        tr->activedirs = NULL;
+    }
+
+    free(tr->activefname);
+    tr->activefname = NULL;
+    free(tr->activeitem);
+    tr->activeitem = NULL;
+
+    return r;
+}
+
 static void free_segments(xapian_receiver_t *tr)
 {
     int i;
@@ -1356,10 +1500,20 @@ static int end_message_update(search_text_receiver_t *rx)
     r = xapian_dbw_end_doc(tr->dbw);
     if (r) goto out;
     ++tr->uncommitted;
+    tr->uncommitted_bytes += tr->super.parts_total;
     /* track that this UID was indexed.  Use SEQ_MERGE to avoid a bitty sequence
      * with lots of holes in it if messages have been expunged meanwhile. */
     if (!tr->indexed) {
-        tr->indexed = seqset_init(0, SEQ_MERGE);
+        struct buf key = BUF_INITIALIZER;
+
+        buf_printf(&key, "%s.%u", tr->super.mailbox->name,
+                              tr->super.mailbox->i.uidvalidity);
+        tr->indexed = hash_lookup(buf_cstring(&key), &tr->pending_indexed);
+        if (!tr->indexed) {
+            tr->indexed = seqset_init(0, SEQ_MERGE);
+            hash_insert(buf_cstring(&key), tr->indexed, &tr->pending_indexed);
+        }
+        buf_free(&key);
     }
     seqset_add(tr->indexed, tr->super.uid, 1);
 
@@ -1370,11 +1524,12 @@ out:
 
 static int begin_mailbox_update(search_text_receiver_t *rx,
                                 struct mailbox *mailbox,
-                                int flags __attribute__((unused)))
+                                int flags)
 {
     xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
     char *fname = activefile_fname(mailbox->name);
     strarray_t *active = NULL;
+    struct buf key = BUF_INITIALIZER;
     int r = 0;
 
     /* not an indexable mailbox, fine - return a code to avoid
@@ -1384,6 +1539,8 @@ static int begin_mailbox_update(search_text_receiver_t *rx,
         goto out;
     }
 
+    tr->batch = (flags & SEARCH_UPDATE_BATCH);
+
     /* XXX - there's an annoying lock inversion going on here.  We have to release
      * the mailbox lock and then re-establish it after we have the xapianactive file
      * open.  We should really just get an mboxname passed down to this layer, but
@@ -1391,6 +1548,17 @@ static int begin_mailbox_update(search_text_receiver_t *rx,
      * identical API */
     mailbox_unlock_index(mailbox, NULL);
 
+    /* in batch mode we may still have this user's database open from
+     * the previous mailbox, in which case just keep going with it,
+     * unless it's been compacted in the meantime */
+    if (tr->dbw && !strcmpsafe(fname, tr->activefname) &&
+        !relock_activefile(tr))
+        goto reuse;
+
+    /* otherwise, finish with it first */
+    r = close_dbw(tr);
+    if (r) goto out;
+
     /* XXX - if not incremental, we actually want to throw away all existing up to
      * this point and write a new one, so we should launch a new file and then
      * reindex using the same algorithm as the "compress" codepath.  The
@@ -1430,22 +1598,33 @@ static int begin_mailbox_update(search_text_receiver_t *rx,
     r = xapian_dbw_open(strarray_nth(tr->activedirs, 0), &tr->dbw);
     if (r) goto out;
 
+    tr->activefname = xstrdup(fname);
+    tr->activeitem = xstrdup(strarray_nth(active, 0));
+
+reuse:
     /* read the indexed data from every directory so know what still needs indexing */
     tr->oldindexed = seqset_init(0, SEQ_MERGE);
     r = read_indexed(tr->activedirs, mailbox->name, mailbox->i.uidvalidity,
                      tr->oldindexed, tr->super.verbose);
     if (r) goto out;
 
+    /* anything indexed but not yet committed in this batch counts too */
+    buf_printf(&key, "%s.%u", mailbox->name, mailbox->i.uidvalidity);
+    tr->indexed = hash_lookup(buf_cstring(&key), &tr->pending_indexed);
+
     /* XXX - and of course we have to lock again! (XXX - no support for the nonblocking bit
      * on this second lock... *sigh*)  We don't have the flags to know that we wanted it */
-    r = mailbox_lock_index(mailbox, LOCK_SHARED);
-    if (r) goto out;
+    if (!mailbox->index_locktype) {
+        r = mailbox_lock_index(mailbox, LOCK_SHARED);
+        if (r) goto out;
+    }
 
     tr->super.mailbox = mailbox;
 
 out:
     free(fname);
     strarray_free(active);
+    buf_free(&key);
     return r;
 }
 
@@ -1473,13 +1652,20 @@ static int end_mailbox_update(search_text_receiver_t *rx,
     xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
     int r = 0;
 
-    r = flush(rx);
-
-    /* flush before cleaning up, since indexed data is written by flush */
-    if (tr->indexed) {
-        seqset_free(tr->indexed);
-        tr->indexed = NULL;
+    /* in batch mode, this only commits if we're over budget, and
+     * the database stays open for the next mailbox.  The activefile
+     * lock doesn't, so that searches and compactions of this user
+     * aren't held up for the whole batch */
+    if (tr->batch) {
+        r = flush(rx);
+        if (tr->activefile && mappedfile_islocked(tr->activefile))
+            mappedfile_unlock(tr->activefile);
     }
+    else
+        r = close_dbw(tr);
+
+    /* the indexed data is owned by pending_indexed until it's written */
+    tr->indexed = NULL;
     if (tr->oldindexed) {
         seqset_free(tr->oldindexed);
         tr->oldindexed = NULL;
@@ -1487,23 +1673,6 @@ static int end_mailbox_update(search_text_receiver_t *rx,
 
     tr->super.mailbox = NULL;
 
-    if (tr->dbw) {
-        xapian_dbw_close(tr->dbw);
-        tr->dbw = NULL;
-    }
-
-    /* don't unlock until DB is committed */
-    if (tr->activefile) {
-        mappedfile_unlock(tr->activefile);
-        mappedfile_close(&tr->activefile);
-        tr->activefile = NULL;
-    }
-
-    if (tr->activedirs) {
-        strarray_free(tr->activedirs);
-        tr->activedirs = NULL;
-    }
-
     return r;
 }
 
@@ -1527,6 +1696,8 @@ static search_text_receiver_t *begin_update(int verbose)
 
     tr->super.verbose = verbose;
 
+    construct_hash_table(&tr->pending_indexed, 1024, 0);
+
     return &tr->super.super;
 }
 
@@ -1537,13 +1708,23 @@ static void free_receiver(xapian_receiver_t *tr)
     free(tr);
 }
 
+static void free_update_receiver(xapian_update_receiver_t *tr)
+{
+    free_hash_table(&tr->pending_indexed, free_pending_indexed);
+    free_receiver(&tr->super);
+}
+
 static int end_update(search_text_receiver_t *rx)
 {
     xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
+    int r;
 
-    free_receiver(&tr->super);
+    /* commit anything left over from batch mode */
+    r = close_dbw(tr);
 
-    return 0;
+    free_update_receiver(tr);
+
+    return r;
 }
 
 static int begin_mailbox_snippets(search_text_receiver_t *rx,
@@ -2126,9 +2307,8 @@ static int reindex_mb(void *rock,
 
 done:
     if (tr) {
-        if (tr->indexed) seqset_free(tr->indexed);
         if (tr->dbw) xapian_dbw_close(tr->dbw);
-        free_receiver(&tr->super);
+        free_update_receiver(tr);
     }
     mailbox_close(&mailbox);
     ptrarray_fini(&batch);
@@ -2195,6 +2375,65 @@ done:
     return r;
 }
 
+/* total size in kilobytes of the files in the database directories */
+static unsigned long dirs_size(const strarray_t *dirs)
+{
+    unsigned long size = 0;
+    int i;
+
+    for (i = 0; i < dirs->count; i++) {
+        const char *dir = strarray_nth(dirs, i);
+        DIR *dh = opendir(dir);
+        struct dirent *de;
+
+        if (!dh) continue;
+        while ((de = readdir(dh))) {
+            char *fname;
+            struct stat sbuf;
+
+            if (de->d_name[0] == '.') continue;
+            fname = strconcat(dir, "/", de->d_name, (char *)NULL);
+            if (!stat(fname, &sbuf) && S_ISREG(sbuf.st_mode))
+                size += sbuf.st_size / 1024;
+            free(fname);
+        }
+        closedir(dh);
+    }
+
+    return size;
+}
+
+/* does the compaction policy say these databases are due to be compacted? */
+static int compact_due(const char *mboxname, const strarray_t *dirs,
+                       int verbose)
+{
+    int maxdbs = config_getint(IMAPOPT_SEARCH_AUTOCOMPACT_MAXDBS);
+    int maxsize = config_getint(IMAPOPT_SEARCH_AUTOCOMPACT_MAXSIZE);
+    unsigned long size;
+
+    if (maxdbs > 0 && dirs->count > maxdbs) {
+        if (verbose)
+            printf("%s has %d databases, compacting\n",
+                   mboxname, dirs->count);
+        return 1;
+    }
+
+    if (maxsize > 0) {
+        size = dirs_size(dirs);
+        if (size > (unsigned long) maxsize) {
+            if (verbose)
+                printf("%s has %luKB in databases, compacting\n",
+                       mboxname, size);
+            return 1;
+        }
+    }
+
+    if (verbose)
+        printf("Skipping %s, not due for compaction\n", mboxname);
+
+    return 0;
+}
+
 static int compact_dbs(const char *userid, const char *tempdir,
                        const strarray_t *srctiers, const char *desttier, int flags)
 {
@@ -2249,6 +2488,9 @@ static int compact_dbs(const char *userid, const char *tempdir,
     /* find out which items actually exist from the set to be compressed - first pass */
     dirs = activefile_resolve(mboxname, mbentry->partition, tochange, /*dostat*/1);
     if (!dirs || !dirs->count) goto out;
+
+    if ((flags & SEARCH_COMPACT_AUTO) && !compact_due(mboxname, dirs, verbose))
+        goto out;
     /* NOTE: it's safe to keep this list even over the unlock/relock because we
      * always write out a new first item if necessary, so these will never be
      * written to after we release the lock - if they don't have content now,
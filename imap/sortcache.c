@@ -0,0 +1,364 @@
+/* sortcache.c -- per-mailbox cache of normalised SORT keys
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * cyrus.sortcache lives next to cyrus.cache and holds, for each UID,
+ * the keys index_msgdata_load() would otherwise rebuild from the cache
+ * record on every SORT or THREAD: the base subject, the local-parts of
+ * From, To and Cc, the display names of From and To, and the
+ * Message-ID and references used to thread messages.  Parsing and
+ * charset-normalising those headers is the bulk of the cost of a SORT
+ * or THREAD, and the answers never change for a given UID.
+ *
+ * The $VERSION key holds SORTCACHE_VERSION and the uidvalidity of the
+ * mailbox; if either has changed, the file is thrown away.  Expunged
+ * UIDs are removed when the mailbox is repacked.
+ *
+ * Reads don't hold any lock between fetches, so concurrent SORTs of a
+ * mailbox whose keys are all cached don't wait for each other.  The
+ * first store starts a write transaction, which is held until
+ * sortcache_close().
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <syslog.h>
+
+#include "assert.h"
+#include "cyrusdb.h"
+#include "global.h"
+#include "mailbox.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#include "sortcache.h"
+
+#define DB config_getstring(IMAPOPT_SORTCACHE_DB)
+#define VERSIONKEY "$VERSION"
+
+struct sortcache {
+    struct db *db;
+    struct txn *tid;
+};
+
+static void make_key(uint32_t uid, char *key)
+{
+    snprintf(key, 9, "%08X", uid);
+}
+
+static int check_version(struct sortcache *sc, const char *want, int *stale)
+{
+    const char *data = NULL;
+    size_t datalen = 0;
+    int r;
+
+    r = cyrusdb_fetch(sc->db, VERSIONKEY, strlen(VERSIONKEY),
+                      &data, &datalen, NULL);
+    if (r == CYRUSDB_NOTFOUND)
+        return cyrusdb_store(sc->db, VERSIONKEY, strlen(VERSIONKEY),
+                             want, strlen(want), &sc->tid);
+    if (r) return r;
+
+    if (datalen != strlen(want) || memcmp(data, want, datalen))
+        *stale = 1;
+
+    return 0;
+}
+
+EXPORTED struct sortcache *sortcache_open(struct mailbox *mailbox)
+{
+    const char *fname;
+    struct sortcache *sc;
+    char want[64];
+    int stale = 0;
+    int r;
+
+    if (!config_getswitch(IMAPOPT_SORTCACHE))
+        return NULL;
+
+    fname = mailbox_meta_fname(mailbox, META_SORTCACHE);
+    if (!fname) return NULL;
+
+    snprintf(want, sizeof(want), "%d %u",
+             SORTCACHE_VERSION, mailbox->i.uidvalidity);
+
+    sc = xzmalloc(sizeof(struct sortcache));
+
+    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &sc->db);
+    if (!r) r = check_version(sc, want, &stale);
+    if (!r && stale) {
+        /* keys from another incarnation of the mailbox, or derived
+         * some other way: start again */
+        if (sc->tid) cyrusdb_abort(sc->db, sc->tid);
+        sc->tid = NULL;
+        cyrusdb_close(sc->db);
+        sc->db = NULL;
+        unlink(fname);
+        r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &sc->db);
+        if (!r) r = check_version(sc, want, &stale);
+    }
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+               cyrusdb_strerror(r));
+        sortcache_close(&sc);
+        return NULL;
+    }
+
+    return sc;
+}
+
+EXPORTED void sortcache_close(struct sortcache **scp)
+{
+    struct sortcache *sc = *scp;
+    int r = 0;
+
+    if (!sc) return;
+
+    if (sc->tid) {
+        r = cyrusdb_commit(sc->db, sc->tid);
+        if (r) {
+            syslog(LOG_ERR, "DBERROR: committing sortcache: %s",
+                   cyrusdb_strerror(r));
+        }
+    }
+    if (sc->db) cyrusdb_close(sc->db);
+
+    free(sc);
+    *scp = NULL;
+}
+
+static const char *get_field(const char **pp, const char *end, char **valp)
+{
+    const char *p = *pp;
+    const char *nul;
+
+    if (p >= end) return NULL;
+    nul = memchr(p + 1, '\0', end - p - 1);
+    if (!nul) return NULL;
+
+    *valp = (*p == '+') ? xstrndup(p + 1, nul - p - 1) : NULL;
+    *pp = nul + 1;
+
+    return p;
+}
+
+EXPORTED int sortcache_fetch(struct sortcache *sc, uint32_t uid,
+                             struct sortcache_keys *keys)
+{
+    const char *data = NULL;
+    const char *p, *end, *nul;
+    size_t datalen = 0;
+    char key[9];
+    int r;
+
+    memset(keys, 0, sizeof(struct sortcache_keys));
+
+    /* inside our own transaction once we've stored anything */
+    make_key(uid, key);
+    r = cyrusdb_fetch(sc->db, key, 8, &data, &datalen,
+                      sc->tid ? &sc->tid : NULL);
+    if (r) return r;
+
+    p = data;
+    end = data + datalen;
+
+    nul = memchr(p, '\0', datalen);
+    if (!nul) goto bad;
+    keys->is_refwd = atoi(p);
+    p = nul + 1;
+
+    if (!get_field(&p, end, &keys->xsubj) ||
+        !get_field(&p, end, &keys->from) ||
+        !get_field(&p, end, &keys->to) ||
+        !get_field(&p, end, &keys->cc) ||
+        !get_field(&p, end, &keys->displayfrom) ||
+        !get_field(&p, end, &keys->displayto) ||
+        !get_field(&p, end, &keys->msgid))
+        goto bad;
+
+    /* then the references, however many there are */
+    while (p < end) {
+        char *ref = NULL;
+        if (!get_field(&p, end, &ref)) goto bad;
+        if (ref) strarray_appendm(&keys->ref, ref);
+    }
+
+    return 0;
+
+bad:
+    /* treat as missing, it'll be overwritten */
+    sortcache_keys_fini(keys);
+    return CYRUSDB_NOTFOUND;
+}
+
+static void put_field(struct buf *buf, const char *val)
+{
+    if (val) {
+        buf_putc(buf, '+');
+        buf_appendcstr(buf, val);
+    }
+    else {
+        buf_putc(buf, '-');
+    }
+    buf_putc(buf, '\0');
+}
+
+EXPORTED int sortcache_store(struct sortcache *sc, uint32_t uid,
+                             const struct sortcache_keys *keys)
+{
+    struct buf buf = BUF_INITIALIZER;
+    char key[9];
+    int i;
+    int r;
+
+    buf_printf(&buf, "%d", keys->is_refwd);
+    buf_putc(&buf, '\0');
+    put_field(&buf, keys->xsubj);
+    put_field(&buf, keys->from);
+    put_field(&buf, keys->to);
+    put_field(&buf, keys->cc);
+    put_field(&buf, keys->displayfrom);
+    put_field(&buf, keys->displayto);
+    put_field(&buf, keys->msgid);
+    for (i = 0; i < keys->ref.count; i++)
+        put_field(&buf, strarray_nth(&keys->ref, i));
+
+    make_key(uid, key);
+    r = cyrusdb_store(sc->db, key, 8, buf.s, buf.len, &sc->tid);
+    buf_free(&buf);
+
+    return r;
+}
+
+EXPORTED void sortcache_keys_fini(struct sortcache_keys *keys)
+{
+    free(keys->xsubj);
+    free(keys->from);
+    free(keys->to);
+    free(keys->cc);
+    free(keys->displayfrom);
+    free(keys->displayto);
+    free(keys->msgid);
+    strarray_fini(&keys->ref);
+    memset(keys, 0, sizeof(struct sortcache_keys));
+}
+
+struct prune_rock {
+    struct db *db;
+    struct txn **tid;
+    const uint32_t *uids;
+    unsigned nuids;
+};
+
+static int prune_p(void *rock,
+                   const char *key, size_t keylen,
+                   const char *data __attribute__((unused)),
+                   size_t datalen __attribute__((unused)))
+{
+    struct prune_rock *prock = (struct prune_rock *) rock;
+    char buf[9];
+    uint32_t uid;
+    unsigned low = 0, high = prock->nuids;
+
+    if (keylen != 8 || key[0] == '$') return 0;
+
+    memcpy(buf, key, 8);
+    buf[8] = '\0';
+    uid = strtoul(buf, NULL, 16);
+
+    while (low < high) {
+        unsigned mid = low + (high - low) / 2;
+        if (prock->uids[mid] == uid) return 0;
+        if (prock->uids[mid] < uid) low = mid + 1;
+        else high = mid;
+    }
+
+    return 1;
+}
+
+static int prune_cb(void *rock,
+                    const char *key, size_t keylen,
+                    const char *data __attribute__((unused)),
+                    size_t datalen __attribute__((unused)))
+{
+    struct prune_rock *prock = (struct prune_rock *) rock;
+
+    return cyrusdb_delete(prock->db, key, keylen, prock->tid, /*force*/1);
+}
+
+EXPORTED int sortcache_prune(struct mailbox *mailbox,
+                             const uint32_t *uids, unsigned nuids)
+{
+    struct sortcache *sc;
+    struct prune_rock prock;
+    int r;
+
+    /* don't create one just to empty it */
+    if (!config_getswitch(IMAPOPT_SORTCACHE)) return 0;
+    if (access(mailbox_meta_fname(mailbox, META_SORTCACHE), F_OK)) return 0;
+
+    sc = sortcache_open(mailbox);
+    if (!sc) return 0;
+
+    prock.db = sc->db;
+    prock.tid = &sc->tid;
+    prock.uids = uids;
+    prock.nuids = nuids;
+
+    r = cyrusdb_foreach(sc->db, "", 0, prune_p, prune_cb, &prock, &sc->tid);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: pruning sortcache for %s: %s",
+               mailbox->name, cyrusdb_strerror(r));
+        cyrusdb_abort(sc->db, sc->tid);
+        sc->tid = NULL;
+    }
+
+    sortcache_close(&sc);
+    return r;
+}
@@ -0,0 +1,94 @@
+/* sortcache.h -- per-mailbox cache of normalised SORT keys
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef SORTCACHE_H
+#define SORTCACHE_H
+
+#include "cyrusdb.h"
+#include "mailbox.h"
+#include "strarray.h"
+
+/* bump this whenever the way any of the keys is derived changes */
+#define SORTCACHE_VERSION 2
+
+/* The header-derived sort keys of one message, as index_msgdata_load()
+ * would compute them from cyrus.cache, plus the Message-ID and
+ * references which THREAD=REFERENCES links messages with.  Missing
+ * keys are NULL. */
+struct sortcache_keys {
+    int is_refwd;
+    char *xsubj;
+    char *from;
+    char *to;
+    char *cc;
+    char *displayfrom;
+    char *displayto;
+    char *msgid;
+    strarray_t ref;
+};
+
+struct sortcache;
+
+/* open the sort key cache of a mailbox, or return NULL if the cache
+ * is disabled or can't be opened */
+extern struct sortcache *sortcache_open(struct mailbox *mailbox);
+
+/* fetch the keys for 'uid' into 'keys' (new strings which the caller
+ * must free with sortcache_keys_fini()), or return CYRUSDB_NOTFOUND */
+extern int sortcache_fetch(struct sortcache *sc, uint32_t uid,
+                           struct sortcache_keys *keys);
+
+/* record the keys for 'uid' */
+extern int sortcache_store(struct sortcache *sc, uint32_t uid,
+                           const struct sortcache_keys *keys);
+
+/* commit anything stored and close the cache */
+extern void sortcache_close(struct sortcache **scp);
+
+/* remove the keys of every message not in 'uids' (sorted ascending) */
+extern int sortcache_prune(struct mailbox *mailbox,
+                           const uint32_t *uids, unsigned nuids);
+
+extern void sortcache_keys_fini(struct sortcache_keys *keys);
+
+#endif /* SORTCACHE_H */
@@ -96,6 +96,8 @@ const int SKIP_FUZZ = 60;
 
 static int verbose = 0;
 static int incremental_mode = 0;
+static int batch_mode = 0;
+static int benchmark_mode = 0;
 static int recursive_flag = 0;
 static int annotation_flag = 0;
 static int running_daemon = 0;
@@ -110,13 +112,13 @@ static void shut_down(int code) __attribute__((noreturn));
 static int usage(const char *name)
 {
     fprintf(stderr,
-            "usage: %s [-C <alt_config>] [-v] [-s] [-a] [mailbox...]\n",
+            "usage: %s [-C <alt_config>] [-v] [-s] [-a] [-b] [-B] [-j workers] [mailbox...]\n",
             name);
     fprintf(stderr,
-            "usage: %s [-C <alt_config>] [-v] [-s] [-a] -u user...\n",
+            "usage: %s [-C <alt_config>] [-v] [-s] [-a] [-b] [-B] [-j workers] -u user...\n",
             name);
     fprintf(stderr,
-            "       %s [-C <alt_config>] [-v] [-s] [-a] -r mailbox [...]\n",
+            "       %s [-C <alt_config>] [-v] [-s] [-a] [-b] [-B] [-j workers] -r mailbox [...]\n",
             name);
     fprintf(stderr,
             "       %s [-C <alt_config>] [-v] [-s] [-d] [-n channel] -R\n",
@@ -170,6 +172,8 @@ static int index_one(const char *name, int blocking)
 
     if (incremental_mode)
         flags |= SEARCH_UPDATE_INCREMENTAL;
+    if (batch_mode)
+        flags |= SEARCH_UPDATE_BATCH;
 
     /* Convert internal name to external */
     char *extname = mboxname_to_external(name, &squat_namespace, NULL);
@@ -313,15 +317,41 @@ static void expand_mboxnames(strarray_t *sa, int nmboxnames,
     }
 }
 
+static void report_throughput(const struct timeval *start, int final)
+{
+    struct search_update_stats stats;
+    struct timeval now;
+    double elapsed;
+
+    search_get_update_stats(&stats);
+    gettimeofday(&now, NULL);
+    elapsed = timesub(start, &now);
+    if (elapsed <= 0) elapsed = 0.000001;
+
+    printf("%s%llu mailboxes, %llu messages, %llu bytes in %.3f sec: "
+           "%.1f docs/sec, %.1f KB/sec\n",
+           final ? "total: " : "",
+           (unsigned long long) stats.mailboxes,
+           (unsigned long long) stats.messages,
+           (unsigned long long) stats.bytes,
+           elapsed,
+           stats.messages / elapsed,
+           stats.bytes / elapsed / 1024);
+}
+
 static int do_indexer(const strarray_t *sa)
 {
+    struct timeval start;
     int r = 0;
+    int r2;
     int i;
 
     rx = search_begin_update(verbose);
     if (rx == NULL)
         return 0;       /* no indexer defined */
 
+    gettimeofday(&start, NULL);
+
     for (i = 0 ; i < sa->count ; i++) {
         r = index_one(sa->data[i], /*blocking*/1);
         if (r == IMAP_MAILBOX_NONEXISTENT)
@@ -329,11 +359,18 @@ static int do_indexer(const strarray_t *sa)
         if (r == IMAP_MAILBOX_LOCKED)
             r = 0; /* XXX - try again? */
         if (r) break;
+        if (benchmark_mode && verbose)
+            report_throughput(&start, 0);
         if (sleepmicroseconds)
             usleep(sleepmicroseconds);
     }
 
-    search_end_update(rx);
+    /* in batch mode, this is where the final commit happens */
+    r2 = search_end_update(rx);
+    if (!r) r = r2;
+
+    if (benchmark_mode)
+        report_throughput(&start, 1);
 
     return r;
 }
@@ -536,6 +573,23 @@ static int compact_mbox(const char *userid, const strarray_t *srctiers,
     return search_compact(userid, temp_root_dir, srctiers, desttier, flags);
 }
 
+/* is the machine too busy to carry on compacting? */
+static int compact_overloaded(void)
+{
+    int maxload = config_getint(IMAPOPT_SEARCH_AUTOCOMPACT_MAXLOAD);
+    double load;
+
+    if (maxload <= 0) return 0;
+    if (getloadavg(&load, 1) != 1) return 0;
+    if (load <= maxload) return 0;
+
+    syslog(LOG_NOTICE, "squatter: load average %.2f exceeds %d,"
+                       " deferring remaining compaction", load, maxload);
+    if (verbose)
+        printf("load average %.2f exceeds %d, stopping\n", load, maxload);
+    return 1;
+}
+
 static int do_compact(const strarray_t *mboxnames, const strarray_t *srctiers,
                       const char *desttier, int flags)
 {
@@ -552,6 +606,11 @@ static int do_compact(const strarray_t *mboxnames, const strarray_t *srctiers,
             continue;
         }
 
+        if ((flags & SEARCH_COMPACT_AUTO) && compact_overloaded()) {
+            free(userid);
+            break;
+        }
+
         r = compact_mbox(userid, srctiers, desttier, flags);
         if (r) break;
 
@@ -798,7 +857,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:I:N:RAXT:S:Fc:de:f:mn:rsiavz:t:ou")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:I:N:RAXT:S:Fc:de:f:mn:rsiavz:t:oubBj:p")) != EOF) {
         switch (opt) {
         case 'C':               /* alt config file */
             alt_config = optarg;
@@ -920,6 +979,22 @@ int main(int argc, char **argv)
             user_mode = 1;
             break;
 
+        case 'b':               /* batch commits across mailboxes */
+            batch_mode = 1;
+            break;
+
+        case 'B':               /* report indexing throughput */
+            benchmark_mode = 1;
+            break;
+
+        case 'p':               /* compact according to policy */
+            compact_flags |= SEARCH_COMPACT_AUTO;
+            break;
+
+        case 'j':               /* parallel text extraction */
+            search_set_extract_workers(atoi(optarg));
+            break;
+
         default:
             usage("squatter");
         }
@@ -49,6 +49,9 @@
 #define FNAME_STATUSCACHEDB "/statuscache.db"
 #define STATUSCACHE_VERSION 4
 
+/* name of the shared memory status table */
+#define FNAME_STATUSCACHESHM "/statuscache.shm"
+
 /* Return the filename of the statuscache database,
  * used for XWARMUP.  Returns a new string which must
  * be free()d by the caller. */
@@ -78,6 +81,16 @@ extern int statuscache_lookup(const char *mboxname, const char *userid,
 extern int statuscache_invalidate(const char *mboxname,
                                   struct statusdata *sdata);
 
+/* the shared memory status table: record the counters of a mailbox
+ * which has just been committed, record the \Seen counts calculated
+ * for a locked mailbox, and look them up */
+extern void statuscache_shm_update(struct mailbox *mailbox);
+extern void statuscache_shm_fill(struct mailbox *mailbox, const char *userid,
+                                 unsigned numrecent, unsigned numunseen);
+extern int statuscache_shm_lookup(const char *mboxname, const char *userid,
+                                  unsigned statusitems,
+                                  struct statusdata *sdata);
+
 /* close the database */
 extern void statuscache_close(void);
 
@@ -172,6 +172,10 @@ EXPORTED int status_lookup(const char *mboxname, const char *userid,
     unsigned c_statusitems;
     int r;
 
+    /* counters shared by all processes need no locks at all */
+    if (!statuscache_shm_lookup(mboxname, userid, statusitems, sdata))
+        return 0;
+
     /* Check status cache if possible */
     if (config_getswitch(IMAPOPT_STATUSCACHE)) {
         /* Do actual lookup of cache item. */
@@ -246,6 +250,9 @@ EXPORTED int status_lookup(const char *mboxname, const char *userid,
 
         /* we've calculated the correct values for both */
         c_statusitems |= STATUS_RECENT | STATUS_UNSEEN;
+
+        if (internalseen)
+            statuscache_shm_fill(mailbox, userid, numrecent, numunseen);
     }
 
     statuscache_fill(sdata, userid, mailbox, c_statusitems,
@@ -272,6 +279,10 @@ EXPORTED int status_lookup_mailbox(struct mailbox *mailbox, const char *userid,
     unsigned c_statusitems;
     int r = 0;
 
+    /* counters shared by all processes need no locks at all */
+    if (!statuscache_shm_lookup(mailbox->name, userid, statusitems, sdata))
+        return 0;
+
     /* Check status cache if possible */
     if (config_getswitch(IMAPOPT_STATUSCACHE)) {
         /* Do actual lookup of cache item. */
@@ -344,6 +355,9 @@ EXPORTED int status_lookup_mailbox(struct mailbox *mailbox, const char *userid,
 
         /* we've calculated the correct values for both */
         c_statusitems |= STATUS_RECENT | STATUS_UNSEEN;
+
+        if (internalseen)
+            statuscache_shm_fill(mailbox, userid, numrecent, numunseen);
     }
 
     statuscache_fill(sdata, userid, mailbox, c_statusitems,
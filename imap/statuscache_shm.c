@@ -0,0 +1,364 @@
+/* statuscache_shm.c -- shared memory table of mailbox status counters
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Every process which commits a mailbox writes its current counters
+ * into a table in a file mapped shared by all processes, so STATUS
+ * (and LIST-STATUS) on a mailbox which hasn't changed can be answered
+ * without opening the mailbox, or even taking a lock.
+ *
+ * The table is a fixed number of 256 byte slots, found by hashing the
+ * mailbox name and probing a few slots onwards; when they're all in
+ * use by other mailboxes, the first is simply overwritten.  Each slot
+ * is protected by a sequence count: a writer makes it odd while it
+ * changes the slot, and a reader copies the slot and only trusts the
+ * copy if the count was even and unchanged throughout.
+ *
+ * The unseen and recent counts depend on the user's \Seen state, so
+ * they're only kept for mailboxes whose \Seen state is in the index
+ * (the owner's, or everyone's with shared seen), and only once a
+ * STATUS has counted them.  Any commit forgets them again.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <syslog.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "global.h"
+#include "mailbox.h"
+#include "mboxname.h"
+#include "strhash.h"
+#include "util.h"
+
+/* generated headers are not necessarily in current directory */
+#include "imap/imap_err.h"
+
+#include "statuscache.h"
+
+#define STATUSSHM_MAGIC         "CYRSTSHM"
+#define STATUSSHM_HEADER_SIZE   64
+#define STATUSSHM_SLOT_SIZE     256
+#define STATUSSHM_PROBE         4
+#define STATUSSHM_NAME_LEN      (STATUSSHM_SLOT_SIZE - 40)
+
+#define SLOT_HAVESEEN           (1<<0)  /* unseen and recent are valid */
+#define SLOT_SHAREDSEEN         (1<<1)  /* ... for every user */
+
+struct statusshm_slot {
+    uint32_t seq;
+    uint32_t uidvalidity;
+    uint32_t exists;
+    uint32_t uidnext;
+    uint32_t unseen;
+    uint32_t recent;
+    uint32_t flags;
+    uint32_t pad;
+    modseq_t highestmodseq;
+    char name[STATUSSHM_NAME_LEN];
+};
+
+static char *statusshm_base = NULL;
+static size_t statusshm_len = 0;
+static uint32_t statusshm_nslots = 0;
+static int statusshm_failed = 0;
+
+static char *statuscache_shm_filename(void)
+{
+    return strconcat(config_dir, FNAME_STATUSCACHESHM, (char *)NULL);
+}
+
+/* map the table, creating it if necessary.  Returns 0 if the table
+ * isn't in use */
+static int statusshm_map(void)
+{
+    int nslots = config_getint(IMAPOPT_STATUSCACHE_SHM_SLOTS);
+    char *fname;
+    struct stat sbuf;
+    size_t len;
+    void *base;
+    int fd;
+
+    if (statusshm_base) return 1;
+    if (statusshm_failed || nslots <= 0) return 0;
+
+    /* only try once per process */
+    statusshm_failed = 1;
+
+    len = STATUSSHM_HEADER_SIZE + (size_t) nslots * STATUSSHM_SLOT_SIZE;
+
+    fname = statuscache_shm_filename();
+    fd = open(fname, O_RDWR|O_CREAT, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+        goto done;
+    }
+
+    if (fstat(fd, &sbuf) == -1) {
+        syslog(LOG_ERR, "IOERROR: fstat %s: %m", fname);
+        goto done;
+    }
+
+    /* a new (zero-filled) table is empty, so racing to create it is
+     * harmless.  A table of the wrong size is from an old config:
+     * remove the file to resize it */
+    if (!sbuf.st_size && ftruncate(fd, len) == -1) {
+        syslog(LOG_ERR, "IOERROR: sizing %s: %m", fname);
+        goto done;
+    }
+    else if (sbuf.st_size && (size_t) sbuf.st_size != len) {
+        syslog(LOG_ERR, "statuscache: %s is not %d slots, not using it",
+               fname, nslots);
+        goto done;
+    }
+
+    base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mapping %s: %m", fname);
+        goto done;
+    }
+
+    if (memcmp(base, STATUSSHM_MAGIC, 8))
+        memcpy(base, STATUSSHM_MAGIC, 8);
+
+    statusshm_base = base;
+    statusshm_len = len;
+    statusshm_nslots = nslots;
+    statusshm_failed = 0;
+
+done:
+    if (fd != -1) close(fd);
+    free(fname);
+    return statusshm_base ? 1 : 0;
+}
+
+static struct statusshm_slot *statusshm_slot(uint32_t n)
+{
+    return (struct statusshm_slot *)
+        (statusshm_base + STATUSSHM_HEADER_SIZE +
+         (size_t) (n % statusshm_nslots) * STATUSSHM_SLOT_SIZE);
+}
+
+/* take a consistent copy of a slot, or return 0 if it's being written */
+static int slot_read(struct statusshm_slot *slot, struct statusshm_slot *copy)
+{
+    volatile uint32_t *seqp = &slot->seq;
+    uint32_t seq = *seqp;
+
+    if (seq & 1) return 0;
+    __sync_synchronize();
+    memcpy(copy, slot, sizeof(struct statusshm_slot));
+    __sync_synchronize();
+
+    return *seqp == seq;
+}
+
+/* as slot_read, but wait a little for a writer to finish */
+static int slot_read_wait(struct statusshm_slot *slot,
+                          struct statusshm_slot *copy)
+{
+    int tries;
+
+    for (tries = 0; tries < 100; tries++) {
+        if (slot_read(slot, copy)) return 1;
+        sched_yield();
+    }
+
+    return 0;
+}
+
+static void slot_lock(struct statusshm_slot *slot)
+{
+    volatile uint32_t *seqp = &slot->seq;
+    int tries;
+
+    for (tries = 0; tries < 1000; tries++) {
+        uint32_t seq = *seqp;
+        if (!(seq & 1) && __sync_bool_compare_and_swap(&slot->seq, seq, seq+1))
+            return;
+        sched_yield();
+    }
+
+    /* whoever was writing this slot died doing it: take it over,
+     * leaving the count odd */
+    __sync_add_and_fetch(&slot->seq, 2);
+}
+
+static void slot_unlock(struct statusshm_slot *slot)
+{
+    __sync_synchronize();
+    __sync_add_and_fetch(&slot->seq, 1);
+}
+
+/* find the slot holding 'name', or the one to replace with it */
+static struct statusshm_slot *slot_find(const char *name, int create)
+{
+    uint32_t hash = strhash(name);
+    struct statusshm_slot copy;
+    struct statusshm_slot *empty = NULL;
+    int i;
+
+    for (i = 0; i < STATUSSHM_PROBE; i++) {
+        struct statusshm_slot *slot = statusshm_slot(hash + i);
+        /* a slot we can't read might be ours: never risk having
+         * the same mailbox in two slots */
+        if (!slot_read_wait(slot, &copy))
+            return create ? slot : NULL;
+        if (!strncmp(copy.name, name, STATUSSHM_NAME_LEN))
+            return slot;
+        if (!empty && !copy.name[0])
+            empty = slot;
+    }
+
+    if (!create) return NULL;
+
+    return empty ? empty : statusshm_slot(hash);
+}
+
+/* record the counters of a mailbox which has just been committed */
+EXPORTED void statuscache_shm_update(struct mailbox *mailbox)
+{
+    struct statusshm_slot *slot;
+
+    if (strlen(mailbox->name) >= STATUSSHM_NAME_LEN) return;
+    if (!statusshm_map()) return;
+
+    slot = slot_find(mailbox->name, /*create*/1);
+    slot_lock(slot);
+
+    if (mailbox->i.options & OPT_MAILBOX_DELETED) {
+        memset(slot->name, 0, STATUSSHM_NAME_LEN);
+        slot->flags = 0;
+    }
+    else {
+        strncpy(slot->name, mailbox->name, STATUSSHM_NAME_LEN);
+        slot->uidvalidity = mailbox->i.uidvalidity;
+        slot->exists = mailbox->i.exists;
+        slot->uidnext = mailbox->i.last_uid + 1;
+        slot->highestmodseq = mailbox->i.highestmodseq;
+        slot->unseen = 0;
+        slot->recent = 0;
+        slot->flags = 0;
+    }
+
+    slot_unlock(slot);
+}
+
+/* record \Seen counts for a locked mailbox, if they're the same for
+ * every user who can find them */
+EXPORTED void statuscache_shm_fill(struct mailbox *mailbox, const char *userid,
+                                   unsigned numrecent, unsigned numunseen)
+{
+    struct statusshm_slot *slot;
+
+    if (!userid || !mailbox_internal_seen(mailbox, userid)) return;
+    if (strlen(mailbox->name) >= STATUSSHM_NAME_LEN) return;
+    if (!statusshm_map()) return;
+
+    slot = slot_find(mailbox->name, /*create*/1);
+    slot_lock(slot);
+
+    /* we hold the index lock, so these are current */
+    strncpy(slot->name, mailbox->name, STATUSSHM_NAME_LEN);
+    slot->uidvalidity = mailbox->i.uidvalidity;
+    slot->exists = mailbox->i.exists;
+    slot->uidnext = mailbox->i.last_uid + 1;
+    slot->highestmodseq = mailbox->i.highestmodseq;
+    slot->unseen = numunseen;
+    slot->recent = numrecent;
+    slot->flags = SLOT_HAVESEEN;
+    if (mailbox->i.options & OPT_IMAP_SHAREDSEEN)
+        slot->flags |= SLOT_SHAREDSEEN;
+
+    slot_unlock(slot);
+}
+
+EXPORTED int statuscache_shm_lookup(const char *mboxname, const char *userid,
+                                    unsigned statusitems,
+                                    struct statusdata *sdata)
+{
+    struct statusshm_slot *slot;
+    struct statusshm_slot copy;
+
+    if (!statusshm_map()) return IMAP_NO_NOSUCHMSG;
+
+    slot = slot_find(mboxname, /*create*/0);
+    if (!slot || !slot_read(slot, &copy)) return IMAP_NO_NOSUCHMSG;
+    if (strncmp(copy.name, mboxname, STATUSSHM_NAME_LEN) || !copy.uidvalidity)
+        return IMAP_NO_NOSUCHMSG;
+
+    sdata->userid = userid;
+    sdata->statusitems = STATUS_MESSAGES | STATUS_UIDNEXT |
+                         STATUS_UIDVALIDITY | STATUS_HIGHESTMODSEQ;
+    sdata->messages = copy.exists;
+    sdata->uidnext = copy.uidnext;
+    sdata->uidvalidity = copy.uidvalidity;
+    sdata->highestmodseq = copy.highestmodseq;
+    sdata->recent = 0;
+    sdata->unseen = 0;
+
+    if (!copy.exists) {
+        /* no messages, so these two must also be zero */
+        sdata->statusitems |= STATUS_RECENT | STATUS_UNSEEN;
+    }
+    else if ((copy.flags & SLOT_HAVESEEN) &&
+             ((copy.flags & SLOT_SHAREDSEEN) ||
+              (userid && mboxname_userownsmailbox(userid, mboxname)))) {
+        sdata->statusitems |= STATUS_RECENT | STATUS_UNSEEN;
+        sdata->recent = copy.recent;
+        sdata->unseen = copy.unseen;
+    }
+
+    if ((sdata->statusitems & statusitems) != statusitems)
+        return IMAP_NO_NOSUCHMSG;
+
+    return 0;
+}
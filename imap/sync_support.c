@@ -45,6 +45,7 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -61,6 +62,7 @@
 
 #include "assert.h"
 #include "global.h"
+#include "hashmap.h"
 #include "imap_proxy.h"
 #include "mboxlist.h"
 #include "exitcodes.h"
@@ -548,6 +550,72 @@ void sync_reserve_list_free(struct sync_reserve_list **lp)
 
 /* ====================================================================== */
 
+/*
+ * The folder, rename, quota, name and seen lists are kept in the order
+ * things were added, because that's the order they go over the wire,
+ * but they get looked up by key once per folder during a user sync.
+ * Once a list is big enough for that to hurt, the first lookup builds
+ * a hashmap of it, which sync_list_hash_add() keeps up to date from
+ * then on.  All the item structs start with their next pointer.
+ */
+
+#define SYNC_LIST_HASH_MIN 16
+
+struct sync_list_item {
+    struct sync_list_item *next;
+};
+
+#define SYNC_LIST_KEY(item, keyoffset) \
+    (*(const char **)((char *)(item) + (keyoffset)))
+
+static void sync_list_hash_free(struct hashmap **hashp)
+{
+    if (!*hashp) return;
+
+    free_hashmap(*hashp, NULL);
+    free(*hashp);
+    *hashp = NULL;
+}
+
+static void sync_list_hash_add(struct hashmap **hashp, const char *key,
+                               void *item)
+{
+    if (!*hashp || !key) return;
+
+    /* lookups always found the first match, keep it that way */
+    if (!hashmap_lookup(key, *hashp))
+        hashmap_insert(key, item, *hashp);
+}
+
+static void *sync_list_lookup(struct hashmap **hashp, void *head,
+                              unsigned long count, size_t keyoffset,
+                              const char *key)
+{
+    struct sync_list_item *p;
+
+    if (!key) return NULL;
+
+    if (!*hashp && count < SYNC_LIST_HASH_MIN) {
+        for (p = head; p; p = p->next) {
+            if (!strcmpsafe(SYNC_LIST_KEY(p, keyoffset), key))
+                return p;
+        }
+        return NULL;
+    }
+
+    if (!*hashp) {
+        *hashp = xzmalloc(sizeof(struct hashmap));
+        construct_hashmap(*hashp, count, 1);
+
+        for (p = head; p; p = p->next)
+            sync_list_hash_add(hashp, SYNC_LIST_KEY(p, keyoffset), p);
+    }
+
+    return hashmap_lookup(key, *hashp);
+}
+
+/* ====================================================================== */
+
 struct sync_folder_list *sync_folder_list_create(void)
 {
     struct sync_folder_list *l = xzmalloc(sizeof (struct sync_folder_list));
@@ -607,19 +675,16 @@ struct sync_folder *sync_folder_list_add(struct sync_folder_list *l,
     result->mark     = 0;
     result->reserve  = 0;
 
+    sync_list_hash_add(&l->hash, result->uniqueid, result);
+
     return(result);
 }
 
 struct sync_folder *sync_folder_lookup(struct sync_folder_list *l,
                                        const char *uniqueid)
 {
-    struct sync_folder *p;
-
-    for (p = l->head; p; p = p->next) {
-        if (!strcmp(p->uniqueid, uniqueid))
-            return p;
-    }
-    return NULL;
+    return sync_list_lookup(&l->hash, l->head, l->count,
+                            offsetof(struct sync_folder, uniqueid), uniqueid);
 }
 
 void sync_folder_list_free(struct sync_folder_list **lp)
@@ -640,6 +705,7 @@ void sync_folder_list_free(struct sync_folder_list **lp)
         free(current);
         current = next;
     }
+    sync_list_hash_free(&l->hash);
     free(l);
     *lp = NULL;
 }
@@ -681,20 +747,16 @@ struct sync_rename *sync_rename_list_add(struct sync_rename_list *l,
     result->uidvalidity = uidvalidity;
     result->done = 0;
 
+    sync_list_hash_add(&l->hash, result->oldname, result);
+
     return result;
 }
 
 struct sync_rename *sync_rename_lookup(struct sync_rename_list *l,
                                             const char *oldname)
 {
-    struct sync_rename *p;
-
-    for (p = l->head; p; p = p->next) {
-        if (!strcmp(p->oldname, oldname))
-            return p;
-    }
-
-    return NULL;
+    return sync_list_lookup(&l->hash, l->head, l->count,
+                            offsetof(struct sync_rename, oldname), oldname);
 }
 
 void sync_rename_list_free(struct sync_rename_list **lp)
@@ -714,6 +776,7 @@ void sync_rename_list_free(struct sync_rename_list **lp)
         free(current);
         current = next;
     }
+    sync_list_hash_free(&l->hash);
     free(l);
     *lp = NULL;
 }
@@ -752,20 +815,16 @@ struct sync_quota *sync_quota_list_add(struct sync_quota_list *l,
         result->limits[res] = QUOTA_UNLIMITED;
     result->done = 0;
 
+    sync_list_hash_add(&l->hash, result->root, result);
+
     return result;
 }
 
 struct sync_quota *sync_quota_lookup(struct sync_quota_list *l,
                                           const char *name)
 {
-    struct sync_quota *p;
-
-    for (p = l->head; p; p = p->next) {
-        if (!strcmp(p->root, name))
-            return p;
-    }
-
-    return NULL;
+    return sync_list_lookup(&l->hash, l->head, l->count,
+                            offsetof(struct sync_quota, root), name);
 }
 
 void sync_quota_list_free(struct sync_quota_list **lp)
@@ -782,6 +841,7 @@ void sync_quota_list_free(struct sync_quota_list **lp)
         free(current);
         current = next;
     }
+    sync_list_hash_free(&l->hash);
     free(l);
     *lp = NULL;
 }
@@ -1159,19 +1219,16 @@ struct sync_name *sync_name_list_add(struct sync_name_list *l,
     item->name = xstrdup(name);
     item->mark = 0;
 
+    sync_list_hash_add(&l->hash, item->name, item);
+
     return item;
 }
 
 struct sync_name *sync_name_lookup(struct sync_name_list *l,
                                         const char *name)
 {
-    struct sync_name *p;
-
-    for (p = l->head; p; p = p->next)
-        if (!strcmp(p->name, name))
-            return p;
-
-    return NULL;
+    return sync_list_lookup(&l->hash, l->head, l->count,
+                            offsetof(struct sync_name, name), name);
 }
 
 void sync_name_list_free(struct sync_name_list **lp)
@@ -1185,6 +1242,7 @@ void sync_name_list_free(struct sync_name_list **lp)
         free(current);
         current = next;
     }
+    sync_list_hash_free(&(*lp)->hash);
     free(*lp);
     *lp = NULL;
 }
@@ -1222,19 +1280,16 @@ struct sync_seen *sync_seen_list_add(struct sync_seen_list *l,
     item->sd.seenuids = xstrdup(seenuids);
     item->mark = 0;
 
+    sync_list_hash_add(&l->hash, item->uniqueid, item);
+
     return item;
 }
 
 struct sync_seen *sync_seen_list_lookup(struct sync_seen_list *l,
                                         const char *uniqueid)
 {
-    struct sync_seen *p;
-
-    for (p = l->head; p; p = p->next)
-        if (!strcmp(p->uniqueid, uniqueid))
-            return p;
-
-    return NULL;
+    return sync_list_lookup(&l->hash, l->head, l->count,
+                            offsetof(struct sync_seen, uniqueid), uniqueid);
 }
 
 void sync_seen_list_free(struct sync_seen_list **lp)
@@ -1249,6 +1304,7 @@ void sync_seen_list_free(struct sync_seen_list **lp)
         free(current);
         current = next;
     }
+    sync_list_hash_free(&(*lp)->hash);
     free(*lp);
     *lp = NULL;
 }
@@ -1439,7 +1495,9 @@ struct dlist *sync_parseline(struct protstream *in)
     struct dlist *dl = NULL;
     int c;
 
-    c = dlist_parse(&dl, 1, in, NULL);
+    /* every APPLY line is parsed, walked and thrown away, so build
+     * it in one arena rather than a malloc per node */
+    c = dlist_parse_arena(&dl, 1, in, NULL);
 
     /* end line - or fail */
     if (c == '\r') c = prot_getc(in);
@@ -166,6 +166,7 @@ struct sync_folder {
 struct sync_folder_list {
     struct sync_folder *head, *tail;
     unsigned long count;
+    struct hashmap *hash;       /* built on demand by lookups */
 };
 
 struct sync_folder_list *sync_folder_list_create(void);
@@ -212,6 +213,7 @@ struct sync_rename_list {
     struct sync_rename *head, *tail;
     unsigned long count;
     unsigned long done;
+    struct hashmap *hash;       /* built on demand by lookups */
 };
 
 struct sync_rename_list *sync_rename_list_create(void);
@@ -240,6 +242,7 @@ struct sync_quota_list {
     struct sync_quota *head, *tail;
     unsigned long count;
     unsigned long done;
+    struct hashmap *hash;       /* built on demand by lookups */
 };
 
 struct sync_quota_list *sync_quota_list_create(void);
@@ -267,6 +270,7 @@ struct sync_name_list {
     struct sync_name *head, *tail;
     unsigned long count;
     unsigned long marked;
+    struct hashmap *hash;       /* built on demand by lookups */
 };
 
 struct sync_name_list *sync_name_list_create(void);
@@ -292,6 +296,7 @@ struct sync_seen {
 struct sync_seen_list {
     struct sync_seen *head, *tail;
     unsigned long count;
+    struct hashmap *hash;       /* built on demand by lookups */
 };
 
 struct sync_seen_list *sync_seen_list_create(void);
@@ -718,6 +718,11 @@ EXPORTED int     tls_init_serverengine(const char *ident,
     if (server_cipher_order)
         off |= SSL_OP_CIPHER_SERVER_PREFERENCE;
 
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config_getswitch(IMAPOPT_TLS_KTLS))
+        off |= SSL_OP_ENABLE_KTLS;
+#endif
+
     SSL_CTX_set_options(s_ctx, off);
     SSL_CTX_set_info_callback(s_ctx, apps_ssl_info_callback);
 
@@ -404,6 +404,27 @@ int xapian_query_run(const xapian_db_t *db, const xapian_query_t *qq,
     return r;
 }
 
+/* estimate of the number of postings a query reads: the sum of the
+ * frequencies of all the terms it mentions */
+unsigned long xapian_query_postings(const xapian_db_t *db, const xapian_query_t *qq)
+{
+    const Xapian::Query *query = (const Xapian::Query *)qq;
+    unsigned long postings = 0;
+
+    try {
+        for (Xapian::TermIterator i = query->get_terms_begin() ;
+             i != query->get_terms_end() ; ++i) {
+            postings += db->database->get_termfreq(*i);
+        }
+    }
+    catch (const Xapian::Error &err) {
+        syslog(LOG_ERR, "IOERROR: Xapian: caught exception: %s: %s",
+                    err.get_context().c_str(), err.get_description().c_str());
+    }
+
+    return postings;
+}
+
 struct xapian_snipgen
 {
     Xapian::Stem *stemmer;
@@ -74,6 +74,7 @@ extern xapian_query_t *xapian_query_new_not(const xapian_db_t *, xapian_query_t
 extern void xapian_query_free(xapian_query_t *);
 extern int xapian_query_run(const xapian_db_t *, const xapian_query_t *,
                             int (*cb)(const char *cyrusid, void *rock), void *rock);
+extern unsigned long xapian_query_postings(const xapian_db_t *, const xapian_query_t *);
 
 /* snippets interface */
 extern xapian_snipgen_t *xapian_snipgen_new(void);
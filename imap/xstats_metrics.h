@@ -60,3 +60,12 @@ X(SPHINX_QUERY),
 X(SPHINX_ROW),
 X(SPHINX_RESULT),
 X(SPHINX_UNINDEXED),
+X(XAPIAN_DB_OPEN),
+X(XAPIAN_DB_FANOUT),
+X(XAPIAN_POSTINGS),
+X(MBOXLIST_FIND_CANDIDATE),
+X(MBOXLIST_FIND_PRUNED),
+X(MBOXLIST_TRIE_STALE),
+X(MBOXLIST_CACHE_HIT),
+X(MBOXLIST_CACHE_MISS),
+X(MBOXLIST_CACHE_FLUSH),
@@ -40,6 +40,7 @@
  */
 
 #include <config.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -67,6 +68,12 @@ extern struct cyrusdb_backend cyrusdb_skiplist;
 extern struct cyrusdb_backend cyrusdb_quotalegacy;
 extern struct cyrusdb_backend cyrusdb_sql;
 extern struct cyrusdb_backend cyrusdb_twoskip;
+extern struct cyrusdb_backend cyrusdb_sharded;
+
+extern int cyrusdb_sharded_open(const char *fname, int nshards,
+                                const char *backend, int flags,
+                                struct dbengine **ret, struct txn **tid);
+extern const char *cyrusdb_sharded_detect(const char *fname);
 
 static struct cyrusdb_backend *_backends[] = {
     &cyrusdb_flat,
@@ -80,15 +87,58 @@ static struct cyrusdb_backend *_backends[] = {
 
 #define DEFAULT_BACKEND "twoskip"
 
+/* backend names of the form "sharded:N:backend" */
+#define SHARDED_PREFIX "sharded:"
+#define SHARDED_MAXSHARDS 256
+
 struct db {
     struct dbengine *engine;
     struct cyrusdb_backend *backend;
 };
 
+/* Parse a sharded backend name, returning the number of shards (or 0
+ * if it isn't one) and the backend of each shard in *basep */
+static int sharded_parse(const char *name, const char **basep)
+{
+    const char *p;
+    char *end;
+    long n;
+
+    if (strncmp(name, SHARDED_PREFIX, strlen(SHARDED_PREFIX)))
+        return 0;
+
+    p = name + strlen(SHARDED_PREFIX);
+    n = strtol(p, &end, 10);
+    if (end == p || *end != ':' || n < 1 || n > SHARDED_MAXSHARDS ||
+        !strncmp(end + 1, SHARDED_PREFIX, strlen(SHARDED_PREFIX))) {
+        char errbuf[1024];
+        snprintf(errbuf, sizeof(errbuf),
+                 "cyrusdb backend %s not supported", name);
+        fatal(errbuf, EC_CONFIG);
+    }
+
+    *basep = end + 1;
+    return n;
+}
+
 static struct cyrusdb_backend *cyrusdb_fromname(const char *name)
 {
     int i;
     struct cyrusdb_backend *db = NULL;
+    const char *base;
+
+    if (sharded_parse(name, &base)) {
+        db = cyrusdb_fromname(base);
+        /* shards have to be single files, and we need fetchnext to
+         * merge them */
+        if (db->archive != &cyrusdb_generic_archive || !db->fetchnext) {
+            char errbuf[1024];
+            snprintf(errbuf, sizeof(errbuf),
+                     "cyrusdb backend %s can't be sharded", base);
+            fatal(errbuf, EC_CONFIG);
+        }
+        return &cyrusdb_sharded;
+    }
 
     for (i = 0; _backends[i]; i++) {
         if (!strcmp(_backends[i]->name, name)) {
@@ -105,6 +155,19 @@ static struct cyrusdb_backend *cyrusdb_fromname(const char *name)
     return db;
 }
 
+static int _backend_open(struct db *db, const char *backend,
+                         const char *fname, int flags, struct txn **tid)
+{
+    const char *base;
+    int nshards = sharded_parse(backend, &base);
+
+    if (nshards)
+        return cyrusdb_sharded_open(fname, nshards, base, flags,
+                                    &db->engine, tid);
+
+    return db->backend->open(fname, flags, &db->engine, tid);
+}
+
 static int _open(const char *backend, const char *fname,
                  int flags, struct db **ret, struct txn **tid)
 {
@@ -125,7 +188,7 @@ static int _open(const char *backend, const char *fname,
      */
 
     /* check if it opens normally.  Horray */
-    r = db->backend->open(fname, flags, &db->engine, tid);
+    r = _backend_open(db, backend, fname, flags, tid);
     if (r == CYRUSDB_NOTFOUND) goto done; /* no open flags */
     if (!r) goto done;
 
@@ -157,10 +220,11 @@ static int _open(const char *backend, const char *fname,
             syslog(LOG_NOTICE, "cyrusdb: opening %s with backend %s (requested %s)",
                    fname, realname, backend);
             db->backend = cyrusdb_fromname(realname);
+            backend = realname;
         }
     }
 
-    r = db->backend->open(fname, flags, &db->engine, tid);
+    r = _backend_open(db, backend, fname, flags, tid);
 
 done:
 
@@ -323,6 +387,21 @@ EXPORTED int cyrusdb_compar(struct db *db,
     return db->backend->compar(db->engine, a, alen, b, blen);
 }
 
+EXPORTED int cyrusdb_lockall(struct db *db, struct txn **tid)
+{
+    const char *data;
+    size_t datalen;
+    int r;
+
+    if (db->backend->lockall)
+        return db->backend->lockall(db->engine, tid);
+
+    /* one lock covers the whole database: any access under tid takes it */
+    r = cyrusdb_fetch(db, "_", 1, &data, &datalen, tid);
+    if (r == CYRUSDB_NOTFOUND) r = 0;
+    return r;
+}
+
 /**********************************************/
 
 EXPORTED void cyrusdb_init(void)
@@ -450,6 +529,65 @@ static int converter_cb(void *rock,
     return cyrusdb_store(cr->db, key, keylen, data, datalen, cr->tid);
 }
 
+/* the files holding a database of type 'backend' at 'fname' */
+static void _dbfiles(const char *backend, const char *fname, strarray_t *files)
+{
+    const char *base;
+    int i, nshards = sharded_parse(backend, &base);
+
+    strarray_append(files, fname);
+    for (i = 0; i < nshards; i++) {
+        struct buf buf = BUF_INITIALIZER;
+        buf_printf(&buf, "%s.%d", fname, i);
+        strarray_appendm(files, buf_release(&buf));
+    }
+}
+
+static int _unlinkdb(const char *backend, const char *fname)
+{
+    strarray_t files = STRARRAY_INITIALIZER;
+    int i, r = 0;
+
+    _dbfiles(backend, fname, &files);
+    for (i = 0; i < files.count; i++) {
+        if (unlink(strarray_nth(&files, i)) && errno != ENOENT && !r)
+            r = CYRUSDB_IOERROR;
+    }
+    strarray_fini(&files);
+
+    return r;
+}
+
+/* move the database at 'from' over the one at 'to', removing any files
+ * of the old layout which the new one doesn't replace.  The layout file
+ * of a sharded database goes last, once all of its shards are in place */
+static int _replacedb(const char *tobackend, const char *from,
+                      const char *frombackend, const char *to)
+{
+    strarray_t fromfiles = STRARRAY_INITIALIZER;
+    strarray_t tofiles = STRARRAY_INITIALIZER;
+    strarray_t oldfiles = STRARRAY_INITIALIZER;
+    int i, r = 0;
+
+    _dbfiles(tobackend, from, &fromfiles);
+    _dbfiles(tobackend, to, &tofiles);
+    _dbfiles(frombackend, to, &oldfiles);
+
+    for (i = fromfiles.count - 1; !r && i >= 0; i--)
+        r = rename(strarray_nth(&fromfiles, i), strarray_nth(&tofiles, i));
+
+    for (i = 0; !r && i < oldfiles.count; i++) {
+        if (strarray_find(&tofiles, strarray_nth(&oldfiles, i), 0) < 0)
+            unlink(strarray_nth(&oldfiles, i));
+    }
+
+    strarray_fini(&fromfiles);
+    strarray_fini(&tofiles);
+    strarray_fini(&oldfiles);
+
+    return r;
+}
+
 /* convert (just copy every record) from one database to another in possibly
    a different format.  It's up to the surrounding code to copy the
    new database over the original if it wants to */
@@ -464,23 +602,27 @@ EXPORTED int cyrusdb_convert(const char *fromfname, const char *tofname,
     struct txn *totid = NULL;
     int r;
 
-    /* open source database */
-    r = cyrusdb_open(frombackend, fromfname, 0, &fromdb);
+    /* open and lock source database.  Backends which can't lock on open
+     * get a bogus fetch to lock them before touching the destination */
+    r = cyrusdb_lockopen(frombackend, fromfname, 0, &fromdb, &fromtid);
     if (r) goto err;
 
-    /* use a bogus fetch to lock source DB before touching the destination */
-    r = cyrusdb_fetch(fromdb, "_", 1, NULL, NULL, &fromtid);
-    if (r == CYRUSDB_NOTFOUND) r = 0;
-    if (r) goto err;
+    if (!fromtid) {
+        r = cyrusdb_fetch(fromdb, "_", 1, NULL, NULL, &fromtid);
+        if (r == CYRUSDB_NOTFOUND) r = 0;
+        if (r) goto err;
+    }
 
     /* same file?  Create with a new name */
     if (!strcmp(tofname, fromfname))
         tofname = newfname = strconcat(fromfname, ".NEW", NULL);
 
     /* remove any rubbish lying around */
-    unlink(tofname);
+    _unlinkdb(tobackend, tofname);
 
-    r = cyrusdb_open(tobackend, tofname, CYRUSDB_CREATE, &todb);
+    /* lock all of the destination up front: a sharded one would
+     * otherwise have to give up its locks to take them in order */
+    r = cyrusdb_lockopen(tobackend, tofname, CYRUSDB_CREATE, &todb, &totid);
     if (r) goto err;
 
     /* set up the copy rock */
@@ -488,7 +630,8 @@ EXPORTED int cyrusdb_convert(const char *fromfname, const char *tofname,
     cr.tid = &totid;
 
     /* copy each record to the destination DB */
-    cyrusdb_foreach(fromdb, "", 0, NULL, converter_cb, &cr, &fromtid);
+    r = cyrusdb_foreach(fromdb, "", 0, NULL, converter_cb, &cr, &fromtid);
+    if (r) goto err;
 
     /* commit destination transaction */
     if (totid) cyrusdb_commit(todb, totid);
@@ -499,7 +642,7 @@ EXPORTED int cyrusdb_convert(const char *fromfname, const char *tofname,
 
     /* created a new filename - so it's a replace-in-place */
     if (newfname) {
-        r = rename(newfname, fromfname);
+        r = _replacedb(tobackend, newfname, frombackend, fromfname);
         if (r) goto err;
     }
 
@@ -518,12 +661,21 @@ err:
     if (fromtid) cyrusdb_abort(fromdb, fromtid);
     if (fromdb) cyrusdb_close(fromdb);
 
-    unlink(tofname);
+    _unlinkdb(tobackend, tofname);
     free(newfname);
 
     return r;
 }
 
+/* remove the database at 'fname', and any other files it is made of.
+ * Other processes which have it open keep their now unlinked copy */
+EXPORTED int cyrusdb_unlink(const char *backend, const char *fname)
+{
+    const char *realname = cyrusdb_detect(fname);
+
+    return _unlinkdb(realname ? realname : backend, fname);
+}
+
 EXPORTED const char *cyrusdb_detect(const char *fname)
 {
     FILE *f;
@@ -546,6 +698,9 @@ EXPORTED const char *cyrusdb_detect(const char *fname)
     if (!strncmp(buf, "\241\002\213\015twoskip file\0\0\0\0", 16))
         return "twoskip";
 
+    if (!strncmp(buf, "\241\002\213\015sharded file\0\0\0\0", 16))
+        return cyrusdb_sharded_detect(fname);
+
     /* unable to detect SQLite databases or flat files explicitly here */
     return NULL;
 }
@@ -577,6 +732,7 @@ EXPORTED strarray_t *cyrusdb_backends(void)
     for (i = 0; _backends[i]; i++) {
         strarray_add(ret, _backends[i]->name);
     }
+    strarray_add(ret, SHARDED_PREFIX "<n>:<backend>");
 
     return ret;
 }
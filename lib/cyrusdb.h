@@ -212,6 +212,11 @@ struct cyrusdb_backend {
     int (*repack)(struct dbengine *db);
     int (*compar)(struct dbengine *db, const char *s1, int l1,
                   const char *s2, int l2);
+
+    /* Optional: lock everything 'tid' can touch, for a transaction
+     * which will write anywhere in the database.  Backends with a
+     * single lock leave this NULL. */
+    int (*lockall)(struct dbengine *db, struct txn **tid);
 };
 
 extern int cyrusdb_copyfile(const char *srcname, const char *dstname);
@@ -219,6 +224,8 @@ extern int cyrusdb_copyfile(const char *srcname, const char *dstname);
 extern int cyrusdb_convert(const char *fromfname, const char *tofname,
                            const char *frombackend, const char *tobackend);
 
+extern int cyrusdb_unlink(const char *backend, const char *fname);
+
 extern int cyrusdb_dumpfile(struct db *db,
                             const char *prefix, size_t prefixlen,
                             FILE *f,
@@ -284,6 +291,7 @@ extern int cyrusdb_repack(struct db *db);
 extern int cyrusdb_compar(struct db *db,
                           const char *a, int alen,
                           const char *b, int blen);
+extern int cyrusdb_lockall(struct db *db, struct txn **tid);
 
 /* somewhat special case, because they don't take a DB */
 
@@ -0,0 +1,822 @@
+/* cyrusdb_sharded.c -- cyrusdb layer spreading one database over several files
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A sharded database spreads its keys over several databases of
+ * another type, so that writers working on unrelated keys don't all
+ * queue on one file lock.  It's opened with a backend name of the form
+ *
+ *     sharded:N:backend
+ *
+ * which stores the records in N files fname.0 .. fname.N-1.  The file
+ * fname itself just records the layout, so that the database can be
+ * detected and converted like any other.
+ *
+ * Each key goes to the shard picked by hashing the leading part of its
+ * first NUL-separated field, cut after sharded_db_depth levels of
+ * hierarchy below any domain, so that (for the default of 2) all of a
+ * user's mailboxes land in the same shard.  A key starting with '$' is
+ * an index entry (like mailboxes.db's $RACL$...$mailbox keys) for the
+ * name after its last '$', and goes in that name's shard, so updating
+ * a record and its index entries stays within one shard.  A foreach
+ * whose prefix decides the shard goes straight to it; any other
+ * foreach merges the shards in key order.
+ *
+ * Transactions are kept per shard and commit one shard at a time, so
+ * a crash during commit of a transaction which touched several shards
+ * can leave it partly applied.
+ *
+ * Shards are only ever locked in ascending order, so transactions can't
+ * deadlock.  A transaction which needs a shard below one it already
+ * holds is aborted with CYRUSDB_AGAIN, as a backend which detects
+ * deadlocks would, and the next transaction on the handle locks every
+ * shard the failed one wanted up front, so the caller's retry goes
+ * through.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cyrusdb.h"
+#include "libcyr_cfg.h"
+#include "retry.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#define SHARDED_MAGIC "\241\002\213\015sharded file\0\0\0\0"
+#define SHARDED_MAGIC_SIZE 16
+#define SHARDED_MAXSHARDS 256
+
+struct dbengine {
+    char *fname;
+    int nshards;
+    struct db **shards;
+    char *prelock;      /* shards for the next transaction to lock first */
+};
+
+/* a transaction on each shard touched so far */
+struct txn {
+    struct txn **shardtids;
+};
+
+/* one shard's position in a merged foreach */
+struct cursor {
+    int valid;
+    struct buf key;
+    struct buf data;
+};
+
+static char *shard_fname(const char *fname, int i)
+{
+    struct buf buf = BUF_INITIALIZER;
+    buf_printf(&buf, "%s.%d", fname, i);
+    return buf_release(&buf);
+}
+
+/*
+ * The part of 'key' which picks its shard: moves *keyp to its start
+ * and returns its length.  Sets *completep if every key starting with
+ * these bytes has the same shard key, which is what lets a foreach
+ * prefix pick a single shard.
+ */
+static size_t shard_keylen(const char **keyp, size_t keylen, int *completep)
+{
+    const char *key = *keyp;
+    int depth = libcyrus_config_getint(CYRUSOPT_SHARDED_DB_DEPTH);
+    const char *end = memchr(key, '\0', keylen);
+    const char *start, *p;
+    int isindex = 0;
+    int dots = 0;
+
+    *completep = 0;
+
+    if (end) {
+        *completep = 1;
+        keylen = end - key;
+    }
+
+    /* index entries go with the name they index */
+    if (keylen && key[0] == '$') {
+        const char *name = key + keylen;
+
+        while (name[-1] != '$') name--;
+        keylen -= name - key;
+        key = *keyp = name;
+        isindex = 1;
+    }
+
+    if (depth <= 0) return keylen;
+
+    /* levels are counted below the domain, if there is one */
+    start = memchr(key, '!', keylen);
+    start = start ? start + 1 : key;
+
+    for (p = start; p < key + keylen; p++) {
+        if (*p != '.' || ++dots < depth) continue;
+
+        /* without a domain separator yet, a longer key could still
+         * turn out to have one, unless there are no domains at all.
+         * Nor can an index prefix rule out another '$' to come */
+        if (!isindex && (start != key ||
+                         !libcyrus_config_getswitch(CYRUSOPT_VIRTDOMAINS)))
+            *completep = 1;
+        return p - key;
+    }
+
+    return keylen;
+}
+
+static int shard_for(struct dbengine *db, const char *key, size_t keylen,
+                     int *completep)
+{
+    int complete;
+    size_t len = shard_keylen(&key, keylen, &complete);
+    unsigned hash = 2166136261U;    /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619U;
+    }
+
+    if (completep) *completep = complete;
+    return hash % db->nshards;
+}
+
+static int abort_txn(struct dbengine *db, struct txn *tid);
+
+/*
+ * Find the transaction to use on shard 'i' for 'tid', or NULL if there
+ * is none.  Returns CYRUSDB_AGAIN, having aborted the whole
+ * transaction, if it would have to wait for shard 'i' while holding a
+ * higher one.
+ */
+static int shard_tid(struct dbengine *db, struct txn **tid, int i,
+                     struct txn ***shardtidp)
+{
+    int j, r;
+
+    *shardtidp = NULL;
+    if (!tid) return 0;
+
+    if (!*tid) {
+        *tid = xzmalloc(sizeof(struct txn));
+        (*tid)->shardtids = xzmalloc(db->nshards * sizeof(struct txn *));
+
+        /* take whatever the last transaction wanted, in order */
+        for (j = 0; j < db->nshards; j++) {
+            if (!db->prelock[j]) continue;
+
+            r = cyrusdb_fetch(db->shards[j], "_", 1, NULL, NULL,
+                              &(*tid)->shardtids[j]);
+            if (r == CYRUSDB_NOTFOUND) r = 0;
+            if (r) {
+                abort_txn(db, *tid);
+                *tid = NULL;
+                return r;
+            }
+        }
+        memset(db->prelock, 0, db->nshards);
+    }
+
+    if (!(*tid)->shardtids[i]) {
+        for (j = i + 1; j < db->nshards; j++) {
+            if ((*tid)->shardtids[j]) break;
+        }
+
+        if (j < db->nshards) {
+            for (j = 0; j < db->nshards; j++) {
+                if ((*tid)->shardtids[j]) db->prelock[j] = 1;
+            }
+            db->prelock[i] = 1;
+
+            abort_txn(db, *tid);
+            *tid = NULL;
+            return CYRUSDB_AGAIN;
+        }
+    }
+
+    *shardtidp = &(*tid)->shardtids[i];
+    return 0;
+}
+
+/* the same, for something which needs every shard */
+static int shard_tid_all(struct dbengine *db, struct txn **tid)
+{
+    struct txn **shardtid;
+    int i, r = 0;
+
+    for (i = 0; !r && i < db->nshards; i++) {
+        r = shard_tid(db, tid, i, &shardtid);
+        if (!r && shardtid && !*shardtid) {
+            r = cyrusdb_fetch(db->shards[i], "_", 1, NULL, NULL, shardtid);
+            if (r == CYRUSDB_NOTFOUND) r = 0;
+            if (r) {
+                abort_txn(db, *tid);
+                *tid = NULL;
+            }
+        }
+    }
+
+    /* so that the retry locks them all before anything else */
+    if (r == CYRUSDB_AGAIN)
+        memset(db->prelock, 1, db->nshards);
+
+    return r;
+}
+
+static void free_txn(struct txn **tid)
+{
+    if (!*tid) return;
+    free((*tid)->shardtids);
+    free(*tid);
+    *tid = NULL;
+}
+
+static int read_layout(const char *fname, int *nshardsp, struct buf *base)
+{
+    char buf[SHARDED_MAGIC_SIZE + 64];
+    const char *p;
+    ssize_t n;
+    int fd;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1)
+        return errno == ENOENT ? CYRUSDB_NOTFOUND : CYRUSDB_IOERROR;
+
+    /* not retry_read: the file is shorter than the buffer */
+    do {
+        n = read(fd, buf, sizeof(buf) - 1);
+    } while (n == -1 && errno == EINTR);
+    close(fd);
+
+    if (n < SHARDED_MAGIC_SIZE ||
+        memcmp(buf, SHARDED_MAGIC, SHARDED_MAGIC_SIZE))
+        return CYRUSDB_IOERROR;
+    buf[n] = '\0';
+
+    p = buf + SHARDED_MAGIC_SIZE;
+    *nshardsp = atoi(p);
+    p = strchr(p, ':');
+    if (!p || *nshardsp < 1 || *nshardsp > SHARDED_MAXSHARDS)
+        return CYRUSDB_IOERROR;
+    buf_setmap(base, p + 1, strcspn(p + 1, "\n"));
+
+    return 0;
+}
+
+static int write_layout(const char *fname, int nshards, const char *base)
+{
+    struct buf buf = BUF_INITIALIZER;
+    char *tmpname = strconcat(fname, ".tmp", (char *)NULL);
+    int fd;
+    int r = 0;
+
+    buf_appendmap(&buf, SHARDED_MAGIC, SHARDED_MAGIC_SIZE);
+    buf_printf(&buf, "%d:%s\n", nshards, base);
+
+    fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1 ||
+        retry_write(fd, buf.s, buf.len) != (ssize_t)buf.len ||
+        fsync(fd) ||
+        rename(tmpname, fname)) {
+        syslog(LOG_ERR, "DBERROR: writing %s: %m", fname);
+        unlink(tmpname);
+        r = CYRUSDB_IOERROR;
+    }
+
+    if (fd != -1) close(fd);
+    free(tmpname);
+    buf_free(&buf);
+    return r;
+}
+
+/* the backend name for what's at 'fname', if it's sharded */
+HIDDEN const char *cyrusdb_sharded_detect(const char *fname)
+{
+    static struct buf name = BUF_INITIALIZER;
+    struct buf base = BUF_INITIALIZER;
+    int nshards;
+
+    if (read_layout(fname, &nshards, &base))
+        return NULL;
+
+    buf_reset(&name);
+    buf_printf(&name, "sharded:%d:%s", nshards, buf_cstring(&base));
+    buf_free(&base);
+
+    return buf_cstring(&name);
+}
+
+static int myclose(struct dbengine *db)
+{
+    int i, r = 0;
+
+    for (i = 0; i < db->nshards; i++) {
+        if (db->shards[i]) {
+            int r2 = cyrusdb_close(db->shards[i]);
+            if (r2 && !r) r = r2;
+        }
+    }
+
+    free(db->shards);
+    free(db->prelock);
+    free(db->fname);
+    free(db);
+
+    return r;
+}
+
+static int fetch(struct dbengine *db,
+                 const char *key, size_t keylen,
+                 const char **data, size_t *datalen,
+                 struct txn **tid)
+{
+    int i = shard_for(db, key, keylen, NULL);
+    struct txn **shardtid;
+    int r = shard_tid(db, tid, i, &shardtid);
+
+    if (r) return r;
+    return cyrusdb_fetch(db->shards[i], key, keylen, data, datalen, shardtid);
+}
+
+static int fetchlock(struct dbengine *db,
+                     const char *key, size_t keylen,
+                     const char **data, size_t *datalen,
+                     struct txn **tid)
+{
+    int i = shard_for(db, key, keylen, NULL);
+    struct txn **shardtid;
+    int r = shard_tid(db, tid, i, &shardtid);
+
+    if (r) return r;
+    return cyrusdb_fetchlock(db->shards[i], key, keylen, data, datalen,
+                             shardtid);
+}
+
+/* the least key after 'key' in any shard */
+static int fetchnext(struct dbengine *db,
+                     const char *key, size_t keylen,
+                     const char **foundkey, size_t *foundkeylen,
+                     const char **data, size_t *datalen,
+                     struct txn **tid)
+{
+    const char *bestkey = NULL, *bestdata = NULL;
+    size_t bestkeylen = 0, bestdatalen = 0;
+    int i, r = 0;
+
+    if (tid) {
+        r = shard_tid_all(db, tid);
+        if (r) return r;
+    }
+
+    for (i = 0; i < db->nshards; i++) {
+        const char *k, *d;
+        size_t klen, dlen;
+
+        r = cyrusdb_fetchnext(db->shards[i], key, keylen, &k, &klen,
+                              &d, &dlen, tid ? &(*tid)->shardtids[i] : NULL);
+        if (r == CYRUSDB_NOTFOUND) continue;
+        if (r) return r;
+
+        if (!bestkey ||
+            cyrusdb_compar(db->shards[0], k, klen, bestkey, bestkeylen) < 0) {
+            bestkey = k;
+            bestkeylen = klen;
+            bestdata = d;
+            bestdatalen = dlen;
+        }
+    }
+
+    if (foundkey) *foundkey = bestkey;
+    if (foundkeylen) *foundkeylen = bestkeylen;
+    if (data) *data = bestdata;
+    if (datalen) *datalen = bestdatalen;
+
+    return bestkey ? 0 : CYRUSDB_NOTFOUND;
+}
+
+/* move 'c' on to the first record after 'key' in shard 'i' which
+ * still starts with 'prefix' */
+static int cursor_next(struct dbengine *db, int i, struct cursor *c,
+                       const char *key, size_t keylen, int exact,
+                       const char *prefix, size_t prefixlen,
+                       struct txn **tid)
+{
+    const char *k = key, *d;
+    size_t klen = keylen, dlen;
+    int r;
+
+    struct txn **shardtid = tid ? &(*tid)->shardtids[i] : NULL;
+
+    if (exact)
+        r = cyrusdb_fetch(db->shards[i], key, keylen, &d, &dlen, shardtid);
+    else
+        r = cyrusdb_fetchnext(db->shards[i], key, keylen, &k, &klen,
+                              &d, &dlen, shardtid);
+
+    c->valid = 0;
+    if (r == CYRUSDB_NOTFOUND) return 0;
+    if (r) return r;
+
+    if (klen < prefixlen || memcmp(k, prefix, prefixlen)) return 0;
+
+    buf_setmap(&c->key, k, klen);
+    buf_setmap(&c->data, d, dlen);
+    c->valid = 1;
+
+    return 0;
+}
+
+static int foreach(struct dbengine *db,
+                   const char *prefix, size_t prefixlen,
+                   foreach_p *p,
+                   foreach_cb *cb, void *rock,
+                   struct txn **tid)
+{
+    struct cursor *cursors;
+    struct buf last = BUF_INITIALIZER;
+    int complete;
+    int i, r = 0;
+
+    if (!prefix) {
+        prefix = "";
+        prefixlen = 0;
+    }
+
+    /* the prefix fixes the shard, so let it do all the work */
+    i = shard_for(db, prefix, prefixlen, &complete);
+    if (complete) {
+        struct txn **shardtid;
+
+        r = shard_tid(db, tid, i, &shardtid);
+        if (r) return r;
+        return cyrusdb_foreach(db->shards[i], prefix, prefixlen,
+                               p, cb, rock, shardtid);
+    }
+
+    /* otherwise merge the shards.  Each cursor holds a copy of its
+     * record and moves on with fetchnext from there, so the callback
+     * is free to change the database under us */
+    if (tid) {
+        r = shard_tid_all(db, tid);
+        if (r) return r;
+    }
+
+    cursors = xzmalloc(db->nshards * sizeof(struct cursor));
+
+    for (i = 0; !r && i < db->nshards; i++) {
+        /* the prefix itself may be a record, but "" never is */
+        if (prefixlen)
+            r = cursor_next(db, i, &cursors[i], prefix, prefixlen, 1,
+                            prefix, prefixlen, tid);
+        if (!r && !cursors[i].valid)
+            r = cursor_next(db, i, &cursors[i], prefix, prefixlen, 0,
+                            prefix, prefixlen, tid);
+    }
+
+    while (!r) {
+        struct cursor *c = NULL;
+        int best = -1;
+
+        for (i = 0; i < db->nshards; i++) {
+            if (!cursors[i].valid) continue;
+            if (!c || cyrusdb_compar(db->shards[0],
+                                     cursors[i].key.s, cursors[i].key.len,
+                                     c->key.s, c->key.len) < 0) {
+                c = &cursors[i];
+                best = i;
+            }
+        }
+        if (!c) break;
+
+        if (!p || p(rock, c->key.s, c->key.len, c->data.s, c->data.len))
+            r = cb(rock, c->key.s, c->key.len, c->data.s, c->data.len);
+        if (r) break;
+
+        buf_copy(&last, &c->key);
+        r = cursor_next(db, best, c, last.s, last.len, 0,
+                        prefix, prefixlen, tid);
+    }
+
+    buf_free(&last);
+
+    for (i = 0; i < db->nshards; i++) {
+        buf_free(&cursors[i].key);
+        buf_free(&cursors[i].data);
+    }
+    free(cursors);
+
+    return r;
+}
+
+static int create(struct dbengine *db,
+                  const char *key, size_t keylen,
+                  const char *data, size_t datalen,
+                  struct txn **tid)
+{
+    int i = shard_for(db, key, keylen, NULL);
+    struct txn **shardtid;
+    int r = shard_tid(db, tid, i, &shardtid);
+
+    if (r) return r;
+    return cyrusdb_create(db->shards[i], key, keylen, data, datalen, shardtid);
+}
+
+static int store(struct dbengine *db,
+                 const char *key, size_t keylen,
+                 const char *data, size_t datalen,
+                 struct txn **tid)
+{
+    int i = shard_for(db, key, keylen, NULL);
+    struct txn **shardtid;
+    int r = shard_tid(db, tid, i, &shardtid);
+
+    if (r) return r;
+    return cyrusdb_store(db->shards[i], key, keylen, data, datalen, shardtid);
+}
+
+static int delete(struct dbengine *db,
+                  const char *key, size_t keylen,
+                  struct txn **tid, int force)
+{
+    int i = shard_for(db, key, keylen, NULL);
+    struct txn **shardtid;
+    int r = shard_tid(db, tid, i, &shardtid);
+
+    if (r) return r;
+    return cyrusdb_delete(db->shards[i], key, keylen, shardtid, force);
+}
+
+static int commit_txn(struct dbengine *db, struct txn *tid)
+{
+    int i, r = 0;
+
+    /* once one shard fails, throw the rest away too */
+    for (i = 0; i < db->nshards; i++) {
+        struct txn *shardtid = tid->shardtids[i];
+        int r2;
+
+        if (!shardtid) continue;
+
+        if (r) r2 = cyrusdb_abort(db->shards[i], shardtid);
+        else r2 = cyrusdb_commit(db->shards[i], shardtid);
+
+        if (r2 && !r) {
+            syslog(LOG_ERR, "DBERROR: sharded %s: commit of shard %d failed",
+                   db->fname, i);
+            r = r2;
+        }
+    }
+
+    free_txn(&tid);
+    return r;
+}
+
+static int abort_txn(struct dbengine *db, struct txn *tid)
+{
+    int i, r = 0;
+
+    for (i = 0; i < db->nshards; i++) {
+        int r2;
+
+        if (!tid->shardtids[i]) continue;
+
+        r2 = cyrusdb_abort(db->shards[i], tid->shardtids[i]);
+        if (r2 && !r) r = r2;
+    }
+
+    free_txn(&tid);
+    return r;
+}
+
+static int dump(struct dbengine *db, int detail)
+{
+    int i, r = 0;
+
+    for (i = 0; !r && i < db->nshards; i++) {
+        printf("SHARD %d\n", i);
+        r = cyrusdb_dump(db->shards[i], detail);
+    }
+
+    return r;
+}
+
+static int consistent(struct dbengine *db)
+{
+    int i, r = 0;
+
+    for (i = 0; !r && i < db->nshards; i++)
+        r = cyrusdb_consistent(db->shards[i]);
+
+    return r;
+}
+
+static int repack(struct dbengine *db)
+{
+    int i, r = 0;
+
+    for (i = 0; !r && i < db->nshards; i++)
+        r = cyrusdb_repack(db->shards[i]);
+
+    return r;
+}
+
+static int mycompar(struct dbengine *db, const char *a, int alen,
+                    const char *b, int blen)
+{
+    return cyrusdb_compar(db->shards[0], a, alen, b, blen);
+}
+
+/* archive the shards along with the layout file */
+HIDDEN int cyrusdb_sharded_archive(const strarray_t *fnames,
+                                   const char *dirname)
+{
+    strarray_t all = STRARRAY_INITIALIZER;
+    struct buf base = BUF_INITIALIZER;
+    int i, j, nshards;
+    int r;
+
+    for (i = 0; i < fnames->count; i++) {
+        const char *fname = strarray_nth(fnames, i);
+
+        strarray_append(&all, fname);
+        if (read_layout(fname, &nshards, &base)) continue;
+
+        for (j = 0; j < nshards; j++)
+            strarray_appendm(&all, shard_fname(fname, j));
+    }
+
+    r = cyrusdb_generic_archive(&all, dirname);
+
+    strarray_fini(&all);
+    buf_free(&base);
+
+    return r;
+}
+
+static int myopen(const char *fname __attribute__((unused)),
+                  int flags __attribute__((unused)),
+                  struct dbengine **ret __attribute__((unused)),
+                  struct txn **tid __attribute__((unused)))
+{
+    /* needs the layout too: see cyrusdb_sharded_open */
+    return CYRUSDB_INTERNAL;
+}
+
+/*
+ * Open 'fname' as 'nshards' shards of type 'backend'.  Returns
+ * CYRUSDB_IOERROR if there is something else at 'fname', so the caller
+ * can detect and deal with it.
+ */
+HIDDEN int cyrusdb_sharded_open(const char *fname, int nshards,
+                                const char *backend, int flags,
+                                struct dbengine **ret, struct txn **tid)
+{
+    struct dbengine *db;
+    struct buf base = BUF_INITIALIZER;
+    int disk_nshards;
+    int create = 0;
+    int i, r;
+
+    if (nshards < 1 || nshards > SHARDED_MAXSHARDS)
+        return CYRUSDB_INTERNAL;
+
+    r = read_layout(fname, &disk_nshards, &base);
+    if (r == CYRUSDB_NOTFOUND) {
+        if (!(flags & CYRUSDB_CREATE)) return CYRUSDB_NOTFOUND;
+        create = 1;
+    }
+    else if (r) {
+        return r;
+    }
+    else {
+        /* laid out differently */
+        r = (disk_nshards != nshards || strcmp(buf_cstring(&base), backend))
+            ? CYRUSDB_IOERROR : 0;
+        buf_free(&base);
+        if (r) return r;
+    }
+
+    db = xzmalloc(sizeof(struct dbengine));
+    db->fname = xstrdup(fname);
+    db->nshards = nshards;
+    db->shards = xzmalloc(nshards * sizeof(struct db *));
+    db->prelock = xzmalloc(nshards);
+
+    for (i = 0; i < nshards; i++) {
+        char *sfname = shard_fname(fname, i);
+
+        if (create) cyrus_mkdir(sfname, 0755);
+        r = cyrusdb_open(backend, sfname, flags, &db->shards[i]);
+        if (r) {
+            syslog(LOG_ERR, "DBERROR: opening shard %s: %s",
+                   sfname, cyrusdb_strerror(r));
+            free(sfname);
+            if (r == CYRUSDB_NOTFOUND) r = CYRUSDB_IOERROR;
+            goto done;
+        }
+        free(sfname);
+    }
+
+    /* only once every shard exists */
+    if (create) {
+        r = write_layout(fname, nshards, backend);
+        if (r) goto done;
+    }
+
+    /* lock the lot */
+    if (tid) {
+        r = shard_tid_all(db, tid);
+        if (r) goto done;
+    }
+
+done:
+    if (r) myclose(db);
+    else *ret = db;
+
+    return r;
+}
+
+static int lockall(struct dbengine *db, struct txn **tid)
+{
+    return shard_tid_all(db, tid);
+}
+
+HIDDEN struct cyrusdb_backend cyrusdb_sharded =
+{
+    "sharded",                          /* name */
+
+    &cyrusdb_generic_init,
+    &cyrusdb_generic_done,
+    &cyrusdb_generic_sync,
+    &cyrusdb_sharded_archive,
+
+    &myopen,
+    &myclose,
+
+    &fetch,
+    &fetchlock,
+    &fetchnext,
+
+    &foreach,
+    &create,
+    &store,
+    &delete,
+
+    &commit_txn,
+    &abort_txn,
+
+    &dump,
+    &consistent,
+    &repack,
+    &mycompar,
+    &lockall
+};
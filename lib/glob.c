@@ -58,6 +58,7 @@
 EXPORTED glob *glob_init(const char *str, char sep)
 {
     struct buf buf = BUF_INITIALIZER;
+    const char *pattern = str;
 
     buf_appendcstr(&buf, "(^");
     while (*str) {
@@ -110,6 +111,8 @@ EXPORTED glob *glob_init(const char *str, char sep)
 
     glob *g = xmalloc(sizeof(glob));
     regcomp(&g->regex, buf_cstring(&buf), 0);
+    g->pattern = xstrdup(pattern);
+    g->sep = sep;
     buf_free(&buf);
 
     return g;
@@ -122,6 +125,7 @@ EXPORTED void glob_free(glob **gp)
     glob *g = *gp;
     if (g) {
         regfree(&g->regex);
+        free(g->pattern);
         free(g);
     }
     *gp = NULL;
@@ -144,3 +148,68 @@ EXPORTED int glob_test(glob *g, const char *str)
 
     return match[1].rm_eo;
 }
+
+/* add pattern position 'i', and the positions after any wildcards
+ * there (which can match nothing), to the set of live positions */
+static void glob_addstate(const char *pattern, char *states, size_t i)
+{
+    while (!states[i]) {
+        states[i] = 1;
+        if (pattern[i] != '*' && pattern[i] != '%') break;
+        i++;
+    }
+}
+
+/* returns 1 if some name below 'prefix' in the hierarchy could match.
+ * Runs the pattern as an NFA over 'prefix' and a separator: if any
+ * position before the end of the pattern is still live, some suffix
+ * completes it.
+ */
+EXPORTED int glob_test_below(glob *g, const char *prefix)
+{
+    const char *pattern = g->pattern;
+    size_t plen = strlen(pattern);
+    char *cur = xzmalloc(plen + 1);
+    char *next = xzmalloc(plen + 1);
+    const char *p;
+    size_t i;
+    int live = 0;
+
+    glob_addstate(pattern, cur, 0);
+
+    for (p = prefix; ; p++) {
+        char c = *p ? *p : g->sep;
+
+        memset(next, 0, plen + 1);
+        live = 0;
+        for (i = 0; i < plen; i++) {
+            if (!cur[i]) continue;
+            if (pattern[i] == '*' || (pattern[i] == '%' && c != g->sep)) {
+                glob_addstate(pattern, next, i);
+                live = 1;
+            }
+            else if (pattern[i] == c) {
+                glob_addstate(pattern, next, i + 1);
+                live = 1;
+            }
+        }
+
+        char *tmp = cur;
+        cur = next;
+        next = tmp;
+
+        if (!live || !*p) break;
+    }
+
+    /* a position at the very end matched the separator itself, which
+     * isn't a name; anything before the end can still be completed */
+    live = 0;
+    for (i = 0; i < plen; i++) {
+        if (cur[i]) live = 1;
+    }
+
+    free(cur);
+    free(next);
+
+    return live;
+}
@@ -55,6 +55,8 @@
  */
 typedef struct glob {
     regex_t regex;
+    char *pattern;
+    char sep;
 } glob;
 
 /* initialize globbing structure
@@ -73,6 +75,15 @@ extern void glob_free(glob **gp);
  */
 extern int glob_test(glob *g, const char *str);
 
+/* returns 1 if some name below 'prefix' in the hierarchy (i.e.
+ * starting with 'prefix' followed by the separator) could match,
+ * otherwise 0.  Names which only partially match 'prefix' itself
+ * are not considered; test those with glob_test.
+ *  g         pre-processed glob string
+ *  prefix    hierarchy prefix
+ */
+extern int glob_test_below(glob *g, const char *prefix);
+
 /* MACROS */
 #define GLOB_MATCH(g, str) ((int)strlen(str) == glob_test((g), (str)))
 
@@ -0,0 +1,453 @@
+/* hashmap.c -- resizable open-addressing hash tables
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "assert.h"
+#include "hashmap.h"
+#include "mpool.h"
+#include "xmalloc.h"
+
+#define HASHMAP_EMPTY   0
+#define HASHMAP_DELETED 1
+
+#define HASHMAP_MINSIZE 16
+
+/* old slots moved across by each insert or delete during a resize.
+ * The new array is twice the size and the old one at most 3/4 full,
+ * so anything over 1 finishes before the new array needs to grow */
+#define HASHMAP_MIGRATE 8
+
+/* strhash() is fine for chains but its low bits are too poor to use
+ * as a probe index, so use FNV-1a with a final mix instead */
+static uint32_t hash_str(const char *key)
+{
+    uint32_t h = 2166136261U;
+
+    while (*key) {
+        h ^= (unsigned char) *key++;
+        h *= 16777619U;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h < 2 ? h + 2 : h;
+}
+
+static uint32_t hash_u64(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+
+    return (uint32_t) key < 2 ? (uint32_t) key + 2 : (uint32_t) key;
+}
+
+static inline int slot_matches(const hashmap_t *map,
+                               const struct hashmap_slot *slot, uint32_t hash,
+                               const char *skey, uint64_t ukey)
+{
+    if (slot->hash != hash) return 0;
+    return map->is_u64 ? slot->key.u64 == ukey : !strcmp(slot->key.str, skey);
+}
+
+static size_t roundup_size(size_t n)
+{
+    size_t size = HASHMAP_MINSIZE;
+
+    while (size < n) size <<= 1;
+
+    return size;
+}
+
+static struct hashmap_slot *find_slot(const hashmap_t *map,
+                                      struct hashmap_slot *slots, size_t size,
+                                      uint32_t hash,
+                                      const char *skey, uint64_t ukey)
+{
+    size_t mask = size - 1;
+    size_t i;
+
+    if (!slots) return NULL;
+
+    /* deleted slots only exist in the old array, and don't end a probe */
+    for (i = hash & mask; slots[i].hash != HASHMAP_EMPTY; i = (i + 1) & mask) {
+        if (slot_matches(map, &slots[i], hash, skey, ukey))
+            return &slots[i];
+    }
+
+    return NULL;
+}
+
+/* put a slot we know isn't there yet into the current array */
+static void place_slot(hashmap_t *map, const struct hashmap_slot *slot)
+{
+    size_t mask = map->size - 1;
+    size_t i;
+
+    for (i = slot->hash & mask; map->slots[i].hash != HASHMAP_EMPTY;
+         i = (i + 1) & mask);
+
+    map->slots[i] = *slot;
+    map->count++;
+}
+
+static void migrate(hashmap_t *map, size_t n)
+{
+    while (map->oldslots && n--) {
+        struct hashmap_slot *slot = &map->oldslots[map->migrated++];
+
+        if (slot->hash >= 2) {
+            place_slot(map, slot);
+            map->oldcount--;
+            /* keep later probes in the old array going past it */
+            slot->hash = HASHMAP_DELETED;
+        }
+
+        if (map->migrated == map->oldsize) {
+            free(map->oldslots);
+            map->oldslots = NULL;
+            map->oldsize = map->oldcount = map->migrated = 0;
+        }
+    }
+}
+
+static void grow(hashmap_t *map)
+{
+    /* never more than one resize in flight */
+    if (map->oldslots) migrate(map, map->oldsize);
+
+    if (!map->slots) {
+        map->size = roundup_size(map->size);
+        map->slots = xzmalloc(map->size * sizeof(struct hashmap_slot));
+        return;
+    }
+
+    map->oldslots = map->slots;
+    map->oldsize = map->size;
+    map->oldcount = map->count;
+    map->migrated = 0;
+
+    map->size *= 2;
+    map->count = 0;
+    map->slots = xzmalloc(map->size * sizeof(struct hashmap_slot));
+}
+
+static void *insert(hashmap_t *map, uint32_t hash,
+                    const char *skey, uint64_t ukey, void *data)
+{
+    struct hashmap_slot *slot;
+    struct hashmap_slot new;
+
+    slot = find_slot(map, map->slots, map->size, hash, skey, ukey);
+    if (!slot)
+        slot = find_slot(map, map->oldslots, map->oldsize, hash, skey, ukey);
+    if (slot) {
+        void *old = slot->data;
+        slot->data = data;
+        return old;
+    }
+
+    if (!map->slots || (map->count + 1) * 4 > map->size * 3)
+        grow(map);
+
+    memset(&new, 0, sizeof(struct hashmap_slot));
+    new.hash = hash;
+    if (map->is_u64)
+        new.key.u64 = ukey;
+    else if (map->pool)
+        new.key.str = mpool_strdup(map->pool, skey);
+    else
+        new.key.str = xstrdup(skey);
+    new.data = data;
+    place_slot(map, &new);
+
+    migrate(map, HASHMAP_MIGRATE);
+
+    return data;
+}
+
+static void *lookup(hashmap_t *map, uint32_t hash,
+                    const char *skey, uint64_t ukey)
+{
+    struct hashmap_slot *slot;
+
+    slot = find_slot(map, map->slots, map->size, hash, skey, ukey);
+    if (!slot)
+        slot = find_slot(map, map->oldslots, map->oldsize, hash, skey, ukey);
+
+    return slot ? slot->data : NULL;
+}
+
+static void *del(hashmap_t *map, uint32_t hash,
+                 const char *skey, uint64_t ukey)
+{
+    struct hashmap_slot *slot;
+    void *data;
+
+    slot = find_slot(map, map->slots, map->size, hash, skey, ukey);
+    if (slot) {
+        size_t mask = map->size - 1;
+        size_t i = slot - map->slots;
+        size_t j = i;
+
+        data = slot->data;
+        if (!map->is_u64 && !map->pool) free(slot->key.str);
+        slot->hash = HASHMAP_EMPTY;
+        map->count--;
+
+        /* shift back anything later in the run which could live here,
+         * so that lookups can stop at the first empty slot */
+        for (;;) {
+            size_t home;
+
+            j = (j + 1) & mask;
+            if (map->slots[j].hash == HASHMAP_EMPTY) break;
+
+            home = map->slots[j].hash & mask;
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                continue;
+
+            map->slots[i] = map->slots[j];
+            map->slots[j].hash = HASHMAP_EMPTY;
+            i = j;
+        }
+    }
+    else {
+        slot = find_slot(map, map->oldslots, map->oldsize, hash, skey, ukey);
+        if (!slot) return NULL;
+
+        data = slot->data;
+        if (!map->is_u64 && !map->pool) free(slot->key.str);
+        slot->hash = HASHMAP_DELETED;
+        map->oldcount--;
+    }
+
+    migrate(map, HASHMAP_MIGRATE);
+
+    return data;
+}
+
+static void enumerate(hashmap_t *map,
+                      void (*func)(const struct hashmap_slot *, void *),
+                      void *rock)
+{
+    size_t i;
+
+    for (i = map->migrated; i < map->oldsize; i++) {
+        if (map->oldslots[i].hash >= 2)
+            func(&map->oldslots[i], rock);
+    }
+
+    for (i = 0; i < map->size && map->slots; i++) {
+        if (map->slots[i].hash >= 2)
+            func(&map->slots[i], rock);
+    }
+}
+
+static void free_slots(hashmap_t *map, struct hashmap_slot *slots,
+                       size_t from, size_t size, void (*func)(void *))
+{
+    size_t i;
+
+    for (i = from; i < size; i++) {
+        if (slots[i].hash < 2) continue;
+        if (func) func(slots[i].data);
+        if (!map->is_u64 && !map->pool) free(slots[i].key.str);
+    }
+
+    free(slots);
+}
+
+static void free_map(hashmap_t *map, void (*func)(void *))
+{
+    if (map->oldslots)
+        free_slots(map, map->oldslots, map->migrated, map->oldsize, func);
+    if (map->slots)
+        free_slots(map, map->slots, 0, map->size, func);
+    if (map->pool)
+        free_mpool(map->pool);
+
+    memset(map, 0, sizeof(hashmap_t));
+}
+
+/* ---------------------------------------------------------------------- */
+
+EXPORTED hashmap_t *construct_hashmap(hashmap_t *map, size_t size,
+                                      int use_mpool)
+{
+    assert(map);
+
+    memset(map, 0, sizeof(hashmap_t));
+    map->size = roundup_size(size + size / 3 + 1);
+    map->slots = xzmalloc(map->size * sizeof(struct hashmap_slot));
+    if (use_mpool)
+        map->pool = new_mpool(size ? size * 16 : 1024);
+
+    return map;
+}
+
+EXPORTED void *hashmap_insert(const char *key, void *data, hashmap_t *map)
+{
+    return insert(map, hash_str(key), key, 0, data);
+}
+
+EXPORTED void *hashmap_lookup(const char *key, hashmap_t *map)
+{
+    if (!map->count && !map->oldcount) return NULL;
+    return lookup(map, hash_str(key), key, 0);
+}
+
+EXPORTED void *hashmap_del(const char *key, hashmap_t *map)
+{
+    if (!map->count && !map->oldcount) return NULL;
+    return del(map, hash_str(key), key, 0);
+}
+
+struct enum_rock {
+    void (*func)(const char *, void *, void *);
+    void (*func64)(uint64_t, void *, void *);
+    void *rock;
+};
+
+static void enum_str(const struct hashmap_slot *slot, void *rock)
+{
+    struct enum_rock *erock = (struct enum_rock *) rock;
+    erock->func(slot->key.str, slot->data, erock->rock);
+}
+
+EXPORTED void hashmap_enumerate(hashmap_t *map,
+                                void (*func)(const char *, void *, void *),
+                                void *rock)
+{
+    struct enum_rock erock = { func, NULL, rock };
+    enumerate(map, enum_str, &erock);
+}
+
+static void keys_cb(const struct hashmap_slot *slot, void *rock)
+{
+    strarray_append((strarray_t *) rock, slot->key.str);
+}
+
+EXPORTED strarray_t *hashmap_keys(hashmap_t *map)
+{
+    strarray_t *sa = strarray_new();
+    enumerate(map, keys_cb, sa);
+    return sa;
+}
+
+EXPORTED int hashmap_numrecords(hashmap_t *map)
+{
+    return map->count + map->oldcount;
+}
+
+EXPORTED void free_hashmap(hashmap_t *map, void (*func)(void *))
+{
+    if (!map) return;
+    free_map(map, func);
+}
+
+/* ---------------------------------------------------------------------- */
+
+EXPORTED hashmapu64_t *construct_hashmapu64(hashmapu64_t *map, size_t size,
+                                            int use_mpool __attribute__((unused)))
+{
+    /* the keys are stored inline, there's nothing for a pool to hold */
+    construct_hashmap(&map->map, size, 0);
+    map->map.is_u64 = 1;
+
+    return map;
+}
+
+EXPORTED void *hashmapu64_insert(uint64_t key, void *data, hashmapu64_t *map)
+{
+    map->map.is_u64 = 1;
+    return insert(&map->map, hash_u64(key), NULL, key, data);
+}
+
+EXPORTED void *hashmapu64_lookup(uint64_t key, hashmapu64_t *map)
+{
+    if (!map->map.count && !map->map.oldcount) return NULL;
+    return lookup(&map->map, hash_u64(key), NULL, key);
+}
+
+EXPORTED void *hashmapu64_del(uint64_t key, hashmapu64_t *map)
+{
+    if (!map->map.count && !map->map.oldcount) return NULL;
+    return del(&map->map, hash_u64(key), NULL, key);
+}
+
+static void enum_u64(const struct hashmap_slot *slot, void *rock)
+{
+    struct enum_rock *erock = (struct enum_rock *) rock;
+    erock->func64(slot->key.u64, slot->data, erock->rock);
+}
+
+EXPORTED void hashmapu64_enumerate(hashmapu64_t *map,
+                                   void (*func)(uint64_t, void *, void *),
+                                   void *rock)
+{
+    struct enum_rock erock = { NULL, func, rock };
+    enumerate(&map->map, enum_u64, &erock);
+}
+
+EXPORTED int hashmapu64_numrecords(hashmapu64_t *map)
+{
+    return hashmap_numrecords(&map->map);
+}
+
+EXPORTED void free_hashmapu64(hashmapu64_t *map, void (*func)(void *))
+{
+    if (!map) return;
+    free_map(&map->map, func);
+}
@@ -0,0 +1,138 @@
+/* hashmap.h -- resizable open-addressing hash tables
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_HASHMAP_H__
+#define __CYRUS_HASHMAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "strarray.h"
+
+/*
+ * A drop-in alternative to hash_table and hashu64_table for tables
+ * whose size isn't known up front.  The slots live in one flat array
+ * with their hash stored alongside the key, so most probes never
+ * touch the key at all.  The array doubles when it gets 3/4 full, and
+ * the entries are moved across a few at a time by later inserts and
+ * deletes rather than all at once, so no single call pays for the
+ * whole resize.
+ *
+ * The size given to construct_hashmap() is only a hint.  As with
+ * hash_table, if use_mpool is set the keys are allocated from a
+ * memory pool which is only released by free_hashmap().
+ *
+ * Don't insert into or delete from a table while enumerating it.
+ */
+
+struct hashmap_slot {
+    uint32_t hash;      /* 0 = empty, 1 = deleted */
+    union {
+        char *str;
+        uint64_t u64;
+    } key;
+    void *data;
+};
+
+typedef struct hashmap {
+    size_t size;                /* always a power of two */
+    size_t count;
+    struct hashmap_slot *slots;
+    /* the previous array while a resize is under way */
+    size_t oldsize;
+    size_t oldcount;
+    size_t migrated;
+    struct hashmap_slot *oldslots;
+    struct mpool *pool;
+    int is_u64;
+} hashmap_t;
+
+typedef struct hashmapu64 {
+    hashmap_t map;
+} hashmapu64_t;
+
+#define HASHMAP_INITIALIZER { 0, 0, NULL, 0, 0, 0, NULL, NULL, 0 }
+#define HASHMAPU64_INITIALIZER { HASHMAP_INITIALIZER }
+
+/* string keys, as hash.h */
+
+extern hashmap_t *construct_hashmap(hashmap_t *map, size_t size,
+                                    int use_mpool);
+
+/* returns 'data', or the data it replaced if 'key' was already there */
+extern void *hashmap_insert(const char *key, void *data, hashmap_t *map);
+
+extern void *hashmap_lookup(const char *key, hashmap_t *map);
+
+/* returns the data which was stored under 'key', if any */
+extern void *hashmap_del(const char *key, hashmap_t *map);
+
+extern void hashmap_enumerate(hashmap_t *map,
+                              void (*func)(const char *, void *, void *),
+                              void *rock);
+
+extern strarray_t *hashmap_keys(hashmap_t *map);
+
+extern int hashmap_numrecords(hashmap_t *map);
+
+extern void free_hashmap(hashmap_t *map, void (*func)(void *));
+
+/* 64 bit integer keys, as hashu64.h */
+
+extern hashmapu64_t *construct_hashmapu64(hashmapu64_t *map, size_t size,
+                                          int use_mpool);
+
+extern void *hashmapu64_insert(uint64_t key, void *data, hashmapu64_t *map);
+
+extern void *hashmapu64_lookup(uint64_t key, hashmapu64_t *map);
+
+extern void *hashmapu64_del(uint64_t key, hashmapu64_t *map);
+
+extern void hashmapu64_enumerate(hashmapu64_t *map,
+                                 void (*func)(uint64_t, void *, void *),
+                                 void *rock);
+
+extern int hashmapu64_numrecords(hashmapu64_t *map);
+
+extern void free_hashmapu64(hashmapu64_t *map, void (*func)(void *));
+
+#endif /* __CYRUS_HASHMAP_H__ */
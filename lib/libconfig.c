@@ -51,11 +51,17 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "assert.h"
 #include "exitcodes.h"
 #include "hash.h"
 #include "libconfig.h"
+#include "map.h"
+#include "retry.h"
+#include "strhash.h"
 #include "xmalloc.h"
 #include "xstrlcat.h"
 #include "xstrlcpy.h"
@@ -66,7 +72,7 @@
 #define INCLUDEHASHSIZE 5 /* relatively small,
                             * but how many includes are reasonable? */
 
-static struct hash_table confighash, includehash;
+static struct hash_table confighash;
 
 /* cached configuration variables accessible to the external world */
 EXPORTED const char *config_filename= NULL;       /* filename of configuration file */
@@ -90,8 +96,9 @@ EXPORTED int config_debug;
 extern void fatal(const char *fatal_message, int fatal_code)
    __attribute__ ((noreturn));
 
-/* prototype to allow for sane function ordering */
+/* prototypes to allow for sane function ordering */
 static void config_read_file(const char *filename);
+static int config_read_snapshot(const char *filename);
 
 EXPORTED const char *config_getstring(enum imapopt opt)
 {
@@ -345,13 +352,9 @@ EXPORTED void config_read(const char *alt_config, const int config_need_data)
         fatal("could not construct configuration hash table", EC_CONFIG);
     }
 
-    if (!construct_hash_table(&includehash, INCLUDEHASHSIZE, 1)) {
-        fatal("could not construct include file  hash table", EC_CONFIG);
-    }
-
-    config_read_file(config_filename);
-
-    free_hash_table(&includehash, NULL);
+    /* a snapshot from master saves scanning the files again */
+    if (config_read_snapshot(config_filename))
+        config_read_file(config_filename);
 
     /* Check configdirectory config option */
     if (!config_dir) {
@@ -489,17 +492,31 @@ EXPORTED void config_read(const char *alt_config, const int config_need_data)
 
 #define GROWSIZE 4096
 
-static void config_read_file(const char *filename)
+/*
+ * Reading imapd.conf happens in two halves: config_scan_file() splits
+ * the files into key/value lines, following @include, and hands each
+ * line on to scan->proc.  config_read_line() then looks the key up in
+ * imapopts and sets the option.  A snapshot is just the output of the
+ * first half, saved along with the results of the option lookups.
+ */
+struct config_scan {
+    hash_table includes;
+    void (*file)(const char *path, const struct stat *sbuf, void *rock);
+    void (*proc)(const char *key, char *val, int lineno, void *rock);
+    void *rock;
+    char errbuf[1024];
+};
+
+static int config_scan_file(const char *filename, struct config_scan *scan)
 {
     FILE *infile = NULL;
-    enum imapopt opt = IMAPOPT_ZERO;
     int lineno = 0;
-    char *buf, errbuf[1024];
+    char *buf;
     const char *cyrus_path;
     unsigned bufsize, len;
-    char *p, *q, *key, *fullkey, *srvkey, *val, *newval;
-    int service_specific;
-    int idlen = (config_ident ? strlen(config_ident) : 0);
+    char *p, *q, *key;
+    struct stat sbuf;
+    int r = -1;
 
     bufsize = GROWSIZE;
     buf = xmalloc(bufsize);
@@ -513,25 +530,32 @@ static void config_read_file(const char *filename)
         infile = fopen(buf, "r");
     }
 
-    if (!infile)
+    if (!infile) {
+        strlcpy(buf, filename, bufsize);
         infile = fopen(filename, "r");
+    }
 
     if (!infile) {
-        snprintf(buf, bufsize, "can't open configuration file %s: %s",
+        snprintf(scan->errbuf, sizeof(scan->errbuf),
+                 "can't open configuration file %s: %s",
                  filename, strerror(errno));
-        fatal(buf, EC_CONFIG);
+        free(buf);
+        return -1;
     }
 
     /* check to see if we've already read this file */
-    if (hash_lookup(filename, &includehash)) {
-        snprintf(buf, bufsize, "configuration file %s included twice",
-                 filename);
-        fatal(buf, EC_CONFIG);
+    if (hash_lookup(filename, &scan->includes)) {
+        snprintf(scan->errbuf, sizeof(scan->errbuf),
+                 "configuration file %s included twice", filename);
+        goto done;
     }
     else {
-        hash_insert(filename, (void*) 0xDEADBEEF, &includehash);
+        hash_insert(filename, (void*) 0xDEADBEEF, &scan->includes);
     }
 
+    if (scan->file && !fstat(fileno(infile), &sbuf))
+        scan->file(buf, &sbuf, scan->rock);
+
     len = 0;
     while (fgets(buf+len, bufsize-len, infile)) {
         if (buf[len]) {
@@ -557,25 +581,23 @@ static void config_read_file(const char *filename)
         len = 0;
         lineno++;
 
-        service_specific = 0;
-
         /* remove leading whitespace */
         for (p = buf; *p && Uisspace(*p); p++);
 
         /* skip comments */
         if (!*p || *p == '#') continue;
 
-        fullkey = key = p;
+        key = p;
         if (*p == '@') p++;  /* allow @ as the first char (for directives) */
         while (*p && (Uisalnum(*p) || *p == '-' || *p == '_')) {
             if (Uisupper(*p)) *p = tolower((unsigned char) *p);
             p++;
         }
         if (*p != ':') {
-            snprintf(errbuf, sizeof(errbuf),
+            snprintf(scan->errbuf, sizeof(scan->errbuf),
                     "invalid option name on line %d of configuration file %s",
                     lineno, filename);
-            fatal(errbuf, EC_CONFIG);
+            goto done;
         }
         *p++ = '\0';
 
@@ -588,225 +610,625 @@ static void config_read_file(const char *filename)
         }
 
         if (!*p) {
-            snprintf(errbuf, sizeof(errbuf),
+            snprintf(scan->errbuf, sizeof(scan->errbuf),
                     "empty option value on line %d of configuration file",
                     lineno);
-            fatal(errbuf, EC_CONFIG);
+            goto done;
         }
 
-        srvkey = NULL;
-
         /* Look for directives */
         if (key[0] == '@') {
             if (!strcasecmp(key, "@include")) {
-                config_read_file(p);
+                if (config_scan_file(p, scan)) goto done;
                 continue;
             }
             else {
-                snprintf(errbuf, sizeof(errbuf),
+                snprintf(scan->errbuf, sizeof(scan->errbuf),
                          "invalid directive on line %d of configuration file %s",
                          lineno, filename);
-                fatal(errbuf, EC_CONFIG);
+                goto done;
             }
         }
 
-        /* Find if there is a <service>_ prefix */
-        if (config_ident && !strncasecmp(key, config_ident, idlen)
-           && key[idlen] == '_') {
-            /* skip service_ prefix */
-            srvkey = key + idlen + 1;
-        }
+        scan->proc(key, p, lineno, scan->rock);
+    }
 
-        /* look for a service_ prefix match in imapopts */
-        if (srvkey) {
-            for (opt = IMAPOPT_ZERO; opt < IMAPOPT_LAST; opt++) {
-                if (!strcasecmp(imapopts[opt].optname, srvkey)) {
-                    key = srvkey;
-                    service_specific = 1;
-                    break;
-                }
-            }
-        }
+    r = 0;
 
-        /* Did not find a service_ specific match, try looking for an
-         * exact match */
-        if (!service_specific) {
-            for (opt = IMAPOPT_ZERO; opt < IMAPOPT_LAST; opt++) {
-                if (!strcasecmp(imapopts[opt].optname, key)) {
-                    break;
-                }
-            }
+ done:
+    fclose(infile);
+    free(buf);
+    return r;
+}
+
+static enum imapopt config_findopt(const char *key)
+{
+    enum imapopt opt;
+
+    for (opt = IMAPOPT_ZERO; opt < IMAPOPT_LAST; opt++) {
+        if (!strcasecmp(imapopts[opt].optname, key)) {
+            break;
         }
+    }
 
-        /* If both of those loops failed, it goes verbatim into the
-         * overflow hash table. */
-
-        if (opt < IMAPOPT_LAST) {
-            /* Okay, we know about this configure option.
-             * So first check that we have either
-             *  1. not seen it
-             *  2. seen its generic form, but this is a service specific form
-             *
-             *  If we have already seen a service-specific form, and this is
-             *  a generic form, just skip it and don't moan.
-             */
-            if (
-                    (imapopts[opt].seen == 1 && !service_specific) ||
-                    (imapopts[opt].seen == 2 && service_specific)
-                ) {
-
-                sprintf(errbuf,
-                        "option '%s' was specified twice in config file (second occurance on line %d)",
-                        fullkey, lineno);
-                fatal(errbuf, EC_CONFIG);
+    return opt;
+}
 
-            } else if (imapopts[opt].seen == 2 && !service_specific) {
-                continue;
-            }
+/* Set option opt (IMAPOPT_LAST for an overflow string) from one line
+ * of the configuration file */
+static void config_setopt(const char *fullkey, char *p, int lineno,
+                          enum imapopt opt, int service_specific)
+{
+    char *q, *val, *newval;
+    char errbuf[1024];
+
+    if (opt < IMAPOPT_LAST) {
+        /* Okay, we know about this configure option.
+         * So first check that we have either
+         *  1. not seen it
+         *  2. seen its generic form, but this is a service specific form
+         *
+         *  If we have already seen a service-specific form, and this is
+         *  a generic form, just skip it and don't moan.
+         */
+        if (
+                (imapopts[opt].seen == 1 && !service_specific) ||
+                (imapopts[opt].seen == 2 && service_specific)
+            ) {
+
+            sprintf(errbuf,
+                    "option '%s' was specified twice in config file (second occurance on line %d)",
+                    fullkey, lineno);
+            fatal(errbuf, EC_CONFIG);
 
-            /* If we've seen it already, we're replacing it, so we need
-             * to free the current string if there is one */
-            if (imapopts[opt].seen && imapopts[opt].t == OPT_STRING)
-                free((char *)imapopts[opt].val.s);
+        } else if (imapopts[opt].seen == 2 && !service_specific) {
+            return;
+        }
 
-            if (service_specific)
-                imapopts[opt].seen = 2;
-            else
-                imapopts[opt].seen = 1;
+        /* If we've seen it already, we're replacing it, so we need
+         * to free the current string if there is one */
+        if (imapopts[opt].seen && imapopts[opt].t == OPT_STRING)
+            free((char *)imapopts[opt].val.s);
 
-            /* this is a known option */
-            switch (imapopts[opt].t) {
-            case OPT_STRING:
-            {
-                imapopts[opt].val.s = xstrdup(p);
+        if (service_specific)
+            imapopts[opt].seen = 2;
+        else
+            imapopts[opt].seen = 1;
 
-                if (opt == IMAPOPT_CONFIGDIRECTORY)
-                    config_dir = imapopts[opt].val.s;
+        /* this is a known option */
+        switch (imapopts[opt].t) {
+        case OPT_STRING:
+        {
+            imapopts[opt].val.s = xstrdup(p);
 
-                break;
-            }
-            case OPT_INT:
-            {
-                long val;
-                char *ptr;
+            if (opt == IMAPOPT_CONFIGDIRECTORY)
+                config_dir = imapopts[opt].val.s;
 
-                val = strtol(p, &ptr, 0);
-                if (!ptr || *ptr != '\0') {
-                    /* error during conversion */
-                    sprintf(errbuf, "non-integer value for %s in line %d",
-                            imapopts[opt].optname, lineno);
-                    fatal(errbuf, EC_CONFIG);
-                }
+            break;
+        }
+        case OPT_INT:
+        {
+            long val;
+            char *ptr;
+
+            val = strtol(p, &ptr, 0);
+            if (!ptr || *ptr != '\0') {
+                /* error during conversion */
+                sprintf(errbuf, "non-integer value for %s in line %d",
+                        imapopts[opt].optname, lineno);
+                fatal(errbuf, EC_CONFIG);
+            }
 
-                imapopts[opt].val.i = val;
-                break;
+            imapopts[opt].val.i = val;
+            break;
+        }
+        case OPT_SWITCH:
+        {
+            if (*p == '0' || *p == 'n' ||
+                (*p == 'o' && p[1] == 'f') || *p == 'f') {
+                imapopts[opt].val.b = 0;
             }
-            case OPT_SWITCH:
-            {
-                if (*p == '0' || *p == 'n' ||
-                    (*p == 'o' && p[1] == 'f') || *p == 'f') {
-                    imapopts[opt].val.b = 0;
-                }
-                else if (*p == '1' || *p == 'y' ||
-                         (*p == 'o' && p[1] == 'n') || *p == 't') {
-                    imapopts[opt].val.b = 1;
+            else if (*p == '1' || *p == 'y' ||
+                     (*p == 'o' && p[1] == 'n') || *p == 't') {
+                imapopts[opt].val.b = 1;
+            }
+            else {
+                /* error during conversion */
+                sprintf(errbuf, "non-switch value for %s in line %d",
+                        imapopts[opt].optname, lineno);
+                fatal(errbuf, EC_CONFIG);
+            }
+            break;
+        }
+        case OPT_ENUM:
+        case OPT_STRINGLIST:
+        case OPT_BITFIELD:
+        {
+            const struct enum_option_s *e;
+
+            /* zero the value */
+            memset(&imapopts[opt].val, 0, sizeof(imapopts[opt].val));
+
+            /* q is at EOS so we'll process entire the string
+               as one value unless told otherwise */
+            q = p + strlen(p);
+
+            if (imapopts[opt].t == OPT_ENUM) {
+                /* normalize on/off values */
+                if (!strcmp(p, "1") || !strcmp(p, "yes") ||
+                    !strcmp(p, "t") || !strcmp(p, "true")) {
+                    p = "on";
+                } else if (!strcmp(p, "0") || !strcmp(p, "no") ||
+                           !strcmp(p, "f") || !strcmp(p, "false")) {
+                    p = "off";
                 }
-                else {
+            } else if (imapopts[opt].t == OPT_BITFIELD) {
+                /* split the string into separate values */
+                q = p;
+            }
+
+            while (*p) {
+                /* find the end of the first value */
+                for (; *q && !Uisspace(*q); q++);
+                if (*q) *q++ = '\0';
+
+                /* see if its a legal value */
+                for (e = imapopts[opt].enum_options;
+                     e->name && strcmp(e->name, p); e++);
+
+                if (!e->name) {
                     /* error during conversion */
-                    sprintf(errbuf, "non-switch value for %s in line %d",
-                            imapopts[opt].optname, lineno);
+                    sprintf(errbuf, "invalid value '%s' for %s in line %d",
+                            p, imapopts[opt].optname, lineno);
                     fatal(errbuf, EC_CONFIG);
                 }
-                break;
+                else if (imapopts[opt].t == OPT_STRINGLIST)
+                    imapopts[opt].val.s = e->name;
+                else if (imapopts[opt].t == OPT_ENUM)
+                    imapopts[opt].val.e = e->val;
+                else
+                    imapopts[opt].val.x |= e->val;
+
+                /* find the start of the next value */
+                for (p = q; *p && Uisspace(*p); p++);
+                q = p;
             }
-            case OPT_ENUM:
-            case OPT_STRINGLIST:
-            case OPT_BITFIELD:
-            {
-                const struct enum_option_s *e;
-
-                /* zero the value */
-                memset(&imapopts[opt].val, 0, sizeof(imapopts[opt].val));
-
-                /* q is already at EOS so we'll process entire the string
-                   as one value unless told otherwise */
-
-                if (imapopts[opt].t == OPT_ENUM) {
-                    /* normalize on/off values */
-                    if (!strcmp(p, "1") || !strcmp(p, "yes") ||
-                        !strcmp(p, "t") || !strcmp(p, "true")) {
-                        p = "on";
-                    } else if (!strcmp(p, "0") || !strcmp(p, "no") ||
-                               !strcmp(p, "f") || !strcmp(p, "false")) {
-                        p = "off";
-                    }
-                } else if (imapopts[opt].t == OPT_BITFIELD) {
-                    /* split the string into separate values */
-                    q = p;
-                }
 
-                while (*p) {
-                    /* find the end of the first value */
-                    for (; *q && !Uisspace(*q); q++);
-                    if (*q) *q++ = '\0';
-
-                    /* see if its a legal value */
-                    for (e = imapopts[opt].enum_options;
-                         e->name && strcmp(e->name, p); e++);
-
-                    if (!e->name) {
-                        /* error during conversion */
-                        sprintf(errbuf, "invalid value '%s' for %s in line %d",
-                                p, imapopts[opt].optname, lineno);
-                        fatal(errbuf, EC_CONFIG);
-                    }
-                    else if (imapopts[opt].t == OPT_STRINGLIST)
-                        imapopts[opt].val.s = e->name;
-                    else if (imapopts[opt].t == OPT_ENUM)
-                        imapopts[opt].val.e = e->val;
-                    else
-                        imapopts[opt].val.x |= e->val;
-
-                    /* find the start of the next value */
-                    for (p = q; *p && Uisspace(*p); p++);
-                    q = p;
-                }
-
-                break;
-            }
-            case OPT_NOTOPT:
-            default:
-                abort();
-            }
-        } else {
-            /* check to make sure it's valid for overflow */
-            /* that is, partition names and anything that might be
-             * used by SASL */
+            break;
+        }
+        case OPT_NOTOPT:
+        default:
+            abort();
+        }
+    } else {
+        /* check to make sure it's valid for overflow */
+        /* that is, partition names and anything that might be
+         * used by SASL */
 /*
   xxx this would be nice if it wasn't for other services who might be
       sharing this config file and whose names we cannot predict
 
-            if (strncasecmp(key,"sasl_",5)
-            && strncasecmp(key,"partition-",10)) {
-                sprintf(errbuf,
-                        "option '%s' is unknown on line %d of config file",
-                        fullkey, lineno);
-                fatal(errbuf, EC_CONFIG);
-            }
+        if (strncasecmp(key,"sasl_",5)
+        && strncasecmp(key,"partition-",10)) {
+            sprintf(errbuf,
+                    "option '%s' is unknown on line %d of config file",
+                    fullkey, lineno);
+            fatal(errbuf, EC_CONFIG);
+        }
 */
 
-            /* Put it in the overflow hash table */
-            newval = xstrdup(p);
-            val = hash_insert(key, newval, &confighash);
-            if (val != newval) {
-                snprintf(errbuf, sizeof(errbuf),
-                        "option '%s' was specified twice in config file (second occurance on line %d)",
-                        fullkey, lineno);
-                fatal(errbuf, EC_CONFIG);
-            }
+        /* Put it in the overflow hash table */
+        newval = xstrdup(p);
+        val = hash_insert(fullkey, newval, &confighash);
+        if (val != newval) {
+            snprintf(errbuf, sizeof(errbuf),
+                    "option '%s' was specified twice in config file (second occurance on line %d)",
+                    fullkey, lineno);
+            fatal(errbuf, EC_CONFIG);
         }
     }
+}
 
-    fclose(infile);
-    free(buf);
+static void config_read_line(const char *key, char *p, int lineno,
+                             void *rock __attribute__((unused)))
+{
+    enum imapopt opt = IMAPOPT_LAST;
+    int service_specific = 0;
+    int idlen = (config_ident ? strlen(config_ident) : 0);
+
+    /* Find if there is a <service>_ prefix, and if so look for a
+     * service_ prefix match in imapopts */
+    if (config_ident && !strncasecmp(key, config_ident, idlen)
+       && key[idlen] == '_') {
+        opt = config_findopt(key + idlen + 1);
+        if (opt < IMAPOPT_LAST) service_specific = 1;
+    }
+
+    /* Did not find a service_ specific match, try looking for an
+     * exact match.  If that fails too, it goes verbatim into the
+     * overflow hash table. */
+    if (!service_specific)
+        opt = config_findopt(key);
+
+    config_setopt(key, p, lineno, opt, service_specific);
+}
+
+static void config_read_file(const char *filename)
+{
+    struct config_scan scan;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.proc = config_read_line;
+
+    if (!construct_hash_table(&scan.includes, INCLUDEHASHSIZE, 1)) {
+        fatal("could not construct include file  hash table", EC_CONFIG);
+    }
+
+    if (config_scan_file(filename, &scan))
+        fatal(scan.errbuf, EC_CONFIG);
+
+    free_hash_table(&scan.includes, NULL);
+}
+
+/*
+ * Configuration snapshots.
+ *
+ * master scans imapd.conf (and anything it includes) once, when it
+ * starts and on SIGHUP, and writes what it found to the file named by
+ * the configsnapshot option, passing the name on to the services it
+ * starts in CONFIG_SNAPSHOT_ENV.  config_read() in those services maps
+ * the snapshot instead of opening and scanning the files itself.  The
+ * option lookups are saved too, so they don't have to be repeated for
+ * every line either.
+ *
+ * The snapshot only saves work, it never changes the result: the lines
+ * are still applied by config_setopt(), so service-specific options and
+ * errors in values behave exactly as they would for the files, and it
+ * is only used if every file in it is unchanged since it was written
+ * (and wasn't changed in the same second, which we couldn't tell).
+ * Any sort of mismatch and we just read the files.
+ *
+ * The layout is a header, the name of the configuration file, a record
+ * for each file read and one for each line.  Everything is aligned to
+ * 8 bytes and stored in host byte order; it never leaves the machine.
+ */
+#define SNAPSHOT_MAGIC "CYRCONF1"
+#define SNAPSHOT_ALIGN(n) (((n) + 7) & ~((size_t) 7))
+
+struct snapshot_header {
+    char magic[8];
+    int64_t scantime;   /* when the files were scanned */
+    uint32_t size;      /* of the whole snapshot */
+    uint32_t nopts;     /* IMAPOPT_LAST of the writer, */
+    uint32_t optsum;    /* and a checksum over imapopts */
+    uint32_t nfiles;
+    uint32_t nlines;
+    uint32_t namelen;   /* of the configuration file name which follows */
+};
+
+struct snapshot_file {
+    int64_t mtime;
+    int64_t size;
+    int64_t ino;
+    uint32_t pathlen;   /* of the path which follows */
+    uint32_t reserved;
+};
+
+struct snapshot_line {
+    uint32_t lineno;
+    uint32_t opt;       /* the key looked up as it is */
+    uint32_t srvlen;    /* length of the key up to its first '_', or 0 */
+    uint32_t srvopt;    /* the key looked up after that '_' */
+    uint32_t keylen;    /* key and value follow, each NUL terminated */
+    uint32_t vallen;
+};
+
+struct snapshot_writer {
+    struct buf files;
+    struct buf lines;
+    uint32_t nfiles;
+    uint32_t nlines;
+};
+
+/* a checksum over the option table, so that a snapshot written by one
+ * build of Cyrus is never read by another */
+static uint32_t snapshot_optsum(void)
+{
+    static uint32_t optsum = 0;
+    enum imapopt opt;
+
+    if (optsum) return optsum;
+
+    optsum = IMAPOPT_LAST;
+    for (opt = IMAPOPT_ZERO; opt < IMAPOPT_LAST; opt++) {
+        optsum = optsum * 31 + strhash(imapopts[opt].optname);
+        optsum = optsum * 31 + imapopts[opt].t;
+    }
+    if (!optsum) optsum = 1;
+
+    return optsum;
+}
+
+static void snapshot_pad(struct buf *buf)
+{
+    static const char zeros[8];
+
+    buf_appendmap(buf, zeros, SNAPSHOT_ALIGN(buf_len(buf)) - buf_len(buf));
+}
+
+static void snapshot_file_cb(const char *path, const struct stat *sbuf,
+                             void *rock)
+{
+    struct snapshot_writer *w = (struct snapshot_writer *) rock;
+    struct snapshot_file rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.mtime = sbuf->st_mtime;
+    rec.size = sbuf->st_size;
+    rec.ino = sbuf->st_ino;
+    rec.pathlen = strlen(path);
+
+    buf_appendmap(&w->files, (const char *) &rec, sizeof(rec));
+    buf_appendmap(&w->files, path, rec.pathlen + 1);
+    snapshot_pad(&w->files);
+    w->nfiles++;
+}
+
+static void snapshot_line_cb(const char *key, char *val, int lineno,
+                             void *rock)
+{
+    struct snapshot_writer *w = (struct snapshot_writer *) rock;
+    struct snapshot_line rec;
+    const char *p = strchr(key, '_');
+
+    memset(&rec, 0, sizeof(rec));
+    rec.lineno = lineno;
+    rec.opt = config_findopt(key);
+    rec.srvlen = p ? p - key : 0;
+    rec.srvopt = p ? config_findopt(p + 1) : IMAPOPT_LAST;
+    rec.keylen = strlen(key);
+    rec.vallen = strlen(val);
+
+    buf_appendmap(&w->lines, (const char *) &rec, sizeof(rec));
+    buf_appendmap(&w->lines, key, rec.keylen + 1);
+    buf_appendmap(&w->lines, val, rec.vallen + 1);
+    snapshot_pad(&w->lines);
+    w->nlines++;
+}
+
+/*
+ * Write a snapshot of the configuration file that was read by
+ * config_read() to 'fname'.  The files are scanned afresh, so this
+ * picks up any changes made to them since.  Returns 0 on success.
+ */
+EXPORTED int config_snapshot_write(const char *fname)
+{
+    struct snapshot_writer w;
+    struct snapshot_header hdr;
+    struct config_scan scan;
+    struct buf name = BUF_INITIALIZER;
+    struct iovec iov[4];
+    char *newfname = NULL;
+    time_t scantime;
+    int fd = -1;
+    int r = -1;
+
+    if (!config_filename) return -1;
+
+    memset(&w, 0, sizeof(w));
+    memset(&scan, 0, sizeof(scan));
+    scan.file = snapshot_file_cb;
+    scan.proc = snapshot_line_cb;
+    scan.rock = &w;
+
+    if (!construct_hash_table(&scan.includes, INCLUDEHASHSIZE, 1)) {
+        fatal("could not construct include file  hash table", EC_CONFIG);
+    }
+
+    scantime = time(NULL);
+    r = config_scan_file(config_filename, &scan);
+    free_hash_table(&scan.includes, NULL);
+    if (r) {
+        syslog(LOG_ERR, "config_snapshot_write: %s", scan.errbuf);
+        goto done;
+    }
+
+    buf_setcstr(&name, config_filename);
+    buf_putc(&name, '\0');
+    snapshot_pad(&name);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.scantime = scantime;
+    hdr.size = sizeof(hdr) + buf_len(&name) +
+        buf_len(&w.files) + buf_len(&w.lines);
+    hdr.nopts = IMAPOPT_LAST;
+    hdr.optsum = snapshot_optsum();
+    hdr.nfiles = w.nfiles;
+    hdr.nlines = w.nlines;
+    hdr.namelen = strlen(config_filename);
+
+    iov[0].iov_base = (char *) &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (char *) buf_base(&name);
+    iov[1].iov_len = buf_len(&name);
+    iov[2].iov_base = (char *) buf_base(&w.files);
+    iov[2].iov_len = buf_len(&w.files);
+    iov[3].iov_base = (char *) buf_base(&w.lines);
+    iov[3].iov_len = buf_len(&w.lines);
+
+    /* write a new file and rename it into place, so that anyone reading
+     * the old one carries on undisturbed */
+    newfname = strconcat(fname, ".NEW", (char *)NULL);
+    fd = open(newfname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+        r = -1;
+        goto done;
+    }
+
+    if (retry_writev(fd, iov, 4) != (ssize_t) hdr.size) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
+        r = -1;
+        goto done;
+    }
+
+    if (close(fd) == -1 || rename(newfname, fname) == -1) {
+        fd = -1;
+        syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+        r = -1;
+        goto done;
+    }
+    fd = -1;
+
+    syslog(LOG_DEBUG, "config_snapshot_write: %s: %u files, %u lines",
+           fname, w.nfiles, w.nlines);
+
+ done:
+    if (fd != -1) close(fd);
+    if (r && newfname) unlink(newfname);
+    free(newfname);
+    buf_free(&name);
+    buf_free(&w.files);
+    buf_free(&w.lines);
+    return r;
+}
+
+/*
+ * Check the snapshot mapped at base is whole, was written for
+ * 'filename' by this build, and that none of its files have changed.
+ * Returns the first line record, or NULL if it can't be used.
+ */
+static const char *snapshot_check(const char *base, size_t len,
+                                  const char *filename)
+{
+    const struct snapshot_header *hdr = (const struct snapshot_header *) base;
+    const char *p, *end = base + len;
+    uint32_t i;
+
+    if (len < sizeof(*hdr)) return NULL;
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic))) return NULL;
+    if (hdr->size != len) return NULL;
+    if (hdr->nopts != IMAPOPT_LAST) return NULL;
+    if (hdr->optsum != snapshot_optsum()) return NULL;
+
+    p = base + sizeof(*hdr);
+    if ((size_t) (end - p) < SNAPSHOT_ALIGN(hdr->namelen + 1)) return NULL;
+    if (strcmp(p, filename)) return NULL;
+    p += SNAPSHOT_ALIGN(hdr->namelen + 1);
+
+    for (i = 0; i < hdr->nfiles; i++) {
+        const struct snapshot_file *rec = (const struct snapshot_file *) p;
+        struct stat sbuf;
+
+        if ((size_t) (end - p) < sizeof(*rec)) return NULL;
+        if ((size_t) (end - p) - sizeof(*rec) <
+            SNAPSHOT_ALIGN(rec->pathlen + 1)) return NULL;
+        p += sizeof(*rec);
+        if (p[rec->pathlen]) return NULL;
+
+        /* only the contents matter: the reader never opens the file,
+         * so a change of owner or mode doesn't stop us using it */
+        if (stat(p, &sbuf) ||
+            sbuf.st_mtime != rec->mtime ||
+            sbuf.st_size != rec->size || (int64_t) sbuf.st_ino != rec->ino)
+            return NULL;
+
+        /* a file changed in the second it was scanned could change
+         * again without its times showing it */
+        if (rec->mtime >= hdr->scantime)
+            return NULL;
+
+        p += SNAPSHOT_ALIGN(rec->pathlen + 1);
+    }
+
+    /* walk the lines once before we use any of them */
+    {
+        const char *q = p;
+
+        for (i = 0; i < hdr->nlines; i++) {
+            const struct snapshot_line *rec = (const struct snapshot_line *) q;
+            size_t reclen;
+
+            if ((size_t) (end - q) < sizeof(*rec)) return NULL;
+            reclen = SNAPSHOT_ALIGN((size_t) rec->keylen + rec->vallen + 2);
+            if ((size_t) (end - q) - sizeof(*rec) < reclen) return NULL;
+            q += sizeof(*rec);
+            if (q[rec->keylen] || q[rec->keylen + 1 + rec->vallen])
+                return NULL;
+            if (rec->opt > IMAPOPT_LAST || rec->srvopt > IMAPOPT_LAST)
+                return NULL;
+            q += reclen;
+        }
+        if (q != end) return NULL;
+    }
+
+    return p;
+}
+
+/*
+ * Read the configuration from the snapshot named in the environment,
+ * if there is one and it is current.  Returns 0 if the configuration
+ * was read, or -1 if the files need to be read instead.
+ */
+static int config_read_snapshot(const char *filename)
+{
+    const char *fname = getenv(CONFIG_SNAPSHOT_ENV);
+    const char *base = NULL, *p;
+    size_t len = 0;
+    struct stat sbuf;
+    uint32_t i, nlines;
+    int idlen = (config_ident ? strlen(config_ident) : 0);
+    int fd;
+
+    if (!fname || !*fname) return -1;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) return -1;
+
+    if (fstat(fd, &sbuf) == -1 ||
+        sbuf.st_size < (off_t) sizeof(struct snapshot_header)) {
+        close(fd);
+        return -1;
+    }
+
+    map_refresh(fd, 1, &base, &len, sbuf.st_size, fname, NULL);
+    close(fd);
+
+    p = snapshot_check(base, len, filename);
+    if (!p) {
+        map_free(&base, &len);
+        return -1;
+    }
+
+    nlines = ((const struct snapshot_header *) base)->nlines;
+    for (i = 0; i < nlines; i++) {
+        const struct snapshot_line *rec = (const struct snapshot_line *) p;
+        const char *key = p + sizeof(*rec);
+        char *val = xstrndup(key + rec->keylen + 1, rec->vallen);
+        enum imapopt opt = IMAPOPT_LAST;
+        int service_specific = 0;
+
+        /* same as config_read_line(), but with the lookups done */
+        if (config_ident && !strncasecmp(key, config_ident, idlen)
+            && key[idlen] == '_') {
+            if ((unsigned) idlen == rec->srvlen)
+                opt = rec->srvopt;
+            else
+                opt = config_findopt(key + idlen + 1);
+            if (opt < IMAPOPT_LAST) service_specific = 1;
+        }
+
+        if (!service_specific)
+            opt = rec->opt;
+
+        config_setopt(key, val, rec->lineno, opt, service_specific);
+        free(val);
+
+        p += sizeof(*rec) + SNAPSHOT_ALIGN(rec->keylen + rec->vallen + 2);
+    }
+
+    map_free(&base, &len);
+
+    return 0;
 }
@@ -64,6 +64,11 @@ extern const char *config_partitiondir(const char *partition);
 extern const char *config_metapartitiondir(const char *partition);
 extern const char *config_archivepartitiondir(const char *partition);
 
+/* configuration snapshots, written by master and read by config_read()
+ * in the services it starts */
+#define CONFIG_SNAPSHOT_ENV "CYRUS_CONFIG_SNAPSHOT"
+extern int config_snapshot_write(const char *fname);
+
 /* cached configuration variables accessable to external world */
 extern const char *config_filename;
 extern const char *config_dir;
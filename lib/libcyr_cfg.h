@@ -105,6 +105,8 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* Levels of mailbox hierarchy hashed to pick a database shard (2) */
+    CYRUSOPT_SHARDED_DB_DEPTH,
 
     CYRUSOPT_LAST
 
@@ -56,6 +56,10 @@
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#define USE_SENDFILE
+#endif
 
 #include "assert.h"
 #include "exitcodes.h"
@@ -68,6 +72,12 @@
 #include "util.h"
 #include "xmalloc.h"
 
+/* OpenSSL can only sendfile() when the kernel does the TLS records;
+ * SSL_OP_ENABLE_KTLS comes from <openssl/ssl.h>, via prot.h */
+#if defined(USE_SENDFILE) && defined(HAVE_SSL) && defined(SSL_OP_ENABLE_KTLS)
+#define USE_KTLS
+#endif
+
 /* Transparant protgroup structure */
 struct protgroup
 {
@@ -1258,6 +1268,114 @@ EXPORTED int prot_write(struct protstream *s, const char *buf, unsigned len)
     return 0;
 }
 
+/*
+ * Can the socket be given file data directly?  Not if the data has to
+ * pass through us on its way: into a buffer, the telemetry log, zlib or
+ * a SASL security layer.  TLS is fine when the kernel does the records.
+ */
+static int prot_zerocopy(struct protstream *s)
+{
+#ifdef USE_SENDFILE
+    if (!s->write || s->writetobuf) return 0;
+    if (s->logfd != PROT_NO_FD) return 0;
+    if (s->saslssf) return 0;
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif /* HAVE_ZLIB */
+#ifdef HAVE_SSL
+    if (s->tls_conn) {
+#ifdef USE_KTLS
+        return BIO_get_ktls_send(SSL_get_wbio(s->tls_conn));
+#else
+        return 0;
+#endif /* USE_KTLS */
+    }
+#endif /* HAVE_SSL */
+    return 1;
+#else
+    (void)s;
+    return 0;
+#endif /* USE_SENDFILE */
+}
+
+EXPORTED int prot_cansendfile(struct protstream *s, size_t len)
+{
+    if (s->error || s->eof) return 0;
+    if (len < PROT_SENDFILE_MIN) return 0;
+
+    return prot_zerocopy(s);
+}
+
+/*
+ * Write to the output stream 's' the 'len' bytes of the file 'fd'
+ * starting at 'offset'.  Large literals leave the page cache for the
+ * socket without being copied into the stream buffer (and the TLS
+ * library) first.  Falls back to reading the file through the buffer.
+ */
+EXPORTED int prot_sendfile(struct protstream *s, int fd,
+                           off_t offset, size_t len)
+{
+    char buf[PROT_BUFSIZE];
+    ssize_t n;
+
+    assert(s->write);
+    if (s->error || s->eof) return EOF;
+    if (len == 0) return 0;
+
+#ifdef USE_SENDFILE
+    if (prot_zerocopy(s)) {
+        size_t sent = 0;
+
+        /* whatever is buffered goes first, and leaves the socket blocking */
+        if (prot_flush_internal(s, 1) == EOF) return EOF;
+        s->boundary = 0;
+
+        while (sent < len) {
+            do {
+                cmdtime_netstart();
+#ifdef USE_KTLS
+                if (s->tls_conn) {
+                    n = SSL_sendfile(s->tls_conn, fd, offset,
+                                     len - sent, 0);
+                    if (n > 0) offset += n;
+                }
+                else
+#endif /* USE_KTLS */
+                    n = sendfile(s->fd, fd, &offset, len - sent);
+                cmdtime_netend();
+            } while (n == -1 && errno == EINTR && !signals_poll());
+
+            if (n <= 0) break;
+            sent += n;
+            s->bytes_out += n;
+        }
+
+        if (sent == len) return 0;
+
+        if (n == 0 || sent || (errno != EINVAL && errno != ENOSYS)) {
+            s->error = xstrdup(n ? strerror(errno) : "unexpected end of file");
+            return EOF;
+        }
+
+        /* this file can't be sent that way, copy it instead */
+    }
+#endif /* USE_SENDFILE */
+
+    while (len) {
+        n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+        if (n == -1 && errno == EINTR && !signals_poll()) continue;
+        if (n <= 0) {
+            s->error = xstrdup(n ? strerror(errno) : "unexpected end of file");
+            return EOF;
+        }
+        if (prot_write(s, buf, n) == EOF) return EOF;
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
 EXPORTED int prot_putbuf(struct protstream *s, struct buf *buf)
 {
     return prot_write(s, buf->s, buf->len);
@@ -256,6 +256,17 @@ extern int prot_fill(struct protstream *s);
 /* Force a flush of an output stream */
 extern int prot_flush(struct protstream *s);
 
+/* Literals at least this long are worth sending without copying */
+#define PROT_SENDFILE_MIN (64*1024)
+
+/* Can 'len' bytes be sent on this stream straight from a file? */
+extern int prot_cansendfile(struct protstream *s, size_t len);
+
+/* Write 'len' bytes of file 'fd' starting at 'offset' to the output
+ * stream, with sendfile() where possible and copying otherwise */
+extern int prot_sendfile(struct protstream *s, int fd,
+                         off_t offset, size_t len);
+
 /* These are protlayer versions of the specified functions */
 extern int prot_write(struct protstream *s, const char *buf, unsigned len);
 extern int prot_putbuf(struct protstream *s, struct buf *buf);
@@ -487,7 +487,7 @@ static int _copyfile_helper(const char *from, const char *to, int flags)
 
     n = retry_write(destfd, src_base, src_size);
 
-    if (n == -1 || fsync(destfd)) {
+    if (n == -1 || (!(flags & COPYFILE_NOSYNC) && fsync(destfd))) {
         syslog(LOG_ERR, "IOERROR: writing %s: %m", to);
         r = -1;
         unlink(to);  /* remove any rubbish we created */
@@ -797,6 +797,27 @@ EXPORTED int parsenum(const char *p, const char **ptr, int maxlen, bit64 *res)
     return 0;
 }
 
+/* 7 bits at a time, least significant first, with the top bit set on
+ * every byte but the last.  Fails if the number runs off the end. */
+EXPORTED int parsevarint(const char *p, const char **ptr, size_t maxlen,
+                         bit64 *res)
+{
+    bit64 result = 0;
+    size_t n;
+
+    for (n = 0; n < maxlen && n < 10; n++) {
+        unsigned char c = p[n];
+        result |= (bit64)(c & 0x7f) << (7 * n);
+        if (!(c & 0x80)) {
+            if (ptr) *ptr = p + n + 1;
+            if (res) *res = result;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
 EXPORTED uint64_t str2uint64(const char *p)
 {
     const char *rest = p;
@@ -1033,6 +1054,15 @@ EXPORTED void buf_appendbit64(struct buf *buf, bit64 num)
     buf_appendmap(buf, (char *)&item, 8);
 }
 
+EXPORTED void buf_appendvarint(struct buf *buf, bit64 num)
+{
+    while (num >= 0x80) {
+        buf_putc(buf, (num & 0x7f) | 0x80);
+        num >>= 7;
+    }
+    buf_putc(buf, num);
+}
+
 EXPORTED void buf_appendmap(struct buf *buf, const char *base, size_t len)
 {
     if (len) {
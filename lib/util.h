@@ -195,7 +195,8 @@ extern int cyrus_mkdir(const char *path, mode_t mode);
 enum {
     COPYFILE_NOLINK = (1<<0),
     COPYFILE_MKDIR  = (1<<1),
-    COPYFILE_RENAME = (1<<2)
+    COPYFILE_RENAME = (1<<2),
+    COPYFILE_NOSYNC = (1<<3)
 };
 
 extern int cyrus_copyfile(const char *from, const char *to, int flags);
@@ -220,6 +221,8 @@ int parseint32(const char *p, const char **ptr, int32_t *res);
 int parseuint32(const char *p, const char **ptr, uint32_t *res);
 int parsenum(const char *p, const char **ptr, int maxlen, bit64 *res);
 int parsehex(const char *p, const char **ptr, int maxlen, bit64 *res);
+/* LEB128, as written by buf_appendvarint() */
+int parsevarint(const char *p, const char **ptr, size_t maxlen, bit64 *res);
 uint64_t str2uint64(const char *p);
 
 /* Timing related funcs/vars */
@@ -269,6 +272,7 @@ void buf_append(struct buf *dst, const struct buf *src);
 void buf_appendcstr(struct buf *buf, const char *str);
 void buf_appendbit32(struct buf *buf, bit32 num);
 void buf_appendbit64(struct buf *buf, bit64 num);
+void buf_appendvarint(struct buf *buf, bit64 num);
 void buf_appendmap(struct buf *buf, const char *base, size_t len);
 void buf_cowappendmap(struct buf *buf, const char *base, unsigned int len);
 void buf_cowappendfree(struct buf *buf, char *base, unsigned int len);
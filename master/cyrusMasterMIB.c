@@ -88,6 +88,24 @@ struct variable4 cyrusMasterMIB_variables[] = {
   { SERVICEID           , ASN_INTEGER   , NOACCESS , var_serviceTable, 3, { 2,1,4 } },
 #define   SERVICECONNS          9
   { SERVICECONNS        , ASN_COUNTER   , NOACCESS , var_serviceTable, 3, { 2,1,5 } },
+#define   SERVICEREUSED         10
+  { SERVICEREUSED       , ASN_COUNTER   , RONLY , var_serviceTable, 3, { 2,1,6 } },
+#define   SERVICEEXITED         11
+  { SERVICEEXITED       , ASN_COUNTER   , RONLY , var_serviceTable, 3, { 2,1,7 } },
+#define   SERVICETHROTTLED      12
+  { SERVICETHROTTLED    , ASN_COUNTER   , RONLY , var_serviceTable, 3, { 2,1,8 } },
+#define   SERVICESTARTAVG       13
+  { SERVICESTARTAVG     , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,9 } },
+#define   SERVICESTARTMAX       14
+  { SERVICESTARTMAX     , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,10 } },
+#define   SERVICEACCEPTAVG      15
+  { SERVICEACCEPTAVG    , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,11 } },
+#define   SERVICEACCEPTMAX      16
+  { SERVICEACCEPTMAX    , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,12 } },
+#define   SERVICEIDLEAVG        17
+  { SERVICEIDLEAVG      , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,13 } },
+#define   SERVICEOLDESTIDLE     18
+  { SERVICEOLDESTIDLE   , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,14 } },
 };
 /*    (L = length of the oidsuffix) */
 
@@ -168,6 +186,11 @@ var_cyrusMasterMIB(struct variable *vp,
 }
 
 
+static long hist_avg(const struct master_hist *h, double scale)
+{
+    return h->count ? (long) (h->total * scale / h->count) : 0;
+}
+
 /*
  * var_serviceTable():
  *   Handle this table separately from the scalar value case.
@@ -237,6 +260,43 @@ var_serviceTable(struct variable *vp,
         long_ret = Services[index - 1].nconnections;
         return (unsigned char *) &long_ret;
 
+    case SERVICEREUSED:
+        long_ret = Services[index - 1].nreused;
+        return (unsigned char *) &long_ret;
+
+    case SERVICEEXITED:
+        long_ret = Services[index - 1].nexited;
+        return (unsigned char *) &long_ret;
+
+    case SERVICETHROTTLED:
+        long_ret = Services[index - 1].nthrottled;
+        return (unsigned char *) &long_ret;
+
+    /* latencies in microseconds, idle ages in milliseconds */
+    case SERVICESTARTAVG:
+        long_ret = hist_avg(&Services[index - 1].startlat, 1000000);
+        return (unsigned char *) &long_ret;
+
+    case SERVICESTARTMAX:
+        long_ret = Services[index - 1].startlat.max * 1000000;
+        return (unsigned char *) &long_ret;
+
+    case SERVICEACCEPTAVG:
+        long_ret = hist_avg(&Services[index - 1].acceptlat, 1000000);
+        return (unsigned char *) &long_ret;
+
+    case SERVICEACCEPTMAX:
+        long_ret = Services[index - 1].acceptlat.max * 1000000;
+        return (unsigned char *) &long_ret;
+
+    case SERVICEIDLEAVG:
+        long_ret = hist_avg(&Services[index - 1].idleage, 1000);
+        return (unsigned char *) &long_ret;
+
+    case SERVICEOLDESTIDLE:
+        long_ret = service_oldest_idle(index - 1) * 1000;
+        return (unsigned char *) &long_ret;
+
     default:
         ERROR_MSG("");
     }
@@ -177,10 +177,22 @@ struct centry {
     char *desc;                 /* human readable description for logging */
     struct timeval spawntime;   /* when the centry was allocated */
     time_t sighuptime;          /* when did we send a SIGHUP */;
+    struct timeval readytime;   /* when it last became ready */
+    int nuses;                  /* connections it has served */
+    int started;                /* has it said it's initialised? */
+    struct timeval waitstart;   /* when the connection it was forked
+                                   for was seen waiting */
     struct centry *next;
 };
 static struct centry *ctable[child_table_size];
 
+const double master_hist_bounds[MASTER_HIST_BUCKETS - 1] = {
+    0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0, 2.0
+};
+
+static const char *stats_file = NULL;   /* where to write statistics */
+static struct timeval stats_mark;       /* when to write them next */
+
 static int janitor_frequency = 1;       /* Janitor sweeps per second */
 static int janitor_position;            /* Entry to begin at in next sweep */
 static struct timeval janitor_mark;     /* Last time janitor did a sweep */
@@ -304,6 +316,7 @@ static struct centry *centry_alloc(void)
     t = xzmalloc(sizeof(*t));
     t->si = SERVICE_NONE;
     gettimeofday(&t->spawntime, NULL);
+    t->readytime = t->spawntime;
     t->sighuptime = (time_t)-1;
 
     return t;
@@ -372,6 +385,63 @@ static void centry_set_state(struct centry *c, enum sstate state)
         c->janitor_deadline = time(NULL) + 2;
 }
 
+static void hist_add(struct master_hist *h, double t)
+{
+    int i;
+
+    if (t < 0.0) t = 0.0;   /* the clock went backwards */
+
+    for (i = 0; i < MASTER_HIST_BUCKETS - 1; i++) {
+        if (t <= master_hist_bounds[i]) break;
+    }
+    h->bucket[i]++;
+    h->count++;
+    h->total += t;
+    if (t > h->max) h->max = t;
+}
+
+/* account for child c of service s picking up a connection */
+static void centry_connection(struct centry *c, struct service *s, int multi)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    if (c->nuses++) s->nreused++;
+
+    /* a threaded service is always ready, so its idle time means nothing */
+    if (!multi)
+        hist_add(&s->idleage, timesub(&c->readytime, &now));
+
+    /* if we forked this child because a connection was waiting, its
+     * first connection is likely that one */
+    if (timerisset(&c->waitstart)) {
+        hist_add(&s->acceptlat, timesub(&c->waitstart, &now));
+        timerclear(&c->waitstart);
+    }
+}
+
+double service_oldest_idle(int si)
+{
+    struct timeval now;
+    struct centry *c;
+    double age, oldest = 0.0;
+    int i;
+
+    gettimeofday(&now, NULL);
+
+    for (i = 0; i < child_table_size; i++) {
+        for (c = ctable[i]; c; c = c->next) {
+            if (c->si != si || c->service_state != SERVICE_STATE_READY)
+                continue;
+            age = timesub(&c->readytime, &now);
+            if (age > oldest) oldest = age;
+        }
+    }
+
+    return oldest;
+}
+
 /*
  * Parse the "listen" parameter as one of the forms:
  *
@@ -828,8 +898,10 @@ static void spawn_service(int si)
                 EX_SOFTWARE);
     }
 
-    if (service_is_fork_limited(s))
+    if (service_is_fork_limited(s)) {
+        s->nthrottled++;
         return;
+    }
 
     get_executable(path, sizeof(path), s->exec);
 
@@ -902,6 +974,10 @@ static void spawn_service(int si)
         c->si = si;
         centry_set_state(c, SERVICE_STATE_READY);
         centry_add(c, p);
+
+        /* this child will pick up the waiting connection, if any */
+        c->waitstart = s->waitstart;
+        timerclear(&s->waitstart);
         break;
     }
 
@@ -1068,6 +1144,9 @@ static void reap_child(void)
                 centry_set_state(c, SERVICE_STATE_UNKNOWN);
             }
             if (s) {
+                s->nexited++;
+                s->exiteduses += c->nuses;
+
                 /* update counters for known services */
                 switch (c->service_state) {
                 case SERVICE_STATE_READY:
@@ -1450,6 +1529,15 @@ static void process_msg(int si, struct notify_message *msg)
 
     /* process message, according to state machine */
     switch (msg->message) {
+    case MASTER_SERVICE_STARTED:
+        /* no change of state, this is just for the statistics */
+        if (!c->started) {
+            c->started = 1;
+            gettimeofday(&c->readytime, NULL);
+            hist_add(&s->startlat, timesub(&c->spawntime, &c->readytime));
+        }
+        break;
+
     case MASTER_SERVICE_AVAILABLE:
         switch (c->service_state) {
         case SERVICE_STATE_READY:
@@ -1474,6 +1562,7 @@ static void process_msg(int si, struct notify_message *msg)
                        "service %s/%s pid %d in BUSY state: now available and in READY state",
                        SERVICEPARAM(s->name), SERVICEPARAM(s->familyname), c->pid);
             centry_set_state(c, SERVICE_STATE_READY);
+            gettimeofday(&c->readytime, NULL);
             s->ready_workers++;
             break;
 
@@ -1523,6 +1612,7 @@ static void process_msg(int si, struct notify_message *msg)
         break;
 
     case MASTER_SERVICE_CONNECTION:
+        centry_connection(c, s, 0);
         switch (c->service_state) {
         case SERVICE_STATE_BUSY:
             s->nconnections++;
@@ -1563,6 +1653,7 @@ static void process_msg(int si, struct notify_message *msg)
         break;
 
     case MASTER_SERVICE_CONNECTION_MULTI:
+        centry_connection(c, s, 1);
         switch (c->service_state) {
         case SERVICE_STATE_READY:
             s->nconnections++;
@@ -1948,6 +2039,121 @@ static void limit_fds(rlim_t x)
 }
 #endif /* HAVE_SETRLIMIT */
 
+static void write_hist(FILE *f, const char *name, const struct master_hist *h)
+{
+    int i;
+
+    fprintf(f, " %s_count=%lu %s_avg=%.6f %s_max=%.6f %s_hist=",
+            name, h->count, name, h->count ? h->total / h->count : 0.0,
+            name, h->max, name);
+    for (i = 0; i < MASTER_HIST_BUCKETS; i++)
+        fprintf(f, "%s%lu", i ? "," : "", h->bucket[i]);
+}
+
+/*
+ * Write the statistics for each service to stats_file, one line per
+ * service, as name=value pairs.  The file is replaced as a whole, so
+ * readers always see a complete set.
+ */
+static void write_stats(void)
+{
+    char *newfname = strconcat(stats_file, ".NEW", (char *)NULL);
+    FILE *f;
+    int i;
+
+    f = fopen(newfname, "w");
+    if (!f) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+        free(newfname);
+        return;
+    }
+
+    fprintf(f, "# cyrus master statistics at %ld\n", (long) time(NULL));
+    fprintf(f, "# histogram buckets (seconds):");
+    for (i = 0; i < MASTER_HIST_BUCKETS - 1; i++)
+        fprintf(f, " %g", master_hist_bounds[i]);
+    fprintf(f, " longer\n");
+
+    for (i = 0; i < nservices; i++) {
+        struct service *s = &Services[i];
+
+        if (!s->name) continue;
+
+        fprintf(f, "%s/%s forks=%d active=%d ready=%d connections=%d"
+                " reused=%d exited=%d uses_per_child=%.2f throttled=%d"
+                " forkrate=%.2f oldest_idle=%.3f",
+                s->name, SERVICEPARAM(s->familyname), s->nforks,
+                s->nactive, s->ready_workers, s->nconnections,
+                s->nreused, s->nexited,
+                s->nexited ? (double) s->exiteduses / s->nexited : 0.0,
+                s->nthrottled, s->forkrate, service_oldest_idle(i));
+        write_hist(f, "start", &s->startlat);
+        write_hist(f, "accept", &s->acceptlat);
+        write_hist(f, "idle", &s->idleage);
+        fprintf(f, "\n");
+    }
+
+    if (ferror(f) | fclose(f)) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
+        unlink(newfname);
+    }
+    else if (rename(newfname, stats_file) == -1) {
+        syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+        unlink(newfname);
+    }
+
+    free(newfname);
+}
+
+static void init_stats(struct timeval now)
+{
+    struct event *evt;
+    int interval = config_getint(IMAPOPT_MASTER_STATS_INTERVAL);
+
+    stats_file = config_getstring(IMAPOPT_MASTER_STATS_FILE);
+    if (!stats_file) return;
+    if (interval < 1) interval = 1;
+
+    stats_mark = now;
+
+    /* make sure we wake up to write them */
+    evt = (struct event *) xzmalloc(sizeof(struct event));
+    evt->name = xstrdup("stats periodic wakeup call");
+    evt->period = interval;
+    evt->periodic = 1;
+    evt->mark = now;
+    schedule_event(evt);
+}
+
+static void stats_tick(struct timeval now)
+{
+    if (!stats_file || timesub(&stats_mark, &now) < 0.0)
+        return;
+
+    write_stats();
+
+    stats_mark = now;
+    stats_mark.tv_sec += config_getint(IMAPOPT_MASTER_STATS_INTERVAL);
+}
+
+/* write a fresh configuration snapshot for the services to read */
+static void write_config_snapshot(void)
+{
+    const char *fname = config_getstring(IMAPOPT_CONFIGSNAPSHOT);
+
+    if (!fname) return;
+
+    if (config_snapshot_write(fname)) {
+        /* the services will just read the configuration files */
+        syslog(LOG_WARNING, "unable to write configuration snapshot %s",
+               fname);
+        unsetenv(CONFIG_SNAPSHOT_ENV);
+        return;
+    }
+
+    setenv(CONFIG_SNAPSHOT_ENV, fname, 1);
+}
+
 static void reread_conf(struct timeval now)
 {
     int i,j;
@@ -1962,6 +2168,10 @@ static void reread_conf(struct timeval now)
     masterconf_getsection("SERVICES", &add_service, (void*) 1);
     masterconf_getsection("DAEMON", &add_daemon, (void *)1);
 
+    /* the children we're about to recycle should see any changes to
+     * imapd.conf as well */
+    write_config_snapshot();
+
     for (i = 0; i < nservices; i++) {
         /* Send SIGHUP to all children:
          *  - for services being added, there are still no children
@@ -2029,6 +2239,7 @@ static void reread_conf(struct timeval now)
 
     /* reinit child janitor */
     init_janitor(now);
+    init_stats(now);
 
     /* send some feedback to admin */
     syslog(LOG_NOTICE,
@@ -2053,7 +2264,7 @@ int main(int argc, char **argv)
     char *alt_config = NULL;
 
     int fd;
-    fd_set rfds;
+    fd_set rfds, lfds;
     char *p = NULL;
     int r = 0;
 
@@ -2379,9 +2590,12 @@ int main(int argc, char **argv)
     }
 #endif
 
+    write_config_snapshot();
+
     /* init ctable janitor */
     gettimeofday(&now, 0);
     init_janitor(now);
+    init_stats(now);
 
     /* ok, we're going to start spawning like mad now */
     syslog(LOG_DEBUG, "ready for work");
@@ -2453,6 +2667,17 @@ int main(int argc, char **argv)
                     Services[i].nactive = 0;
                     Services[i].nconnections = 0;
                     Services[i].associate = 0;
+                    memset(&Services[i].startlat, 0,
+                           sizeof(Services[i].startlat));
+                    memset(&Services[i].acceptlat, 0,
+                           sizeof(Services[i].acceptlat));
+                    memset(&Services[i].idleage, 0,
+                           sizeof(Services[i].idleage));
+                    timerclear(&Services[i].waitstart);
+                    Services[i].nreused = 0;
+                    Services[i].nthrottled = 0;
+                    Services[i].nexited = 0;
+                    Services[i].exiteduses = 0;
 
                     xclose(Services[i].stat[0]);
                     xclose(Services[i].stat[1]);
@@ -2472,6 +2697,7 @@ int main(int argc, char **argv)
         }
 
         FD_ZERO(&rfds);
+        FD_ZERO(&lfds);
         maxfd = 0;
         for (i = 0; i < nservices; i++) {
             int x = Services[i].stat[0];
@@ -2495,6 +2721,7 @@ int main(int argc, char **argv)
                     syslog(LOG_DEBUG, "listening for connections for %s/%s",
                            Services[i].name, Services[i].familyname);
                 FD_SET(y, &rfds);
+                FD_SET(y, &lfds);
                 if (y > maxfd) maxfd = y;
             }
 
@@ -2565,11 +2792,18 @@ int main(int argc, char **argv)
                 y >= 0 && FD_ISSET(y, &rfds))
             {
                 /* huh, someone wants to talk to us */
+                if (!timerisset(&Services[i].waitstart))
+                    gettimeofday(&Services[i].waitstart, NULL);
                 spawn_service(i);
             }
+            else if (y >= 0 && FD_ISSET(y, &lfds) && !FD_ISSET(y, &rfds)) {
+                /* whoever was waiting has given up */
+                timerclear(&Services[i].waitstart);
+            }
         }
         gettimeofday(&now, 0);
         child_janitor(now);
+        stats_tick(now);
 
 #ifdef HAVE_NETSNMP
         run_alarms();
@@ -7,6 +7,18 @@
 #include "libconfig.h" /* for config_dir and IMAPOPT_SYNC_MACHINEID */
 #include "strarray.h"
 
+/* latency histogram: bucket i counts the events which took at most
+ * master_hist_bounds[i] seconds, and the last bucket everything longer */
+#define MASTER_HIST_BUCKETS 12
+extern const double master_hist_bounds[MASTER_HIST_BUCKETS - 1];
+
+struct master_hist {
+    unsigned long count;
+    double total;               /* seconds */
+    double max;
+    unsigned long bucket[MASTER_HIST_BUCKETS];
+};
+
 /* needed for possible SNMP monitoring */
 struct service {
     char *name;                 /* name of service */
@@ -42,11 +54,26 @@ struct service {
     /* fork rate computation */
     struct timeval last_interval_start;
     unsigned int interval_forks;
+
+    /* prefork pool profiling */
+    struct master_hist startlat;  /* fork until the child has initialised */
+    struct master_hist acceptlat; /* connection waiting, no ready workers,
+                                     until a new child accepts it */
+    struct master_hist idleage;   /* worker idle time before each use */
+    struct timeval waitstart;     /* when a connection was seen waiting,
+                                     until a child is forked for it */
+    int nreused;                /* connections served by a used child */
+    int nthrottled;             /* forks deferred by maxforkrate */
+    int nexited;                /* children which have exited */
+    unsigned long exiteduses;   /* connections served by those children */
 };
 
 extern struct service *Services;
 extern int nservices;
 
+/* age in seconds of the longest idle ready worker of service si */
+extern double service_oldest_idle(int si);
+
 /*
  * Description of multiple address family support from
  * Hajimu UMEMOTO <ume@mahoroba.org>:
@@ -261,6 +261,9 @@ int main(int argc, char **argv, char **envp)
         return 1;
     }
 
+    /* let master know how long we took to get going */
+    notify_master(STATUS_FD, MASTER_SERVICE_STARTED);
+
     for (;;) {
         /* ok, listen to this socket until someone talks to us */
         fd = -1;
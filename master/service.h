@@ -51,7 +51,8 @@ enum {
     MASTER_SERVICE_AVAILABLE = 0x01,
     MASTER_SERVICE_UNAVAILABLE = 0x02,
     MASTER_SERVICE_CONNECTION = 0x03,
-    MASTER_SERVICE_CONNECTION_MULTI = 0x04
+    MASTER_SERVICE_CONNECTION_MULTI = 0x04,
+    MASTER_SERVICE_STARTED = 0x05       /* initialised; statistics only */
 };
 
 extern int service_init(int argc, char **argv, char **envp);
@@ -0,0 +1,135 @@
+/* config-bench.c -- time config_read() from the files and from a snapshot
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * usage: config-bench [-n rounds] [-s service] imapd.conf
+ *
+ * Reads the configuration 'rounds' times the way a freshly started
+ * service does, first from the files themselves and then from a
+ * snapshot written by config_snapshot_write(), and prints the average
+ * time each config_read() took.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "exitcodes.h"
+#include "libconfig.h"
+
+EXPORTED void fatal(const char *s, int code)
+{
+    fprintf(stderr, "config-bench: %s\n", s);
+    exit(code);
+}
+
+static double bench(const char *fname, int rounds)
+{
+    struct timeval start, end;
+    int i;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < rounds; i++) {
+        config_reset();
+        config_read(fname, 0);
+    }
+    gettimeofday(&end, NULL);
+
+    return ((end.tv_sec - start.tv_sec) * 1e6 +
+            (end.tv_usec - start.tv_usec)) / rounds;
+}
+
+int main(int argc, char **argv)
+{
+    const char *service = "imap";
+    char snapshot[] = "/tmp/config-bench.XXXXXX";
+    int rounds = 10000;
+    double files, snap;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != EOF) {
+        switch (opt) {
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 's':
+            service = optarg;
+            break;
+        default:
+            rounds = 0;
+            break;
+        }
+    }
+    if (rounds <= 0 || optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-n rounds] [-s service] imapd.conf\n",
+                argv[0]);
+        exit(EC_USAGE);
+    }
+
+    config_ident = service;
+    unsetenv(CONFIG_SNAPSHOT_ENV);
+
+    /* once to warm the caches, and to be able to write the snapshot */
+    config_read(argv[optind], 0);
+    files = bench(argv[optind], rounds);
+
+    opt = mkstemp(snapshot);
+    if (opt == -1 || config_snapshot_write(snapshot)) {
+        fprintf(stderr, "config-bench: can't write %s\n", snapshot);
+        exit(EC_IOERR);
+    }
+    setenv(CONFIG_SNAPSHOT_ENV, snapshot, 1);
+    snap = bench(argv[optind], rounds);
+    close(opt);
+    unlink(snapshot);
+
+    printf("files:    %8.1f us per config_read\n", files);
+    printf("snapshot: %8.1f us per config_read\n", snap);
+
+    return 0;
+}
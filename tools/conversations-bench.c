@@ -0,0 +1,217 @@
+/* conversations-bench.c -- time conversation records in both formats
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * usage: conversations-bench [-n conversations] dbdir
+ *
+ * Saves and loads a set of conversations with a bit of everything in
+ * them in a scratch conversations database under dbdir, first in the
+ * binary record format and then in the old text format, and prints
+ * the total record size and the time taken for each.  The text "save"
+ * renders from a binary record, so includes a binary decode too.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "cyrusdb.h"
+#include "exitcodes.h"
+#include "libcyr_cfg.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#include "imap/conversations.h"
+#include "imap/global.h"
+
+EXPORTED void fatal(const char *s, int code)
+{
+    fprintf(stderr, "conversations-bench: %s\n", s);
+    exit(code);
+}
+
+static conversation_t *gen_conversation(struct conversations_state *state,
+                                        int i)
+{
+    static const char * const folders[] = {
+        "user.foo.INBOX",
+        "user.foo.Manilla",
+        "user.foo.VanillaGorilla",
+        "user.foo.SarsparillaGorilla",
+        "user.foo.Lists.cyrus-devel"
+    };
+    conversation_t *conv = conversation_new(state);
+    int counts[8] = { 0 };
+    char subject[64];
+    int j;
+
+    for (j = 0 ; j < 5 ; j++) {
+        conversation_update(state, conv, folders[j],
+                            /*num_records*/1 + j, /*exists*/1 + j,
+                            /*unseen*/j % 2, /*size*/1000 * j,
+                            counts, /*modseq*/100 + i + j);
+    }
+
+    conversation_update_sender(conv, "Fred Bloggs", NULL,
+                               "fred", "example.com", 1400000000 + i, 3);
+    conversation_update_sender(conv, NULL, NULL,
+                               "jane", "example.com", 1400000001 + i, 1);
+    conversation_update_sender(conv, "Cyrus", "@relay.example.org",
+                               "cyrus", "example.org", 1400000002, 2);
+
+    snprintf(subject, sizeof(subject), "conversation number %d", i);
+    conv->subject = xstrdup(subject);
+
+    return conv;
+}
+
+int main(int argc, char **argv)
+{
+    struct conversations_state *state = NULL;
+    conversation_t **convs;
+    struct buf text = BUF_INITIALIZER;
+    struct buf fname = BUF_INITIALIZER;
+    struct timeval start, end;
+    double t_save, t_load;
+    char bkey[32];
+    const char *data;
+    size_t datalen, size;
+    int n = 2000;
+    int i, pass, opt, r;
+
+    while ((opt = getopt(argc, argv, "n:")) != EOF) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        default:
+            n = 0;
+            break;
+        }
+    }
+    if (n <= 0 || optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-n conversations] dbdir\n", argv[0]);
+        exit(EC_USAGE);
+    }
+
+    libcyrus_config_setstring(CYRUSOPT_CONFIG_DIR, argv[optind]);
+    cyrusdb_init();
+    config_conversations_db = "twoskip";
+
+    buf_printf(&fname, "%s/conversations-bench.db", argv[optind]);
+    unlink(buf_cstring(&fname));
+
+    r = conversations_open_path(buf_cstring(&fname), &state);
+    if (r) {
+        fprintf(stderr, "conversations-bench: can't open %s: %s\n",
+                buf_cstring(&fname), error_message(r));
+        exit(EC_IOERR);
+    }
+
+    convs = xmalloc(n * sizeof(conversation_t *));
+    for (i = 0 ; i < n ; i++)
+        convs[i] = gen_conversation(state, i);
+
+    /* pass 0 is binary, pass 1 text */
+    for (pass = 0 ; pass < 2 ; pass++) {
+        gettimeofday(&start, NULL);
+        for (i = 0 ; i < n ; i++) {
+            snprintf(bkey, sizeof(bkey), "B" CONV_FMT, (conversation_id_t)i + 1);
+            if (!pass) {
+                r = conversation_store(state, bkey, strlen(bkey), convs[i]);
+            }
+            else {
+                r = cyrusdb_fetch(state->db, bkey, strlen(bkey),
+                                  &data, &datalen, &state->txn);
+                if (!r) {
+                    conversations_record_text(state, bkey, strlen(bkey),
+                                              data, datalen, &text);
+                    r = cyrusdb_store(state->db, bkey, strlen(bkey),
+                                      text.s, text.len, &state->txn);
+                }
+            }
+            if (r) fatal("can't save conversation", EC_SOFTWARE);
+        }
+        gettimeofday(&end, NULL);
+        t_save = timesub(&start, &end);
+
+        gettimeofday(&start, NULL);
+        for (i = 0 ; i < n ; i++) {
+            conversation_t *conv = NULL;
+            r = conversation_load(state, (conversation_id_t)i + 1, &conv);
+            if (r || !conv) fatal("can't load conversation", EC_SOFTWARE);
+            conversation_free(conv);
+        }
+        gettimeofday(&end, NULL);
+        t_load = timesub(&start, &end);
+
+        size = 0;
+        for (i = 0 ; i < n ; i++) {
+            snprintf(bkey, sizeof(bkey), "B" CONV_FMT, (conversation_id_t)i + 1);
+            r = cyrusdb_fetch(state->db, bkey, strlen(bkey),
+                              &data, &datalen, &state->txn);
+            if (!r) size += datalen;
+        }
+
+        printf("%-6s %d conversations: %8zu bytes, save %8.6fs, load %8.6fs\n",
+               pass ? "text" : "binary", n, size, t_save, t_load);
+    }
+
+    conversations_abort(&state);
+    unlink(buf_cstring(&fname));
+
+    for (i = 0 ; i < n ; i++)
+        conversation_free(convs[i]);
+    free(convs);
+    buf_free(&text);
+    buf_free(&fname);
+
+    cyrusdb_done();
+
+    return 0;
+}
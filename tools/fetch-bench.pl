@@ -0,0 +1,78 @@
+#!/usr/bin/perl
+#
+# fetch-bench.pl - measure FETCH throughput in messages per second
+#
+# usage: fetch-bench.pl [-h host] [-p port] [-m mailbox] [-n rounds]
+#                       [-i items] user password
+#
+# Logs in, selects the mailbox and repeatedly fetches every message
+# with the items a client asks for when it first syncs a mailbox.
+#
+
+use strict;
+use warnings;
+use Getopt::Std;
+use IO::Socket::INET;
+use Time::HiRes qw(gettimeofday tv_interval);
+
+my %opts;
+getopts('h:p:m:n:i:', \%opts) && @ARGV == 2
+    or die "usage: $0 [-h host] [-p port] [-m mailbox] [-n rounds] " .
+           "[-i items] user password\n";
+
+my ($user, $pass) = @ARGV;
+my $host = $opts{h} || 'localhost';
+my $port = $opts{p} || 143;
+my $mailbox = $opts{m} || 'INBOX';
+my $rounds = $opts{n} || 10;
+my $items = $opts{i} ||
+    'FLAGS ENVELOPE BODYSTRUCTURE INTERNALDATE RFC822.SIZE';
+
+my $sock = IO::Socket::INET->new(PeerAddr => $host, PeerPort => $port,
+                                 Proto => 'tcp')
+    or die "$host:$port: $!\n";
+binmode($sock);
+
+my $tag = 0;
+
+# send a command and read up to its tagged response, counting
+# untagged FETCH responses and skipping over literals
+sub command {
+    my ($cmd) = @_;
+    my $t = 'B' . $tag++;
+    my $fetches = 0;
+
+    print $sock "$t $cmd\r\n";
+    while (my $line = <$sock>) {
+        $fetches++ if $line =~ /^\* \d+ FETCH /;
+        while ($line =~ /\{(\d+)\}\r\n$/) {
+            my $data;
+            read($sock, $data, $1) == $1 or die "short literal\n";
+            $line = <$sock>;
+            defined $line or die "connection closed\n";
+        }
+        if ($line =~ /^\Q$t\E (\S+)/) {
+            die "$cmd: $line" if $1 ne 'OK';
+            return $fetches;
+        }
+    }
+    die "connection closed\n";
+}
+
+my $greeting = <$sock>;
+die "no greeting\n" unless defined $greeting && $greeting =~ /^\* OK/;
+
+command("LOGIN \"$user\" \"$pass\"");
+command("SELECT \"$mailbox\"");
+
+my $total = 0;
+my $start = [gettimeofday];
+for (1 .. $rounds) {
+    $total += command("FETCH 1:* ($items)");
+}
+my $elapsed = tv_interval($start);
+
+command("LOGOUT");
+
+printf "%d messages in %.3fs: %.0f messages/sec\n",
+    $total, $elapsed, $elapsed > 0 ? $total / $elapsed : 0;
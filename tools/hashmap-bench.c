@@ -0,0 +1,197 @@
+/* hashmap-bench.c -- time hash_table and hashu64 against hashmap
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * usage: hashmap-bench [keys...]
+ *
+ * Fills and then looks up every key in a hash_table and a hashmap,
+ * and in a hashu64_table and a hashmapu64, for the sort of keys Cyrus
+ * actually uses - mailbox names, message-ids and conversation ids -
+ * with the table sized the way callers typically guess, ie too small.
+ * By default it does this for 1000, 5000 and 10000 keys.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "exitcodes.h"
+#include "hash.h"
+#include "hashu64.h"
+#include "hashmap.h"
+#include "strarray.h"
+#include "util.h"
+
+#define GUESS 1024
+
+EXPORTED void fatal(const char *s, int code)
+{
+    fprintf(stderr, "hashmap-bench: %s\n", s);
+    exit(code);
+}
+
+static void bench_keys(const char *what, const strarray_t *keys)
+{
+    hash_table table;
+    hashmap_t map;
+    struct timeval start, end;
+    double t_table, t_map;
+    int i, n = strarray_size(keys);
+    int found = 0;
+
+    gettimeofday(&start, NULL);
+    construct_hash_table(&table, GUESS, 1);
+    for (i = 0 ; i < n ; i++)
+        hash_insert(strarray_nth(keys, i), (void *)keys, &table);
+    for (i = 0 ; i < n ; i++)
+        if (hash_lookup(strarray_nth(keys, i), &table)) found++;
+    free_hash_table(&table, NULL);
+    gettimeofday(&end, NULL);
+    t_table = timesub(&start, &end);
+
+    gettimeofday(&start, NULL);
+    construct_hashmap(&map, GUESS, 1);
+    for (i = 0 ; i < n ; i++)
+        hashmap_insert(strarray_nth(keys, i), (void *)keys, &map);
+    for (i = 0 ; i < n ; i++)
+        if (hashmap_lookup(strarray_nth(keys, i), &map)) found++;
+    free_hashmap(&map, NULL);
+    gettimeofday(&end, NULL);
+    t_map = timesub(&start, &end);
+
+    if (found != 2 * n)
+        fatal("lost keys", EC_SOFTWARE);
+
+    printf("%-16s %7d keys: hash_table %8.6fs, hashmap    %8.6fs\n",
+           what, n, t_table, t_map);
+}
+
+static void bench_u64(int n)
+{
+    hashu64_table table;
+    hashmapu64_t map;
+    struct timeval start, end;
+    double t_table, t_map;
+    uint64_t cid;
+    int i, found = 0;
+
+    gettimeofday(&start, NULL);
+    construct_hashu64_table(&table, GUESS, 0);
+    for (i = 0, cid = 1 ; i < n ; i++, cid += 0x9e3779b97f4a7c15ULL)
+        hashu64_insert(cid, &table, &table);
+    for (i = 0, cid = 1 ; i < n ; i++, cid += 0x9e3779b97f4a7c15ULL)
+        if (hashu64_lookup(cid, &table)) found++;
+    free_hashu64_table(&table, NULL);
+    gettimeofday(&end, NULL);
+    t_table = timesub(&start, &end);
+
+    gettimeofday(&start, NULL);
+    construct_hashmapu64(&map, GUESS, 0);
+    for (i = 0, cid = 1 ; i < n ; i++, cid += 0x9e3779b97f4a7c15ULL)
+        hashmapu64_insert(cid, &map, &map);
+    for (i = 0, cid = 1 ; i < n ; i++, cid += 0x9e3779b97f4a7c15ULL)
+        if (hashmapu64_lookup(cid, &map)) found++;
+    free_hashmapu64(&map, NULL);
+    gettimeofday(&end, NULL);
+    t_map = timesub(&start, &end);
+
+    if (found != 2 * n)
+        fatal("lost keys", EC_SOFTWARE);
+
+    printf("%-16s %7d keys: hashu64    %8.6fs, hashmapu64 %8.6fs\n",
+           "conversation ids", n, t_table, t_map);
+}
+
+int main(int argc, char **argv)
+{
+    static const char * const folders[] = {
+        "INBOX", "Sent", "Drafts", "Trash", "Archive", "Lists.cyrus-devel",
+        "Lists.info-cyrus", "Work.Projects", "Work.Reports", "Family"
+    };
+    static const char * const sizes[] = { "1000", "5000", "10000" };
+    const char * const *args = sizes;
+    strarray_t keys = STRARRAY_INITIALIZER;
+    int nargs = 3;
+    int i, j;
+
+    if (argc > 1) {
+        args = (const char * const *) argv + 1;
+        nargs = argc - 1;
+    }
+
+    for (j = 0 ; j < nargs ; j++) {
+        int n = atoi(args[j]);
+
+        if (n <= 0) {
+            fprintf(stderr, "usage: %s [keys...]\n", argv[0]);
+            exit(EC_USAGE);
+        }
+
+        strarray_truncate(&keys, 0);
+        for (i = 0 ; i < n ; i++) {
+            char name[64];
+            snprintf(name, sizeof(name), "user.u%d.%s", i / 10, folders[i % 10]);
+            strarray_append(&keys, name);
+        }
+        bench_keys("mailbox names", &keys);
+
+        strarray_truncate(&keys, 0);
+        for (i = 0 ; i < n ; i++) {
+            char msgid[64];
+            snprintf(msgid, sizeof(msgid), "<%08x.%d.%u@mail.example.com>",
+                     i * 2654435761U, i, i % 977);
+            strarray_append(&keys, msgid);
+        }
+        bench_keys("message-ids", &keys);
+
+        bench_u64(n);
+    }
+
+    strarray_fini(&keys);
+
+    return 0;
+}
@@ -0,0 +1,143 @@
+/* sync-bench.c -- time the folder lookups of a full user sync
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * usage: sync-bench [folders...]
+ *
+ * Builds master and replica folder lists for synthetic users with
+ * the given numbers of folders (by default 50, 500, 5000 and 20000),
+ * then looks every master folder up in the replica's list, as
+ * do_user_main() does, and prints the time per folder.  With the
+ * lists hashed that should stay flat as the user grows.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "exitcodes.h"
+#include "util.h"
+#include "imap/sync_support.h"
+
+EXPORTED void fatal(const char *s, int code)
+{
+    fprintf(stderr, "sync-bench: %s\n", s);
+    exit(code);
+}
+
+static struct synccrcs nocrcs = { 0, 0 };
+
+static void add_folder(struct sync_folder_list *l,
+                       const char *uniqueid, const char *name)
+{
+    sync_folder_list_add(l, uniqueid, name, 0, "default",
+                         "anyone\tlrs\t", 0, 1, 0, 0, nocrcs,
+                         0, 0, 0, 0, NULL, 0);
+}
+
+static double sync_user(int nfolders)
+{
+    struct sync_folder_list *master = sync_folder_list_create();
+    struct sync_folder_list *replica = sync_folder_list_create();
+    struct sync_folder *mfolder;
+    struct timeval start, end;
+    char id[64], name[64];
+    int i, found = 0;
+
+    for (i = 0 ; i < nfolders ; i++) {
+        snprintf(id, sizeof(id), "%08x-%d", i * 2654435761U, i);
+        snprintf(name, sizeof(name), "user.u%d.f%d", nfolders, i);
+        add_folder(master, id, name);
+        /* the replica lists them in a different order */
+        snprintf(id, sizeof(id), "%08x-%d",
+                 (nfolders - 1 - i) * 2654435761U, nfolders - 1 - i);
+        add_folder(replica, id, name);
+    }
+
+    gettimeofday(&start, NULL);
+    for (mfolder = master->head ; mfolder ; mfolder = mfolder->next) {
+        if (sync_folder_lookup(replica, mfolder->uniqueid))
+            found++;
+    }
+    gettimeofday(&end, NULL);
+
+    if (found != nfolders)
+        fatal("replica is missing folders", EC_SOFTWARE);
+
+    sync_folder_list_free(&master);
+    sync_folder_list_free(&replica);
+
+    return timesub(&start, &end);
+}
+
+int main(int argc, char **argv)
+{
+    static const char * const sizes[] = { "50", "500", "5000", "20000" };
+    const char * const *args = sizes;
+    int nargs = 4;
+    int i;
+
+    if (argc > 1) {
+        args = (const char * const *) argv + 1;
+        nargs = argc - 1;
+    }
+
+    for (i = 0 ; i < nargs ; i++) {
+        int n = atoi(args[i]);
+        double t;
+
+        if (n <= 0) {
+            fprintf(stderr, "usage: %s [folders...]\n", argv[0]);
+            exit(EC_USAGE);
+        }
+
+        t = sync_user(n);
+        printf("%6d folders: %8.6fs, %6.3fus per folder\n",
+               n, t, t * 1000000.0 / n);
+    }
+
+    return 0;
+}